@@ -10,76 +10,341 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "helper.h"
 #include "structs.h"
 #include "cache.h"
 #include "rcs.h"
 
-static bucket_t cache_hash_table[CACHE_HASH_BUCKETS];
+/*
+ * Everything below, including the reference counts and the cache links of
+ * the items, is guarded by this lock. It is only held for short, in-memory
+ * operations.
+ */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Hash tables : the second one is only used while growing the first */
+static table_t cache_tables[2];
+static int cache_rehashing = 0;
+static unsigned int cache_rehash_index = 0;
+
 static unsigned int cache_item_count = 0;
+static size_t cache_byte_count = 0;
+
+/* Limits */
+static unsigned int cache_max_items = CACHE_SIZE;
+static size_t cache_max_bytes = CACHE_BYTES;
+
+/*
+ * Recency list of the items nobody references, most recently released
+ * first : the items in use are kept off it, so that eviction only looks at
+ * its tail.
+ */
+static metadata_t *cache_lru_head = NULL;
+static metadata_t *cache_lru_tail = NULL;
+
+/* Statistics */
+static unsigned long cache_hits = 0;
+static unsigned long cache_misses = 0;
+static unsigned long cache_negative_hits = 0;
+static unsigned long cache_evictions = 0;
 
 
 /*
- * Initialize the cache control structures.
+ * Allocate the (empty) buckets of a hash table.
  */
-void cache_initialize(void)
+static void cache_table_initialize(table_t *table, unsigned int size)
 {
   unsigned int i;
 
-  /* Initialize the buckets */
-  for (i = 0; i < CACHE_HASH_BUCKETS; i++)
+  table->t_buckets = safe_malloc(sizeof(bucket_t) * size);
+  for (i = 0; i < size; i++)
     {
-      cache_hash_table[i].b_count = 0;
-      cache_hash_table[i].b_contents = NULL;
+      table->t_buckets[i].b_count = 0;
+      table->t_buckets[i].b_contents = NULL;
     }
-
-  /* No items in there */
-  cache_item_count = 0;
+  table->t_size = size;
+  table->t_count = 0;
 }
 
 /*
- * Free the cache data.
+ * Free a hash table, and the items still in it.
  */
-void cache_finalize(void)
+static void cache_table_finalize(table_t *table)
 {
   unsigned int i;
 
-  for (i = 0; i < CACHE_HASH_BUCKETS; i++)
+  for (i = 0; i < table->t_size; i++)
     {
       metadata_t *metadata, *next;
 
-      metadata = cache_hash_table[i].b_contents;
+      metadata = table->t_buckets[i].b_contents;
       while (metadata)
 	{
 	  next = metadata->md_next;
 	  rcs_free_metadata(metadata);
 	  metadata = next;
 	}
-      cache_hash_table[i].b_count = 0;
-      cache_hash_table[i].b_contents = NULL;
     }
+  free(table->t_buckets);
+  table->t_buckets = NULL;
+  table->t_size = 0;
+  table->t_count = 0;
 }
 
 /*
- * Retrieve file metadata from the cache, assuming there is some in there.
- * It returns NULL if there is no *cached* metadata. It is the caller's
- * responsibility to try to read the metadata on disk (and if possible feed
- * it to the cache too)
- *
- * Items accessed are bumped to the top of their hash bucket, so repeat
- * accesses are faster, and so these items don't get zapped when the cache
- * grows too much and it is necessary to clean it up.
+ * Initialize the cache control structures. A zero limit selects the
+ * default value.
+ */
+void cache_initialize(unsigned int max_items, size_t max_bytes)
+{
+  /* Initialize the buckets */
+  cache_table_initialize(&cache_tables[0], CACHE_HASH_BUCKETS);
+  cache_rehashing = 0;
+  cache_rehash_index = 0;
+
+  /* No items in there */
+  cache_item_count = 0;
+  cache_byte_count = 0;
+  cache_lru_head = NULL;
+  cache_lru_tail = NULL;
+  cache_hits = 0;
+  cache_misses = 0;
+  cache_negative_hits = 0;
+  cache_evictions = 0;
+
+  cache_max_items = max_items ? max_items : CACHE_SIZE;
+  cache_max_bytes = max_bytes ? max_bytes : CACHE_BYTES;
+}
+
+/*
+ * Free the cache data.
+ */
+void cache_finalize(void)
+{
+  cache_table_finalize(&cache_tables[0]);
+  if (cache_rehashing)
+    cache_table_finalize(&cache_tables[1]);
+  cache_rehashing = 0;
+
+  cache_item_count = 0;
+  cache_byte_count = 0;
+  cache_lru_head = NULL;
+  cache_lru_tail = NULL;
+}
+
+/*
+ * Compute the memory used by a metadata block, including its version list
+ * and its name, though the name may be shared.
+ */
+static size_t cache_metadata_size(metadata_t *metadata)
+{
+  version_t *version;
+  size_t size;
+
+  size = sizeof(metadata_t) + strlen(metadata->md_name) + 1;
+  for (version = metadata->md_versions; version; version = version->v_next)
+    size += sizeof(version_t);
+  return size + sizeof(version_t *) * metadata->md_count;
+}
+
+/*
+ * Find the bucket an item with the given hash belongs to. While growing,
+ * the buckets of the old table that have already been moved are found in
+ * the new table.
+ */
+static bucket_t *cache_locate(uint64_t hash, table_t **table)
+{
+  unsigned int index;
+
+  index = hash & (cache_tables[0].t_size - 1);
+  if (cache_rehashing && (index < cache_rehash_index))
+    {
+      *table = &cache_tables[1];
+      return &cache_tables[1].t_buckets[hash & (cache_tables[1].t_size - 1)];
+    }
+  *table = &cache_tables[0];
+  return &cache_tables[0].t_buckets[index];
+}
+
+/*
+ * Link an item at the top of a bucket.
+ */
+static void cache_bucket_push(table_t *table, bucket_t *bucket,
+			      metadata_t *metadata)
+{
+  metadata->md_previous = NULL;
+  metadata->md_next = bucket->b_contents;
+  if (bucket->b_contents)
+    bucket->b_contents->md_previous = metadata;
+  bucket->b_contents = metadata;
+  bucket->b_count++;
+  table->t_count++;
+}
+
+/*
+ * Move some buckets of the old table to the new one, when growing. The work
+ * is spread over the cache operations, so that no single lookup has to pay
+ * for rehashing the whole cache.
+ */
+static void cache_rehash_step(void)
+{
+  unsigned int moved, empty;
+
+  for (moved = 0, empty = 0;
+       cache_rehashing && (moved < CACHE_REHASH_STEP) &&
+	 (empty < CACHE_REHASH_EMPTY);
+       cache_rehash_index++)
+    {
+      bucket_t *bucket;
+      metadata_t *metadata;
+
+      bucket = &cache_tables[0].t_buckets[cache_rehash_index];
+      if (bucket->b_contents)
+	moved++;
+      else
+	empty++;
+
+      while ((metadata = bucket->b_contents))
+	{
+	  table_t *target = &cache_tables[1];
+
+	  bucket->b_contents = metadata->md_next;
+	  bucket->b_count--;
+	  cache_tables[0].t_count--;
+	  cache_bucket_push(target, &target->t_buckets[metadata->md_hash &
+						       (target->t_size - 1)],
+			    metadata);
+	}
+
+      /* Swap the tables when everything has been moved */
+      if (cache_rehash_index + 1 == cache_tables[0].t_size)
+	{
+	  free(cache_tables[0].t_buckets);
+	  cache_tables[0] = cache_tables[1];
+	  cache_rehashing = 0;
+	}
+    }
+  if (!cache_rehashing)
+    cache_rehash_index = 0;
+}
+
+/*
+ * Start growing the hash table when it gets loaded.
+ */
+static void cache_check_growth(void)
+{
+  if (cache_rehashing || (cache_tables[0].t_count < cache_tables[0].t_size))
+    return;
+  cache_table_initialize(&cache_tables[1], cache_tables[0].t_size * 2);
+  cache_rehash_index = 0;
+  cache_rehashing = 1;
+}
+
+/*
+ * Unlink an item from the recency list.
+ */
+static void cache_lru_unlink(metadata_t *metadata)
+{
+  if (metadata->md_lru_previous)
+    metadata->md_lru_previous->md_lru_next = metadata->md_lru_next;
+  else
+    cache_lru_head = metadata->md_lru_next;
+  if (metadata->md_lru_next)
+    metadata->md_lru_next->md_lru_previous = metadata->md_lru_previous;
+  else
+    cache_lru_tail = metadata->md_lru_previous;
+  metadata->md_lru_next = NULL;
+  metadata->md_lru_previous = NULL;
+}
+
+/*
+ * Put an item at the head of the recency list.
+ */
+static void cache_lru_push(metadata_t *metadata)
+{
+  metadata->md_lru_previous = NULL;
+  metadata->md_lru_next = cache_lru_head;
+  if (cache_lru_head)
+    cache_lru_head->md_lru_previous = metadata;
+  else
+    cache_lru_tail = metadata;
+  cache_lru_head = metadata;
+}
+
+/*
+ * Put an item at the tail of the recency list, where it is evicted first.
  */
-metadata_t *cache_get_metadata(const char *vpath)
+static void cache_lru_append(metadata_t *metadata)
+{
+  metadata->md_lru_next = NULL;
+  metadata->md_lru_previous = cache_lru_tail;
+  if (cache_lru_tail)
+    cache_lru_tail->md_lru_next = metadata;
+  else
+    cache_lru_head = metadata;
+  cache_lru_tail = metadata;
+}
+
+/*
+ * Remove an item from its hash bucket and from the recency list, and
+ * forget about its memory usage. It does not free it.
+ */
+static void cache_unlink_metadata(metadata_t *metadata)
+{
+  bucket_t *bucket;
+  table_t *table;
+
+  bucket = cache_locate(metadata->md_hash, &table);
+  if (metadata->md_previous)
+    metadata->md_previous->md_next = metadata->md_next;
+  else
+    bucket->b_contents = metadata->md_next;
+  if (metadata->md_next)
+    metadata->md_next->md_previous = metadata->md_previous;
+  metadata->md_next = NULL;
+  metadata->md_previous = NULL;
+  bucket->b_count--;
+  table->t_count--;
+
+  /* Only the items nobody uses are on the recency list */
+  if (!metadata->md_refcount)
+    cache_lru_unlink(metadata);
+
+  cache_item_count--;
+  cache_byte_count -= metadata->md_size;
+  metadata->md_cached = 0;
+}
+
+/*
+ * Get the hash of an entry of a directory. The root has no parent, and an
+ * empty name.
+ */
+static uint64_t cache_hash(metadata_t *parent, const char *name)
+{
+  if (!parent)
+    return helper_hash_string(name);
+  return helper_hash_component(parent->md_hash, name);
+}
+
+/*
+ * Find an item in its bucket, and bump it to the top of the bucket. The
+ * cache has to be locked.
+ */
+static metadata_t *cache_find(metadata_t *parent, const char *name,
+			      uint64_t hash)
 {
   bucket_t *bucket;
+  table_t *table;
   metadata_t *metadata;
 
-  /* Lookup the item */
-  bucket = &cache_hash_table[CACHE_HASH(vpath)];
+  /* Lookup the item, only comparing names when the hashes match */
+  bucket = cache_locate(hash, &table);
   metadata = bucket->b_contents;
-  while (metadata && strcmp(metadata->md_vfile, vpath))
+  while (metadata && ((metadata->md_hash != hash) ||
+		      (metadata->md_parent != parent) ||
+		      strcmp(metadata->md_name, name)))
     metadata = metadata->md_next;
   if (!metadata)
     return NULL;
@@ -94,93 +359,289 @@ metadata_t *cache_get_metadata(const char *vpath)
       /* Reconnect it on top */
       metadata->md_previous = NULL;
       metadata->md_next = bucket->b_contents;
-      bucket->b_contents->md_previous = NULL;
+      bucket->b_contents->md_previous = metadata;
       bucket->b_contents = metadata;
     }
+  return metadata;
+}
+
+/*
+ * Take a reference on an item, the cache being locked. A cached item leaves
+ * the recency list while it is in use.
+ */
+static void cache_get_metadata(metadata_t *metadata)
+{
+  if (!metadata->md_refcount++ && metadata->md_cached)
+    cache_lru_unlink(metadata);
+}
 
+/*
+ * Retrieve the metadata of an entry of a directory from the cache, assuming
+ * there is some in there. The root directory is the entry with no parent and
+ * an empty name. It returns NULL if there is no *cached* metadata. It is the
+ * caller's responsibility to try to read the metadata on disk (and if
+ * possible feed it to the cache too)
+ *
+ * Items accessed are bumped to the top of their hash bucket, so repeat
+ * accesses are faster. They leave the recency list while they are in use,
+ * and come back at its top once released, so that they don't get zapped
+ * when the cache grows too much and it is necessary to clean it up.
+ *
+ * The returned item is referenced : it won't be evicted until the caller
+ * gives it back with cache_release_metadata().
+ */
+metadata_t *cache_get_child(metadata_t *parent, const char *name)
+{
+  metadata_t *metadata;
+
+  pthread_mutex_lock(&cache_lock);
+  cache_rehash_step();
+  metadata = cache_find(parent, name, cache_hash(parent, name));
+  if (!metadata)
+    cache_misses++;
+  else
+    {
+      cache_hits++;
+      if (metadata->md_negative)
+	cache_negative_hits++;
+      metadata->md_demoted = 0;
+      cache_get_metadata(metadata);
+    }
+  pthread_mutex_unlock(&cache_lock);
   return metadata;
 }
 
 /*
- * Clean the older items out of the cache to free space. The goal is to
- * half the number of items, so that we don't get called constantly.
+ * Give back a reference, the cache being locked. Cached items go back on
+ * the recency list with their last reference, at its top, or at its tail if
+ * they were demoted meanwhile. Items that are not in the cache anymore are
+ * freed instead, which gives back the reference they held on their parent.
  */
-void cache_cleanup_old_items()
+static void cache_put_metadata(metadata_t *metadata)
 {
-  /* FIXME: implement it if it really needed */
+  metadata_t *parent;
+
+  while (metadata)
+    {
+      metadata->md_refcount--;
+      if (metadata->md_refcount)
+	break;
+      if (metadata->md_cached)
+	{
+	  if (metadata->md_demoted)
+	    cache_lru_append(metadata);
+	  else
+	    cache_lru_push(metadata);
+	  metadata->md_demoted = 0;
+	  break;
+	}
+      parent = metadata->md_parent;
+      rcs_free_metadata(metadata);
+      metadata = parent;
+    }
 }
 
 /*
- * Insert file metadata into the cache. It does not check if the data is
- * already there, so try to avoid putting it twice (especially if the two
- * instances are different !)
+ * Evict the least recently used items until the cache fits in its limits,
+ * keeping room for an item of the given size. Only the items nobody
+ * references are on the recency list, so each one evicted is taken from
+ * its tail (directories are referenced by their cached entries, so the tree
+ * is evicted from the leaves up, a directory coming back at the top of the
+ * list once its last entry goes).
+ */
+static void cache_cleanup_old_items(size_t room)
+{
+  metadata_t *metadata;
+
+  while ((metadata = cache_lru_tail) &&
+	 ((cache_item_count + 1 > cache_max_items) ||
+	  (cache_byte_count + room > cache_max_bytes)))
+    {
+      cache_unlink_metadata(metadata);
+      metadata->md_refcount = 1;
+      cache_put_metadata(metadata);
+      cache_evictions++;
+    }
+}
+
+/*
+ * Insert file metadata into the cache, as an entry of its md_parent
+ * directory, which gets referenced by it. The locks and the index of the
+ * versions of the item are set up here, since it is shared from now on.
+ *
+ * Another thread may have inserted the same entry meanwhile. In that case
+ * the cached item is kept and the given one is freed, unless the cached one
+ * only says the file does not exist and the given one describes it : the
+ * new file replaces the negative entry.
  *
  * If the cache has grown too big, it is cleaned up, the least recently
  * used items going away. That way we avoid to trash frequently-used entries.
+ *
+ * The caller gets a reference on the item that ends up in the cache, and
+ * has to release it.
  */
-void cache_add_metadata(metadata_t *metadata)
+metadata_t *cache_add_metadata(metadata_t *metadata)
 {
   bucket_t *bucket;
+  table_t *table;
+  metadata_t *cached;
 
-  /* Check if cache needs cleaning */
-  if (cache_item_count == CACHE_SIZE)
-    cache_cleanup_old_items();
+  pthread_rwlock_init(&metadata->md_lock, NULL);
+  pthread_mutex_init(&metadata->md_update, NULL);
+  rcs_versions_changed(metadata);
+  metadata->md_size = cache_metadata_size(metadata);
+  metadata->md_hash = cache_hash(metadata->md_parent, metadata->md_name);
 
-  /* Insert the element */
-  bucket = &cache_hash_table[CACHE_HASH(metadata->md_vfile)];
-  metadata->md_previous = NULL;
-  metadata->md_next = bucket->b_contents;
-  if (bucket->b_contents)
-    bucket->b_contents->md_previous = metadata;
-  bucket->b_contents = metadata;
+  pthread_mutex_lock(&cache_lock);
+
+  /* Check if it is already there */
+  cached = cache_find(metadata->md_parent, metadata->md_name,
+		      metadata->md_hash);
+  if (cached && (!cached->md_negative || metadata->md_negative))
+    {
+      cache_get_metadata(cached);
+      pthread_mutex_unlock(&cache_lock);
+      rcs_free_metadata(metadata);
+      return cached;
+    }
+  if (cached)
+    cache_unlink_metadata(cached);
+  if (metadata->md_parent)
+    cache_get_metadata(metadata->md_parent);
+
+  /* Check if cache needs cleaning, or a bigger table */
+  cache_cleanup_old_items(metadata->md_size);
+  cache_check_growth();
+  cache_rehash_step();
 
-  /* Bump the bucket's item counter, and the global counter */
+  /* Insert the element, bumping the bucket's and table's item counters */
+  bucket = cache_locate(metadata->md_hash, &table);
+  cache_bucket_push(table, bucket, metadata);
+  metadata->md_cached = 1;
+  metadata->md_demoted = 0;
+  metadata->md_refcount = 1;
+
+  /* Bump the global counters */
   cache_item_count++;
-  bucket->b_count++;
+  cache_byte_count += metadata->md_size;
+
+  /* The negative entry goes away with its last user */
+  if (cached && !cached->md_refcount)
+    {
+      cached->md_refcount = 1;
+      cache_put_metadata(cached);
+    }
+
+  pthread_mutex_unlock(&cache_lock);
+  return metadata;
 }
 
 /*
- * Null out the bucket... This probably isn't a wonderful
- * way to do it, but it works, and I haven't thought of
- * anything more wonderful yet. -M@
+ * Account for a change in the memory used by a cached item, for example
+ * after a version has been added or purged.
  */
-void cache_drop_metadata(const char *vpath)
+void cache_update_metadata(metadata_t *metadata)
 {
-	bucket_t *bucket;
+  size_t size;
 
-  	/* Lookup the item */
-  	bucket = &cache_hash_table[CACHE_HASH(vpath)];
-  	// nuke it.
-	bucket->b_contents=NULL;
-	
+  size = cache_metadata_size(metadata);
+  pthread_mutex_lock(&cache_lock);
+  if (metadata->md_cached)
+    cache_byte_count = cache_byte_count - metadata->md_size + size;
+  metadata->md_size = size;
+  pthread_mutex_unlock(&cache_lock);
 }
 
 /*
- * Try to find the path composed of the maximal number of elements of the
- * array that will have a cache hit. Return the count, and the metadata. It
- * returns a count of -1 if there is no hit at all.
+ * Take another reference on an item the caller already holds, for a user
+ * that outlives the caller's.
  */
-int cache_find_maximal_match(char **array, metadata_t **result)
+void cache_hold_metadata(metadata_t *metadata)
 {
-  int count;
+  pthread_mutex_lock(&cache_lock);
+  metadata->md_refcount++;
+  pthread_mutex_unlock(&cache_lock);
+}
 
-  /* Count items */
-  for (count = 0; array[count]; count++) ;
+/*
+ * Give back a reference obtained from the cache. Dropped items are freed
+ * once their last user is gone.
+ */
+void cache_release_metadata(metadata_t *metadata)
+{
+  pthread_mutex_lock(&cache_lock);
+  cache_put_metadata(metadata);
+  pthread_mutex_unlock(&cache_lock);
+}
 
-  for (/* Nothing */; count >= 0; count--)
+/*
+ * Give back several references at once, like the kernel does when it forgets
+ * an inode it has looked up many times.
+ */
+void cache_forget_metadata(metadata_t *metadata, unsigned long count)
+{
+  pthread_mutex_lock(&cache_lock);
+  while (count--)
+    cache_put_metadata(metadata);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Remove an item from the cache, for example because the file it describes
+ * has been purged. It will be freed when its last reference is released.
+ */
+void cache_drop_metadata(metadata_t *metadata)
+{
+  pthread_mutex_lock(&cache_lock);
+  if (metadata->md_cached)
+    cache_unlink_metadata(metadata);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Tell if an item is still in the cache, or has been dropped and may have
+ * been replaced by a new one for the same file.
+ */
+int cache_has_metadata(metadata_t *metadata)
+{
+  int res;
+
+  pthread_mutex_lock(&cache_lock);
+  res = metadata->md_cached;
+  pthread_mutex_unlock(&cache_lock);
+  return res;
+}
+
+/*
+ * Make an item the least recently used one, so that it is the first to go
+ * when the cache is full, for example after a background scan looked it up.
+ * An item in use goes at the tail of the recency list once released, unless
+ * it is looked up again meanwhile.
+ */
+void cache_demote_metadata(metadata_t *metadata)
+{
+  pthread_mutex_lock(&cache_lock);
+  if (metadata->md_cached && metadata->md_refcount)
+    metadata->md_demoted = 1;
+  else if (metadata->md_cached && (metadata != cache_lru_tail))
     {
-      char *old_value, *path;
-
-      /* Try with this count */
-      old_value = array[count];
-      array[count] = NULL;
-      path = helper_build_composite("-A", "/", array);
-      array[count] = old_value;
-      *result = cache_get_metadata(path);
-      free(path);
-      if (*result)
-	return count;
+      cache_lru_unlink(metadata);
+      cache_lru_append(metadata);
     }
+  pthread_mutex_unlock(&cache_lock);
+}
 
-  return -1;
+/*
+ * Get a snapshot of the cache counters.
+ */
+void cache_get_stats(cache_stats_t *stats)
+{
+  pthread_mutex_lock(&cache_lock);
+  stats->cs_items = cache_item_count;
+  stats->cs_bytes = cache_byte_count;
+  stats->cs_hits = cache_hits;
+  stats->cs_misses = cache_misses;
+  stats->cs_negative_hits = cache_negative_hits;
+  stats->cs_evictions = cache_evictions;
+  pthread_mutex_unlock(&cache_lock);
 }
@@ -11,16 +11,35 @@
 
 # include "structs.h"
 
-# define CACHE_SIZE 256 /* low for testing */
-# define CACHE_HASH_BUCKETS 128
+# define CACHE_SIZE		16384		/* Default max items	*/
+# define CACHE_BYTES		(32 << 20)	/* Default max memory	*/
+# define CACHE_HASH_BUCKETS	128		/* Initial bucket count	*/
+# define CACHE_REHASH_STEP	1		/* Buckets moved per op	*/
+# define CACHE_REHASH_EMPTY	16		/* Empty buckets per op	*/
 
-# define CACHE_HASH(x) (helper_hash_string((x)) % (CACHE_HASH_BUCKETS))
+typedef struct cache_stats_t	cache_stats_t;
 
-void		cache_initialize(void);
+struct				cache_stats_t
+{
+  unsigned int			cs_items;	/* Cached items		*/
+  size_t			cs_bytes;	/* Memory used		*/
+  unsigned long			cs_hits;	/* Lookup hits		*/
+  unsigned long			cs_misses;	/* Lookup misses	*/
+  unsigned long			cs_negative_hits; /* Hits on absent files */
+  unsigned long			cs_evictions;	/* Items evicted	*/
+};
+
+void		cache_initialize(unsigned int max_items, size_t max_bytes);
 void		cache_finalize(void);
-metadata_t	*cache_get_metadata(const char *vpath);
-void		cache_add_metadata(metadata_t *metadata);
-void 		cache_drop_metadata(const char *vpath);
-int		cache_find_maximal_match(char **array, metadata_t **result);
+metadata_t	*cache_get_child(metadata_t *parent, const char *name);
+metadata_t	*cache_add_metadata(metadata_t *metadata);
+void		cache_update_metadata(metadata_t *metadata);
+void		cache_hold_metadata(metadata_t *metadata);
+void		cache_release_metadata(metadata_t *metadata);
+void		cache_forget_metadata(metadata_t *metadata, unsigned long count);
+void 		cache_drop_metadata(metadata_t *metadata);
+int		cache_has_metadata(metadata_t *metadata);
+void		cache_demote_metadata(metadata_t *metadata);
+void		cache_get_stats(cache_stats_t *stats);
 
 #endif /* !CACHE_H */
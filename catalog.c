@@ -0,0 +1,602 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include "helper.h"
+#include "journal.h"
+#include "catalog.h"
+
+/*
+ * With catalogs, the metadata and default version files of all the entries
+ * of a version directory are kept in a single catalog file there, instead
+ * of two files per entry. The catalog is sorted, so finding an entry is a
+ * binary search in its mapping, and listing the directory reads it alone.
+ * Catalogs are only written by journal checkpoints, which merge all the
+ * changes a directory had since the last one. The first merge in a
+ * directory imports the files it had, and removes them once the catalog is
+ * on the disk. Once the root has a catalog, the tree keeps using them.
+ */
+
+static int catalog_on = 0;
+
+/*
+ * Tell whether a file of a directory belongs in its catalog.
+ */
+static int catalog_held(const char *name)
+{
+  return !strncmp(name, "metadata.", 9) || !strncmp(name, "dfl-meta.", 9);
+}
+
+/*
+ * Map the catalog file, if there is a valid one.
+ */
+static void catalog_map(catalog_t *catalog)
+{
+  const catalog_header_t *header;
+  struct stat st_catalog;
+  char *data;
+  int fd;
+
+  catalog->c_data = NULL;
+  catalog->c_size = 0;
+  catalog->c_count = 0;
+  fd = open(catalog->c_path, O_RDONLY);
+  if (fd == -1)
+    return;
+  if ((fstat(fd, &st_catalog) == -1) ||
+      (st_catalog.st_size < (off_t)sizeof(catalog_header_t)))
+    {
+      close(fd);
+      return;
+    }
+  data = mmap(NULL, st_catalog.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return;
+
+  header = (const catalog_header_t *)data;
+  if (memcmp(header->ch_magic, CATALOG_MAGIC, sizeof(header->ch_magic)) ||
+      (header->ch_count > (st_catalog.st_size - sizeof(catalog_header_t)) /
+       sizeof(catalog_record_t)))
+    {
+      munmap(data, st_catalog.st_size);
+      return;
+    }
+  catalog->c_data = data;
+  catalog->c_size = st_catalog.st_size;
+  catalog->c_count = header->ch_count;
+}
+
+/*
+ * Name of a record, or NULL if it points outside of the file.
+ */
+static const char *catalog_name(catalog_t *catalog,
+				const catalog_record_t *record)
+{
+  const char *name;
+
+  if (record->cr_name >= catalog->c_size)
+    return NULL;
+  name = catalog->c_data + record->cr_name;
+  if (!memchr(name, '\0', catalog->c_size - record->cr_name))
+    return NULL;
+  return name;
+}
+
+/*
+ * Record of the given index.
+ */
+static const catalog_record_t *catalog_record(catalog_t *catalog,
+					      unsigned int index)
+{
+  return (const catalog_record_t *)(catalog->c_data +
+				    sizeof(catalog_header_t)) + index;
+}
+
+/*
+ * Open the catalog of a directory. The directory may have none yet, if it
+ * was not converted, in which case its files are used. Returns NULL if
+ * catalogs are not used.
+ */
+catalog_t *catalog_open(const char *dir)
+{
+  catalog_t *catalog;
+
+  if (!catalog_on)
+    return NULL;
+  catalog = safe_malloc(sizeof(catalog_t));
+  catalog->c_path = helper_build_composite("SS", "/", dir, CATALOG_NAME);
+  catalog_map(catalog);
+  return catalog;
+}
+
+/*
+ * Map the catalog again, for a directory that may just have been
+ * converted.
+ */
+int catalog_reload(catalog_t *catalog)
+{
+  if (catalog->c_data)
+    munmap(catalog->c_data, catalog->c_size);
+  catalog_map(catalog);
+  return catalog->c_data ? 0 : -1;
+}
+
+void catalog_close(catalog_t *catalog)
+{
+  if (!catalog)
+    return;
+  if (catalog->c_data)
+    munmap(catalog->c_data, catalog->c_size);
+  free(catalog->c_path);
+  free(catalog);
+}
+
+/*
+ * Find a file in a catalog. Returns 1 and its contents, which stay valid
+ * until the catalog is closed, or 0 if the catalog does not hold it, or -1
+ * if the directory has no catalog.
+ */
+int catalog_find(catalog_t *catalog, const char *name, const char **data,
+		 size_t *size)
+{
+  const catalog_record_t *record;
+  const char *other;
+  unsigned int low, high, middle;
+  int order;
+
+  if (!catalog->c_data)
+    return -1;
+
+  low = 0;
+  high = catalog->c_count;
+  while (low < high)
+    {
+      middle = low + (high - low) / 2;
+      record = catalog_record(catalog, middle);
+      other = catalog_name(catalog, record);
+      if (!other)
+	return 0;
+      order = strcmp(other, name);
+      if (!order)
+	{
+	  if ((record->cr_data > catalog->c_size) ||
+	      (record->cr_size > catalog->c_size - record->cr_data))
+	    return 0;
+	  *data = catalog->c_data + record->cr_data;
+	  *size = record->cr_size;
+	  return 1;
+	}
+      if (order < 0)
+	low = middle + 1;
+      else
+	high = middle;
+    }
+  return 0;
+}
+
+/*
+ * Order of the entries of a catalog.
+ */
+static int catalog_compare(const void *first, const void *second)
+{
+  return strcmp(((const catalog_entry_t *)first)->ce_name,
+		((const catalog_entry_t *)second)->ce_name);
+}
+
+/*
+ * Free the entries read from a catalog or a directory.
+ */
+static void catalog_free_entries(catalog_entry_t *entries, unsigned int count)
+{
+  unsigned int i;
+
+  for (i = 0; i < count; i++)
+    {
+      free(entries[i].ce_name);
+      free(entries[i].ce_data);
+    }
+  free(entries);
+}
+
+/*
+ * Copy the files a catalog holds.
+ */
+static catalog_entry_t *catalog_read_entries(catalog_t *catalog,
+					     unsigned int *count)
+{
+  const catalog_record_t *record;
+  catalog_entry_t *entries;
+  const char *name, *data;
+  size_t size;
+  unsigned int i;
+
+  entries = safe_malloc(sizeof(catalog_entry_t) * (catalog->c_count + 1));
+  *count = 0;
+  for (i = 0; i < catalog->c_count; i++)
+    {
+      record = catalog_record(catalog, i);
+      name = catalog_name(catalog, record);
+      if (!name || (catalog_find(catalog, name, &data, &size) != 1))
+	continue;
+      entries[*count].ce_name = safe_strdup(name);
+      entries[*count].ce_data = safe_malloc(size + 1);
+      memcpy(entries[*count].ce_data, data, size);
+      entries[*count].ce_size = size;
+      (*count)++;
+    }
+  return entries;
+}
+
+/*
+ * Read the files of a directory that go in its catalog, sorted.
+ */
+static catalog_entry_t *catalog_import(const char *dir, unsigned int *count)
+{
+  catalog_entry_t *entries;
+  struct dirent *entry;
+  struct stat st_file;
+  unsigned int allocated;
+  char *path, *data;
+  ssize_t res;
+  size_t done;
+  DIR *handle;
+  int fd;
+
+  handle = opendir(dir);
+  if (!handle)
+    return NULL;
+
+  allocated = 16;
+  entries = safe_malloc(sizeof(catalog_entry_t) * allocated);
+  *count = 0;
+  while ((entry = readdir(handle)))
+    {
+      if (!catalog_held(entry->d_name))
+	continue;
+      path = helper_build_composite("SS", "/", dir, entry->d_name);
+      fd = open(path, O_RDONLY);
+      free(path);
+      if (fd == -1)
+	continue;
+      if (fstat(fd, &st_file) == -1)
+	{
+	  close(fd);
+	  continue;
+	}
+      data = safe_malloc(st_file.st_size + 1);
+      for (done = 0; done < (size_t)st_file.st_size; done += res)
+	{
+	  res = pread(fd, data + done, st_file.st_size - done, done);
+	  if (res == -1 && errno == EINTR)
+	    res = 0;
+	  else if (res <= 0)
+	    break;
+	}
+      close(fd);
+
+      if (*count == allocated)
+	{
+	  allocated *= 2;
+	  entries = safe_realloc(entries, sizeof(catalog_entry_t) * allocated);
+	}
+      entries[*count].ce_name = safe_strdup(entry->d_name);
+      entries[*count].ce_data = data;
+      entries[*count].ce_size = done;
+      (*count)++;
+    }
+  closedir(handle);
+
+  qsort(entries, *count, sizeof(catalog_entry_t), catalog_compare);
+  return entries;
+}
+
+/*
+ * Write a catalog holding the given sorted entries, in place of the old
+ * one. With flush, it is on the disk when this returns.
+ */
+static int catalog_write(const char *path, catalog_entry_t **entries,
+			 unsigned int count, int flush)
+{
+  catalog_header_t *header;
+  catalog_record_t *record;
+  unsigned long long size;
+  unsigned int i;
+  size_t offset;
+  ssize_t res;
+  char *data, *temp;
+  int fd;
+
+  size = sizeof(catalog_header_t) + (unsigned long long)count *
+    sizeof(catalog_record_t);
+  for (i = 0; i < count; i++)
+    size += strlen(entries[i]->ce_name) + 1 + entries[i]->ce_size;
+  if (size > UINT32_MAX)
+    {
+      errno = EFBIG;
+      return -1;
+    }
+
+  data = safe_malloc(size);
+  header = (catalog_header_t *)data;
+  memcpy(header->ch_magic, CATALOG_MAGIC, sizeof(header->ch_magic));
+  header->ch_count = count;
+  header->ch_reserved = 0;
+  record = (catalog_record_t *)(header + 1);
+  offset = sizeof(catalog_header_t) + count * sizeof(catalog_record_t);
+  for (i = 0; i < count; i++, record++)
+    {
+      record->cr_name = offset;
+      strcpy(data + offset, entries[i]->ce_name);
+      offset += strlen(entries[i]->ce_name) + 1;
+      record->cr_data = offset;
+      record->cr_size = entries[i]->ce_size;
+      record->cr_reserved = 0;
+      memcpy(data + offset, entries[i]->ce_data, entries[i]->ce_size);
+      offset += entries[i]->ce_size;
+    }
+
+  temp = helper_get_sibling_name(path, JOURNAL_NAME);
+  fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1)
+    {
+      free(temp);
+      free(data);
+      return -1;
+    }
+  for (offset = 0; offset < size; offset += res)
+    {
+      res = write(fd, data + offset, size - offset);
+      if (res == -1 && errno == EINTR)
+	res = 0;
+      else if (res == -1)
+	break;
+    }
+  free(data);
+  if ((offset < size) || (flush && (fdatasync(fd) == -1)) ||
+      (close(fd) == -1) || (rename(temp, path) == -1))
+    {
+      int error = errno;
+      unlink(temp);
+      free(temp);
+      errno = error;
+      return -1;
+    }
+  free(temp);
+  return 0;
+}
+
+/*
+ * Apply changes to the catalog of a directory, creating it from the files
+ * of the directory if it has none. Files with no data are removed. With
+ * flush, the new catalog is on the disk when this returns, and the files
+ * it replaced are removed. Otherwise, the caller does it with
+ * catalog_prune() once the catalog is on the disk. Returns 1 if the
+ * catalog was created, 0 if it was updated, -1 on error.
+ */
+int catalog_merge(const char *dir, catalog_entry_t *updates,
+		  unsigned int count, int flush)
+{
+  catalog_entry_t *old, **merged;
+  catalog_t catalog;
+  unsigned int old_count, total, i, j;
+  int res, order, imported;
+
+  catalog.c_path = helper_build_composite("SS", "/", dir, CATALOG_NAME);
+  catalog_map(&catalog);
+  imported = !catalog.c_data;
+  if (catalog.c_data)
+    {
+      old = catalog_read_entries(&catalog, &old_count);
+      munmap(catalog.c_data, catalog.c_size);
+    }
+  else
+    old = catalog_import(dir, &old_count);
+  if (!old)
+    {
+      free(catalog.c_path);
+      return -1;
+    }
+
+  /* Both lists are sorted, the changes win */
+  if (count)
+    qsort(updates, count, sizeof(catalog_entry_t), catalog_compare);
+  merged = safe_malloc(sizeof(catalog_entry_t *) * (old_count + count + 1));
+  total = 0;
+  for (i = 0, j = 0; (i < old_count) || (j < count); )
+    {
+      if (i == old_count)
+	order = 1;
+      else if (j == count)
+	order = -1;
+      else
+	order = strcmp(old[i].ce_name, updates[j].ce_name);
+      if (order < 0)
+	merged[total++] = &old[i++];
+      else
+	{
+	  if (updates[j].ce_data)
+	    merged[total++] = &updates[j];
+	  j++;
+	  if (!order)
+	    i++;
+	}
+    }
+
+  res = catalog_write(catalog.c_path, merged, total, flush);
+  free(merged);
+  catalog_free_entries(old, old_count);
+  free(catalog.c_path);
+  if (res == -1)
+    return -1;
+  if (imported && flush)
+    catalog_prune(dir);
+  return imported;
+}
+
+/*
+ * Remove the files of a directory its catalog holds now.
+ */
+void catalog_prune(const char *dir)
+{
+  struct dirent *entry;
+  char *path;
+  DIR *handle;
+
+  handle = opendir(dir);
+  if (!handle)
+    return;
+  while ((entry = readdir(handle)))
+    if (catalog_held(entry->d_name))
+      {
+	path = helper_build_composite("SS", "/", dir, entry->d_name);
+	unlink(path);
+	free(path);
+      }
+  closedir(handle);
+}
+
+/*
+ * Order of names in a listing.
+ */
+static int catalog_compare_names(const void *first, const void *second)
+{
+  return strcmp(*(char * const *)first, *(char * const *)second);
+}
+
+/*
+ * List the entries of a version directory that have a file with the given
+ * prefix, in its catalog or on the disk, and in the journal. The names are
+ * returned without the prefix, sorted, in a NULL-terminated array to free
+ * with helper_free_array(). Returns NULL on error.
+ */
+char **catalog_list(const char *dir, const char *prefix)
+{
+  const catalog_record_t *record;
+  struct dirent *entry;
+  catalog_t *catalog;
+  unsigned int allocated, count, i, j;
+  size_t length;
+  const char *name;
+  char **names, **pending;
+  DIR *handle;
+
+  length = strlen(prefix);
+  allocated = 16;
+  names = safe_malloc(sizeof(char *) * allocated);
+  count = 0;
+
+  catalog = catalog_open(dir);
+  if (catalog && catalog->c_data)
+    {
+      for (i = 0; i < catalog->c_count; i++)
+	{
+	  record = catalog_record(catalog, i);
+	  name = catalog_name(catalog, record);
+	  if (!name || strncmp(name, prefix, length))
+	    continue;
+	  if (count + 1 >= allocated)
+	    {
+	      allocated *= 2;
+	      names = safe_realloc(names, sizeof(char *) * allocated);
+	    }
+	  names[count++] = safe_strdup(name);
+	}
+    }
+  else
+    {
+      handle = opendir(dir);
+      if (!handle)
+	{
+	  int error = errno;
+	  catalog_close(catalog);
+	  free(names);
+	  errno = error;
+	  return NULL;
+	}
+      while ((entry = readdir(handle)))
+	{
+	  if (strncmp(entry->d_name, prefix, length))
+	    continue;
+	  if (count + 1 >= allocated)
+	    {
+	      allocated *= 2;
+	      names = safe_realloc(names, sizeof(char *) * allocated);
+	    }
+	  names[count++] = safe_strdup(entry->d_name);
+	}
+      closedir(handle);
+    }
+  catalog_close(catalog);
+
+  /* The journal knows about files that are not written yet */
+  pending = journal_list(dir, prefix);
+  for (i = 0; pending[i]; i++)
+    {
+      if (count + 1 >= allocated)
+	{
+	  allocated *= 2;
+	  names = safe_realloc(names, sizeof(char *) * allocated);
+	}
+      names[count++] = pending[i];
+    }
+  free(pending);
+
+  /* Sort them, and strip the prefix and the duplicates */
+  qsort(names, count, sizeof(char *), catalog_compare_names);
+  for (i = 0, j = 0; i < count; i++)
+    if ((j && !strcmp(names[j - 1], names[i] + length)) ||
+	!names[i][length])
+      free(names[i]);
+    else
+      {
+	memmove(names[i], names[i] + length, strlen(names[i] + length) + 1);
+	names[j++] = names[i];
+      }
+  names[j] = NULL;
+  return names;
+}
+
+/*
+ * Whether the tree uses catalogs.
+ */
+int catalog_enabled(void)
+{
+  return catalog_on;
+}
+
+/*
+ * Start using catalogs if asked to, or if the tree already does. The root
+ * directory is converted at once, which marks the tree as using them.
+ */
+int catalog_setup(const char *vroot, int enabled)
+{
+  char *path;
+  int exists;
+
+  path = helper_build_composite("SS", "/", vroot, CATALOG_NAME);
+  exists = !access(path, F_OK);
+  free(path);
+  if (!exists && !enabled)
+    return 0;
+
+  catalog_on = 1;
+  if (exists)
+    return 0;
+  return (catalog_merge(vroot, NULL, 0, 1) == -1) ? -1 : 0;
+}
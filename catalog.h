@@ -0,0 +1,73 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#ifndef CATALOG_H
+# define CATALOG_H
+
+# include <stdint.h>
+# include <sys/types.h>
+
+# define CATALOG_NAME		"catalog"	/* In each directory	*/
+# define CATALOG_MAGIC		"CPFSCAT1"	/* Catalog file format	*/
+
+typedef struct catalog_header_t	catalog_header_t;
+typedef struct catalog_record_t	catalog_record_t;
+typedef struct catalog_entry_t	catalog_entry_t;
+typedef struct catalog_t	catalog_t;
+
+/*
+ * Start of a catalog file, in host byte order. It is followed by the
+ * records of the files it holds, sorted by name, then by their names and
+ * contents. Offsets are from the start of the file.
+ */
+struct				catalog_header_t
+{
+  char				ch_magic[8];	/* CATALOG_MAGIC	*/
+  uint32_t			ch_count;	/* Records		*/
+  uint32_t			ch_reserved;	/* Zero			*/
+};
+
+/* A file held in a catalog */
+struct				catalog_record_t
+{
+  uint32_t			cr_name;	/* Offset of the name	*/
+  uint32_t			cr_data;	/* Offset of contents	*/
+  uint32_t			cr_size;	/* Bytes of contents	*/
+  uint32_t			cr_reserved;	/* Zero			*/
+};
+
+/* A file to put in a catalog, or to remove from it if there is no data */
+struct				catalog_entry_t
+{
+  char				*ce_name;	/* Name in the directory */
+  char				*ce_data;	/* Contents, or NULL	*/
+  size_t			ce_size;	/* Bytes		*/
+};
+
+/* The catalog of a directory, mapped for reading */
+struct				catalog_t
+{
+  char				*c_path;	/* Catalog file		*/
+  char				*c_data;	/* Mapping, NULL if none */
+  size_t			c_size;		/* Bytes mapped		*/
+  unsigned int			c_count;	/* Records		*/
+};
+
+int		catalog_setup(const char *vroot, int enabled);
+int		catalog_enabled(void);
+catalog_t	*catalog_open(const char *dir);
+int		catalog_reload(catalog_t *catalog);
+void		catalog_close(catalog_t *catalog);
+int		catalog_find(catalog_t *catalog, const char *name,
+			     const char **data, size_t *size);
+int		catalog_merge(const char *dir, catalog_entry_t *updates,
+			      unsigned int count, int flush);
+void		catalog_prune(const char *dir);
+char		**catalog_list(const char *dir, const char *prefix);
+
+#endif /* !CATALOG_H */
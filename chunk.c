@@ -0,0 +1,293 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "helper.h"
+#include "structs.h"
+#include "rcs.h"
+#include "overlay.h"
+#include "store.h"
+#include "chunk.h"
+
+/*
+ * The object store only shares versions that are identical as a whole. Old
+ * versions of large files can instead be cut in chunks, at the places where
+ * a rolling hash of their contents says so : an edit only changes the chunks
+ * around it, since the cuts after it are found at the same data, even if it
+ * moved. Each chunk is an object of the store, so the chunks that did not
+ * change are shared with the other versions of the file, and with any other
+ * file holding them.
+ *
+ * The cuts follow FastCDC : the gear hash is only looked at past the minimum
+ * size, with a harder condition before the average size than after it, so
+ * that the sizes gather around the average, and no chunk is larger than the
+ * maximum size.
+ */
+
+static pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+static chunk_stats_t chunk_stats;
+static uint64_t chunk_gear[256];
+static int chunk_enabled = 0;
+
+
+/*
+ * Fill the gear table, the same way each time since the cuts must not
+ * change, and allow versions to be chunked or not.
+ */
+void chunk_setup(int enabled)
+{
+  uint64_t state, value;
+  int i;
+
+  state = CHUNK_SEED;
+  for (i = 0; i < 256; i++)
+    {
+      /* splitmix64 */
+      state += 0x9E3779B97F4A7C15ULL;
+      value = state;
+      value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+      chunk_gear[i] = value ^ (value >> 31);
+    }
+  chunk_enabled = enabled;
+}
+
+/*
+ * Find the size of the chunk at the start of the given data.
+ */
+static size_t chunk_cut(const unsigned char *data, size_t size)
+{
+  size_t i, normal;
+  uint64_t hash;
+
+  if (size <= CHUNK_MIN)
+    return size;
+  if (size > CHUNK_MAX)
+    size = CHUNK_MAX;
+  normal = (size < CHUNK_AVERAGE) ? size : CHUNK_AVERAGE;
+
+  hash = 0;
+  for (i = CHUNK_MIN; i < normal; i++)
+    {
+      hash = (hash << 1) + chunk_gear[data[i]];
+      if (!(hash & CHUNK_MASK_SMALL))
+	return i + 1;
+    }
+  for (; i < size; i++)
+    {
+      hash = (hash << 1) + chunk_gear[data[i]];
+      if (!(hash & CHUNK_MASK_LARGE))
+	return i + 1;
+    }
+  return size;
+}
+
+/*
+ * Remove a directory of chunks, which may have been the last users of some
+ * objects.
+ */
+void chunk_remove(const char *directory)
+{
+  struct dirent *entry;
+  char *chunk;
+  DIR *dir;
+  int removed;
+
+  if (!(dir = opendir(directory)))
+    return;
+  removed = 0;
+  while ((entry = readdir(dir)))
+    {
+      if (entry->d_name[0] == '.')
+	continue;
+      chunk = helper_build_composite("SS", "/", directory, entry->d_name);
+      if (!unlink(chunk))
+	removed = 1;
+      free(chunk);
+    }
+  closedir(dir);
+  rmdir(directory);
+  if (removed)
+    store_release();
+}
+
+/*
+ * Cut a file in chunks, linked in the given directory from the objects
+ * holding them. The offset each chunk ends at is added to the array.
+ */
+static int chunk_split(int fd, const char *directory, uint64_t **ends,
+		       unsigned int *count, chunk_stats_t *stats)
+{
+  size_t head, length, size, allocated;
+  char name[16], *buffer, *chunk;
+  off_t offset, end;
+  ssize_t got;
+  int res, eof;
+
+  buffer = safe_malloc(CHUNK_BUFFER);
+  allocated = 0;
+  head = 0;
+  length = 0;
+  offset = 0;
+  end = 0;
+  eof = 0;
+  res = 0;
+  while (!res && (length || !eof))
+    {
+      /* Keep a whole chunk in the buffer, until the end of the file */
+      if (!eof && (length < CHUNK_MAX))
+	{
+	  memmove(buffer, buffer + head, length);
+	  head = 0;
+	  got = pread(fd, buffer + length, CHUNK_BUFFER - length, offset);
+	  if (got == -1 && errno == EINTR)
+	    continue;
+	  if (got == -1)
+	    res = -1;
+	  else if (got == 0)
+	    eof = 1;
+	  else
+	    {
+	      length += got;
+	      offset += got;
+	    }
+	  continue;
+	}
+
+      size = chunk_cut((unsigned char *)buffer + head, length);
+      if (*count == allocated)
+	{
+	  allocated = allocated ? allocated * 2 : 64;
+	  *ends = safe_realloc(*ends, sizeof(uint64_t) * allocated);
+	}
+      sprintf(name, "%08X", *count);
+      chunk = helper_build_composite("SS", "/", directory, name);
+      res = store_add_chunk(buffer + head, size, chunk);
+      free(chunk);
+      if (res == -1)
+	break;
+      stats->ck_chunks++;
+      if (res)
+	stats->ck_shared++;
+      else
+	stats->ck_stored += size;
+      end += size;
+      (*ends)[(*count)++] = end;
+      head += size;
+      length -= size;
+      res = 0;
+    }
+  free(buffer);
+  stats->ck_bytes += end;
+  return res;
+}
+
+/*
+ * Make an old version of a large file a chunked version. Returns 1 if it
+ * was chunked, 0 if it is left alone because chunking is off or the version
+ * is small, special, already stored or has user attributes, or -1. The
+ * caller holds the metadata's update lock, and makes sure the version holds
+ * all its data and will not be written to anymore.
+ */
+int chunk_add_version(metadata_t *metadata, version_t *version)
+{
+  struct timespec start, stop;
+  struct stat st_data;
+  chunk_stats_t stats;
+  char rfile[PATH_MAX], *directory, *data;
+  uint64_t *ends;
+  unsigned int count;
+  int src, dst, res;
+
+  if (!chunk_enabled)
+    return 0;
+  if ((rcs_version_file(metadata, version, rfile) == -1) ||
+      (lstat(rfile, &st_data) == -1))
+    return -1;
+  if (!S_ISREG(st_data.st_mode) || (st_data.st_size < OVERLAY_MIN_SIZE) ||
+      (st_data.st_nlink != 1) || store_has_attributes(rfile))
+    return 0;
+
+  /* Left by a crash, since the version holds all its data */
+  directory = helper_get_sibling_name(rfile, "chunks");
+  chunk_remove(directory);
+  free(directory);
+  directory = helper_get_sibling_name(rfile, "newchunks");
+  chunk_remove(directory);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  memset(&stats, 0, sizeof(chunk_stats_t));
+  ends = NULL;
+  count = 0;
+  dst = -1;
+  data = helper_get_sibling_name(rfile, "chunked");
+  src = open(rfile, O_RDONLY);
+  res = ((src == -1) || (mkdir(directory, S_IRWXU) == -1)) ? -1 : 0;
+  if (!res)
+    res = chunk_split(src, directory, &ends, &count, &stats);
+
+  /* The version file only keeps its size */
+  if (!res &&
+      (((dst = open(data, O_WRONLY | O_CREAT | O_TRUNC,
+		    st_data.st_mode & 07777)) == -1) ||
+       (ftruncate(dst, st_data.st_size) == -1) || (fsync(dst) == -1)))
+    res = -1;
+  if (dst != -1)
+    close(dst);
+  if (src != -1)
+    close(src);
+  if (!res)
+    res = overlay_install_chunks(metadata, version, data, directory, ends,
+				 count);
+  if (res)
+    {
+      int error = errno;
+      unlink(data);
+      chunk_remove(directory);
+      errno = error;
+    }
+  free(ends);
+  free(data);
+  free(directory);
+  if (res)
+    return -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &stop);
+  pthread_mutex_lock(&chunk_lock);
+  chunk_stats.ck_versions++;
+  chunk_stats.ck_chunks += stats.ck_chunks;
+  chunk_stats.ck_shared += stats.ck_shared;
+  chunk_stats.ck_bytes += stats.ck_bytes;
+  chunk_stats.ck_stored += stats.ck_stored;
+  chunk_stats.ck_usecs += (stop.tv_sec - start.tv_sec) * 1000000ULL +
+    (stop.tv_nsec - start.tv_nsec) / 1000;
+  pthread_mutex_unlock(&chunk_lock);
+  return 1;
+}
+
+/*
+ * Get a snapshot of the chunking counters.
+ */
+void chunk_get_stats(chunk_stats_t *stats)
+{
+  pthread_mutex_lock(&chunk_lock);
+  *stats = chunk_stats;
+  pthread_mutex_unlock(&chunk_lock);
+}
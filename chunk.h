@@ -0,0 +1,40 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#ifndef CHUNK_H
+# define CHUNK_H
+
+# include "structs.h"
+
+# define CHUNK_MIN		(16 << 10)	/* Smallest chunk	*/
+# define CHUNK_AVERAGE		(64 << 10)	/* Usual chunk		*/
+# define CHUNK_MAX		(256 << 10)	/* Largest chunk	*/
+# define CHUNK_MASK_SMALL	0xFFFFC00000000000ULL	/* 18 bits	*/
+# define CHUNK_MASK_LARGE	0xFFFC000000000000ULL	/* 14 bits	*/
+# define CHUNK_BUFFER		(4 * CHUNK_MAX)	/* Bytes read at once	*/
+# define CHUNK_SEED		0x636F707966732121ULL	/* Gear table	*/
+
+typedef struct chunk_stats_t	chunk_stats_t;
+
+/* Counters of the chunked versions */
+struct				chunk_stats_t
+{
+  unsigned long			ck_versions;	/* Versions chunked	*/
+  unsigned long			ck_chunks;	/* Chunks cut		*/
+  unsigned long			ck_shared;	/* Chunks already known	*/
+  unsigned long long		ck_bytes;	/* Data bytes chunked	*/
+  unsigned long long		ck_stored;	/* Bytes of new chunks	*/
+  unsigned long long		ck_usecs;	/* Time spent chunking	*/
+};
+
+void		chunk_setup(int enabled);
+int		chunk_add_version(metadata_t *metadata, version_t *version);
+void		chunk_remove(const char *directory);
+void		chunk_get_stats(chunk_stats_t *stats);
+
+#endif /* !CHUNK_H */
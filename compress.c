@@ -0,0 +1,222 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <zlib.h>
+
+#include "helper.h"
+#include "structs.h"
+#include "rcs.h"
+#include "overlay.h"
+#include "store.h"
+#include "compress.h"
+
+/*
+ * Old versions are seldom read, so once they have not been written to for a
+ * while, they can be compressed. A compressed version is cut in frames of
+ * COMPRESS_FRAME bytes, each compressed on its own, so that a read only
+ * decompresses the frames it needs. The frames are stored one after the
+ * other in a file named frames.<version file>, the version file keeps its
+ * size as a sparse file, and its map file tells where each frame ends (see
+ * overlay.c).
+ *
+ * Versions that do not shrink by at least an eighth are left alone.
+ */
+
+static int compress_level = COMPRESS_LEVEL;
+static time_t compress_age = COMPRESS_AGE;
+
+
+/*
+ * Set the compression level, from 1 to 9, or 0 to compress nothing, and how
+ * long a version has to be left alone before it is compressed.
+ */
+void compress_setup(int level, time_t age)
+{
+  if (level > Z_BEST_COMPRESSION)
+    level = Z_BEST_COMPRESSION;
+  compress_level = (level < 0) ? 0 : level;
+  compress_age = age;
+}
+
+/*
+ * Compress a file frame by frame to another file. The offset each frame ends
+ * at in the new file is added to the array. Returns the size of the new
+ * file, or -1.
+ */
+static off_t compress_frames(int src, off_t size, int dst, uint64_t **ends,
+			     unsigned int *count)
+{
+  char *buffer, *packed;
+  uLongf length, bound;
+  off_t offset, done;
+  size_t frame, written;
+  ssize_t res;
+
+  bound = compressBound(COMPRESS_FRAME);
+  buffer = safe_malloc(COMPRESS_FRAME);
+  packed = safe_malloc(bound);
+  *count = (size + COMPRESS_FRAME - 1) / COMPRESS_FRAME;
+  *ends = safe_malloc(sizeof(uint64_t) * *count + 1);
+  done = 0;
+  for (offset = 0; (done != -1) && (offset < size); offset += frame)
+    {
+      frame = (size - offset < COMPRESS_FRAME) ? size - offset :
+	COMPRESS_FRAME;
+      length = bound;
+      if (overlay_read(NULL, src, buffer, frame, offset) == -1)
+	{
+	  done = -1;
+	  break;
+	}
+      if (compress2((Bytef *)packed, &length, (Bytef *)buffer, frame,
+		    compress_level) != Z_OK)
+	{
+	  errno = EIO;
+	  done = -1;
+	  break;
+	}
+      for (written = 0; written < length; written += res)
+	{
+	  res = pwrite(dst, packed + written, length - written,
+		       done + written);
+	  if (res == -1 && errno == EINTR)
+	    res = 0;
+	  else if (res == -1)
+	    break;
+	}
+      if (written < length)
+	{
+	  done = -1;
+	  break;
+	}
+      done += length;
+      (*ends)[offset / COMPRESS_FRAME] = done;
+    }
+  free(buffer);
+  free(packed);
+  return done;
+}
+
+/*
+ * Compress an old version that was not written to for long enough. Returns
+ * 1 if it was compressed, or 0 if it is left alone because compression is
+ * off or the version is small, special, shared with other versions, has
+ * user attributes or does not shrink. If it is too recent, *retry is moved
+ * back to when it will be old enough, if that is earlier. The caller holds
+ * the metadata's update lock, and makes sure the version holds all its data
+ * and will not be written to anymore.
+ */
+int compress_add_version(metadata_t *metadata, version_t *version,
+			 time_t *retry)
+{
+  struct stat st_data;
+  char rfile[PATH_MAX], *frames, *data;
+  unsigned int count;
+  uint64_t *ends;
+  off_t packed;
+  time_t due;
+  int src, dst, fd, res;
+
+  if (!compress_level)
+    return 0;
+  if ((rcs_version_file(metadata, version, rfile) == -1) ||
+      (lstat(rfile, &st_data) == -1))
+    return -1;
+  if (!S_ISREG(st_data.st_mode) || (st_data.st_size < COMPRESS_FRAME) ||
+      (st_data.st_nlink > 2) || store_has_attributes(rfile))
+    return 0;
+  due = st_data.st_mtime + compress_age;
+  if (due > time(NULL))
+    {
+      if (!*retry || (due < *retry))
+	*retry = due;
+      return 0;
+    }
+
+  ends = NULL;
+  count = 0;
+  dst = -1;
+  frames = helper_get_sibling_name(rfile, "newframes");
+  data = helper_get_sibling_name(rfile, "packed");
+  src = open(rfile, O_RDONLY);
+  res = ((src == -1) ||
+	 ((dst = open(frames, O_RDWR | O_CREAT | O_TRUNC,
+		      S_IRUSR | S_IWUSR)) == -1)) ? -1 : 0;
+  packed = 0;
+  if (!res && ((packed = compress_frames(src, st_data.st_size, dst, &ends,
+					 &count)) == -1))
+    res = -1;
+  if (!res && (packed > st_data.st_size - st_data.st_size / 8))
+    res = 1;
+  if (!res)
+    res = fdatasync(dst);
+  if (src != -1)
+    close(src);
+
+  /* The version file only keeps its size */
+  fd = -1;
+  if (!res &&
+      (((fd = open(data, O_WRONLY | O_CREAT | O_TRUNC,
+		   st_data.st_mode & 07777)) == -1) ||
+       (ftruncate(fd, st_data.st_size) == -1) || (fsync(fd) == -1)))
+    res = -1;
+  if (fd != -1)
+    close(fd);
+  if (!res)
+    res = overlay_install_frames(metadata, version, data, frames, dst,
+				 st_data.st_size, ends, count);
+  if (!res && (st_data.st_nlink > 1))
+    store_release();
+  if (res)
+    {
+      int error = errno;
+      unlink(frames);
+      unlink(data);
+      errno = error;
+    }
+  if (dst != -1)
+    close(dst);
+  free(ends);
+  free(frames);
+  free(data);
+  if (res == -1)
+    return -1;
+  return !res;
+}
+
+/*
+ * Read and decompress the frame stored between two offsets of a file, to a
+ * buffer of COMPRESS_FRAME bytes. Returns the number of bytes it holds, or
+ * -1.
+ */
+ssize_t compress_load_frame(int fd, off_t start, off_t end, char *buffer)
+{
+  uLongf length;
+  char *packed;
+  int res;
+
+  packed = safe_malloc(end - start + 1);
+  res = overlay_read(NULL, fd, packed, end - start, start);
+  length = COMPRESS_FRAME;
+  if (!res && (uncompress((Bytef *)buffer, &length, (Bytef *)packed,
+			  end - start) != Z_OK))
+    {
+      errno = EIO;
+      res = -1;
+    }
+  free(packed);
+  return res ? -1 : (ssize_t)length;
+}
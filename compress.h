@@ -0,0 +1,26 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#ifndef COMPRESS_H
+# define COMPRESS_H
+
+# include <time.h>
+# include <sys/types.h>
+# include "structs.h"
+
+# define COMPRESS_FRAME		(64 << 10)	/* Bytes per frame	*/
+# define COMPRESS_LEVEL		0		/* Default, zero is off	*/
+# define COMPRESS_AGE		86400		/* Default, in seconds	*/
+
+void		compress_setup(int level, time_t age);
+int		compress_add_version(metadata_t *metadata, version_t *version,
+				     time_t *retry);
+ssize_t		compress_load_frame(int fd, off_t start, off_t end,
+				    char *buffer);
+
+#endif /* !COMPRESS_H */
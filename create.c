@@ -8,83 +8,91 @@
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <assert.h>
+#include <string.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#ifdef __linux__
+# include <linux/fs.h>
+#endif
 
 #include "helper.h"
 #include "structs.h"
+#include "intern.h"
+#include "slab.h"
 #include "write.h"
 #include "rcs.h"
 #include "create.h"
 #include "cache.h"
+#include "overlay.h"
+#include "delta.h"
 
 /*
- * Build a version file name with the given serial for the given virtual file.
+ * Get a handle on the real directory of the entries of a directory, and
+ * build the name of the file with the given serial of one of them in it, in
+ * a buffer of NAME_MAX + 1 bytes. The handle is given back with
+ * dircache_put(). Returns NULL on error.
  */
-static char *create_version_name(const char *vpath, int serial)
+static dircache_t *create_version_at(metadata_t *parent, const char *name,
+				     int serial, char *file)
 {
-  char buffer[9], *filename, *dirname, *translated, *cfile, *complete;
-
-  filename = helper_extract_filename(vpath);
-  dirname = helper_extract_dirname(vpath);
+  char path[PATH_MAX];
+  int res;
 
   /* Get the directory's path translation */
-  translated = rcs_translate_path(dirname, rcs_version_path);
-  assert(translated != NULL);
+  pthread_rwlock_rdlock(&parent->md_lock);
+  res = rcs_directory(parent, path);
+  pthread_rwlock_unlock(&parent->md_lock);
+  if (res)
+    return NULL;
 
   /* Build the version file name */
-  snprintf(buffer, 9, "%08X", serial);
-  cfile = helper_build_composite("SS", ".", buffer, filename);
-
-  complete = helper_build_composite("SS", "/", translated, cfile);
-
-  free(translated);
-  free(cfile);
-  free(dirname);
-  free(filename);
-  return complete;
+  if (snprintf(file, NAME_MAX + 1, "%08X.%s", serial, name) > NAME_MAX)
+    {
+      errno = ENAMETOOLONG;
+      return NULL;
+    }
+  return dircache_get(path);
 }
 
 /*
- * Build a metadata file name with the given virtual file and prefix.
- * prefix is "metadata" for metadata file and "dfl-meta" for default file.
+ * Build a metadata file name with the given file metadata and prefix, in a
+ * buffer of PATH_MAX bytes. prefix is "metadata" for metadata file and
+ * "dfl-meta" for default file. The root's metadata is in the version
+ * directory itself. Returns non-zero if the directory of the file is gone.
  */
-char *create_meta_name(char *vpath, char *prefix)
+int create_meta_name(metadata_t *metadata, char *prefix, char *buffer)
 {
-  char *dir, *file, *xlat, *name, *res;
-
-  dir = helper_extract_dirname(vpath);
-  file = helper_extract_filename(vpath);
-  xlat = rcs_translate_path(dir, rcs_version_path);
-  name = helper_build_composite("SS", ".", prefix, file);
-  res = helper_build_composite("SS", "/", xlat, name);
-  free(xlat);
-  free(name);
-  free(file);
-  free(dir);
-  return res;
+  if (rcs_entry_directory(metadata, buffer))
+    return -1;
+  return helper_append_path(buffer, "/%s.%s", prefix, metadata->md_name);
 }
 
 /*
- * Link a version to a metadata structure, and flush changes to disk. It will
- * only link the version in memory if the changes were successfully committed
- * to disk first.
+ * Link a version to a metadata structure, and flush changes to disk. It is
+ * unlinked from memory again if the changes could not be committed to disk.
+ * The caller has to hold the metadata's update lock : the files are written
+ * with it only, the lock being taken for writing just to change the list.
  */
 static int create_link_version(metadata_t *metadata, version_t *version)
 {
-  char *metafile, *dflfile;
-  int old_vid, old_svid, old_deleted;
+  char metafile[PATH_MAX], dflfile[PATH_MAX];
+  int old_vid, old_svid, old_deleted, error;
 
   /* Build the path for the metadata and default files */
-  metafile = create_meta_name(metadata->md_vfile, "metadata");
-  dflfile = create_meta_name(metadata->md_vfile, "dfl-meta");
+  if (create_meta_name(metadata, "metadata", metafile) ||
+      create_meta_name(metadata, "dfl-meta", dflfile))
+    return -1;
 
   /* Link in memory */
+  pthread_rwlock_wrlock(&metadata->md_lock);
   version->v_next = metadata->md_versions;
   metadata->md_versions = version;
 
@@ -93,60 +101,76 @@ static int create_link_version(metadata_t *metadata, version_t *version)
   old_svid = metadata->md_dfl_svid;
   metadata->md_dfl_vid = LATEST;
   metadata->md_dfl_svid = LATEST;
+  rcs_versions_changed(metadata);
 
   /* We are not deleted anymore */
   old_deleted = metadata->md_deleted;
   metadata->md_deleted = 0;
+  pthread_rwlock_unlock(&metadata->md_lock);
 
   /* Write the metafiles */
-  if (write_metadata_file(metafile, metadata) ||
-      write_default_file(dflfile, metadata->md_dfl_vid, metadata->md_dfl_svid))
+  if (write_metadata_append(metafile, metadata) ||
+      write_default_file(dflfile, LATEST, LATEST))
     {
       /* Something failed, remove the version from memory */
+      error = errno;
+      pthread_rwlock_wrlock(&metadata->md_lock);
       metadata->md_versions = version->v_next;
       metadata->md_dfl_vid = old_vid;
       metadata->md_dfl_svid = old_svid;
       metadata->md_deleted = old_deleted;
-
-      free(metafile);
-      free(dflfile);
+      rcs_versions_changed(metadata);
+      pthread_rwlock_unlock(&metadata->md_lock);
+      errno = error;
       return -1;
     }
 
-  free(metafile);
-  free(dflfile);
+  cache_update_metadata(metadata);
   return 0;
 }
 
-#define TIME_LIMIT 1
+#define COPY_ALL ((off_t)-1)
+
+static int create_copy_version(metadata_t *metadata, version_t *current,
+			       version_t *version, off_t length);
 
 /*
  * Create a new version or subversion of a file. This is a generic interface.
  * If subversion is set, it will create a subversion with the given attributes.
  * Else it will create a version. It won't work for initial version creation.
+ * If do_copy is set, the new version starts with the first length bytes of
+ * the current one, or all of it if length is COPY_ALL.
+ *
+ * The caller has to hold the metadata's update lock, so that the versions
+ * can be read without taking the metadata's lock, and the (possibly long)
+ * copy only blocks the other writers of this file.
  */
-static int create_new_version_generic(const char *vpath, int subversion,
-				      int do_copy, mode_t mode, uid_t uid,
-				      gid_t gid)
+static int create_new_version_generic(metadata_t *metadata, int subversion,
+				      int do_copy, off_t length, mode_t mode,
+				      uid_t uid, gid_t gid)
 {
-  metadata_t *metadata;
   version_t *version, *current;
   int result;
 
   /* We *want* to see deleted files there */
-  rcs_ignore_deleted = 1;
-
-  metadata = rcs_translate_to_metadata(vpath, rcs_version_path);
-  assert(metadata != NULL);
-
-  current = rcs_find_version(metadata, LATEST, LATEST);
-  assert(current != NULL);
+  current = rcs_find_version(metadata, LATEST, LATEST, RCS_SHOW_DELETED);
+  if (!current)
+    {
+      /* All the versions were purged */
+      errno = ENOENT;
+      return -1;
+    }
 
-  /* Return to normal behavior */
-  rcs_ignore_deleted = 0;
+  /*
+   * Check timestamp in order not to create bogus new versions, but a deleted
+   * file that is created again always needs its new version
+   */
+  if (!metadata->md_deleted &&
+      (time(NULL) - metadata->md_timestamp < TIME_LIMIT))
+    return 0;
 
-  /* Check timestamp in order not to create bogus new versions */
-  if (time(NULL) - metadata->md_timestamp < TIME_LIMIT)
+  /* A file open for writing already has its new version */
+  if (do_copy && metadata->md_writers)
     return 0;
 
   /* Can't create a subversion from a deleted file */
@@ -154,7 +178,7 @@ static int create_new_version_generic(const char *vpath, int subversion,
     return -1;
 
   /* Create a new version in memory */
-  version = safe_malloc(sizeof(version_t));
+  version = slab_alloc(&slab_versions);
   if (subversion)
     {
       /* If we have a locked version, we have to bump the real version */
@@ -171,7 +195,7 @@ static int create_new_version_generic(const char *vpath, int subversion,
       version->v_mode = mode & 07777;
       version->v_uid = uid;
       version->v_gid = gid;
-      version->v_rfile = safe_strdup(current->v_rfile);
+      version->v_file = current->v_file;
     }
   else
     {
@@ -180,122 +204,204 @@ static int create_new_version_generic(const char *vpath, int subversion,
       version->v_mode = current->v_mode & 07777;
       version->v_uid = do_copy ? current->v_uid : uid;
       version->v_gid = do_copy ? current->v_gid : gid;
-      version->v_rfile = create_version_name(vpath, version->v_vid);
+      version->v_file = version->v_vid;
     }
+  version->v_overlay = NULL;
+  version->v_probed = 0;
   version->v_next = NULL;
 
-  /* Create the file and copy the contents over, then link the version */
+  /*
+   * Create the file and copy the contents over, then link the version. The
+   * layers of the current version may be based on older versions.
+   */
   if (!subversion && do_copy)
-    result = create_copy_file(current->v_rfile, version->v_rfile);
+    {
+      result = rcs_load_history(metadata);
+      if (!result)
+	result = create_copy_version(metadata, current, version, length);
+    }
   else
     result = 0;
   if (!result)
       result = create_link_version(metadata, version);
   if (result)
     {
-      free(version->v_rfile);
-      free(version);
+      if (version->v_overlay)
+	overlay_remove(metadata, version);
+      slab_free(version);
+      return -1;
     }
 
-  return result;
+  /* The version it replaces can be encoded as a delta once it settles */
+  if (!subversion)
+    delta_schedule(metadata);
+
+  return 0;
 }
 
 /*
- * Create the metadata file for a new file
+ * Create the metadata file for a new entry of a directory. It replaces the
+ * negative entry the directory may have for this name in the cache.
  */
-static int create_new_metadata(const char *vpath, char *rpath, mode_t mode, uid_t uid, gid_t gid)
+static int create_new_metadata(metadata_t *parent, const char *name,
+			       mode_t mode, uid_t uid, gid_t gid)
 {
   metadata_t *metadata;
   version_t *version;
-  char *metafile;
+  char metafile[PATH_MAX];
   int res;
 
-  metadata = safe_malloc(sizeof (metadata_t));
-  metadata->md_vfile = safe_strdup(vpath);
-  metadata->md_vpath = helper_split_to_array(vpath, '/');
+  metadata = slab_alloc(&slab_metadata);
+  metadata->md_parent = parent;
+  metadata->md_name = intern_get(name);
   metadata->md_deleted = 0;
+  metadata->md_negative = 0;
+  metadata->md_writers = 0;
+  metadata->md_partial = 0;
+  metadata->md_appendable = 1;
   metadata->md_timestamp = time(NULL);
   metadata->md_dfl_vid = LATEST;
   metadata->md_dfl_svid = LATEST;
-  version = safe_malloc(sizeof (version_t));
+  metadata->md_pinned = NULL;
+  metadata->md_index = NULL;
+  metadata->md_count = 0;
+  metadata->md_borrowed = 0;
+  version = slab_alloc(&slab_versions);
   metadata->md_versions = version;
   version->v_vid = 1;
   version->v_svid = 0;
+  version->v_file = 1;
   version->v_mode = mode;
   version->v_uid = uid;
   version->v_gid = gid;
-  version->v_rfile = rpath;
+  version->v_overlay = NULL;
+  version->v_probed = 1;
   version->v_next = NULL;
-  cache_add_metadata(metadata);
-  metafile = create_meta_name(metadata->md_vfile, "metadata");
-  res = write_metadata_file(metafile, metadata);
-  free(metafile);
+  metadata = cache_add_metadata(metadata);
+  res = create_meta_name(metadata, "metadata", metafile) ? -1 :
+    write_metadata_file(metafile, metadata);
+  cache_release_metadata(metadata);
   return res;
 }
 
 /*
- * Create a new version of the file described by a virtual path. It handles
- * all the operations : copying the old version to a new version id, creating
- * the associated metadata and flushing everything to disk. It does *not*
- * handle the case where the file does not already exist !
+ * Give back what create_find_entry() returned.
  */
-int create_new_version(const char *vpath)
+static void create_release_entry(metadata_t *parent, metadata_t *metadata)
 {
-  return create_new_version_generic(vpath, 0, 1, 0, 0, 0);
+  if (metadata)
+    {
+      pthread_mutex_unlock(&metadata->md_update);
+      cache_release_metadata(metadata);
+    }
+  pthread_mutex_unlock(&parent->md_update);
+}
+
+/*
+ * Find where a new entry of a directory goes : if an older version of it
+ * existed, get its (deleted) metadata. Returns a negative error code if the
+ * file can't be created. Else, the update locks of the directory and of the
+ * older metadata are held, so that nobody else creates the same file
+ * meanwhile, and everything has to be given back with create_release_entry().
+ */
+static int create_find_entry(metadata_t *parent, const char *name,
+			     metadata_t **metadata)
+{
+  pthread_mutex_lock(&parent->md_update);
+
+  /* The directory may have been removed since the kernel looked it up */
+  if (!rcs_find_version(parent, LATEST, LATEST, RCS_HIDE_DELETED))
+    {
+      pthread_mutex_unlock(&parent->md_update);
+      return -ENOENT;
+    }
+
+  /* check if an older version existed */
+  *metadata = rcs_lookup(parent, name);
+  if (*metadata)
+    pthread_mutex_lock(&(*metadata)->md_update);
+  if (*metadata && !(*metadata)->md_deleted)
+    {
+      create_release_entry(parent, *metadata);
+      return -EEXIST;
+    }
+  return 0;
+}
+
+/*
+ * Create a new version of a file : it handles all the operations, copying
+ * the old version to a new version id, creating the associated metadata and
+ * flushing everything to disk. It does *not* handle the case where the file
+ * does not already exist ! The caller has to hold the metadata's update lock.
+ */
+int create_new_version_locked(metadata_t *metadata)
+{
+  return create_new_version_generic(metadata, 0, 1, COPY_ALL, 0, 0, 0);
+}
+
+/*
+ * Create a new version of a file like create_new_version_locked() does, for
+ * a file that is going to be truncated to the given size : only what
+ * survives the truncation is copied, and nothing at all for an empty file.
+ * The caller has to hold the metadata's update lock.
+ */
+int create_new_version_truncated(metadata_t *metadata, off_t size)
+{
+  return create_new_version_generic(metadata, 0, 1, size, 0, 0, 0);
 }
 
 /*
  * Create a subversion of the file, using the specified new meta-information.
- * It needs a file with at least one version to work !
+ * It needs a file with at least one version to work ! The caller has to hold
+ * the metadata's update lock.
  */
-int create_new_subversion(const char *vpath, mode_t mode, uid_t uid, gid_t gid)
+int create_new_subversion_locked(metadata_t *metadata, mode_t mode, uid_t uid,
+				 gid_t gid)
 {
-  return create_new_version_generic(vpath, 1, 0, mode, uid, gid);
+  return create_new_version_generic(metadata, 1, 0, 0, mode, uid, gid);
 }
 
 /*
  * Create a new empty file version 1.
  * Handle the case where an older version of the file aldready exists.
  */
-int create_new_file(const char *vpath, mode_t mode, uid_t uid, gid_t gid, dev_t dev)
+int create_new_file(metadata_t *parent, const char *name, mode_t mode,
+		    uid_t uid, gid_t gid, dev_t dev)
 {
   metadata_t *metadata;
+  dircache_t *directory;
   mode_t create_mode;
-  char *path;
+  char file[NAME_MAX + 1];
   int res;
 
   if (!(mode && (S_IFREG | S_IFCHR | S_IFBLK | S_IFIFO | S_IFSOCK))) {
     return -EPERM;
   }
-  /* check if an older version existed */
-  rcs_ignore_deleted = 1;
-  metadata = rcs_translate_to_metadata(vpath, rcs_version_path);
-  rcs_ignore_deleted = 0;
-  if (metadata && !metadata->md_deleted)
-    return -EEXIST;
-  if (!metadata)
-    path = create_version_name(vpath, 1);
-  else
-    path = create_version_name(vpath, metadata->md_versions->v_vid + 1);
+  res = create_find_entry(parent, name, &metadata);
+  if (res)
+    return res;
+  directory = create_version_at(parent, name, metadata ?
+				metadata->md_versions->v_vid + 1 : 1, file);
 
   /* remove suid, sgid, rwx for group and others */
   create_mode = (mode & ~S_ISUID & ~S_ISGID & ~S_ISVTX
 		 & ~S_IRWXG & ~S_IRWXO) | S_IRWXU;
-  if (mknod(path, create_mode, dev) == -1) {
-    free(path);
-    return -errno;
-  }
+  res = directory ? mknodat(directory->dc_fd, file, create_mode, dev) : -1;
+  if (directory)
+    dircache_put(directory);
+  if (res == -1)
+    res = -errno;
   /* FIXME: the owned should be the same as the parent if suid */
-  if (!metadata)
-    res = create_new_metadata(vpath, path, mode & 07777, uid, gid);
+  else if (!metadata)
+    res = create_new_metadata(parent, name, mode & 07777, uid, gid);
   else
-    res = create_new_version_generic(vpath, 0, 0, mode, uid, gid);
+    res = create_new_version_generic(metadata, 0, 0, 0, mode, uid, gid);
 
   /* Update timestamp */
-  metadata = rcs_translate_to_metadata(vpath, rcs_version_path);
-  if (metadata)
+  if (!res && metadata)
     metadata->md_timestamp = time(NULL);
 
+  create_release_entry(parent, metadata);
   return res;
 }
 
@@ -303,73 +409,290 @@ int create_new_file(const char *vpath, mode_t mode, uid_t uid, gid_t gid, dev_t
  * Create a new symlink, version 1.
  * Handle the case where an older version of the file aldready exists.
  */
-int create_new_symlink(const char *dest, const char *vpath, uid_t uid, gid_t gid)
+int create_new_symlink(const char *dest, metadata_t *parent, const char *name,
+		       uid_t uid, gid_t gid)
 {
-  char *realpath;
   metadata_t *metadata;
+  dircache_t *directory;
+  char file[NAME_MAX + 1];
   int res;
 
-  /* check if an older version existed */
-  rcs_ignore_deleted = 1;
-  metadata = rcs_translate_to_metadata(vpath, rcs_version_path);
-  rcs_ignore_deleted = 0;
-  if (metadata && !metadata->md_deleted)
-    return -EEXIST;
-  if (!metadata)
-    realpath = create_version_name(vpath, 1);
-  else
-    realpath = create_version_name(vpath, metadata->md_versions->v_vid + 1);
-  if (symlink(dest, realpath) == -1) {
-    free(realpath);
-    return -errno;
-  }
+  res = create_find_entry(parent, name, &metadata);
+  if (res)
+    return res;
+  directory = create_version_at(parent, name, metadata ?
+				metadata->md_versions->v_vid + 1 : 1, file);
+  res = directory ? symlinkat(dest, directory->dc_fd, file) : -1;
+  if (directory)
+    dircache_put(directory);
+  if (res == -1)
+    res = -errno;
   /* FIXME: the owned should be the same as the parent if suid */
-  if (!metadata)
-    res = create_new_metadata(vpath, realpath, S_IRWXU | S_IRWXG | S_IRWXO, uid, gid);
+  else if (!metadata)
+    res = create_new_metadata(parent, name, S_IRWXU | S_IRWXG | S_IRWXO,
+			      uid, gid);
   else
-    res = create_new_version_generic(vpath, 0, 0, S_IRWXU | S_IRWXG | S_IRWXO, uid, gid);
+    res = create_new_version_generic(metadata, 0, 0, 0,
+				     S_IRWXU | S_IRWXG | S_IRWXO, uid, gid);
+
+  create_release_entry(parent, metadata);
   return res;
 }
 
-int create_new_directory(const char *vpath, mode_t mode, uid_t uid, gid_t gid)
+int create_new_directory(metadata_t *parent, const char *name, mode_t mode,
+			 uid_t uid, gid_t gid)
 {
-  char *realpath;
   metadata_t *metadata;
+  dircache_t *directory;
+  char file[NAME_MAX + 1];
   int res;
 
-  /* check if an older version existed */
-  rcs_ignore_deleted = 1;
-  metadata = rcs_translate_to_metadata(vpath, rcs_version_path);
-  rcs_ignore_deleted = 0;
-  if (metadata && !metadata->md_deleted)
-    return -EEXIST;
-  if (!metadata)
-    realpath = create_version_name(vpath, 1);
-  else
-    realpath = create_version_name(vpath, metadata->md_versions->v_vid + 1);
+  res = create_find_entry(parent, name, &metadata);
+  if (res)
+    return res;
+  directory = create_version_at(parent, name, metadata ?
+				metadata->md_versions->v_vid + 1 : 1, file);
   /* FIXME: */
-  if (mkdir(realpath, 0700) == -1) {
-    free(realpath);
-    return -errno;
-  }
+  res = directory ? mkdirat(directory->dc_fd, file, 0700) : -1;
+  if (directory)
+    dircache_put(directory);
+  if (res == -1)
+    res = -errno;
   /* FIXME: the owned should be the same as the parent if suid */
-  if (!metadata)
-    res = create_new_metadata(vpath, realpath, mode, uid, gid);
+  else if (!metadata)
+    res = create_new_metadata(parent, name, mode, uid, gid);
   else
-    res = create_new_version_generic(vpath, 0, 0, mode, uid, gid);
+    res = create_new_version_generic(metadata, 0, 0, 0, mode, uid, gid);
+
+  create_release_entry(parent, metadata);
   return res;
 }
 
+#define COPY_CHUNK	(8 << 20)	/* Bytes per kernel copy	*/
+#define COPY_BUFFER	(1 << 20)	/* Bytes per buffered copy	*/
+#define COPY_ALIGN	4096		/* Alignment of the buffer	*/
+
+/* Copy strategies, from the fastest to the slowest */
+#define COPY_REFLINK	0
+#define COPY_RANGE	1
+#define COPY_SENDFILE	2
+#define COPY_BUFFERED	3
+
+static pthread_mutex_t copy_lock = PTHREAD_MUTEX_INITIALIZER;
+static copy_stats_t copy_stats;
+
+/*
+ * Write a whole buffer at the given offset of a file.
+ */
+static int create_write_buffer(int fd, const char *buffer, size_t size,
+			       off_t offset)
+{
+  ssize_t res;
+
+  while (size)
+    {
+      res = pwrite(fd, buffer, size, offset);
+      if (res == -1 && errno == EINTR)
+	continue;
+      if (res == -1)
+	return -1;
+      buffer += res;
+      size -= res;
+      offset += res;
+    }
+  return 0;
+}
+
+/*
+ * Copy the data between two offsets of a file to another file, at the same
+ * offsets moved by shift, with the given strategy, or a slower one if the
+ * kernel can't do it for these files. Returns the strategy that worked, or
+ * -1. The buffer is only allocated if it is needed, and has to be freed by
+ * the caller.
+ */
+static int create_copy_segment(int src, int dst, off_t start, off_t end,
+			       off_t shift, int strategy, char **buffer)
+{
+  off_t in, out;
+  ssize_t res;
+  size_t length;
+
+  in = start;
+  while (in < end)
+    {
+      length = (end - in < COPY_CHUNK) ? (size_t)(end - in) : COPY_CHUNK;
+      if (strategy == COPY_RANGE)
+	{
+	  out = in + shift;
+	  res = copy_file_range(src, &in, dst, &out, length, 0);
+	  if (res == -1 && (errno == EXDEV || errno == ENOSYS ||
+			    errno == EOPNOTSUPP || errno == EINVAL))
+	    {
+	      strategy = COPY_SENDFILE;
+	      continue;
+	    }
+	}
+      else if (strategy == COPY_SENDFILE)
+	{
+	  /* sendfile() writes at the current position of the target */
+	  if (lseek(dst, in + shift, SEEK_SET) == -1)
+	    return -1;
+	  res = sendfile(dst, src, &in, length);
+	  if (res == -1 && (errno == EINVAL || errno == ENOSYS))
+	    {
+	      strategy = COPY_BUFFERED;
+	      continue;
+	    }
+	}
+      else
+	{
+	  if (!*buffer && posix_memalign((void **)buffer, COPY_ALIGN,
+					 COPY_BUFFER))
+	    {
+	      *buffer = NULL;
+	      errno = ENOMEM;
+	      return -1;
+	    }
+	  if (length > COPY_BUFFER)
+	    length = COPY_BUFFER;
+	  res = pread(src, *buffer, length, in);
+	  if (res > 0)
+	    {
+	      if (create_write_buffer(dst, *buffer, res, in + shift) == -1)
+		return -1;
+	      in += res;
+	    }
+	}
+
+      if (res == -1 && errno == EINTR)
+	continue;
+      if (res == -1)
+	return -1;
+      if (res == 0)
+	{
+	  /* The file is shorter than expected */
+	  break;
+	}
+    }
+  return strategy;
+}
+
+/*
+ * Account for a file copied with the given strategy, that had the given
+ * numbers of data and hole bytes.
+ */
+static void create_count_copy(int strategy, off_t copied, off_t holes)
+{
+  /* Files without data don't tell much about the strategies */
+  pthread_mutex_lock(&copy_lock);
+  if (copied)
+    {
+      if (strategy == COPY_RANGE)
+	copy_stats.cp_ranges++;
+      else if (strategy == COPY_SENDFILE)
+	copy_stats.cp_sendfiles++;
+      else
+	copy_stats.cp_buffered++;
+    }
+  copy_stats.cp_bytes += copied;
+  copy_stats.cp_holes += holes;
+  pthread_mutex_unlock(&copy_lock);
+}
+
+/*
+ * Copy the first size bytes of a regular file of the given length to an
+ * empty file. The target shares the blocks of the source if the filesystem
+ * can do it. Else only the data segments are copied, by the kernel if
+ * possible, so that the holes of sparse files stay holes.
+ */
+static int create_copy_data(int src, int dst, off_t length, off_t size)
+{
+  off_t offset, data, hole, copied;
+  char *buffer;
+  int strategy;
+
+  /* Nothing to copy for a truncated file */
+  if (!size)
+    return 0;
+
+#ifdef FICLONE
+  if (ioctl(dst, FICLONE, src) == 0)
+    {
+      /* Cloning is cheap enough to drop the end afterwards */
+      if ((size < length) && (ftruncate(dst, size) == -1))
+	return -1;
+      pthread_mutex_lock(&copy_lock);
+      copy_stats.cp_reflinks++;
+      pthread_mutex_unlock(&copy_lock);
+      return 0;
+    }
+#endif
+
+  buffer = NULL;
+  strategy = COPY_RANGE;
+  copied = 0;
+  for (offset = 0; offset < size; offset = hole)
+    {
+      data = lseek(src, offset, SEEK_DATA);
+      if (data == -1 && errno == ENXIO)
+	{
+	  /* Only a hole is left */
+	  break;
+	}
+      if (data == -1)
+	{
+	  /* The filesystem does not know about holes */
+	  data = offset;
+	  hole = size;
+	}
+      else if ((hole = lseek(src, data, SEEK_HOLE)) == -1 || hole > size)
+	hole = size;
+      if (data >= size)
+	break;
+
+      strategy = create_copy_segment(src, dst, data, hole, 0, strategy,
+				     &buffer);
+      if (strategy == -1)
+	{
+	  free(buffer);
+	  return -1;
+	}
+      copied += hole - data;
+    }
+  free(buffer);
+
+  /* The holes at the end of the file were not written */
+  if (ftruncate(dst, size) == -1)
+    return -1;
+
+  create_count_copy(strategy, copied, size - copied);
+  return 0;
+}
+
+/*
+ * Get a snapshot of the copy counters.
+ */
+void create_get_copy_stats(copy_stats_t *stats)
+{
+  pthread_mutex_lock(&copy_lock);
+  *stats = copy_stats;
+  pthread_mutex_unlock(&copy_lock);
+}
+
 /*
  * Copy a (real) file to another (real) file.
  * file can be a regular file or a simlink
+ * Only the first length bytes of a regular file are copied, unless length
+ * is negative.
  */
-int create_copy_file(const char *source, const char *target)
+int create_copy_file(const char *source, const char *target, off_t length)
 {
   struct stat src_stat;
 
   if (lstat(source, &src_stat) == -1)
     return -1;
+  if ((length < 0) || (length > src_stat.st_size))
+    length = src_stat.st_size;
 
   if (S_ISLNK(src_stat.st_mode)) {
     char lnk[1024];
@@ -381,8 +704,6 @@ int create_copy_file(const char *source, const char *target)
       return -3;
   } else if (S_ISREG(src_stat.st_mode)) {
     int src, dst;
-    int rsize;
-    char buf[1024];
     if ((src = open(source, O_RDONLY)) == -1) {
       return -4;
     }
@@ -390,20 +711,13 @@ int create_copy_file(const char *source, const char *target)
       close(src);
       return -5;
     }
-    while ((rsize = read(src, buf, 1024))) {
-      if (rsize == -1 && errno == EINTR)
-	continue ;
-      if (rsize == -1) {
-	close(src);
-	close(dst);
-	return -6;
-      }
-      while (write(dst, buf, rsize) == -1)
-	if (errno != EINTR) {
-	  close(src);
-	  close(dst);
-	  return -7;
-	}
+    if (create_copy_data(src, dst, src_stat.st_size, length) == -1) {
+      int error = errno;
+      close(src);
+      close(dst);
+      unlink(target);
+      errno = error;
+      return -6;
     }
     close(src);
     close(dst);
@@ -412,3 +726,172 @@ int create_copy_file(const char *source, const char *target)
   }
   return 0;
 }
+
+/*
+ * Copy the data of a file from the given position to the offsets between
+ * start and end of another file. Returns the strategy that worked, or -1.
+ */
+int create_copy_range(int src, off_t position, int dst, off_t start,
+		      off_t end)
+{
+  char *buffer;
+  int strategy;
+
+  buffer = NULL;
+  strategy = create_copy_segment(src, dst, position, position + end - start,
+				 start - position, COPY_RANGE, &buffer);
+  free(buffer);
+  return strategy;
+}
+
+/*
+ * Copy the first length bytes of an overlay version to a new file, which
+ * then has all its data, reading each extent from the layer that holds it.
+ * The caller holds the metadata's update lock.
+ */
+static int create_copy_layers(metadata_t *metadata, version_t *current,
+			      const char *target, mode_t mode, off_t length)
+{
+  extent_t *extents;
+  chain_t *chain;
+  char source[PATH_MAX];
+  int src, dst, count, i, res, strategy;
+  off_t copied;
+
+  if ((rcs_version_file(metadata, current, source) == -1) ||
+      ((src = open(source, O_RDONLY)) == -1))
+    return -1;
+  res = overlay_open_chain(metadata, current, src, &chain);
+  close(src);
+  if (res == -1)
+    return -1;
+  if ((dst = creat(target, mode)) == -1)
+    {
+      overlay_close_chain(chain);
+      return -1;
+    }
+
+  /* Never written blocks stay holes */
+  copied = 0;
+  strategy = COPY_RANGE;
+  count = overlay_map_range(chain, 0, length, &extents);
+  for (i = 0; strategy != -1 && i < count; i++)
+    if (extents[i].e_data)
+      {
+	if (create_write_buffer(dst, extents[i].e_data, extents[i].e_length,
+				extents[i].e_offset) == -1)
+	  strategy = -1;
+	copied += extents[i].e_length;
+      }
+    else if (!extents[i].e_zero)
+      {
+	strategy = create_copy_range(extents[i].e_fd,
+				     extents[i].e_position, dst,
+				     extents[i].e_offset,
+				     extents[i].e_offset +
+				     extents[i].e_length);
+	copied += extents[i].e_length;
+      }
+  if (count != -1)
+    overlay_free_extents(extents, count);
+  if ((count == -1) || (strategy == -1) || (ftruncate(dst, length) == -1))
+    {
+      int error = errno;
+      close(dst);
+      unlink(target);
+      overlay_close_chain(chain);
+      errno = error;
+      return -1;
+    }
+  create_count_copy(strategy, copied, length - copied);
+  close(dst);
+  overlay_close_chain(chain);
+  return 0;
+}
+
+/*
+ * Give a new version the first length bytes of the current one, or all of
+ * it if length is COPY_ALL. A large regular file gets an overlay version,
+ * that only holds the blocks written from now on, unless the filesystem can
+ * share its blocks, or there are enough overlays below already. The caller
+ * holds the metadata's update lock.
+ */
+static int create_copy_version(metadata_t *metadata, version_t *current,
+			       version_t *version, off_t length)
+{
+  struct stat src_stat;
+  overlay_t *overlay;
+  char source[PATH_MAX], target[PATH_MAX];
+  int layered, depth, src, dst;
+
+  if ((rcs_version_file(metadata, current, source) == -1) ||
+      (rcs_version_file(metadata, version, target) == -1) ||
+      (lstat(source, &src_stat) == -1))
+    return -1;
+  if ((length < 0) || (length > src_stat.st_size))
+    length = src_stat.st_size;
+  if (!S_ISREG(src_stat.st_mode))
+    return create_copy_file(source, target, length);
+
+  if (overlay_get(metadata, current, &overlay) == -1)
+    return -1;
+  layered = (overlay != NULL);
+  overlay_put(overlay);
+
+  /* Small files are simply copied, and so are overlays stacked too high */
+  depth = (length < OVERLAY_MIN_SIZE) ? OVERLAY_DEPTH :
+    overlay_depth(metadata, current);
+  if (depth == -1)
+    return -1;
+  if (depth >= OVERLAY_DEPTH)
+    {
+      if (layered)
+	return create_copy_layers(metadata, current, target,
+				  src_stat.st_mode, length);
+      return create_copy_file(source, target, length);
+    }
+
+  if ((dst = creat(target, src_stat.st_mode)) == -1)
+    return -1;
+#ifdef FICLONE
+  if (!layered && (src = open(source, O_RDONLY)) != -1)
+    {
+      /* Shared blocks are as cheap, and leave nothing to stack */
+      if (ioctl(dst, FICLONE, src) == 0)
+	{
+	  close(src);
+	  if ((length < src_stat.st_size) && (ftruncate(dst, length) == -1))
+	    {
+	      int error = errno;
+	      close(dst);
+	      unlink(target);
+	      errno = error;
+	      return -1;
+	    }
+	  close(dst);
+	  pthread_mutex_lock(&copy_lock);
+	  copy_stats.cp_reflinks++;
+	  pthread_mutex_unlock(&copy_lock);
+	  return 0;
+	}
+      close(src);
+    }
+#else
+  (void) src;
+#endif
+
+  if ((ftruncate(dst, length) == -1) ||
+      (overlay_create(metadata, version, current->v_vid, length) == -1))
+    {
+      int error = errno;
+      close(dst);
+      unlink(target);
+      errno = error;
+      return -1;
+    }
+  close(dst);
+  pthread_mutex_lock(&copy_lock);
+  copy_stats.cp_overlays++;
+  pthread_mutex_unlock(&copy_lock);
+  return 0;
+}
@@ -9,12 +9,37 @@
 #ifndef CREATE_H
 # define CREATE_H
 
-char *create_meta_name(char *vpath, char *prefix);
-int create_new_version(const char *vpath);
-int create_new_subversion(const char *vpath, mode_t mode, uid_t uid, gid_t gid);
-int create_new_file(const char *vpath, mode_t mode, uid_t uid, gid_t gid, dev_t dev);
-int create_new_symlink(const char *dest, const char *vpath, uid_t uid, gid_t gid);
-int create_new_directory(const char *vpath, mode_t mode, uid_t uid, gid_t gid);
-int create_copy_file(const char *source, const char *target);
+# include "structs.h"
+
+# define TIME_LIMIT		1		/* Seconds per version	*/
+
+typedef struct copy_stats_t	copy_stats_t;
+
+struct				copy_stats_t
+{
+  unsigned long			cp_reflinks;	/* Files cloned		*/
+  unsigned long			cp_ranges;	/* copy_file_range()	*/
+  unsigned long			cp_sendfiles;	/* sendfile()		*/
+  unsigned long			cp_buffered;	/* read() and write()	*/
+  unsigned long			cp_overlays;	/* Only written blocks	*/
+  unsigned long long		cp_bytes;	/* Data bytes copied	*/
+  unsigned long long		cp_holes;	/* Hole bytes skipped	*/
+};
+
+int create_meta_name(metadata_t *metadata, char *prefix, char *buffer);
+int create_new_version_locked(metadata_t *metadata);
+int create_new_version_truncated(metadata_t *metadata, off_t size);
+int create_new_subversion_locked(metadata_t *metadata, mode_t mode, uid_t uid,
+				 gid_t gid);
+int create_new_file(metadata_t *parent, const char *name, mode_t mode,
+		    uid_t uid, gid_t gid, dev_t dev);
+int create_new_symlink(const char *dest, metadata_t *parent, const char *name,
+		       uid_t uid, gid_t gid);
+int create_new_directory(metadata_t *parent, const char *name, mode_t mode,
+			 uid_t uid, gid_t gid);
+int create_copy_file(const char *source, const char *target, off_t length);
+int create_copy_range(int src, off_t position, int dst, off_t start,
+		      off_t end);
+void create_get_copy_stats(copy_stats_t *stats);
 
 #endif /* !CREATE_H */
@@ -0,0 +1,488 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "helper.h"
+#include "structs.h"
+#include "cache.h"
+#include "rcs.h"
+#include "create.h"
+#include "overlay.h"
+#include "store.h"
+#include "chunk.h"
+#include "compress.h"
+#include "retain.h"
+#include "delta.h"
+
+/*
+ * Old versions are kept as reverse deltas : the newest version of a file
+ * holds all its data, and each older one only holds the blocks it differs by
+ * from the version that came after it. They use the map files of the
+ * overlays (see overlay.c), based on a newer version instead of an older
+ * one, so reading an old version goes up the chain of the versions that
+ * followed it. To bound that chain, every depth + 1th version (by version
+ * ID) keeps all its data too, which does not change as new versions come.
+ *
+ * The versions are encoded by a background thread, once a file has had no
+ * new version for DELTA_DELAY seconds, and only when its newest version
+ * can't be written to anymore. Each step holds the file's update lock, so
+ * that no version comes or goes meanwhile, and the lock is released between
+ * the versions.
+ */
+
+static pthread_mutex_t delta_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t delta_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_t delta_thread;
+
+/* Everything below is guarded by the delta_lock */
+static delta_item_t *delta_queue = NULL;
+static unsigned int delta_depth = 0;
+static int delta_running = 0;
+static int delta_stopping = 0;
+
+
+/*
+ * Check if a version is worth encoding : small files and special files are
+ * kept whole, and so are the files with user attributes, that the new data
+ * file would not have.
+ */
+static int delta_worth(metadata_t *metadata, version_t *version)
+{
+  struct stat st_data;
+  char rfile[PATH_MAX];
+
+  if ((rcs_version_file(metadata, version, rfile) == -1) ||
+      (lstat(rfile, &st_data) == -1))
+    return 0;
+  return S_ISREG(st_data.st_mode) && (st_data.st_size >= OVERLAY_MIN_SIZE) &&
+    !store_has_attributes(rfile);
+}
+
+/*
+ * Compare a chunk of a version with what the same offsets of the next newer
+ * version read as, and write the blocks that differ to the new data file.
+ */
+static int delta_compare(const char *old, const char *new, off_t length,
+			 off_t offset, int dst, unsigned char *map)
+{
+  off_t block, size, index;
+
+  for (block = 0; block < length; block += OVERLAY_BLOCK)
+    {
+      size = length - block;
+      if (size > OVERLAY_BLOCK)
+	size = OVERLAY_BLOCK;
+      if (!memcmp(old + block, new + block, size))
+	continue;
+      if (pwrite(dst, old + block, size, offset + block) != size)
+	{
+	  if (errno == 0)
+	    errno = ENOSPC;
+	  return -1;
+	}
+      index = (offset + block) / OVERLAY_BLOCK;
+      map[index / 8] |= 1 << (index % 8);
+    }
+  return 0;
+}
+
+/*
+ * Encode a version that holds all its data as the blocks it differs by from
+ * the next newer version. Past the end of the shorter one, the blocks it
+ * does not hold read as zeroes. The caller holds the metadata's update lock.
+ */
+static int delta_encode(metadata_t *metadata, version_t *version,
+			version_t *newer)
+{
+  struct stat st_old, st_new;
+  unsigned char *map;
+  char rfile[PATH_MAX], *old, *new, *data;
+  chain_t *chain;
+  off_t offset, length, base_size, zero;
+  size_t bytes;
+  int src, base, dst, res, error;
+
+  if (rcs_version_file(metadata, newer, rfile) == -1)
+    return -1;
+  base = open(rfile, O_RDONLY);
+  if (rcs_version_file(metadata, version, rfile) == -1)
+    {
+      error = errno;
+      if (base != -1)
+	close(base);
+      errno = error;
+      return -1;
+    }
+  chain = NULL;
+  dst = -1;
+  src = open(rfile, O_RDONLY);
+  res = ((src == -1) || (base == -1) || (fstat(src, &st_old) == -1) ||
+	 (fstat(base, &st_new) == -1) ||
+	 (overlay_open_chain(metadata, newer, base, &chain) == -1)) ? -1 : 0;
+
+  data = helper_get_sibling_name(rfile, "delta");
+  if (!res &&
+      (((dst = open(data, O_WRONLY | O_CREAT | O_TRUNC,
+		    st_old.st_mode & 07777)) == -1) ||
+       (ftruncate(dst, st_old.st_size) == -1)))
+    res = -1;
+
+  map = NULL;
+  bytes = 0;
+  base_size = 0;
+  if (!res)
+    {
+      base_size = (st_new.st_size < st_old.st_size) ? st_new.st_size :
+	st_old.st_size;
+      bytes = st_old.st_size / OVERLAY_BLOCK / 8 + 1;
+      map = safe_malloc(bytes);
+      memset(map, 0, bytes);
+      old = safe_malloc(DELTA_CHUNK);
+      new = safe_malloc(DELTA_CHUNK);
+      for (offset = 0; !res && offset < st_old.st_size; offset += length)
+	{
+	  length = st_old.st_size - offset;
+	  if (length > DELTA_CHUNK)
+	    length = DELTA_CHUNK;
+	  res = overlay_read(NULL, src, old, length, offset);
+	  if (!res)
+	    res = overlay_read(chain, base, new, length, offset);
+	  if (!res && (offset + length > base_size))
+	    {
+	      zero = (base_size > offset) ? base_size - offset : 0;
+	      memset(new + zero, 0, length - zero);
+	    }
+	  if (!res)
+	    res = delta_compare(old, new, length, offset, dst, map);
+	}
+      free(old);
+      free(new);
+    }
+  if (!res)
+    res = fdatasync(dst);
+
+  error = errno;
+  overlay_close_chain(chain);
+  if (dst != -1)
+    close(dst);
+  if (base != -1)
+    close(base);
+  if (src != -1)
+    close(src);
+  if (!res)
+    {
+      res = overlay_install(metadata, version, data, newer->v_vid, base_size,
+			    map, bytes);
+      error = errno;
+      if (!res && (st_old.st_nlink > 1))
+	store_release();
+    }
+  if (res)
+    unlink(data);
+  free(data);
+  free(map);
+  errno = error;
+  return res;
+}
+
+/*
+ * Do the next step of the encoding of a file, going from its newest version
+ * to the oldest : flatten a version that has to hold all its data, or that
+ * is not based on the next newer one, or encode a version that holds all its
+ * data. Chunked and compressed versions are never encoded, and are kept as
+ * they are, and so are the versions whose file a newer version uses : its
+ * subversions, or a version made from it while it was pinned.
+ * Returns 1 after a step, 0 once there is nothing left to do, or -1. The
+ * caller holds the metadata's update lock.
+ */
+static int delta_encode_step(metadata_t *metadata, unsigned int max_depth)
+{
+  version_t *version, *newer;
+  overlay_t *overlay;
+  unsigned int depth, i, *newest;
+  int full, whole, based, keep, res;
+
+  newer = NULL;
+  depth = 0;
+  res = 0;
+  newest = rcs_newest_users(metadata);
+  for (i = 0, version = metadata->md_versions; version;
+       i++, version = version->v_next)
+    {
+      if (newest[i] < i)
+	continue;
+
+      if (overlay_get(metadata, version, &overlay) == -1)
+	{
+	  res = -1;
+	  break;
+	}
+      whole = overlay_whole(overlay);
+      full = !overlay || whole;
+      based = overlay && newer && (overlay->o_base == newer->v_vid);
+      overlay_put(overlay);
+      keep = !newer || !(version->v_vid % (max_depth + 1)) ||
+	(depth >= max_depth);
+
+      if (!full && (keep || !based))
+	{
+	  res = (overlay_flatten_version(metadata, version) == -1) ? -1 : 1;
+	  break;
+	}
+      if (full && !whole && !keep && delta_worth(metadata, version))
+	{
+	  res = (delta_encode(metadata, version, newer) == -1) ? -1 : 1;
+	  break;
+	}
+      depth = full ? 0 : depth + 1;
+      newer = version;
+    }
+  free(newest);
+  return res;
+}
+
+/*
+ * Put the old versions that hold all their data in the object store, so
+ * that they share it with the identical versions of any file, or as chunks
+ * if they are large enough, so that they share the parts that did not
+ * change, or compress them once they are old enough. The newest version,
+ * and the versions whose file a newer one uses, are left as they are.
+ * *retry gets when a version that is not old enough yet will be. The caller
+ * holds the metadata's update lock.
+ */
+static int delta_store_versions(metadata_t *metadata, time_t *retry)
+{
+  version_t *version;
+  overlay_t *overlay;
+  unsigned int i, *newest;
+  int res;
+
+  res = 0;
+  newest = rcs_newest_users(metadata);
+  for (i = 0, version = metadata->md_versions; version;
+       i++, version = version->v_next)
+    {
+      if (!i || (newest[i] < i))
+	continue;
+      if ((res = overlay_get(metadata, version, &overlay)) == -1)
+	break;
+      overlay_put(overlay);
+      if (overlay)
+	continue;
+      if ((res = chunk_add_version(metadata, version)) == 0 &&
+	  (res = compress_add_version(metadata, version, retry)) == 0)
+	res = store_add_version(metadata, version);
+      if (res == -1)
+	break;
+    }
+  free(newest);
+  return (res == -1) ? -1 : 0;
+}
+
+/*
+ * Do the next step of the work on a file : the encoding of its versions,
+ * then the storage of the whole ones. Returns 1 after a step of the
+ * encoding, 0 once everything is done, and -1, with EBUSY if the newest
+ * version may still be written to. The caller holds the metadata's update
+ * lock.
+ */
+static int delta_step(metadata_t *metadata, unsigned int max_depth,
+		      time_t *retry)
+{
+  int res;
+
+  if (metadata->md_writers ||
+      (time(NULL) - metadata->md_timestamp < TIME_LIMIT))
+    {
+      errno = EBUSY;
+      return -1;
+    }
+  if (max_depth && (res = delta_encode_step(metadata, max_depth)))
+    return res;
+  return delta_store_versions(metadata, retry);
+}
+
+/*
+ * Encode the old versions of a file, one at a time. Returns -1 with EBUSY if
+ * it has to be done again later, and sets *retry if some versions will only
+ * be old enough to compress later. A file dropped from the cache is left
+ * alone : its files now belong to the metadata of the next lookup.
+ */
+static int delta_encode_file(metadata_t *metadata, unsigned int max_depth,
+			     time_t *retry)
+{
+  int res;
+
+  do
+    {
+      *retry = 0;
+      pthread_mutex_lock(&metadata->md_update);
+      if (!cache_has_metadata(metadata))
+	res = 0;
+      else if (!(res = rcs_load_history(metadata)))
+	res = delta_step(metadata, max_depth, retry);
+      pthread_mutex_unlock(&metadata->md_update);
+    }
+  while ((res == 1) && !__atomic_load_n(&delta_stopping, __ATOMIC_ACQUIRE));
+  return res;
+}
+
+/*
+ * Queue a file to be encoded at the given time, or move its encoding to that
+ * time if it was already queued and postpone is set, or if it was due later.
+ */
+static void delta_queue_file(metadata_t *metadata, time_t due, int postpone)
+{
+  delta_item_t *item;
+
+  pthread_mutex_lock(&delta_lock);
+  if (!delta_running)
+    {
+      pthread_mutex_unlock(&delta_lock);
+      return;
+    }
+  for (item = delta_queue; item; item = item->di_next)
+    if (item->di_metadata == metadata)
+      break;
+  if (!item)
+    {
+      item = safe_malloc(sizeof(delta_item_t));
+      cache_hold_metadata(metadata);
+      item->di_metadata = metadata;
+      item->di_due = due;
+      item->di_next = delta_queue;
+      delta_queue = item;
+      pthread_cond_signal(&delta_wakeup);
+    }
+  else if (postpone || (due < item->di_due))
+    item->di_due = due;
+  pthread_mutex_unlock(&delta_lock);
+}
+
+/*
+ * Background thread : encode the queued files as they become due, the
+ * earliest first.
+ */
+static void *delta_worker(void *unused)
+{
+  delta_item_t **item, **first, *due;
+  struct timespec deadline;
+  unsigned int max_depth;
+  metadata_t *metadata;
+  time_t retry;
+  int res;
+
+  (void) unused;
+  pthread_mutex_lock(&delta_lock);
+  while (!delta_stopping)
+    {
+      first = NULL;
+      for (item = &delta_queue; *item; item = &(*item)->di_next)
+	if (!first || ((*item)->di_due < (*first)->di_due))
+	  first = item;
+      if (!first)
+	{
+	  pthread_cond_wait(&delta_wakeup, &delta_lock);
+	  continue;
+	}
+      if ((*first)->di_due > time(NULL))
+	{
+	  deadline.tv_sec = (*first)->di_due;
+	  deadline.tv_nsec = 0;
+	  pthread_cond_timedwait(&delta_wakeup, &delta_lock, &deadline);
+	  continue;
+	}
+
+      due = *first;
+      *first = due->di_next;
+      max_depth = delta_depth;
+      pthread_mutex_unlock(&delta_lock);
+
+      metadata = due->di_metadata;
+      free(due);
+
+      /* Its policy may not keep all its versions anymore */
+      retain_file(metadata);
+      res = delta_encode_file(metadata, max_depth, &retry);
+      if ((res == -1) && (errno == EBUSY))
+	delta_schedule(metadata);
+      else if (!res && retry)
+	delta_queue_file(metadata, retry, 0);
+      cache_release_metadata(metadata);
+      store_sweep();
+
+      pthread_mutex_lock(&delta_lock);
+    }
+  pthread_mutex_unlock(&delta_lock);
+  return NULL;
+}
+
+/*
+ * Start the background thread, that encodes chains of at most depth
+ * versions. A depth of zero keeps all the versions whole.
+ */
+void delta_start(unsigned int depth)
+{
+  if (depth > OVERLAY_DEPTH)
+    depth = OVERLAY_DEPTH;
+
+  pthread_mutex_lock(&delta_lock);
+  delta_depth = depth;
+  delta_stopping = 0;
+  delta_running = !pthread_create(&delta_thread, NULL, delta_worker, NULL);
+  pthread_mutex_unlock(&delta_lock);
+}
+
+/*
+ * Stop the background encoding, and forget the files that were left in the
+ * queue. Their versions are encoded the next time they get a new one.
+ */
+void delta_stop(void)
+{
+  delta_item_t *item;
+
+  pthread_mutex_lock(&delta_lock);
+  if (!delta_running)
+    {
+      pthread_mutex_unlock(&delta_lock);
+      return;
+    }
+  delta_running = 0;
+  __atomic_store_n(&delta_stopping, 1, __ATOMIC_RELEASE);
+  pthread_cond_signal(&delta_wakeup);
+  pthread_mutex_unlock(&delta_lock);
+  pthread_join(delta_thread, NULL);
+
+  while (delta_queue)
+    {
+      item = delta_queue;
+      delta_queue = item->di_next;
+      cache_release_metadata(item->di_metadata);
+      free(item);
+    }
+}
+
+/*
+ * Queue a file that got a new version, or push its encoding back if it was
+ * already queued, so that files being changed are left alone until they
+ * settle. The caller holds a reference on the metadata.
+ */
+void delta_schedule(metadata_t *metadata)
+{
+  delta_queue_file(metadata, time(NULL) + DELTA_DELAY, 1);
+}
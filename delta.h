@@ -0,0 +1,33 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#ifndef DELTA_H
+# define DELTA_H
+
+# include <time.h>
+# include "structs.h"
+
+# define DELTA_DEPTH		4		/* Default chain limit	*/
+# define DELTA_DELAY		10		/* Seconds to settle	*/
+# define DELTA_CHUNK		(256 << 10)	/* Bytes compared	*/
+
+typedef struct delta_item_t	delta_item_t;
+
+/* A file whose old versions are waiting to be encoded */
+struct				delta_item_t
+{
+  metadata_t			*di_metadata;	/* Referenced file	*/
+  time_t			di_due;		/* When to encode it	*/
+  delta_item_t			*di_next;	/* Next in the queue	*/
+};
+
+void		delta_start(unsigned int depth);
+void		delta_stop(void);
+void		delta_schedule(metadata_t *metadata);
+
+#endif /* !DELTA_H */
@@ -0,0 +1,233 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "helper.h"
+#include "dircache.h"
+
+/*
+ * The files of the versions are reached relative to an open handle on the
+ * real directory they are in, so that the kernel only walks their own name
+ * instead of the whole path of the version tree. The handles are kept by
+ * path : the real directory of a version never moves, and is never
+ * removed while the filesystem is mounted. At most the given number of
+ * handles nobody uses stay open, the least recently used being closed
+ * first.
+ */
+
+static pthread_mutex_t dircache_lock = PTHREAD_MUTEX_INITIALIZER;
+static dircache_t **dircache_table = NULL;
+static unsigned int dircache_buckets = 0;
+static unsigned int dircache_count = 0;
+static unsigned int dircache_max = DIRCACHE_HANDLES;
+
+/* The handles nobody uses, most recently used first */
+static dircache_t *dircache_lru_head = NULL;
+static dircache_t *dircache_lru_tail = NULL;
+
+/*
+ * Set how many handles may stay open, zero meaning the default. It is only
+ * called before the first handle is opened.
+ */
+void dircache_setup(unsigned int handles)
+{
+  dircache_max = handles ? handles : DIRCACHE_HANDLES;
+}
+
+/*
+ * Make the table, with at least as many buckets as handles kept. The
+ * caller holds the lock.
+ */
+static void dircache_initialize(void)
+{
+  unsigned int size;
+
+  for (size = DIRCACHE_BUCKETS; size < dircache_max; size *= 2)
+    ;
+  dircache_table = safe_malloc(sizeof(dircache_t *) * size);
+  memset(dircache_table, 0, sizeof(dircache_t *) * size);
+  dircache_buckets = size;
+}
+
+/*
+ * Find the handle of a directory. The caller holds the lock.
+ */
+static dircache_t *dircache_find(const char *path, uint64_t hash)
+{
+  dircache_t *entry;
+
+  for (entry = dircache_table[hash & (dircache_buckets - 1)]; entry;
+       entry = entry->dc_next)
+    if ((entry->dc_hash == hash) && !strcmp(entry->dc_path, path))
+      return entry;
+  return NULL;
+}
+
+/*
+ * Take a handle out of the list of the unused ones. The caller holds the
+ * lock.
+ */
+static void dircache_lru_unlink(dircache_t *entry)
+{
+  if (entry->dc_lru_previous)
+    entry->dc_lru_previous->dc_lru_next = entry->dc_lru_next;
+  else
+    dircache_lru_head = entry->dc_lru_next;
+  if (entry->dc_lru_next)
+    entry->dc_lru_next->dc_lru_previous = entry->dc_lru_previous;
+  else
+    dircache_lru_tail = entry->dc_lru_previous;
+}
+
+/*
+ * Take a reference on a handle found in the table. The caller holds the
+ * lock.
+ */
+static void dircache_hold(dircache_t *entry)
+{
+  if (!entry->dc_refcount++)
+    dircache_lru_unlink(entry);
+}
+
+/*
+ * Take the least recently used handles out of the table, while there are
+ * too many of them, and return them in a list to close once the lock is
+ * released. The caller holds the lock.
+ */
+static dircache_t *dircache_evict(void)
+{
+  dircache_t *entry, **link, *evicted;
+
+  evicted = NULL;
+  while ((dircache_count > dircache_max) && dircache_lru_tail)
+    {
+      entry = dircache_lru_tail;
+      dircache_lru_unlink(entry);
+      for (link = &dircache_table[entry->dc_hash & (dircache_buckets - 1)];
+	   *link != entry; link = &(*link)->dc_next)
+	;
+      *link = entry->dc_next;
+      dircache_count--;
+      entry->dc_next = evicted;
+      evicted = entry;
+    }
+  return evicted;
+}
+
+/*
+ * Close a list of handles from dircache_evict().
+ */
+static void dircache_close(dircache_t *entry)
+{
+  dircache_t *next;
+
+  for (; entry; entry = next)
+    {
+      next = entry->dc_next;
+      close(entry->dc_fd);
+      free(entry);
+    }
+}
+
+/*
+ * Get a handle on a real directory, opening it if it is not open yet. It
+ * is given back with dircache_put(). Returns NULL on error.
+ */
+dircache_t *dircache_get(const char *path)
+{
+  dircache_t *entry, *evicted;
+  uint64_t hash;
+  size_t length;
+  int fd;
+
+  hash = helper_hash_string(path);
+  pthread_mutex_lock(&dircache_lock);
+  if (!dircache_table)
+    dircache_initialize();
+  entry = dircache_find(path, hash);
+  if (entry)
+    {
+      dircache_hold(entry);
+      pthread_mutex_unlock(&dircache_lock);
+      return entry;
+    }
+  pthread_mutex_unlock(&dircache_lock);
+
+  /* Walk the path without the lock, and keep it unless another was faster */
+  fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1)
+    return NULL;
+  pthread_mutex_lock(&dircache_lock);
+  entry = dircache_find(path, hash);
+  if (entry)
+    {
+      dircache_hold(entry);
+      pthread_mutex_unlock(&dircache_lock);
+      close(fd);
+      return entry;
+    }
+
+  length = strlen(path);
+  entry = safe_malloc(sizeof(dircache_t) + length + 1);
+  entry->dc_fd = fd;
+  entry->dc_refcount = 1;
+  entry->dc_hash = hash;
+  memcpy(entry->dc_path, path, length + 1);
+  entry->dc_next = dircache_table[hash & (dircache_buckets - 1)];
+  dircache_table[hash & (dircache_buckets - 1)] = entry;
+  dircache_count++;
+  evicted = dircache_evict();
+  pthread_mutex_unlock(&dircache_lock);
+  dircache_close(evicted);
+  return entry;
+}
+
+/*
+ * Give back a handle from dircache_get(). It stays open until there are
+ * too many unused handles.
+ */
+void dircache_put(dircache_t *entry)
+{
+  dircache_t *evicted;
+
+  pthread_mutex_lock(&dircache_lock);
+  evicted = NULL;
+  if (!--entry->dc_refcount)
+    {
+      entry->dc_lru_previous = NULL;
+      entry->dc_lru_next = dircache_lru_head;
+      if (dircache_lru_head)
+	dircache_lru_head->dc_lru_previous = entry;
+      else
+	dircache_lru_tail = entry;
+      dircache_lru_head = entry;
+      evicted = dircache_evict();
+    }
+  pthread_mutex_unlock(&dircache_lock);
+  dircache_close(evicted);
+}
+
+/*
+ * Close all the handles, none of them being used anymore.
+ */
+void dircache_finalize(void)
+{
+  unsigned int handles;
+
+  pthread_mutex_lock(&dircache_lock);
+  handles = dircache_max;
+  dircache_max = 0;
+  dircache_close(dircache_evict());
+  dircache_max = handles;
+  pthread_mutex_unlock(&dircache_lock);
+}
@@ -0,0 +1,36 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#ifndef DIRCACHE_H
+# define DIRCACHE_H
+
+# include <stdint.h>
+
+# define DIRCACHE_HANDLES	256		/* Default open handles	*/
+# define DIRCACHE_BUCKETS	1024		/* Minimum table size	*/
+
+typedef struct dircache_t	dircache_t;
+
+/* An open handle on a real directory, followed by its path */
+struct				dircache_t
+{
+  int				dc_fd;		/* O_PATH descriptor	*/
+  unsigned int			dc_refcount;	/* Users of the handle	*/
+  uint64_t			dc_hash;	/* Hash of the path	*/
+  dircache_t			*dc_next;	/* Next in the bucket	*/
+  dircache_t			*dc_lru_next;	/* Less recently used	*/
+  dircache_t			*dc_lru_previous; /* More recently used	*/
+  char				dc_path[];	/* Real directory	*/
+};
+
+void		dircache_setup(unsigned int handles);
+void		dircache_finalize(void);
+dircache_t	*dircache_get(const char *path);
+void		dircache_put(dircache_t *entry);
+
+#endif /* !DIRCACHE_H */
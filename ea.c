@@ -10,43 +10,27 @@
 #include <sys/stat.h>
 #include <sys/xattr.h>
 #include <string.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <fuse.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "helper.h"
 #include "structs.h"
+#include "slab.h"
+#include "intern.h"
 #include "write.h"
+#include "journal.h"
 #include "rcs.h"
 #include "ea.h"
 #include "cache.h"
-
-/*
- * frees metadata, I guess.. Stolen from main.c...
- * This should go into some other .c file, but I'll be damned
- * if I can decide which one...
- * 	--M@
- */
-void free_metadata(metadata_t *metadata)
-{
-  version_t *version, *next;
-
-  version = metadata->md_versions;
-  
-  while (version)
-    {
-      next = version->v_next;
-      free(version->v_rfile);
-      free(version);
-      version = next;
-    }
-  if (metadata->md_vpath)
-    helper_free_array(metadata->md_vpath);
-  free(metadata->md_vfile);
-  free(metadata);
-}
+#include "create.h"
+#include "overlay.h"
+#include "chunk.h"
+#include "delta.h"
+#include "retain.h"
 
 /*
  * We support extended attributes to allow user-space scripts to manipulate
@@ -59,20 +43,53 @@ void free_metadata(metadata_t *metadata)
  *                         to list the available versions.
  *  - rcs.purge			 : this is an ungettable attribute that purges
  * 						   copies of - or all of - a file.
+ *  - rcs.cache_stats    : read-only counters of the metadata cache, to help
+ *                         sizing it.
+ *  - rcs.copy_stats     : read-only counters of the ways versions were
+ *                         copied.
+ *  - rcs.chunk_stats    : read-only counters of the versions cut in
+ *                         chunks.
+ *  - rcs.alloc_stats    : read-only counters of the memory held for the
+ *                         metadata, to watch its fragmentation.
+ *  - rcs.retention      : how many versions, bytes and seconds of history
+ *                         are kept, for a file or the files below a
+ *                         directory.
+ */
+
+/*
+ * Remove the files of a purged version of a file, unless a kept version
+ * still uses them, and free it.
  */
+static void ea_purge_version(metadata_t *metadata, version_t *version,
+			     int used)
+{
+  if (!used)
+    overlay_discard(metadata, version);
+  overlay_put(version->v_overlay);
+  slab_free(version);
+}
 
 /*
- * Set the value of an extended attribute.
+ * Check if an attribute looks at all the versions of a file, that have to
+ * be read first.
  */
-int callback_setxattr(const char *path, const char *name, const char *value,
-		      size_t size, int flags)
+static int ea_needs_history(const char *name)
+{
+  return !strcmp(name, "rcs.purge") || !strcmp(name, "rcs.locked_version") ||
+    !strcmp(name, "rcs.metadata_dump");
+}
+
+/*
+ * Set the value of an extended attribute, for a file we have the metadata of,
+ * on behalf of the given user. The caller holds the metadata's update lock :
+ * the files are written with it only, and its lock is taken for writing
+ * just to change the versions in memory.
+ */
+static int ea_set_attribute(metadata_t *metadata, const char *name,
+			    const char *value, size_t size, int flags,
+			    uid_t uid)
 {
-  metadata_t *metadata;
   version_t *version;
-	
-  metadata = rcs_translate_to_metadata(path, rcs_version_path);
-  if (!metadata)
-    return -ENOENT;
 
   if (!strcmp(name,"rcs.purge"))
   	{
@@ -93,34 +110,22 @@ int callback_setxattr(const char *path, const char *name, const char *value,
       	local[size] = '\0';
       	memcpy(local, value, size);
 
-		// Get the raw path
-		char *rpath = rcs_translate_path(path, rcs_version_path);
-  		if (!rpath)
-    		return -ENOENT;
-    		
-    	// Get the raw directory
-  		char *rfdir=helper_extract_dirname(rpath);
-  		// Get the original filename
-  		char *rfname=helper_extract_filename(path);	
-  	
-  		// Build the full path to the metadatafile
-  		char *mdfile=(char *)malloc((strlen(rfdir) + 1 + strlen("metadata.") + strlen(rfname) + 1)*sizeof(char));
-  		strcpy(mdfile,rfdir);
-  		strcat(mdfile,"/metadata.");
-  		strcat(mdfile,rfname);
+		// Build the full path to the metadatafile
+  		char mdfile[PATH_MAX];
+  		if (create_meta_name(metadata, "metadata", mdfile)) {
+  			free(local);
+  			return -errno;
+  		}
   		
   		int c=0; // to count how many versions to delete
+  		version_t *last, *purged;
 
 
 		// Count the number of versions there are
-  		version = metadata->md_versions;
-  		version_t *v=version;
-  		int vnum=1; // number of versions
-  		while(v->v_next) { 
-  			v=v->v_next;
-  			vnum++; 
-  		}
-  		v=version; // reset
+  		int vnum=0; // number of versions
+  		for (version = metadata->md_versions; version;
+  		     version = version->v_next)
+  			vnum++;
   		
   		if(!strcmp(local,"A")) {
   			// Delete them all
@@ -129,75 +134,78 @@ int callback_setxattr(const char *path, const char *name, const char *value,
   			// we have a number, so set c to it
   			c=atoi(local);
   		}
-  		
-  		/* Let's do this... Crawl through the list, nulling
-  		 * next's and unlinking files
+  		free(local);
+  		if (c <= 0)
+  			return 0;
+
+  		/*
+  		 * The versions we keep must not need the others. This
+  		 * and the writes below only need the update lock : the
+  		 * lock is only taken for writing to cut the list.
   		 */
-  		version_t *next;
+  		if((c < vnum) && (retain_flatten(metadata, vnum - c) == -1))
+  			return -errno;
+
+  		// The files a kept version still uses stay, even the
+  		// ones of older versions it was made from while pinned
+  		unsigned int kept = (c < vnum) ? vnum - c : 0, i;
+  		unsigned int *newest = rcs_newest_users(metadata);
+  		
   		if(c >= vnum) {
   			// we're toasting them all...
-  			while(v) {			
-  				//unlink file.. scary!
-  				unlink(v->v_rfile);
-  				
-  				next=v->v_next;
-  				v->v_next=NULL;
-  				v=next;
-  			}
+  			pthread_rwlock_wrlock(&metadata->md_lock);
+  			purged = metadata->md_versions;
   			metadata->md_versions = NULL;
-  		} else {
-  			// cull
-  			vnum-=c; // number of versions we want to _keep_.
-  			while(v) {
-  				if(vnum > 1) {
-  					//next
-  					vnum--;
-  					v=v->v_next;
-  				} else {
-  					//null the next, and nuke the next file
-  					next=v->v_next;
-  					v->v_next=NULL;
-  					v=next;
-
-  					if(v) {
-  						//unlink file.. scary!
-  						unlink(v->v_rfile);
-  					}
-  				}
-  			}
-  			/* This isn't strictly necessary, but we've
-  			 * been mucking around in version a lot, so
-  			 * let's just do it.
-  			 */
-  			metadata->md_versions=version;
-  		}
-  		
-  		if(metadata->md_versions == NULL) {
-  			// Free the metadata from cache
-  			cache_drop_metadata(metadata->md_vfile);
-  			free_metadata(metadata);
+  			rcs_versions_changed(metadata);
+  			pthread_rwlock_unlock(&metadata->md_lock);
+
+  			// Drop the metadata from cache, it goes away with
+  			// our reference
+  			cache_drop_metadata(metadata);
   			// kill the metadata file too.. SCARY!!!
-  			unlink(mdfile);
-  			
+  			journal_remove(mdfile);
+  			retain_write_policy(metadata, NULL);
   		} else {
+  			// cull, keeping the vnum - c newest ones
+  			last = metadata->md_index[vnum - c - 1];
+  			pthread_rwlock_wrlock(&metadata->md_lock);
+  			purged = last->v_next;
+  			last->v_next = NULL;
+  			rcs_versions_changed(metadata);
+  			pthread_rwlock_unlock(&metadata->md_lock);
+
   			// We've made changes to the metadata, and got at least one
-  			// version left.. need to update it
+  			// version left.. need to update it, or put them back
   			if (write_metadata_file(mdfile, metadata) == -1) {
-    			free(mdfile);
-    			return -errno;
+  				int error = errno;
+  				pthread_rwlock_wrlock(&metadata->md_lock);
+  				last->v_next = purged;
+  				rcs_versions_changed(metadata);
+  				pthread_rwlock_unlock(&metadata->md_lock);
+  				free(newest);
+  				return -error;
   			}
+  			cache_update_metadata(metadata);
   		}
-  		//free(mdfile);
 
+  		/* Unlink the files of the purged versions.. scary! */
+  		for (i = kept; purged; i++) {
+  			version = purged->v_next;
+  			ea_purge_version(metadata, purged, newest[i] < kept);
+  			purged = version;
+  		}
+  		free(newest);
+
+  		/* The objects the purged versions shared get swept */
+  		delta_schedule(metadata);
   		return 0;
   		
   	}
   else if (!strcmp(name, "rcs.locked_version"))
     {
-      struct fuse_context *context;
       unsigned int length;
       int vid, svid;
-      char *dflfile, *local;
+      char dflfile[PATH_MAX], *local;
 
       /* Copy the value to NUL-terminate it */
       local = safe_malloc(size + 1);
@@ -214,16 +222,10 @@ int callback_setxattr(const char *path, const char *name, const char *value,
       free(local);
 
       /* Check if we actually have that version (or a compatible version) */
-      for (version = metadata->md_versions; version; version = version->v_next)
-	{
-	  if (vid == -1)
-	    break;
-	  if ((version->v_vid == (unsigned)vid) && (svid == -1))
-	    break;
-	  if ((version->v_vid == (unsigned)vid) &&
-	      (version->v_svid == (unsigned)svid))
-	    break;
-	}
+      if (vid == LATEST)
+	version = metadata->md_versions;
+      else
+	version = rcs_get_version(metadata, vid, svid);
       if (!version)
 	return -EINVAL;
 
@@ -233,39 +235,74 @@ int callback_setxattr(const char *path, const char *name, const char *value,
        * to prevent curious users from resurrecting versions with too lax
        * permissions.
        */
-      context = fuse_get_context();
-      if ((context->uid != 0) && (context->uid != version->v_uid))
+      if ((uid != 0) && (uid != version->v_uid))
 	return -EACCES;
 
       /* Try to commit to disk */
-      dflfile = helper_create_meta_name(path, "dfl-meta");
-      if (write_default_file(dflfile, vid, svid) != 0)
-	{
-	  free(dflfile);
-	  return -errno;
-	}
-      free(dflfile);
+      if (create_meta_name(metadata, "dfl-meta", dflfile) ||
+	  (write_default_file(dflfile, vid, svid) != 0))
+	return -errno;
 
       /* If ok, change in RAM */
+      pthread_rwlock_wrlock(&metadata->md_lock);
       metadata->md_dfl_vid = vid;
       metadata->md_dfl_svid = svid;
+      rcs_versions_changed(metadata);
+      pthread_rwlock_unlock(&metadata->md_lock);
 
       return 0;
     }
-  else if (!strcmp(name, "rcs.metadata_dump"))
+  else if (!strcmp(name, "rcs.retention"))
+    {
+      retain_policy_t policy;
+      unsigned int length;
+      long age;
+      char *local;
+
+      /* Copy the value to NUL-terminate it */
+      local = safe_malloc(size + 1);
+      local[size] = '\0';
+      memcpy(local, value, size);
+
+      if ((sscanf(local, "%u:%llu:%ld%n", &policy.rp_versions,
+		  &policy.rp_bytes, &age, &length) != 3) ||
+	  (length != size) || (age < 0))
+	{
+	  free(local);
+	  return -EINVAL;
+	}
+      free(local);
+      policy.rp_age = age;
+
+      /* Like the locked version, only the owner may change it */
+      version = rcs_find_version(metadata, LATEST, LATEST, RCS_HIDE_DELETED);
+      if ((uid != 0) && (uid != version->v_uid))
+	return -EACCES;
+      if (retain_write_policy(metadata, &policy) != 0)
+	return -errno;
+      return 0;
+    }
+  else if (!strcmp(name, "rcs.metadata_dump") ||
+	   !strcmp(name, "rcs.cache_stats") ||
+	   !strcmp(name, "rcs.copy_stats") ||
+	   !strcmp(name, "rcs.chunk_stats") ||
+	   !strcmp(name, "rcs.alloc_stats"))
     {
-      /* This one is read-only */
+      /* These are read-only */
       return -EPERM;
     }
   else
     {
+      char rfile[PATH_MAX];
       int res;
 
       /* Pass those through */
-      version = rcs_find_version(metadata, LATEST, LATEST);
+      version = rcs_find_version(metadata, LATEST, LATEST, RCS_HIDE_DELETED);
       if (!version)
 	return -ENOENT;
-      res = lsetxattr(version->v_rfile, name, value, size, flags);
+      if (rcs_version_file(metadata, version, rfile) == -1)
+	return -errno;
+      res = lsetxattr(rfile, name, value, size, flags);
       if (res == -1)
 	return -errno;
       return 0;
@@ -273,17 +310,37 @@ int callback_setxattr(const char *path, const char *name, const char *value,
 }
 
 /*
- * Get the value of an extended attribute.
+ * Set the value of an extended attribute of a file, on behalf of the given
+ * user.
  */
-int callback_getxattr(const char *path, const char *name, char *value,
-		      size_t size)
+int ea_setxattr(metadata_t *metadata, const char *name, const char *value,
+		size_t size, int flags, uid_t uid)
 {
-  metadata_t *metadata;
-  version_t *version;
+  int res;
 
-  metadata = rcs_translate_to_metadata(path, rcs_version_path);
-  if (!metadata)
-    return -ENOENT;
+  pthread_mutex_lock(&metadata->md_update);
+  if (ea_needs_history(name) && (rcs_load_history(metadata) == -1))
+    {
+      res = -errno;
+      pthread_mutex_unlock(&metadata->md_update);
+      return res;
+    }
+  if (!rcs_find_version(metadata, LATEST, LATEST, RCS_HIDE_DELETED))
+    res = -ENOENT;
+  else
+    res = ea_set_attribute(metadata, name, value, size, flags, uid);
+  pthread_mutex_unlock(&metadata->md_update);
+  return res;
+}
+
+/*
+ * Get the value of an extended attribute, for a file we have the metadata of.
+ * The caller holds the metadata's lock for reading.
+ */
+static int ea_get_attribute(metadata_t *metadata, const char *name,
+			    char *value, size_t size)
+{
+  version_t *version;
 
   if (!strcmp(name, "rcs.locked_version"))
     {
@@ -336,9 +393,11 @@ int callback_getxattr(const char *path, const char *name, char *value,
 	   version = version->v_next)
 	{
 	  struct stat st_data;
+	  char rfile[PATH_MAX];
 
 	  /* stat() the real file, but just ignore failures (bad version ?) */
-	  if (lstat(version->v_rfile, &st_data) < 0)
+	  if ((rcs_version_file(metadata, version, rfile) == -1) ||
+	      (lstat(rfile, &st_data) < 0))
 	    {
 	      st_data.st_mode = S_IFREG;
 	      st_data.st_mtime = -1;
@@ -381,41 +440,196 @@ int callback_getxattr(const char *path, const char *name, char *value,
       free(result);
       return res;
     }
+  else if (!strcmp(name, "rcs.cache_stats"))
+    {
+      cache_stats_t stats;
+      char buffer[128];
+
+      /*
+       * Items, bytes, hits, misses, evictions and hits on absent files, in
+       * that order
+       */
+      cache_get_stats(&stats);
+      snprintf(buffer, 128, "%u:%lu:%lu:%lu:%lu:%lu", stats.cs_items,
+	       (unsigned long)stats.cs_bytes, stats.cs_hits, stats.cs_misses,
+	       stats.cs_evictions, stats.cs_negative_hits);
+
+      /* Handle the EA protocol */
+      if (size == 0)
+	return strlen(buffer);
+      if (strlen(buffer) > size)
+	return -ERANGE;
+      strcpy(value, buffer);
+      return strlen(buffer);
+    }
+  else if (!strcmp(name, "rcs.chunk_stats"))
+    {
+      chunk_stats_t stats;
+      char buffer[160];
+
+      /*
+       * Versions chunked, chunks cut and chunks already in the store, then
+       * data bytes chunked, bytes of new chunks and microseconds spent, in
+       * that order
+       */
+      chunk_get_stats(&stats);
+      snprintf(buffer, 160, "%lu:%lu:%lu:%llu:%llu:%llu",
+	       stats.ck_versions, stats.ck_chunks, stats.ck_shared,
+	       stats.ck_bytes, stats.ck_stored, stats.ck_usecs);
+
+      /* Handle the EA protocol */
+      if (size == 0)
+	return strlen(buffer);
+      if (strlen(buffer) > size)
+	return -ERANGE;
+      strcpy(value, buffer);
+      return strlen(buffer);
+    }
+  else if (!strcmp(name, "rcs.alloc_stats"))
+    {
+      slab_stats_t versions, metadata;
+      unsigned int names;
+      size_t bytes;
+      char buffer[192];
+
+      /*
+       * Versions allocated and room for more in their slabs, then the same
+       * for the metadata, then slabs held and slabs ever allocated, then
+       * shared names and their bytes, in that order
+       */
+      slab_get_stats(&slab_versions, &versions);
+      slab_get_stats(&slab_metadata, &metadata);
+      intern_get_stats(&names, &bytes);
+      snprintf(buffer, 192, "%lu:%lu:%lu:%lu:%lu:%lu:%u:%lu",
+	       versions.ss_used, versions.ss_free, metadata.ss_used,
+	       metadata.ss_free, versions.ss_slabs + metadata.ss_slabs,
+	       versions.ss_created + metadata.ss_created, names,
+	       (unsigned long)bytes);
+
+      /* Handle the EA protocol */
+      if (size == 0)
+	return strlen(buffer);
+      if (strlen(buffer) > size)
+	return -ERANGE;
+      strcpy(value, buffer);
+      return strlen(buffer);
+    }
+  else if (!strcmp(name, "rcs.retention"))
+    {
+      retain_policy_t policy;
+      char buffer[80];
+      int res;
+
+      /* Versions, bytes and seconds, in that order */
+      res = retain_read_policy(metadata, &policy);
+      if (res == -1)
+	return -errno;
+      if (res == 0)
+	return -ENODATA;
+      snprintf(buffer, 80, "%u:%llu:%ld", policy.rp_versions,
+	       policy.rp_bytes, (long)policy.rp_age);
+
+      /* Handle the EA protocol */
+      if (size == 0)
+	return strlen(buffer);
+      if (strlen(buffer) > size)
+	return -ERANGE;
+      strcpy(value, buffer);
+      return strlen(buffer);
+    }
+  else if (!strcmp(name, "rcs.copy_stats"))
+    {
+      copy_stats_t stats;
+      char buffer[128];
+
+      /*
+       * Files cloned, copied with copy_file_range(), with sendfile() and
+       * through a buffer, then data bytes copied and hole bytes skipped,
+       * then overlay versions that copied nothing, in that order
+       */
+      create_get_copy_stats(&stats);
+      snprintf(buffer, 128, "%lu:%lu:%lu:%lu:%llu:%llu:%lu",
+	       stats.cp_reflinks, stats.cp_ranges, stats.cp_sendfiles,
+	       stats.cp_buffered, stats.cp_bytes, stats.cp_holes,
+	       stats.cp_overlays);
+
+      /* Handle the EA protocol */
+      if (size == 0)
+	return strlen(buffer);
+      if (strlen(buffer) > size)
+	return -ERANGE;
+      strcpy(value, buffer);
+      return strlen(buffer);
+    }
   else
     {
+      char rfile[PATH_MAX];
       int res;
 
       /*
        * We are not interested in those, simply forward them to the real
        * filesystem.
        */
-      version = rcs_find_version(metadata, LATEST, LATEST);
+      version = rcs_find_version(metadata, LATEST, LATEST, RCS_HIDE_DELETED);
       if (!version)
 	return -ENOENT;
-      res = lgetxattr(version->v_rfile, name, value, size);
+      if (rcs_version_file(metadata, version, rfile) == -1)
+	return -errno;
+      res = lgetxattr(rfile, name, value, size);
       if (res == -1)
 	return -errno;
       return res;
     }
 }
 
+/*
+ * Get the value of an extended attribute of a file.
+ */
+int ea_getxattr(metadata_t *metadata, const char *name, char *value,
+		size_t size)
+{
+  int res;
+
+  if (ea_needs_history(name))
+    {
+      pthread_mutex_lock(&metadata->md_update);
+      res = (rcs_load_history(metadata) == -1) ? -errno : 0;
+      pthread_mutex_unlock(&metadata->md_update);
+      if (res)
+	return res;
+    }
+  pthread_rwlock_rdlock(&metadata->md_lock);
+  if (!rcs_find_version(metadata, LATEST, LATEST, RCS_HIDE_DELETED))
+    res = -ENOENT;
+  else
+    res = ea_get_attribute(metadata, name, value, size);
+  pthread_rwlock_unlock(&metadata->md_lock);
+  return res;
+}
+
 #define ATTRIBUTE_STRING "rcs.locked_version\0rcs.metadata_dump"
 
 /*
- * List the supported extended attributes.
+ * List the supported extended attributes of a file.
  */
-int callback_listxattr(const char *path, char *list, size_t size)
+int ea_listxattr(metadata_t *metadata, char *list, size_t size)
 {
-  char *rpath, *buffer;
+  version_t *version;
+  char rfile[PATH_MAX], *buffer;
   unsigned int length;
   int res;
 
-  rpath = rcs_translate_path(path, rcs_version_path);
-  if (!rpath)
-    return -ENOENT;
+  pthread_rwlock_rdlock(&metadata->md_lock);
+  version = rcs_find_version(metadata, LATEST, LATEST, RCS_HIDE_DELETED);
+  if (!version || (rcs_version_file(metadata, version, rfile) == -1))
+    {
+      res = version ? -errno : -ENOENT;
+      pthread_rwlock_unlock(&metadata->md_lock);
+      return res;
+    }
 
   /* We need to get the EAs of the real file, and mix our own */
-  res = llistxattr(path, NULL, 0);
+  res = llistxattr(rfile, NULL, 0);
   if (res == -1)
     {
       /* Ignore errors, as many filesystems don't support EA */
@@ -424,17 +638,18 @@ int callback_listxattr(const char *path, char *list, size_t size)
     }
   else
     {
-      length = res;
-      buffer = safe_malloc(length + sizeof(ATTRIBUTE_STRING));
-      if (llistxattr(rpath, buffer, length) == -1)
+      buffer = safe_malloc(res + sizeof(ATTRIBUTE_STRING));
+      res = llistxattr(rfile, buffer, res);
+      if (res == -1)
 	{
+	  res = -errno;
+	  pthread_rwlock_unlock(&metadata->md_lock);
 	  free(buffer);
-	  free(rpath);
-	  return -errno;
+	  return res;
 	}
+      length = res;
     }
-
-  free(rpath);
+  pthread_rwlock_unlock(&metadata->md_lock);
 
   /* Append ours to the buffer */
   memcpy(buffer + length, ATTRIBUTE_STRING, sizeof(ATTRIBUTE_STRING));
@@ -455,26 +670,57 @@ int callback_listxattr(const char *path, char *list, size_t size)
 }
 
 /*
- * Remove an extended attribute.
+ * Remove an extended attribute of a file, on behalf of the given user.
  */
-int callback_removexattr(const char *path, const char *name)
+int ea_removexattr(metadata_t *metadata, const char *name, uid_t uid)
 {
   if (!strcmp(name, "rcs.locked_version") ||
-      !strcmp(name, "rcs.metadata_dump"))
+      !strcmp(name, "rcs.metadata_dump") ||
+      !strcmp(name, "rcs.cache_stats") ||
+      !strcmp(name, "rcs.copy_stats") ||
+      !strcmp(name, "rcs.chunk_stats") ||
+      !strcmp(name, "rcs.alloc_stats"))
     {
       /* Our attributes can't be deleted */
       return -EPERM;
     }
+  else if (!strcmp(name, "rcs.retention"))
+    {
+      version_t *version;
+      int res;
+
+      /* The file gets the policy of the directories above it again */
+      pthread_mutex_lock(&metadata->md_update);
+      pthread_rwlock_rdlock(&metadata->md_lock);
+      version = rcs_find_version(metadata, LATEST, LATEST, RCS_HIDE_DELETED);
+      if (!version)
+	res = -ENOENT;
+      else if ((uid != 0) && (uid != version->v_uid))
+	res = -EACCES;
+      else if (retain_write_policy(metadata, NULL) != 0)
+	res = (errno == ENOENT) ? -ENODATA : -errno;
+      else
+	res = 0;
+      pthread_rwlock_unlock(&metadata->md_lock);
+      pthread_mutex_unlock(&metadata->md_update);
+      return res;
+    }
   else
     {
-      char *rpath;
+      version_t *version;
+      char rfile[PATH_MAX];
       int res;
 
-      rpath = rcs_translate_path(path, rcs_version_path);
-      res = lremovexattr(rpath, name);
-      free(rpath);
-      if (res == -1)
-        return -errno;
-      return 0;
+      pthread_rwlock_rdlock(&metadata->md_lock);
+      version = rcs_find_version(metadata, LATEST, LATEST, RCS_HIDE_DELETED);
+      if (!version)
+	res = -ENOENT;
+      else if ((rcs_version_file(metadata, version, rfile) == -1) ||
+	       (lremovexattr(rfile, name) == -1))
+	res = -errno;
+      else
+	res = 0;
+      pthread_rwlock_unlock(&metadata->md_lock);
+      return res;
     }
 }
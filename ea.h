@@ -9,11 +9,13 @@
 #ifndef EA_H
 # define EA_H
 
-int	callback_setxattr(const char *path, const char *name,
-			  const char *value, size_t size, int flags);
-int	callback_getxattr(const char *path, const char *name, char *value,
-			  size_t size);
-int	callback_listxattr(const char *path, char *list, size_t size);
-int	callback_removexattr(const char *path, const char *name);
+# include "structs.h"
+
+int	ea_setxattr(metadata_t *metadata, const char *name, const char *value,
+		    size_t size, int flags, uid_t uid);
+int	ea_getxattr(metadata_t *metadata, const char *name, char *value,
+		    size_t size);
+int	ea_listxattr(metadata_t *metadata, char *list, size_t size);
+int	ea_removexattr(metadata_t *metadata, const char *name, uid_t uid);
 
 #endif /* !EA_H */
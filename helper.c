@@ -11,9 +11,10 @@
 #include <stdarg.h>
 #include <assert.h>
 #include <stdio.h>
+#include <errno.h>
+#include <limits.h>
 
 #include "helper.h"
-#include "rcs.h"
 
 
 /*
@@ -68,66 +69,6 @@ char *helper_strdup(const char *str, char *file, int line, const char *fn)
   return result;
 }
 
-/*
- * Split a character string into its constitutive elements, using a given
- * separator. Ignores empty elements (like repeats of the separator, or a
- * separator at the beginning or the end of the string) Returns a
- * NULL-terminated array.
- */
-char **helper_split_to_array(const char *string, char separator)
-{
-  unsigned int count, i;
-  char **result;
-  int start;
-
-  for (i = 0, count = 0; string[i]; i++)
-    {
-      /*
-       * We have an item when :
-       *  - we are at the beginning and the first character is not a separator
-       *  - we are elsewhere and we are switching from a separator to another
-       *    character
-       */
-      if (i == 0)
-	{
-	  if (string[i] != separator)
-	    count++;
-	}
-      else if ((string[i - 1] == separator) && (string[i] != separator))
-	count ++;
-    }
-
-  result = safe_malloc(sizeof(char *) * (count + 1));
-  result[count] = NULL;
-
-  /* Stop there if nothing to store */
-  if (!count)
-    return result;
-
-  /* We look one behind, so we can catch the '\0' as a separator */
-  for (count = 0, start = -1, i = 0; !i || string[i - 1]; i++)
-    {
-      if (!string[i] || (string[i] == separator))
-	{
-	  if (start == -1)
-	    continue;
-	  else
-	    {
-	      /* Save the item */
-	      result[count] = safe_malloc(i - start + 1);
-	      memcpy(result[count], string + start, i - start);
-	      result[count][i - start] = '\0';
-	      count++;
-	      start = -1;
-	    }
-	}
-      else if (start == -1)
-	start = i;
-    }
-
-  return result;
-}
-
 /*
  * Free a string array.
  */
@@ -140,20 +81,6 @@ void helper_free_array(char **array)
   free(array);
 }
 
-/*
- * Check if an array has a given prefix, ie the first array begins with
- * the items of the second, in order.
- */
-int helper_array_has_prefix(char **longest, char **shortest)
-{
-  unsigned int i;
-
-  for (i = 0; longest[i] && shortest[i]; i++)
-    if (strcmp(longest[i], shortest[i]))
-      return 0;
-  return (shortest[i] == NULL);
-}
-
 /*
  * Concatenate strings and strings arrays with a given separator. The first
  * arguments tells the function what is expected at each position : 'S' is
@@ -164,7 +91,7 @@ char *helper_build_composite(char *format, char *separator, ...)
 {
   unsigned int length, i;
   va_list args;
-  char *result;
+  char *result, *end;
 
   /* Count chars */
   va_start(args, separator);
@@ -200,17 +127,18 @@ char *helper_build_composite(char *format, char *separator, ...)
   va_end(args);
 
   result = safe_malloc(length + 1);
-  result[0] = '\0';
+  end = result;
+  *end = '\0';
 
-  /* Now do it */
+  /* Now do it, each string going after the previous one */
   va_start(args, separator);
   for (i = 0; format[i]; i++)
     if (format[i] == '-')
-      strcat(result, separator);
+      end = stpcpy(end, separator);
     else
       {
 	if (format[i] == 'S')
-	  strcat(result, va_arg(args, char *));
+	  end = stpcpy(end, va_arg(args, char *));
 	else
 	  {
 	    unsigned int j;
@@ -219,30 +147,119 @@ char *helper_build_composite(char *format, char *separator, ...)
 	    array = va_arg(args, char **);
 	    for (j = 0; array[j]; j++)
 	      {
-		strcat(result, array[j]);
+		end = stpcpy(end, array[j]);
 		if (array[j + 1])
-		  strcat(result, separator);
+		  end = stpcpy(end, separator);
 	      }
 	  }
 
 	  if (format[i + 1] && (format[i + 1] != '-'))
-	    strcat(result, separator);
+	    end = stpcpy(end, separator);
       }
+  va_end(args);
 
   /* All done */
   return result;
 }
 
 /*
- * Hash a string into an 8-bit number.
+ * Find the next component of a path, after the separators before it, and
+ * its length. Nothing is copied : the component ends at the next separator
+ * or at the end of the path. Returns NULL when there are no more.
  */
-unsigned char helper_hash_string(const char *string)
+const char *helper_next_component(const char *path, char separator,
+				  size_t *length)
 {
-  unsigned char result;
+  while (*path == separator)
+    path++;
+  if (!*path)
+    return NULL;
+  for (*length = 0; path[*length] && (path[*length] != separator);
+       (*length)++)
+    ;
+  return path;
+}
 
-  for (result = 0; *string; string++)
-    result ^= *string;
-  return result;
+/*
+ * Append formatted text to the path in a buffer of PATH_MAX bytes. Returns
+ * non-zero, with errno set to ENAMETOOLONG, if it does not fit.
+ */
+int helper_append_path(char *buffer, const char *format, ...)
+{
+  va_list args;
+  size_t length;
+  int res;
+
+  length = strlen(buffer);
+  va_start(args, format);
+  res = vsnprintf(buffer + length, PATH_MAX - length, format, args);
+  va_end(args);
+  if ((res < 0) || ((size_t)res >= PATH_MAX - length))
+    {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+  return 0;
+}
+
+/*
+ * Final avalanche of a 64-bit hash, so that every bit of the input affects
+ * the low bits used to select buckets.
+ */
+uint64_t helper_hash_mix(uint64_t hash)
+{
+  hash ^= hash >> 33;
+  hash *= 0xFF51AFD7ED558CCDULL;
+  hash ^= hash >> 33;
+  hash *= 0xC4CEB9FE1A85EC53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+/*
+ * Hash a path component into a 64-bit number (FNV-1a, followed by a final
+ * mix), starting from the hash of its parent. Hashing a path component by
+ * component that way gives a hash of the whole path.
+ */
+uint64_t helper_hash_component(uint64_t seed, const char *name)
+{
+  uint64_t result;
+
+  for (result = seed ^ '/'; *name; name++)
+    {
+      result *= HASH_FNV_PRIME;
+      result ^= (unsigned char)*name;
+    }
+  return helper_hash_mix(result * HASH_FNV_PRIME);
+}
+
+/*
+ * Hash a string into a 64-bit number.
+ */
+uint64_t helper_hash_string(const char *string)
+{
+  return helper_hash_component(HASH_FNV_OFFSET, string);
+}
+
+/*
+ * Hash a buffer of file data, eight bytes at a time, carrying on from the
+ * hash of the data before it. Only the last buffer may have a size that is
+ * not a multiple of eight, and the result still needs a final mix.
+ */
+uint64_t helper_hash_data(uint64_t seed, const char *data, size_t size)
+{
+  uint64_t word;
+  size_t i;
+
+  for (i = 0; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+    {
+      memcpy(&word, data + i, sizeof(uint64_t));
+      seed ^= word * HASH_DATA_PRIME;
+      seed = ((seed << 31) | (seed >> 33)) * HASH_FNV_PRIME;
+    }
+  for (; i < size; i++)
+    seed = (seed ^ (unsigned char)data[i]) * HASH_FNV_PRIME;
+  return seed;
 }
 
 /*
@@ -287,31 +304,21 @@ char *helper_read_line(FILE *fh)
 }
 
 /*
- * Get a complete prefixed file name, of the form <prefix>.<base>.
+ * Get the path of a file next to another one, whose name is the other's
+ * name with a prefix, of the form <dirname>/<prefix>.<filename>.
  */
-char *helper_get_file_name(char *base, char *prefix)
+char *helper_get_sibling_name(const char *path, char *prefix)
 {
   char *result;
+  const char *name;
 
-  result = safe_malloc(strlen(base) + strlen(prefix) + 2);
-  sprintf(result, "%s.%s", prefix, base);
+  name = rindex(path, '/');
+  name = name ? name + 1 : path;
+  result = safe_malloc(strlen(path) + strlen(prefix) + 2);
+  sprintf(result, "%.*s%s.%s", (int)(name - path), path, prefix, name);
   return result;
 }
 
-/*
- * Return the filename part of a path.
- */
-char *helper_extract_filename(const char *path)
-{
-  char *result;
-
-  result = rindex(path, '/');
-  if (result)
-    return safe_strdup(result + 1);
-  else
-    return safe_strdup(path);
-}
-
 /*
  * Return the dirname part of a path.
  */
@@ -327,23 +334,3 @@ char *helper_extract_dirname(const char *path)
     *result = '\0';
   return safe_realloc(result, strlen(result) + 1);
 }
-
-/*
- * Build a metadata file name with the given virtual file and prefix.
- * prefix is "metadata" for metadata file and "dfl-meta" for default file.
- */
-char *helper_create_meta_name(const char *vpath, char *prefix)
-{
-  char *dir, *file, *xlat, *name, *res;
-
-  dir = helper_extract_dirname(vpath);
-  file = helper_extract_filename(vpath);
-  xlat = rcs_translate_path(dir, rcs_version_path);
-  name = helper_build_composite("SS", ".", prefix, file);
-  res = helper_build_composite("SS", "/", xlat, name);
-  free(xlat);
-  free(name);
-  free(file);
-  free(dir);
-  return res;
-}
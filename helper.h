@@ -10,10 +10,15 @@
 # define HELPER_H
 
 # include <stdio.h>
+# include <stdint.h>
 # include <sys/types.h>
 
 # define LINE_BUFFER_STEP	1024
 
+# define HASH_FNV_OFFSET	0xCBF29CE484222325ULL
+# define HASH_FNV_PRIME		0x00000100000001B3ULL
+# define HASH_DATA_PRIME	0x9E3779B185EBCA87ULL
+
 
 /*
  * Safe memory allocation
@@ -38,21 +43,29 @@ char		*helper_strdup(const char *str, char *file, int line,
  * String arrays
  */
 
-char		**helper_split_to_array(const char *string, char separator);
 void		helper_free_array(char **array);
-int		helper_array_has_prefix(char **longest, char **shortest);
 char		*helper_build_composite(char *format, char *separator, ...);
 
 
+/*
+ * Paths built in place, in buffers of PATH_MAX bytes
+ */
+
+const char	*helper_next_component(const char *path, char separator,
+				       size_t *length);
+int		helper_append_path(char *buffer, const char *format, ...);
+
+
 /*
  * Miscellaneous things
  */
 
-unsigned char	helper_hash_string(const char *string);
+uint64_t	helper_hash_component(uint64_t seed, const char *name);
+uint64_t	helper_hash_string(const char *string);
+uint64_t	helper_hash_data(uint64_t seed, const char *data, size_t size);
+uint64_t	helper_hash_mix(uint64_t hash);
 char		*helper_read_line(FILE *fh);
-char		*helper_get_file_name(char *base, char *prefix);
-char		*helper_extract_filename(const char *path);
+char		*helper_get_sibling_name(const char *path, char *prefix);
 char		*helper_extract_dirname(const char *path);
-char		*helper_create_meta_name(const char *vpath, char *prefix);
 
 #endif /* !HELPER_H */
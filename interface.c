@@ -12,21 +12,21 @@
 #define _XOPEN_SOURCE 500
 #endif
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <dirent.h>
-#include <errno.h>
-#include <sys/statfs.h>
-#include <sys/vfs.h>
 #include <errno.h>
+#include <limits.h>
+#include <sys/statvfs.h>
 #include <sys/stat.h>
 #include <stdlib.h>
 #include <sys/xattr.h>
 #include <sys/time.h>
 #include <time.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "helper.h"
 #include "cache.h"
@@ -35,435 +35,1191 @@
 #include "create.h"
 #include "write.h"
 #include "ea.h"
+#include "overlay.h"
+#include "store.h"
+#include "catalog.h"
+
+/*
+ * The inode numbers we give to the kernel are the addresses of the metadata
+ * of the files, except for the root which has its own number. Each time we
+ * answer with an entry, the kernel gets a reference on the metadata, that it
+ * gives back with forget. So an inode number is valid as long as the kernel
+ * uses it, and the cache can't evict what the kernel knows about.
+ */
+
+#define INTERFACE_TIMEOUT	1.0		/* Entry and attribute cache */
+#define INTERFACE_UNKNOWN_INO	0xffffffff	/* Inode for listings	*/
+
+static metadata_t *interface_root = NULL;
+
+/*
+ * Get the metadata behind an inode number.
+ */
+static metadata_t *interface_metadata(fuse_ino_t ino)
+{
+  if (ino == FUSE_ROOT_ID)
+    return interface_root;
+  return (metadata_t *)(uintptr_t)ino;
+}
 
-static int callback_getattr(const char *path, struct stat *st_data)
+/*
+ * Get the inode number of some metadata.
+ */
+static fuse_ino_t interface_inode(metadata_t *metadata)
+{
+  if (metadata == interface_root)
+    return FUSE_ROOT_ID;
+  return (fuse_ino_t)(uintptr_t)metadata;
+}
+
+/*
+ * Get the attributes of the current version of a file.
+ */
+static int interface_stat(metadata_t *metadata, struct stat *st_data)
 {
-  metadata_t *metadata;
   version_t *version;
-  char *rpath;
+  dircache_t *directory;
+  char name[NAME_MAX + 1];
   int res;
 
   /* Use the real file */
-  rpath = rcs_translate_path(path, rcs_version_path);
-  if (!rpath)
-    return -ENOENT;
-  metadata = cache_get_metadata(path);
-  version = rcs_find_version(metadata, LATEST, LATEST);
-  res = lstat(rpath, st_data);
-  free(rpath);
+  pthread_rwlock_rdlock(&metadata->md_lock);
+  version = rcs_find_version(metadata, LATEST, LATEST, RCS_HIDE_DELETED);
+  if (!version)
+    {
+      pthread_rwlock_unlock(&metadata->md_lock);
+      return -ENOENT;
+    }
+  res = -1;
+  directory = rcs_version_at(metadata, version, name);
+  if (directory)
+    {
+      res = fstatat(directory->dc_fd, name, st_data, AT_SYMLINK_NOFOLLOW);
+      dircache_put(directory);
+    }
 
   if(res == -1)
-    return -errno;
+    {
+      res = -errno;
+      pthread_rwlock_unlock(&metadata->md_lock);
+      return res;
+    }
 
   /* Mix our metadata to the stat results */
+  st_data->st_ino = interface_inode(metadata);
   st_data->st_mode = (st_data->st_mode & ~0777) | version->v_mode;
   st_data->st_uid = version->v_uid;
   st_data->st_gid = version->v_gid;
 
+  pthread_rwlock_unlock(&metadata->md_lock);
   return 0;
 }
 
-static int callback_readlink(const char *path, char *buf, size_t size)
+/*
+ * Fill the entry the kernel wants for a name in a directory. On success, the
+ * entry holds a reference on the metadata, for the kernel.
+ */
+static int interface_lookup(metadata_t *parent, const char *name,
+			    struct fuse_entry_param *entry)
 {
-  char *rpath;
+  metadata_t *metadata;
   int res;
 
-  rpath = rcs_translate_path(path, rcs_version_path);
-  if (!rpath)
+  memset(entry, 0, sizeof(struct fuse_entry_param));
+  entry->attr_timeout = INTERFACE_TIMEOUT;
+  entry->entry_timeout = INTERFACE_TIMEOUT;
+
+  metadata = rcs_lookup(parent, name);
+  if (!metadata)
     return -ENOENT;
+  res = interface_stat(metadata, &entry->attr);
+  if (res)
+    {
+      cache_release_metadata(metadata);
+      return res;
+    }
+  entry->ino = interface_inode(metadata);
+  return 0;
+}
+
+/*
+ * Answer with the entry of a file we just created.
+ */
+static void interface_reply_entry(fuse_req_t req, metadata_t *parent,
+				  const char *name)
+{
+  struct fuse_entry_param entry;
+  int res;
+
+  res = interface_lookup(parent, name, &entry);
+  if (res)
+    fuse_reply_err(req, -res);
+  else if (fuse_reply_entry(req, &entry))
+    cache_release_metadata(interface_metadata(entry.ino));
+}
+
+static void callback_init(void *userdata, struct fuse_conn_info *conn)
+{
+  /* The root's metadata is kept referenced by main() */
+  interface_root = userdata;
+
+  /*
+   * Have O_TRUNC passed to open, instead of a truncation after the open,
+   * so that we know the old contents are not needed in the new version
+   */
+  if (conn->capable & FUSE_CAP_ATOMIC_O_TRUNC)
+    conn->want |= FUSE_CAP_ATOMIC_O_TRUNC;
+}
+
+static void callback_lookup(fuse_req_t req, fuse_ino_t parent,
+			    const char *name)
+{
+  struct fuse_entry_param entry;
+  int res;
+
+  res = interface_lookup(interface_metadata(parent), name, &entry);
+  if (res == -ENOENT)
+    {
+      /* A null inode lets the kernel remember the file does not exist */
+      entry.ino = 0;
+      fuse_reply_entry(req, &entry);
+    }
+  else if (res)
+    fuse_reply_err(req, -res);
+  else if (fuse_reply_entry(req, &entry))
+    cache_release_metadata(interface_metadata(entry.ino));
+}
+
+static void callback_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+  /* The root is not referenced by the kernel */
+  if (ino != FUSE_ROOT_ID)
+    cache_forget_metadata(interface_metadata(ino), nlookup);
+  fuse_reply_none(req);
+}
+
+static void callback_forget_multi(fuse_req_t req, size_t count,
+				  struct fuse_forget_data *forgets)
+{
+  size_t i;
+
+  for (i = 0; i < count; i++)
+    if (forgets[i].ino != FUSE_ROOT_ID)
+      cache_forget_metadata(interface_metadata(forgets[i].ino),
+			    forgets[i].nlookup);
+  fuse_reply_none(req);
+}
+
+static void callback_getattr(fuse_req_t req, fuse_ino_t ino,
+			     struct fuse_file_info *fi)
+{
+  struct stat st_data;
+  int res;
+
+  (void) fi;
+  res = interface_stat(interface_metadata(ino), &st_data);
+  if (res)
+    fuse_reply_err(req, -res);
+  else
+    fuse_reply_attr(req, &st_data, INTERFACE_TIMEOUT);
+}
+
+/*
+ * Change the mode or the owner of a file, which creates a subversion.
+ */
+static int interface_set_owner(metadata_t *metadata, struct stat *attr,
+			       int to_set)
+{
+  version_t *version;
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  int res;
 
-  res = readlink(rpath, buf, size - 1);
+  pthread_mutex_lock(&metadata->md_update);
+  version = rcs_find_version(metadata, LATEST, LATEST, RCS_HIDE_DELETED);
+  if (!version)
+    res = -ENOENT;
+  else
+    {
+      mode = (to_set & FUSE_SET_ATTR_MODE) ? attr->st_mode : version->v_mode;
+      uid = (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : version->v_uid;
+      gid = (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : version->v_gid;
+      res = 0;
+      if (create_new_subversion_locked(metadata, mode, uid, gid) != 0)
+	res = -errno;
+    }
+  pthread_mutex_unlock(&metadata->md_update);
+  return res;
+}
+
+/*
+ * Get a handle opened for writing ready to modify its file. The first time,
+ * the new version is created (unless the other writers already have one, or
+ * the file was deleted while open) and the handle switches to it. If the
+ * file is about to be truncated to the given size, only what survives is
+ * copied, -1 copying everything. Returns 0 or a negative error code.
+ */
+static int interface_start_writing(handle_t *handle, off_t size)
+{
+  metadata_t *metadata;
+  version_t *version;
+  chain_t *chain;
+  int fd, res;
+
+  if (__atomic_load_n(&handle->h_dirty, __ATOMIC_ACQUIRE))
+    return 0;
+
+  metadata = handle->h_metadata;
+  pthread_mutex_lock(&metadata->md_update);
+  if (handle->h_dirty)
+    {
+      /* Another thread wrote through this handle meanwhile */
+      pthread_mutex_unlock(&metadata->md_update);
+      return 0;
+    }
+
+  res = 0;
+  if (rcs_find_version(metadata, LATEST, LATEST, RCS_HIDE_DELETED))
+    res = (size == -1) ? create_new_version_locked(metadata) :
+      create_new_version_truncated(metadata, size);
+
+  /* The layers of the version may be based on versions not read yet */
+  if (!res)
+    res = rcs_load_history(metadata);
+  version = rcs_find_version(metadata, LATEST, LATEST, RCS_SHOW_DELETED);
   if (res == -1)
+    res = -errno;
+  else if (!version)
+    res = -ENOENT;
+  else if ((fd = rcs_open_version(metadata, version,
+				  handle->h_flags)) == -1)
+    res = -errno;
+  else if (overlay_open_chain(metadata, version, fd, &chain) == -1)
     {
-      free(rpath);
-      return -errno;
+      res = -errno;
+      close(fd);
     }
+  else
+    {
+      /*
+       * Replace the descriptor in place, for the reads running meanwhile.
+       * They may still use the old chain, which is kept until the release.
+       */
+      if (!chain)
+	dup2(fd, handle->h_fd);
+      close(fd);
+      handle->h_retired = handle->h_chain;
+      __atomic_store_n(&handle->h_chain, chain, __ATOMIC_RELEASE);
+      metadata->md_writers++;
+      __atomic_store_n(&handle->h_dirty, 1, __ATOMIC_RELEASE);
+    }
+  pthread_mutex_unlock(&metadata->md_update);
+  return res;
+}
 
-  buf[res] = '\0';
-  free(rpath);
-  return 0;
+/*
+ * Truncate the file of a version, that may be an overlay. The caller holds
+ * the metadata's update lock.
+ */
+static int interface_truncate_version(metadata_t *metadata, version_t *version,
+				      off_t size)
+{
+  overlay_t *overlay;
+  char rfile[PATH_MAX];
+  int fd, res;
+
+  if ((rcs_version_file(metadata, version, rfile) == -1) ||
+      (overlay_get(metadata, version, &overlay) == -1))
+    return -errno;
+  if (!overlay)
+    return (truncate(rfile, size) == -1) ? -errno : 0;
+
+  fd = open(rfile, O_WRONLY);
+  res = (fd == -1) ? -1 : overlay_truncate(overlay, fd, size);
+  if (res == -1)
+    res = -errno;
+  if (fd != -1)
+    close(fd);
+  overlay_put(overlay);
+  return res;
 }
 
-#define METADATA_PREFIX "metadata."
+/*
+ * Change the size of a file. Through a handle open for writing, it is the
+ * handle's version that changes, else a new version is created first. Either
+ * way, a new version only gets what survives the truncation.
+ */
+static int interface_set_size(metadata_t *metadata, off_t size,
+			      struct fuse_file_info *fi)
+{
+  version_t *version;
+  handle_t *handle;
+  int res;
+
+  if (fi)
+    {
+      handle = (handle_t *)(uintptr_t)fi->fh;
+      res = interface_start_writing(handle, size);
+      if (res)
+	return res;
+      if (handle->h_chain)
+	res = overlay_truncate(handle->h_chain->c_overlays[0],
+			       handle->h_chain->c_fds[0], size);
+      else
+	res = ftruncate(handle->h_fd, size);
+      if (res == -1)
+	return -errno;
+      return 0;
+    }
 
-static int callback_getdir(const char *path, fuse_dirh_t h, fuse_dirfil_t fill)
+  pthread_mutex_lock(&metadata->md_update);
+  if (!rcs_find_version(metadata, LATEST, LATEST, RCS_HIDE_DELETED))
+    res = -ENOENT;
+  else if (create_new_version_truncated(metadata, size) == -1)
+    res = -errno;
+  else
+    {
+      version = rcs_find_version(metadata, LATEST, LATEST, RCS_HIDE_DELETED);
+      metadata->md_timestamp = time(NULL);
+      res = interface_truncate_version(metadata, version, size);
+    }
+  pthread_mutex_unlock(&metadata->md_update);
+  return res;
+}
+
+/*
+ * Change the access and modification times of a file.
+ */
+static int interface_set_times(metadata_t *metadata, struct stat *attr,
+			       int to_set)
+{
+  struct timespec times[2];
+  version_t *version;
+  char rfile[PATH_MAX];
+  int res;
+
+  times[0] = attr->st_atim;
+  times[1] = attr->st_mtim;
+  if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+    times[0].tv_nsec = UTIME_NOW;
+  else if (!(to_set & FUSE_SET_ATTR_ATIME))
+    times[0].tv_nsec = UTIME_OMIT;
+  if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+    times[1].tv_nsec = UTIME_NOW;
+  else if (!(to_set & FUSE_SET_ATTR_MTIME))
+    times[1].tv_nsec = UTIME_OMIT;
+
+  /* The times of a stored version would change for every file sharing it */
+  pthread_mutex_lock(&metadata->md_update);
+  version = rcs_find_version(metadata, LATEST, LATEST, RCS_HIDE_DELETED);
+  if (!version)
+    res = -ENOENT;
+  else if ((rcs_version_file(metadata, version, rfile) == -1) ||
+	   (store_detach(rfile) == -1) ||
+	   (utimensat(AT_FDCWD, rfile, times, AT_SYMLINK_NOFOLLOW) == -1))
+    res = -errno;
+  else
+    res = 0;
+  pthread_mutex_unlock(&metadata->md_update);
+  return res;
+}
+
+static void callback_setattr(fuse_req_t req, fuse_ino_t ino,
+			     struct stat *attr, int to_set,
+			     struct fuse_file_info *fi)
 {
-  struct dirent *entry;
-  char *rpath;
+  metadata_t *metadata;
+  struct stat st_data;
   int res;
-  DIR *dir;
 
-  rpath = rcs_translate_path(path, rcs_version_path);
-  dir = opendir(rpath);
-  if (!dir)
+  metadata = interface_metadata(ino);
+  res = 0;
+  if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+    res = interface_set_owner(metadata, attr, to_set);
+  if (!res && (to_set & FUSE_SET_ATTR_SIZE))
+    res = interface_set_size(metadata, attr->st_size, fi);
+  if (!res && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)))
+    res = interface_set_times(metadata, attr, to_set);
+  if (!res)
+    res = interface_stat(metadata, &st_data);
+
+  if (res)
+    fuse_reply_err(req, -res);
+  else
+    fuse_reply_attr(req, &st_data, INTERFACE_TIMEOUT);
+}
+
+static void callback_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+  metadata_t *metadata;
+  version_t *version;
+  dircache_t *directory;
+  char name[NAME_MAX + 1], buffer[PATH_MAX];
+  int res;
+
+  metadata = interface_metadata(ino);
+  pthread_rwlock_rdlock(&metadata->md_lock);
+  version = rcs_find_version(metadata, LATEST, LATEST, RCS_HIDE_DELETED);
+  if (!version)
+    res = -ENOENT;
+  else if (!(directory = rcs_version_at(metadata, version, name)))
+    res = -errno;
+  else
+    {
+      res = readlinkat(directory->dc_fd, name, buffer, PATH_MAX - 1);
+      if (res == -1)
+	res = -errno;
+      dircache_put(directory);
+    }
+  pthread_rwlock_unlock(&metadata->md_lock);
+
+  if (res < 0)
+    fuse_reply_err(req, -res);
+  else
+    {
+      buffer[res] = '\0';
+      fuse_reply_readlink(req, buffer);
+    }
+}
+
+#define METADATA_PREFIX "metadata."
+
+/*
+ * List the visible entries of a directory, '.' and '..' included, so that
+ * the listing looks reasonable.
+ */
+static int interface_list_directory(metadata_t *dir_metadata,
+				    listing_t *listing)
+{
+  unsigned int allocated, i;
+  char **names;
+  char rpath[PATH_MAX];
+
+  pthread_rwlock_rdlock(&dir_metadata->md_lock);
+  if (rcs_directory(dir_metadata, rpath) == -1)
     {
-      free(rpath);
+      pthread_rwlock_unlock(&dir_metadata->md_lock);
       return -errno;
     }
+  names = catalog_list(rpath, METADATA_PREFIX);
+  pthread_rwlock_unlock(&dir_metadata->md_lock);
+  if (!names)
+    return -errno;
+
+  allocated = 16;
+  listing->l_names = safe_malloc(sizeof(char *) * allocated);
+  listing->l_names[0] = safe_strdup(".");
+  listing->l_names[1] = safe_strdup("..");
+  listing->l_count = 2;
 
-  /* Find the metadata files */
-  do
+  /* Each metadata file has a versionned file behind it */
+  for (i = 0; names[i]; i++)
     {
-      entry = readdir(dir);
-      if (entry)
+      metadata_t *metadata;
+      int deleted;
+
+      /* Check if the file is not currently in deleted state */
+      metadata = rcs_lookup(dir_metadata, names[i]);
+      if (!metadata)
+	continue;
+      pthread_rwlock_rdlock(&metadata->md_lock);
+      deleted = metadata->md_deleted;
+      pthread_rwlock_unlock(&metadata->md_lock);
+      cache_release_metadata(metadata);
+      if (deleted)
+	continue;
+
+      /* Keep room for the final NULL */
+      if (listing->l_count + 1 >= allocated)
 	{
-	  /*
-	   * We want the metadata files (because a versionned file is
-	   * behind them, the '.' and '..' directories, so that the listing
-	   * looks reasonable.
-	   */
-	  if (!strcmp(entry->d_name, "metadata."))
-	    {
-	      /* This is the root's metadata, ignore it */
-	      continue;
-	    }
-	  else if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
-	    {
-	      res = fill(h, entry->d_name, 0);
-	      if (res != 0)
-		break;
-	    }
-	  else if (!strncmp(entry->d_name, METADATA_PREFIX,
-			    strlen(METADATA_PREFIX)))
-	    {
-	      metadata_t *metadata;
-	      char *file;
-
-	      /* Check if the file is not currently in deleted state */
-	      if (strcmp(path, "/"))
-		file = helper_build_composite("SS", "/", path,
-					      entry->d_name +
-					      strlen(METADATA_PREFIX));
-	      else
-		file = helper_build_composite("-S", "/", entry->d_name +
-					      strlen(METADATA_PREFIX));
-	      metadata = rcs_translate_to_metadata(file, rcs_version_path);
-	      free(file);
-	      if (metadata && !metadata->md_deleted)
-		{
-		  res = fill(h, entry->d_name + strlen(METADATA_PREFIX), 0);
-		  if (res != 0)
-		    break;
-		}
-	    }
+	  allocated *= 2;
+	  listing->l_names = safe_realloc(listing->l_names,
+					  sizeof(char *) * allocated);
 	}
+      listing->l_names[listing->l_count++] = safe_strdup(names[i]);
     }
-  while (entry);
+  listing->l_names[listing->l_count] = NULL;
 
-  closedir(dir);
-  free(rpath);
+  helper_free_array(names);
   return 0;
 }
 
-static int callback_mknod(const char *path, mode_t mode, dev_t rdev)
+/*
+ * Take a snapshot of the directory entries when it is opened, so that the
+ * offsets of the following reads are simply indexes in it.
+ */
+static void callback_opendir(fuse_req_t req, fuse_ino_t ino,
+			     struct fuse_file_info *fi)
 {
-  return create_new_file(path, mode, fuse_get_context()->uid,
-			 fuse_get_context()->gid, rdev);
+  listing_t *listing;
+  int res;
+
+  listing = safe_malloc(sizeof(listing_t));
+  res = interface_list_directory(interface_metadata(ino), listing);
+  if (res)
+    {
+      free(listing);
+      fuse_reply_err(req, -res);
+      return;
+    }
+
+  fi->fh = (uintptr_t)listing;
+  if (fuse_reply_open(req, fi))
+    {
+      helper_free_array(listing->l_names);
+      free(listing);
+    }
 }
 
-static int callback_mkdir(const char *path, mode_t mode)
+static void callback_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			     off_t off, struct fuse_file_info *fi)
 {
-  return create_new_directory(path, mode, fuse_get_context()->uid,
-			      fuse_get_context()->gid);
+  listing_t *listing;
+  struct stat st_data;
+  unsigned int index;
+  size_t used, length;
+  char *buffer;
+
+  (void) ino;
+  listing = (listing_t *)(uintptr_t)fi->fh;
+  buffer = safe_malloc(size);
+  used = 0;
+
+  memset(&st_data, 0, sizeof(struct stat));
+  st_data.st_ino = INTERFACE_UNKNOWN_INO;
+  for (index = off; index < listing->l_count; index++)
+    {
+      length = fuse_add_direntry(req, buffer + used, size - used,
+				 listing->l_names[index], &st_data, index + 1);
+      if (length > size - used)
+	break;
+      used += length;
+    }
+
+  fuse_reply_buf(req, buffer, used);
+  free(buffer);
 }
 
-static int callback_unlink(const char *path)
+/*
+ * Like callback_readdir(), but with the attributes of the entries, which
+ * saves the kernel a lookup for each of them.
+ */
+static void callback_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+				 off_t off, struct fuse_file_info *fi)
+{
+  struct fuse_entry_param entry;
+  metadata_t *dir_metadata;
+  listing_t *listing;
+  unsigned int index;
+  size_t used, length;
+  char *buffer, *name;
+
+  dir_metadata = interface_metadata(ino);
+  listing = (listing_t *)(uintptr_t)fi->fh;
+  buffer = safe_malloc(size);
+  used = 0;
+
+  for (index = off; index < listing->l_count; index++)
+    {
+      name = listing->l_names[index];
+      if (!strcmp(name, ".") || !strcmp(name, ".."))
+	{
+	  /* The kernel does not look those up */
+	  memset(&entry, 0, sizeof(struct fuse_entry_param));
+	  entry.attr.st_ino = INTERFACE_UNKNOWN_INO;
+	  entry.attr.st_mode = S_IFDIR;
+	}
+      else if (interface_lookup(dir_metadata, name, &entry))
+	{
+	  /* Deleted since the directory was opened */
+	  continue;
+	}
+
+      length = fuse_add_direntry_plus(req, buffer + used, size - used, name,
+				      &entry, index + 1);
+      if (length > size - used)
+	{
+	  if (entry.ino)
+	    cache_release_metadata(interface_metadata(entry.ino));
+	  break;
+	}
+      used += length;
+    }
+
+  fuse_reply_buf(req, buffer, used);
+  free(buffer);
+}
+
+static void callback_releasedir(fuse_req_t req, fuse_ino_t ino,
+				struct fuse_file_info *fi)
+{
+  listing_t *listing;
+
+  (void) ino;
+  listing = (listing_t *)(uintptr_t)fi->fh;
+  helper_free_array(listing->l_names);
+  free(listing);
+  fuse_reply_err(req, 0);
+}
+
+static void callback_mknod(fuse_req_t req, fuse_ino_t parent,
+			   const char *name, mode_t mode, dev_t rdev)
+{
+  const struct fuse_ctx *context;
+  int res;
+
+  context = fuse_req_ctx(req);
+  res = create_new_file(interface_metadata(parent), name, mode, context->uid,
+			context->gid, rdev);
+  if (res)
+    fuse_reply_err(req, -res);
+  else
+    interface_reply_entry(req, interface_metadata(parent), name);
+}
+
+static void callback_mkdir(fuse_req_t req, fuse_ino_t parent,
+			   const char *name, mode_t mode)
+{
+  const struct fuse_ctx *context;
+  int res;
+
+  context = fuse_req_ctx(req);
+  res = create_new_directory(interface_metadata(parent), name, mode,
+			     context->uid, context->gid);
+  if (res)
+    fuse_reply_err(req, -res);
+  else
+    interface_reply_entry(req, interface_metadata(parent), name);
+}
+
+/*
+ * Mark a file as deleted, and write it to its metadata file, whose name is
+ * given. The file is still there if the write fails. The caller holds the
+ * metadata's update lock. Returns 0 or a negative error code.
+ */
+static int interface_mark_deleted(metadata_t *metadata, char *metafile)
+{
+  int res;
+
+  pthread_rwlock_wrlock(&metadata->md_lock);
+  metadata->md_deleted = 1;
+  pthread_rwlock_unlock(&metadata->md_lock);
+  if (write_metadata_append(metafile, metadata) != -1)
+    return 0;
+
+  res = -errno;
+  pthread_rwlock_wrlock(&metadata->md_lock);
+  metadata->md_deleted = 0;
+  pthread_rwlock_unlock(&metadata->md_lock);
+  return res;
+}
+
+static void callback_unlink(fuse_req_t req, fuse_ino_t parent,
+			    const char *name)
 {
   metadata_t *metadata;
   version_t *version;
   struct stat st_rfile;
-  char *metafile;
+  char rfile[PATH_MAX], metafile[PATH_MAX];
 
-  metadata = rcs_translate_to_metadata(path, rcs_version_path);
-  if (!metadata || metadata->md_deleted)
-    return -ENOENT;
-  version = rcs_find_version(metadata, LATEST, LATEST);
-  if (lstat(version->v_rfile, &st_rfile) == -1)
-    return -errno;
-  if (S_ISDIR(st_rfile.st_mode))
-    return -EISDIR;
-  metadata->md_deleted = 1;
-  metafile = create_meta_name(metadata->md_vfile, "metadata");
-  if (write_metadata_file(metafile, metadata) == -1) {
-    free(metafile);
+  int res;
+
+  metadata = rcs_lookup(interface_metadata(parent), name);
+  if (!metadata)
+    {
+      fuse_reply_err(req, ENOENT);
+      return;
+    }
+  pthread_mutex_lock(&metadata->md_update);
+  version = rcs_find_version(metadata, LATEST, LATEST, RCS_HIDE_DELETED);
+  if (!version)
+    res = -ENOENT;
+  else if ((rcs_version_file(metadata, version, rfile) == -1) ||
+	   (lstat(rfile, &st_rfile) == -1))
+    res = -errno;
+  else if (S_ISDIR(st_rfile.st_mode))
+    res = -EISDIR;
+  else if (create_meta_name(metadata, "metadata", metafile))
+    res = -errno;
+  else
+    res = interface_mark_deleted(metadata, metafile);
+  pthread_mutex_unlock(&metadata->md_update);
+  cache_release_metadata(metadata);
+  fuse_reply_err(req, -res);
+}
+
+/*
+ * Check that a directory only has deleted files in it, given the real
+ * directory of its current version.
+ */
+static int check_empty_directory(metadata_t *dir_metadata, const char *rpath)
+{
+  metadata_t *metadata;
+  unsigned int i;
+  char **names;
+  int res;
+
+  names = catalog_list(rpath, METADATA_PREFIX);
+  if (!names)
     return -errno;
+
+  /* Check if there is any file in the directory */
+  for (i = 0; names[i]; i++) {
+    /* Check if the file is not currently in deleted state */
+    metadata = rcs_lookup(dir_metadata, names[i]);
+    if (metadata) {
+      pthread_rwlock_rdlock(&metadata->md_lock);
+      res = metadata->md_deleted;
+      pthread_rwlock_unlock(&metadata->md_lock);
+      cache_release_metadata(metadata);
+      if (!res) {
+	/* we found a file */
+	helper_free_array(names);
+	return -ENOTEMPTY;
+      }
+    }
   }
-  free(metafile);
+
+  helper_free_array(names);
   return 0;
 }
 
-static int callback_rmdir(const char *path)
+static void callback_rmdir(fuse_req_t req, fuse_ino_t parent,
+			   const char *name)
 {
   metadata_t *dir_metadata;
   version_t *version;
   struct stat st_rfile;
-  char *metafile;
-  DIR *dir;
-  struct dirent *entry;
-  char *rpath;
-
-  dir_metadata = rcs_translate_to_metadata(path, rcs_version_path);
-  if (!dir_metadata || dir_metadata->md_deleted)
-    return -ENOENT;
-  version = rcs_find_version(dir_metadata, LATEST, LATEST);
-  if (lstat(version->v_rfile, &st_rfile) == -1)
-    return -errno;
-  if (!S_ISDIR(st_rfile.st_mode))
-    return -ENOTDIR;
+  char rpath[PATH_MAX], metafile[PATH_MAX];
 
-  rpath = rcs_translate_path(path, rcs_version_path);
-  dir = opendir(rpath);
-  if (!dir) {
-    free(rpath);
-    return -errno;
-  }
+  int res;
 
-  /* Check if there is any file in the directory */
-  do {
-    entry = readdir(dir);
-    if (entry) {
-      /*
-       * We want the metadata files (because a versionned file is
-       * behind them, the '.' and '..' directories, so that the listing
-       * looks reasonable.
-       */
-      if (!strcmp(entry->d_name, "metadata.")) {
-	/* This is the root's metadata, ignore it */
-	continue;
-      } else if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
-	continue ;
-      } else if (!strncmp(entry->d_name, METADATA_PREFIX,
-			    strlen(METADATA_PREFIX))) {
-	metadata_t *metadata;
-	char *file;
-
-	/* Check if the file is not currently in deleted state */
-	if (strcmp(path, "/"))
-	  file = helper_build_composite("SS", "/", path,
-					entry->d_name +
-					strlen(METADATA_PREFIX));
-	else
-	  file = helper_build_composite("-S", "/", entry->d_name +
-					strlen(METADATA_PREFIX));
-	metadata = rcs_translate_to_metadata(file, rcs_version_path);
-	free(file);
-	if (metadata && !metadata->md_deleted) {
-	  /* we found a file */
-	  closedir(dir);
-	  free(rpath);
-	  return -ENOTEMPTY;
-	}
-      }
+  dir_metadata = rcs_lookup(interface_metadata(parent), name);
+  if (!dir_metadata)
+    {
+      fuse_reply_err(req, ENOENT);
+      return;
     }
-  }
-  while (entry);
 
-  closedir(dir);
-  free(rpath);
+  /* Nobody can create files in the directory while we hold this */
+  pthread_mutex_lock(&dir_metadata->md_update);
+  version = rcs_find_version(dir_metadata, LATEST, LATEST,
+			     RCS_HIDE_DELETED);
+  if (!version)
+    res = -ENOENT;
+  else if ((rcs_version_file(dir_metadata, version, rpath) == -1) ||
+	   (lstat(rpath, &st_rfile) == -1))
+    res = -errno;
+  else if (!S_ISDIR(st_rfile.st_mode))
+    res = -ENOTDIR;
+  else
+    res = check_empty_directory(dir_metadata, rpath);
 
-  dir_metadata->md_deleted = 1;
-  metafile = create_meta_name(dir_metadata->md_vfile, "metadata");
-  if (write_metadata_file(metafile, dir_metadata) == -1) {
-    free(metafile);
-    return -errno;
-  }
-  free(metafile);
-  return 0;
+  if (!res && create_meta_name(dir_metadata, "metadata", metafile))
+    res = -errno;
+  else if (!res)
+    res = interface_mark_deleted(dir_metadata, metafile);
+  pthread_mutex_unlock(&dir_metadata->md_update);
+  cache_release_metadata(dir_metadata);
+  fuse_reply_err(req, -res);
 }
 
-static int callback_symlink(const char *from, const char *to)
+static void callback_symlink(fuse_req_t req, const char *link,
+			     fuse_ino_t parent, const char *name)
 {
-  return create_new_symlink(from, to, fuse_get_context()->uid,
-			    fuse_get_context()->gid);
+  const struct fuse_ctx *context;
+  int res;
+
+  context = fuse_req_ctx(req);
+  res = create_new_symlink(link, interface_metadata(parent), name,
+			   context->uid, context->gid);
+  if (res)
+    fuse_reply_err(req, -res);
+  else
+    interface_reply_entry(req, interface_metadata(parent), name);
 }
 
-static int callback_rename(const char *from, const char *to)
+static void callback_rename(fuse_req_t req, fuse_ino_t parent,
+			    const char *name, fuse_ino_t newparent,
+			    const char *newname, unsigned int flags)
 {
   /*
    * Not suppored, because there is always a fallback path, and we don't
    * version moves per se, so just let the calling program do the move
    * "manually".
    */
-  (void)from;
-  (void)to;
-  return -EXDEV;
+  (void) parent;
+  (void) name;
+  (void) newparent;
+  (void) newname;
+  (void) flags;
+  fuse_reply_err(req, EXDEV);
 }
 
-static int callback_link(const char *from, const char *to)
+static void callback_link(fuse_req_t req, fuse_ino_t ino,
+			  fuse_ino_t newparent, const char *newname)
 {
   /*
    * Forbid hard links, since there is no way to make them point to a new
    * version if need be.
    */
-  (void)from;
-  (void)to;
-  return -EPERM;
+  (void) ino;
+  (void) newparent;
+  (void) newname;
+  fuse_reply_err(req, EPERM);
 }
 
-static int callback_chmod(const char *path, mode_t mode)
+/*
+ * Open the real file of the current version of a file, and the layers it is
+ * read from. Until the first write, the handle only reads the current
+ * version. The truncation is done afterwards, since the map of an overlay
+ * changes too. The caller holds the metadata's lock, or its update lock if
+ * truncating.
+ */
+static int interface_open_version(metadata_t *metadata, int flags, int write,
+				  int truncate, chain_t **chain)
 {
-  metadata_t *metadata;
   version_t *version;
+  int fd, error;
 
-  metadata = rcs_translate_to_metadata(path, rcs_version_path);
-  if (!metadata)
-    return -ENOENT;
-  version = rcs_find_version(metadata, LATEST, LATEST);
+  *chain = NULL;
+  version = rcs_find_version(metadata, LATEST, LATEST, RCS_HIDE_DELETED);
   if (!version)
-    return -ENOENT;
-
-  if (create_new_subversion(path, mode, version->v_uid, version->v_gid) != 0)
-    return -errno;
-  return 0;
+    {
+      errno = ENOENT;
+      return -1;
+    }
+  fd = rcs_open_version(metadata, version,
+			(write && !truncate) ? O_RDONLY : (flags & ~O_TRUNC));
+  if ((fd != -1) &&
+      ((overlay_open_chain(metadata, version, fd, chain) == -1) ||
+       (truncate && *chain &&
+	(overlay_truncate((*chain)->c_overlays[0], fd, 0) == -1)) ||
+       (truncate && !*chain && (ftruncate(fd, 0) == -1))))
+    {
+      error = errno;
+      overlay_close_chain(*chain);
+      *chain = NULL;
+      close(fd);
+      fd = -1;
+      errno = error;
+    }
+  return fd;
 }
 
-static int callback_chown(const char *path, uid_t uid, gid_t gid)
+/*
+ * Open the real file of the current version of a file, and keep it in a
+ * handle for the next calls. Opening for writing does not create a version
+ * yet, so that handles that never write cost nothing : see
+ * interface_start_writing(). Only a truncating open creates its (empty)
+ * version at once. The kernel does not keep its page cache across opens,
+ * since the current version may have changed.
+ */
+static void callback_open(fuse_req_t req, fuse_ino_t ino,
+			  struct fuse_file_info *fi)
 {
   metadata_t *metadata;
-  version_t *version;
-
-  metadata = rcs_translate_to_metadata(path, rcs_version_path);
-  if (!metadata)
-    return -ENOENT;
-  version = rcs_find_version(metadata, LATEST, LATEST);
-  if (!version)
-    return -ENOENT;
+  handle_t *handle;
+  chain_t *chain;
+  int write, truncate, fd, res;
 
-  if (create_new_subversion(path, version->v_mode, uid, gid) != 0)
-    return -errno;
-  return 0;
-}
+  metadata = interface_metadata(ino);
+  write = (fi->flags & O_WRONLY) || (fi->flags & O_RDWR);
+  truncate = write && (fi->flags & O_TRUNC);
+  if (truncate)
+    {
+      /* A deleted file must not come back to life */
+      pthread_mutex_lock(&metadata->md_update);
+      if (!rcs_find_version(metadata, LATEST, LATEST, RCS_HIDE_DELETED))
+	{
+	  res = -1;
+	  errno = ENOENT;
+	}
+      else
+	res = create_new_version_truncated(metadata, 0);
+      if (res == -1)
+	{
+	  res = errno;
+	  pthread_mutex_unlock(&metadata->md_update);
+	  fuse_reply_err(req, res);
+	  return;
+	}
+    }
+  else
+    pthread_rwlock_rdlock(&metadata->md_lock);
 
-static int callback_truncate(const char *path, off_t size)
-{
-    int res;
-    char *rpath;
-    metadata_t *metadata;
+  fd = interface_open_version(metadata, fi->flags, write, truncate, &chain);
+  if ((fd == -1) && (errno == EAGAIN))
+    {
+      /* Its layers are based on versions that were not read yet */
+      if (truncate)
+	res = rcs_load_history(metadata);
+      else
+	{
+	  pthread_rwlock_unlock(&metadata->md_lock);
+	  pthread_mutex_lock(&metadata->md_update);
+	  res = rcs_load_history(metadata);
+	  pthread_mutex_unlock(&metadata->md_update);
+	  pthread_rwlock_rdlock(&metadata->md_lock);
+	}
+      if (!res)
+	fd = interface_open_version(metadata, fi->flags, write, truncate,
+				    &chain);
+    }
+  res = errno;
+  if ((fd != -1) && truncate)
+    metadata->md_writers++;
 
-    if (create_new_version(path) == -1)
-      return -errno;
+  if (truncate)
+    pthread_mutex_unlock(&metadata->md_update);
+  else
+    pthread_rwlock_unlock(&metadata->md_lock);
 
-    rpath = rcs_translate_path(path, rcs_version_path);
-    metadata = cache_get_metadata(path);
-    metadata->md_timestamp = time(NULL);
-    res = truncate(rpath, size);
-    if(res == -1)
-      return -errno;
+  if (fd == -1)
+    {
+      fuse_reply_err(req, res);
+      return;
+    }
 
-    return 0;
+  /* The kernel keeps its reference on the metadata until the release */
+  handle = safe_malloc(sizeof(handle_t));
+  handle->h_fd = fd;
+  handle->h_flags = fi->flags & ~(O_CREAT | O_EXCL | O_TRUNC);
+  handle->h_write = write;
+  handle->h_dirty = truncate;
+  handle->h_chain = chain;
+  handle->h_retired = NULL;
+  handle->h_metadata = metadata;
+  fi->fh = (uintptr_t)handle;
+  fi->keep_cache = 0;
+  if (fuse_reply_open(req, fi))
+    {
+      /* The request was interrupted, there will be no release */
+      overlay_close_chain(chain);
+      close(fd);
+      if (truncate)
+	{
+	  pthread_mutex_lock(&metadata->md_update);
+	  metadata->md_writers--;
+	  pthread_mutex_unlock(&metadata->md_update);
+	}
+      free(handle);
+    }
 }
 
-static int callback_utime(const char *path, struct utimbuf *buf)
+/*
+ * Answer a read of an overlay version with the extents of the layers that
+ * hold the data, for the library to read or splice in turn, or with the data
+ * itself when it had to be decompressed.
+ */
+static void interface_read_layers(fuse_req_t req, chain_t *chain, size_t size,
+				  off_t off)
 {
-  char *rpath;
-  int res;
-
-  rpath = rcs_translate_path(path, rcs_version_path);
-  if (!rpath)
-    return -ENOENT;
+  struct fuse_bufvec *buffer;
+  extent_t *extents;
+  int count, i;
 
-  res = utime(rpath, buf);
-  if (res == -1)
+  count = overlay_map_range(chain, off, size, &extents);
+  if (count == -1)
     {
-      free(rpath);
-      return -errno;
+      fuse_reply_err(req, errno);
+      return;
+    }
+  if (count == 0)
+    {
+      overlay_free_extents(extents, count);
+      fuse_reply_buf(req, NULL, 0);
+      return;
     }
 
-  free(rpath);
-  return 0;
+  buffer = safe_malloc(sizeof(struct fuse_bufvec) +
+		       sizeof(struct fuse_buf) * (count - 1));
+  memset(buffer, 0, sizeof(struct fuse_bufvec) +
+	 sizeof(struct fuse_buf) * (count - 1));
+  buffer->count = count;
+  for (i = 0; i < count; i++)
+    {
+      buffer->buf[i].size = extents[i].e_length;
+      if (extents[i].e_data)
+	{
+	  /* Decompressed from a frame */
+	  buffer->buf[i].mem = extents[i].e_data;
+	  continue;
+	}
+      buffer->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+      buffer->buf[i].fd = extents[i].e_fd;
+      buffer->buf[i].pos = extents[i].e_position;
+    }
+  fuse_reply_data(req, buffer, FUSE_BUF_SPLICE_MOVE);
+  free(buffer);
+  overlay_free_extents(extents, count);
 }
 
-static int callback_open(const char *path, int flags)
+static void callback_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+			  off_t off, struct fuse_file_info *fi)
 {
-  char *rpath;
-  int res;
+  struct fuse_bufvec buffer = FUSE_BUFVEC_INIT(size);
+  handle_t *handle;
+  chain_t *chain;
 
-  if ((flags & O_WRONLY) || (flags & O_RDWR)) {
-    if (create_new_version(path) == -1)
-      return -errno;
-  }
+  /* Let the library read the real file, and splice it if it can */
+  (void) ino;
+  handle = (handle_t *)(uintptr_t)fi->fh;
+  chain = __atomic_load_n(&handle->h_chain, __ATOMIC_ACQUIRE);
+  if (chain)
+    {
+      interface_read_layers(req, chain, size, off);
+      return;
+    }
+  buffer.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+  buffer.buf[0].fd = handle->h_fd;
+  buffer.buf[0].pos = off;
+  fuse_reply_data(req, &buffer, FUSE_BUF_SPLICE_MOVE);
+}
 
-  rpath = rcs_translate_path(path, rcs_version_path);
-  res = open(rpath, flags);
-  free(rpath);
+static void callback_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+			   size_t size, off_t off, struct fuse_file_info *fi)
+{
+  handle_t *handle;
+  ssize_t res;
+
+  (void) ino;
+  handle = (handle_t *)(uintptr_t)fi->fh;
+  res = interface_start_writing(handle, -1);
+  if (res)
+    {
+      fuse_reply_err(req, -res);
+      return;
+    }
+  if (handle->h_chain)
+    res = overlay_write(handle->h_chain, buf, size, off);
+  else
+    res = pwrite(handle->h_fd, buf, size, off);
   if(res == -1)
-    return -errno;
-  close(res);
-  return 0;
+    fuse_reply_err(req, errno);
+  else
+    fuse_reply_write(req, res);
 }
 
-static int callback_read(const char *path, char *buf, size_t size, off_t off)
+static void callback_statfs(fuse_req_t req, fuse_ino_t ino)
 {
-  char *rpath;
-  int fd, res;
+  struct statvfs st_buf;
 
-  rpath = rcs_translate_path(path, rcs_version_path);
-  fd = open(rpath, O_RDONLY);
-  if (fd == -1)
+  /* Report the space available where the versions are stored */
+  (void) ino;
+  if (statvfs(rcs_version_path, &st_buf) == -1)
+    fuse_reply_err(req, errno);
+  else
+    fuse_reply_statfs(req, &st_buf);
+}
+
+static void callback_release(fuse_req_t req, fuse_ino_t ino,
+			     struct fuse_file_info *fi)
+{
+  handle_t *handle;
+  metadata_t *metadata;
+
+  (void) ino;
+  handle = (handle_t *)(uintptr_t)fi->fh;
+  metadata = handle->h_metadata;
+  close(handle->h_fd);
+  overlay_close_chain(handle->h_chain);
+  overlay_close_chain(handle->h_retired);
+  if (handle->h_dirty)
     {
-      free(rpath);
-      return -errno;
+      pthread_mutex_lock(&metadata->md_update);
+      metadata->md_writers--;
+      pthread_mutex_unlock(&metadata->md_update);
     }
-  res = pread(fd, buf, size, off);
-  if (res == -1)
-    res = -errno;
-  close(fd);
-  free(rpath);
-  return res;
+  free(handle);
+  fuse_reply_err(req, 0);
 }
 
-static int callback_write(const char *path, const char *buf, size_t size,
-                     off_t offset)
+static void callback_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+			   struct fuse_file_info *fi)
 {
-  int fd;
+  handle_t *handle;
+  chain_t *chain;
   int res;
-  char *rpath;
 
-  rpath = rcs_translate_path(path, rcs_version_path);
-  fd = open(rpath, O_WRONLY);
-  if(fd == -1)
-    {
-      free(rpath);
-      return -errno;
-    }
-  res = pwrite(fd, buf, size, offset);
-  if(res == -1)
-    res = -errno;
-  close(fd);
-  free(rpath);
-  return res;
+  (void) ino;
+  handle = (handle_t *)(uintptr_t)fi->fh;
+  chain = __atomic_load_n(&handle->h_chain, __ATOMIC_ACQUIRE);
+  if (chain)
+    res = overlay_sync(chain, datasync);
+  else if (datasync)
+    res = fdatasync(handle->h_fd);
+  else
+    res = fsync(handle->h_fd);
+  fuse_reply_err(req, (res == -1) ? errno : 0);
 }
 
-static int callback_statfs(const char *path, struct statfs *st_buf)
+static void callback_setxattr(fuse_req_t req, fuse_ino_t ino,
+			      const char *name, const char *value,
+			      size_t size, int flags)
 {
   int res;
 
-  res = statfs(path, st_buf);
-  if (res == -1)
-    return -errno;
-  return 0;
+  res = ea_setxattr(interface_metadata(ino), name, value, size, flags,
+		    fuse_req_ctx(req)->uid);
+  fuse_reply_err(req, -res);
 }
 
-static int callback_release(const char *path, int flags)
+static void callback_getxattr(fuse_req_t req, fuse_ino_t ino,
+			      const char *name, size_t size)
 {
-  /* No special treatment */
-  (void) path;
-  (void) flags;
-  return 0;
+  char *value;
+  int res;
+
+  /* A null size asks for the size of the value */
+  value = size ? safe_malloc(size) : NULL;
+  res = ea_getxattr(interface_metadata(ino), name, value, size);
+  if (res < 0)
+    fuse_reply_err(req, -res);
+  else if (!size)
+    fuse_reply_xattr(req, res);
+  else
+    fuse_reply_buf(req, value, res);
+  free(value);
 }
 
-static int callback_fsync(const char *path, int isdatasync)
+static void callback_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
 {
-  /* No special treatment */
-  (void) path;
-  (void) isdatasync;
-  return 0;
+  char *list;
+  int res;
+
+  /* A null size asks for the size of the list */
+  list = size ? safe_malloc(size) : NULL;
+  res = ea_listxattr(interface_metadata(ino), list, size);
+  if (res < 0)
+    fuse_reply_err(req, -res);
+  else if (!size)
+    fuse_reply_xattr(req, res);
+  else
+    fuse_reply_buf(req, list, res);
+  free(list);
+}
+
+static void callback_removexattr(fuse_req_t req, fuse_ino_t ino,
+				 const char *name)
+{
+  fuse_reply_err(req, -ea_removexattr(interface_metadata(ino), name,
+				       fuse_req_ctx(req)->uid));
 }
 
-struct fuse_operations callback_oper = {
+struct fuse_lowlevel_ops callback_oper = {
+    .init	= callback_init,
+    .lookup	= callback_lookup,
+    .forget	= callback_forget,
+    .forget_multi = callback_forget_multi,
     .getattr	= callback_getattr,
+    .setattr	= callback_setattr,
     .readlink	= callback_readlink,
-    .getdir	= callback_getdir,
+    .opendir	= callback_opendir,
+    .readdir	= callback_readdir,
+    .readdirplus= callback_readdirplus,
+    .releasedir	= callback_releasedir,
     .mknod	= callback_mknod,
     .mkdir	= callback_mkdir,
     .symlink	= callback_symlink,
@@ -471,10 +1227,6 @@ struct fuse_operations callback_oper = {
     .rmdir	= callback_rmdir,
     .rename	= callback_rename,
     .link	= callback_link,
-    .chmod	= callback_chmod,
-    .chown	= callback_chown,
-    .truncate	= callback_truncate,
-    .utime	= callback_utime,
     .open	= callback_open,
     .read	= callback_read,
     .write	= callback_write,
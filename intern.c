@@ -0,0 +1,132 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "helper.h"
+#include "intern.h"
+
+/*
+ * The names of the entries of the tree are kept once, however many
+ * directories have an entry with that name : the metadata of the entries
+ * only point to the shared copy. The table doubles when it holds as many
+ * names as it has buckets.
+ */
+
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+static intern_t **intern_table = NULL;
+static unsigned int intern_buckets = 0;
+static unsigned int intern_count = 0;
+static size_t intern_bytes = 0;
+
+/*
+ * Get the shared record a name handed out by intern_get() is part of.
+ */
+static intern_t *intern_record(const char *name)
+{
+  return (intern_t *)(name - offsetof(intern_t, i_name));
+}
+
+/*
+ * Move the names to a table twice as large. The caller holds the lock.
+ */
+static void intern_grow(void)
+{
+  intern_t **table, *record, *next;
+  unsigned int size, i;
+
+  size = intern_buckets ? intern_buckets * 2 : INTERN_BUCKETS;
+  table = safe_malloc(sizeof(intern_t *) * size);
+  memset(table, 0, sizeof(intern_t *) * size);
+  for (i = 0; i < intern_buckets; i++)
+    for (record = intern_table[i]; record; record = next)
+      {
+	next = record->i_next;
+	record->i_next = table[record->i_hash & (size - 1)];
+	table[record->i_hash & (size - 1)] = record;
+      }
+  free(intern_table);
+  intern_table = table;
+  intern_buckets = size;
+}
+
+/*
+ * Get the shared copy of a name, to give back with intern_put().
+ */
+const char *intern_get(const char *name)
+{
+  intern_t *record;
+  uint64_t hash;
+  size_t length;
+
+  hash = helper_hash_string(name);
+  pthread_mutex_lock(&intern_lock);
+  if (intern_buckets)
+    for (record = intern_table[hash & (intern_buckets - 1)]; record;
+	 record = record->i_next)
+      if ((record->i_hash == hash) && !strcmp(record->i_name, name))
+	{
+	  record->i_refcount++;
+	  pthread_mutex_unlock(&intern_lock);
+	  return record->i_name;
+	}
+
+  if (intern_count >= intern_buckets)
+    intern_grow();
+  length = strlen(name);
+  record = safe_malloc(sizeof(intern_t) + length + 1);
+  record->i_hash = hash;
+  record->i_refcount = 1;
+  memcpy(record->i_name, name, length + 1);
+  record->i_next = intern_table[hash & (intern_buckets - 1)];
+  intern_table[hash & (intern_buckets - 1)] = record;
+  intern_count++;
+  intern_bytes += sizeof(intern_t) + length + 1;
+  pthread_mutex_unlock(&intern_lock);
+  return record->i_name;
+}
+
+/*
+ * Give back a name from intern_get(). The last user frees it.
+ */
+void intern_put(const char *name)
+{
+  intern_t *record, **link;
+
+  if (!name)
+    return;
+  record = intern_record(name);
+  pthread_mutex_lock(&intern_lock);
+  if (--record->i_refcount)
+    {
+      pthread_mutex_unlock(&intern_lock);
+      return;
+    }
+  for (link = &intern_table[record->i_hash & (intern_buckets - 1)];
+       *link != record; link = &(*link)->i_next)
+    ;
+  *link = record->i_next;
+  intern_count--;
+  intern_bytes -= sizeof(intern_t) + strlen(record->i_name) + 1;
+  pthread_mutex_unlock(&intern_lock);
+  free(record);
+}
+
+/*
+ * Get how many names are shared, and the memory they use.
+ */
+void intern_get_stats(unsigned int *names, size_t *bytes)
+{
+  pthread_mutex_lock(&intern_lock);
+  *names = intern_count;
+  *bytes = intern_bytes;
+  pthread_mutex_unlock(&intern_lock);
+}
@@ -0,0 +1,32 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#ifndef INTERN_H
+# define INTERN_H
+
+# include <stdint.h>
+# include <stddef.h>
+
+# define INTERN_BUCKETS		1024		/* Initial table size	*/
+
+typedef struct intern_t		intern_t;
+
+/* A name shared by all the entries that have it, followed by the name */
+struct				intern_t
+{
+  intern_t			*i_next;	/* Next in the bucket	*/
+  uint64_t			i_hash;		/* Hash of the name	*/
+  unsigned int			i_refcount;	/* Users of the name	*/
+  char				i_name[];	/* The name itself	*/
+};
+
+const char	*intern_get(const char *name);
+void		intern_put(const char *name);
+void		intern_get_stats(unsigned int *names, size_t *bytes);
+
+#endif /* !INTERN_H */
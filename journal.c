@@ -0,0 +1,914 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "helper.h"
+#include "catalog.h"
+#include "journal.h"
+
+/*
+ * Metadata and default version files are not rewritten in place anymore.
+ * Each new image of such a file is appended to a journal at the root of the
+ * version tree, and all the writers that wait at the same time share one
+ * fdatasync. Until the next checkpoint, the images live in a table that
+ * readers look at before the disk, and the real files are only written then,
+ * once for all the changes they had since the last one. A record that only
+ * appends to a file holds what it appends, and where : replaying it again
+ * over a file that already has it changes nothing.
+ */
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_flushed = PTHREAD_COND_INITIALIZER;
+static journal_entry_t *journal_table[JOURNAL_BUCKETS];
+static char *journal_root = NULL;
+static size_t journal_root_length = 0;
+static int journal_fd = -1;
+static off_t journal_bytes = 0;
+static unsigned int journal_files = 0;
+static unsigned long long journal_appended = 0;
+static unsigned long long journal_synced = 0;
+static unsigned long long journal_failed = 0;
+static unsigned int journal_waiting = 0;
+static int journal_syncing = 0;
+static int journal_stale = 0;
+
+/*
+ * Write a whole buffer to a file descriptor, at its current position.
+ */
+static int journal_write_buffer(int fd, const char *data, size_t size)
+{
+  ssize_t res;
+  size_t done;
+
+  for (done = 0; done < size; done += res)
+    {
+      res = write(fd, data + done, size - done);
+      if (res == -1 && errno == EINTR)
+	res = 0;
+      else if (res == -1)
+	return -1;
+    }
+  return 0;
+}
+
+/*
+ * Replace a file with the given contents. The new contents go to a sibling
+ * first, so a crash leaves either file.
+ */
+static int journal_install(const char *path, const char *data, size_t size)
+{
+  char *temp;
+  int fd, res;
+
+  temp = helper_get_sibling_name(path, JOURNAL_NAME);
+  fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1)
+    {
+      free(temp);
+      return -1;
+    }
+  res = journal_write_buffer(fd, data, size);
+  if (close(fd) == -1)
+    res = -1;
+  if (!res)
+    res = rename(temp, path);
+  if (res == -1)
+    {
+      int error = errno;
+      unlink(temp);
+      errno = error;
+    }
+  free(temp);
+  return res;
+}
+
+/*
+ * Find the pending image of a file, and make an empty one if asked to.
+ */
+static journal_entry_t *journal_find(const char *path, int create)
+{
+  journal_entry_t *entry;
+  unsigned int bucket;
+
+  bucket = helper_hash_string(path) % JOURNAL_BUCKETS;
+  for (entry = journal_table[bucket]; entry; entry = entry->je_next)
+    if (!strcmp(entry->je_path, path))
+      return entry;
+  if (!create)
+    return NULL;
+
+  entry = safe_malloc(sizeof(journal_entry_t));
+  entry->je_path = safe_strdup(path);
+  entry->je_data = NULL;
+  entry->je_size = 0;
+  entry->je_exists = 0;
+  entry->je_next = journal_table[bucket];
+  journal_table[bucket] = entry;
+  journal_files++;
+  return entry;
+}
+
+/*
+ * Record the new image of a file in the table. A NULL image means the file
+ * is removed.
+ */
+static void journal_set(const char *path, const char *data, size_t size)
+{
+  journal_entry_t *entry;
+
+  entry = journal_find(path, 1);
+  free(entry->je_data);
+  entry->je_data = NULL;
+  entry->je_size = size;
+  if (data)
+    {
+      entry->je_data = safe_malloc(size + 1);
+      memcpy(entry->je_data, data, size);
+    }
+  else
+    entry->je_exists = 0;
+}
+
+/*
+ * Read what the disk holds for a file : its contents in the catalog of its
+ * directory, or the file itself. Returns a copy to free, or NULL.
+ */
+static char *journal_load(const char *path, size_t *size)
+{
+  struct stat st_file;
+  catalog_t *catalog;
+  const char *found;
+  char *dir, *data;
+  ssize_t res;
+  int fd;
+
+  dir = helper_extract_dirname(path);
+  catalog = catalog_open(dir);
+  free(dir);
+  if (catalog)
+    switch (catalog_find(catalog, rindex(path, '/') + 1, &found, size))
+      {
+      case 1:
+	data = safe_malloc(*size + 1);
+	memcpy(data, found, *size);
+	catalog_close(catalog);
+	return data;
+      case 0:
+	catalog_close(catalog);
+	errno = ENOENT;
+	return NULL;
+      }
+  catalog_close(catalog);
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+  if (fstat(fd, &st_file) == -1)
+    {
+      close(fd);
+      return NULL;
+    }
+  data = safe_malloc(st_file.st_size + 1);
+  for (*size = 0; *size < (size_t)st_file.st_size; *size += res)
+    {
+      res = pread(fd, data + *size, st_file.st_size - *size, *size);
+      if (res == -1 && errno == EINTR)
+	res = 0;
+      else if (res <= 0)
+	{
+	  close(fd);
+	  free(data);
+	  errno = EIO;
+	  return NULL;
+	}
+    }
+  close(fd);
+  return data;
+}
+
+/*
+ * Find the pending image of a file that is to be appended to. A file that
+ * has none yet gets what the disk holds. Returns NULL if there is no such
+ * file.
+ */
+static journal_entry_t *journal_pending(const char *path)
+{
+  journal_entry_t *entry;
+  size_t size;
+  char *data;
+
+  entry = journal_find(path, 0);
+  if (entry && !entry->je_data)
+    {
+      errno = ENOENT;
+      return NULL;
+    }
+  if (entry)
+    return entry;
+
+  data = journal_load(path, &size);
+  if (!data)
+    return NULL;
+  entry = journal_find(path, 1);
+  entry->je_data = data;
+  entry->je_size = size;
+  entry->je_exists = 1;
+  return entry;
+}
+
+/*
+ * Record in the table that a file has new contents past its first offset
+ * bytes. Returns non-zero if there is no such file, or if it is shorter.
+ */
+static int journal_grow(const char *path, const char *data, size_t size,
+			size_t offset)
+{
+  journal_entry_t *entry;
+
+  entry = journal_pending(path);
+  if (!entry)
+    return -1;
+  if (entry->je_size < offset)
+    {
+      errno = EIO;
+      return -1;
+    }
+  entry->je_data = safe_realloc(entry->je_data, offset + size + 1);
+  memcpy(entry->je_data + offset, data, size);
+  entry->je_size = offset + size;
+  return 0;
+}
+
+/*
+ * Forget all the pending images.
+ */
+static void journal_clear(void)
+{
+  journal_entry_t *entry, *next;
+  unsigned int i;
+
+  for (i = 0; i < JOURNAL_BUCKETS; i++)
+    {
+      for (entry = journal_table[i]; entry; entry = next)
+	{
+	  next = entry->je_next;
+	  free(entry->je_path);
+	  free(entry->je_data);
+	  free(entry);
+	}
+      journal_table[i] = NULL;
+    }
+  journal_files = 0;
+}
+
+/*
+ * Order of the pending images for a checkpoint with catalogs : by
+ * directory, then by name.
+ */
+static int journal_compare(const void *first, const void *second)
+{
+  const char *one, *other, *one_name, *other_name;
+  size_t one_length, other_length;
+  int order;
+
+  one = (*(journal_entry_t * const *)first)->je_path;
+  other = (*(journal_entry_t * const *)second)->je_path;
+  one_name = rindex(one, '/');
+  other_name = rindex(other, '/');
+  one_length = one_name - one;
+  other_length = other_name - other;
+  order = memcmp(one, other, (one_length < other_length) ? one_length :
+		 other_length);
+  if (order)
+    return order;
+  if (one_length != other_length)
+    return (one_length < other_length) ? -1 : 1;
+  return strcmp(one_name, other_name);
+}
+
+/*
+ * Merge the pending images into the catalogs of their directories. The
+ * directories whose catalog was just created are returned, for their files
+ * to be removed once the catalogs are on the disk.
+ */
+static int journal_merge(char ***created)
+{
+  journal_entry_t **entries;
+  journal_entry_t *entry;
+  catalog_entry_t *updates;
+  unsigned int i, j, count, made;
+  char *dir;
+  size_t length;
+  int res;
+
+  entries = safe_malloc(sizeof(journal_entry_t *) * (journal_files + 1));
+  count = 0;
+  for (i = 0; i < JOURNAL_BUCKETS; i++)
+    for (entry = journal_table[i]; entry; entry = entry->je_next)
+      entries[count++] = entry;
+  qsort(entries, count, sizeof(journal_entry_t *), journal_compare);
+
+  updates = safe_malloc(sizeof(catalog_entry_t) * (count + 1));
+  *created = safe_malloc(sizeof(char *) * (count + 1));
+  made = 0;
+  res = 0;
+  for (i = 0; !res && i < count; i = j)
+    {
+      dir = helper_extract_dirname(entries[i]->je_path);
+      length = strlen(dir);
+      for (j = i; j < count; j++)
+	{
+	  if (strncmp(entries[j]->je_path, dir, length) ||
+	      (entries[j]->je_path[length] != '/') ||
+	      index(entries[j]->je_path + length + 1, '/'))
+	    break;
+	  updates[j - i].ce_name = entries[j]->je_path + length + 1;
+	  updates[j - i].ce_data = entries[j]->je_data;
+	  updates[j - i].ce_size = entries[j]->je_size;
+	}
+
+      /* A directory that is gone does not need to be written */
+      switch (catalog_merge(dir, updates, j - i, 0))
+	{
+	case 1:
+	  (*created)[made++] = dir;
+	  dir = NULL;
+	  break;
+	case -1:
+	  if (errno != ENOENT)
+	    res = -1;
+	  break;
+	}
+      free(dir);
+    }
+  (*created)[made] = NULL;
+  free(updates);
+  free(entries);
+  return res;
+}
+
+/*
+ * Write all the pending images to their files, or their catalogs, and empty
+ * the journal once they are on the disk. On error, everything is left for
+ * the next try. It waits while some records are not in the table yet, as
+ * emptying the journal would lose them. The caller holds the journal lock.
+ */
+static int journal_checkpoint(void)
+{
+  journal_entry_t *entry;
+  char **created;
+  unsigned int i;
+  int res;
+
+  if (journal_waiting)
+    return 0;
+  created = NULL;
+  if (catalog_enabled())
+    {
+      if (journal_merge(&created) == -1)
+	{
+	  helper_free_array(created);
+	  return -1;
+	}
+    }
+  else
+    for (i = 0; i < JOURNAL_BUCKETS; i++)
+      for (entry = journal_table[i]; entry; entry = entry->je_next)
+	{
+	  if (entry->je_data)
+	    res = journal_install(entry->je_path, entry->je_data,
+				  entry->je_size);
+	  else
+	    res = unlink(entry->je_path);
+
+	  /* A file whose directory is gone does not need to be written */
+	  if (res == -1 && errno != ENOENT)
+	    return -1;
+	}
+
+  /* One flush for all the files, then the records are not needed */
+  if ((syncfs(journal_fd) == -1) || (ftruncate(journal_fd, 0) == -1))
+    {
+      if (created)
+	helper_free_array(created);
+      return -1;
+    }
+  journal_clear();
+  journal_bytes = 0;
+  journal_stale = 0;
+  journal_synced = journal_appended;
+  pthread_cond_broadcast(&journal_flushed);
+
+  /* The new catalogs replace the files of their directories */
+  if (created)
+    {
+      for (i = 0; created[i]; i++)
+	catalog_prune(created[i]);
+      helper_free_array(created);
+    }
+  return 0;
+}
+
+/*
+ * Wait until the record with the given sequence number is on the disk. The
+ * first writer that finds no flush running starts one for all the records
+ * appended so far, and the others wait for it. The caller holds the journal
+ * lock, which is released during the flush.
+ */
+static int journal_commit(unsigned long long sequence)
+{
+  unsigned long long target;
+  int res;
+
+  while (journal_synced < sequence)
+    {
+      if (journal_failed >= sequence)
+	{
+	  errno = EIO;
+	  return -1;
+	}
+      if (journal_syncing)
+	{
+	  pthread_cond_wait(&journal_flushed, &journal_lock);
+	  continue;
+	}
+
+      target = journal_appended;
+      journal_syncing = 1;
+      pthread_mutex_unlock(&journal_lock);
+      res = fdatasync(journal_fd);
+      pthread_mutex_lock(&journal_lock);
+      journal_syncing = 0;
+      if (res == -1)
+	journal_failed = target;
+      else if (target > journal_synced)
+	journal_synced = target;
+      pthread_cond_broadcast(&journal_flushed);
+    }
+  return 0;
+}
+
+/*
+ * Build a record for the new image of a file past the given offset, or its
+ * removal if data is NULL. Paths in the version tree are kept relative to
+ * its root.
+ */
+static char *journal_record(const char *path, const char *data, size_t size,
+			    size_t offset, size_t *length)
+{
+  journal_header_t header;
+  char *record;
+
+  if (!strncmp(path, journal_root, journal_root_length) &&
+      (path[journal_root_length] == '/'))
+    path += journal_root_length + 1;
+
+  header.jh_magic = JOURNAL_MAGIC;
+  header.jh_path = strlen(path);
+  header.jh_size = data ? size : JOURNAL_REMOVED;
+  header.jh_offset = offset;
+  header.jh_hash = 0;
+  if (!data)
+    size = 0;
+
+  *length = sizeof(journal_header_t) + header.jh_path + size;
+  record = safe_malloc(*length);
+  memcpy(record, &header, sizeof(journal_header_t));
+  memcpy(record + sizeof(journal_header_t), path, header.jh_path);
+  if (size)
+    memcpy(record + sizeof(journal_header_t) + header.jh_path, data, size);
+  header.jh_hash = helper_hash_data(0, record, *length);
+  memcpy(record, &header, sizeof(journal_header_t));
+  return record;
+}
+
+/*
+ * Append a record, wait until it is on the disk, and only then make the
+ * table show the new image, so that nobody reads an image that may not
+ * survive a crash. A record that could not be flushed is not in the table,
+ * and goes away with the next checkpoint, which writes the table and
+ * empties the journal. A non-zero offset is where the contents go in the
+ * pending image, that the caller made sure exists. The caller holds the
+ * journal lock.
+ */
+static int journal_append(const char *path, const char *data, size_t size,
+			  size_t offset)
+{
+  char *record;
+  size_t length;
+  int res;
+
+  if (data && ((size >= JOURNAL_REMOVED) ||
+	       (offset >= JOURNAL_REMOVED - size)))
+    {
+      errno = EFBIG;
+      return -1;
+    }
+
+  record = journal_record(path, data, size, offset, &length);
+  if (journal_write_buffer(journal_fd, record, length) == -1)
+    {
+      int error = errno;
+
+      /* Do not leave a torn record that would hide the next ones */
+      ftruncate(journal_fd, journal_bytes);
+      free(record);
+      errno = error;
+      return -1;
+    }
+  free(record);
+  journal_bytes += length;
+
+  journal_waiting++;
+  res = journal_commit(++journal_appended);
+  journal_waiting--;
+  if (res == -1)
+    {
+      int error = errno;
+
+      /* Do not let a later flush or a replay keep what was refused */
+      journal_stale = 1;
+      journal_checkpoint();
+      errno = error;
+      return -1;
+    }
+  if (offset)
+    journal_grow(path, data, size, offset);
+  else
+    journal_set(path, data, size);
+  if (journal_stale)
+    journal_checkpoint();
+  return 0;
+}
+
+/*
+ * Put a file in the catalog of its directory at once, when there is no
+ * journal.
+ */
+static int journal_merge_file(const char *path, const char *data,
+			      size_t size)
+{
+  catalog_entry_t update;
+  char *dir;
+  int res;
+
+  dir = helper_extract_dirname(path);
+  update.ce_name = (char *)path + strlen(dir) + 1;
+  update.ce_data = (char *)data;
+  update.ce_size = size;
+  res = catalog_merge(dir, &update, 1, 1);
+  free(dir);
+  return (res == -1) ? -1 : 0;
+}
+
+/*
+ * Write the new contents of a metadata or default version file. Without a
+ * journal, the file is simply rewritten.
+ */
+int journal_write(const char *path, const char *data, size_t size)
+{
+  journal_entry_t *entry;
+  int res, fd;
+
+  pthread_mutex_lock(&journal_lock);
+  if (journal_fd == -1)
+    {
+      pthread_mutex_unlock(&journal_lock);
+      if (catalog_enabled())
+	return journal_merge_file(path, data, size);
+      fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if (fd == -1)
+	return -1;
+      res = journal_write_buffer(fd, data, size);
+      if (close(fd) == -1)
+	res = -1;
+      return res;
+    }
+
+  if (journal_append(path, data, size, 0) == -1)
+    {
+      pthread_mutex_unlock(&journal_lock);
+      return -1;
+    }
+
+  /*
+   * Directory listings look at the disk, so the file must be there. It is,
+   * if a checkpoint went by during the flush.
+   */
+  entry = journal_find(path, 0);
+  if (entry && !entry->je_exists && !catalog_enabled())
+    {
+      fd = open(path, O_WRONLY | O_CREAT, 0666);
+      if (fd == -1)
+	{
+	  pthread_mutex_unlock(&journal_lock);
+	  return -1;
+	}
+      close(fd);
+      entry->je_exists = 1;
+    }
+
+  /* Checkpoint lazily, when there is enough to write */
+  if ((journal_files >= JOURNAL_FILES) || (journal_bytes >= JOURNAL_BYTES))
+    journal_checkpoint();
+  pthread_mutex_unlock(&journal_lock);
+  return 0;
+}
+
+/*
+ * Append to a metadata file, that has to exist. Without a journal, the file
+ * is simply appended to, unless it is in a catalog.
+ */
+int journal_extend(const char *path, const char *data, size_t size)
+{
+  journal_entry_t *entry;
+  size_t length;
+  char *image;
+  int res, fd;
+
+  pthread_mutex_lock(&journal_lock);
+  if (journal_fd == -1)
+    {
+      pthread_mutex_unlock(&journal_lock);
+      if (catalog_enabled())
+	{
+	  image = journal_load(path, &length);
+	  if (!image)
+	    return -1;
+	  image = safe_realloc(image, length + size + 1);
+	  memcpy(image + length, data, size);
+	  res = journal_merge_file(path, image, length + size);
+	  free(image);
+	  return res;
+	}
+      fd = open(path, O_WRONLY | O_APPEND);
+      if (fd == -1)
+	return -1;
+      res = journal_write_buffer(fd, data, size);
+      if (close(fd) == -1)
+	res = -1;
+      return res;
+    }
+
+  entry = journal_pending(path);
+  if (!entry || (journal_append(path, data, size, entry->je_size) == -1))
+    {
+      pthread_mutex_unlock(&journal_lock);
+      return -1;
+    }
+
+  /* Checkpoint lazily, when there is enough to write */
+  if ((journal_files >= JOURNAL_FILES) || (journal_bytes >= JOURNAL_BYTES))
+    journal_checkpoint();
+  pthread_mutex_unlock(&journal_lock);
+  return 0;
+}
+
+/*
+ * Remove a metadata or default version file. The file goes away at once,
+ * once the journal says so. A file that does not exist is not an error.
+ */
+int journal_remove(const char *path)
+{
+  int res;
+
+  pthread_mutex_lock(&journal_lock);
+  if ((journal_fd != -1) && (journal_append(path, NULL, 0, 0) == -1))
+    {
+      pthread_mutex_unlock(&journal_lock);
+      return -1;
+    }
+  if ((journal_fd == -1) && catalog_enabled() &&
+      (journal_merge_file(path, NULL, 0) == -1) && (errno != ENOENT))
+    {
+      pthread_mutex_unlock(&journal_lock);
+      return -1;
+    }
+  res = unlink(path);
+  pthread_mutex_unlock(&journal_lock);
+  if (!res || (errno == ENOENT))
+    return 0;
+  return res;
+}
+
+/*
+ * Look for a file in the journal. Returns 0 if the file on the disk is up
+ * to date, or 1 and a copy of its contents to free, NULL if it is removed.
+ */
+int journal_read(const char *path, char **data, size_t *size)
+{
+  journal_entry_t *entry;
+
+  pthread_mutex_lock(&journal_lock);
+  entry = (journal_fd != -1) ? journal_find(path, 0) : NULL;
+  if (!entry)
+    {
+      pthread_mutex_unlock(&journal_lock);
+      return 0;
+    }
+
+  *data = NULL;
+  *size = 0;
+  if (entry->je_data)
+    {
+      *data = safe_malloc(entry->je_size + 1);
+      memcpy(*data, entry->je_data, entry->je_size);
+      (*data)[entry->je_size] = '\0';
+      *size = entry->je_size;
+    }
+  pthread_mutex_unlock(&journal_lock);
+  return 1;
+}
+
+/*
+ * List the files of a directory with the given prefix that the journal
+ * holds, and that are not removed. Returns a NULL-terminated array of their
+ * names.
+ */
+char **journal_list(const char *dir, const char *prefix)
+{
+  journal_entry_t *entry;
+  unsigned int i, count, allocated;
+  size_t length, prefix_length;
+  char **names;
+  char *name;
+
+  length = strlen(dir);
+  prefix_length = strlen(prefix);
+  allocated = 4;
+  names = safe_malloc(sizeof(char *) * allocated);
+  count = 0;
+
+  pthread_mutex_lock(&journal_lock);
+  for (i = 0; i < JOURNAL_BUCKETS; i++)
+    for (entry = journal_table[i]; entry; entry = entry->je_next)
+      {
+	if (!entry->je_data || strncmp(entry->je_path, dir, length) ||
+	    (entry->je_path[length] != '/'))
+	  continue;
+	name = entry->je_path + length + 1;
+	if (index(name, '/') || strncmp(name, prefix, prefix_length))
+	  continue;
+	if (count + 1 >= allocated)
+	  {
+	    allocated *= 2;
+	    names = safe_realloc(names, sizeof(char *) * allocated);
+	  }
+	names[count++] = safe_strdup(name);
+      }
+  pthread_mutex_unlock(&journal_lock);
+
+  names[count] = NULL;
+  return names;
+}
+
+/*
+ * Load the valid records of the journal in the table. Reading stops at the
+ * first record that was not completely written.
+ */
+static int journal_replay(void)
+{
+  journal_header_t header;
+  struct stat st_journal;
+  char *contents, *path;
+  size_t offset, size;
+  ssize_t res;
+  uint64_t hash;
+
+  if (fstat(journal_fd, &st_journal) == -1)
+    return -1;
+  contents = safe_malloc(st_journal.st_size + 1);
+  for (size = 0; size < (size_t)st_journal.st_size; size += res)
+    {
+      res = pread(journal_fd, contents + size, st_journal.st_size - size,
+		  size);
+      if (res == -1 && errno == EINTR)
+	res = 0;
+      else if (res <= 0)
+	break;
+    }
+
+  offset = 0;
+  while (offset + sizeof(journal_header_t) <= size)
+    {
+      memcpy(&header, contents + offset, sizeof(journal_header_t));
+      if ((header.jh_magic != JOURNAL_MAGIC) ||
+	  (header.jh_path > size - offset - sizeof(journal_header_t)))
+	break;
+      if ((header.jh_size != JOURNAL_REMOVED) &&
+	  (header.jh_size > size - offset - sizeof(journal_header_t) -
+	   header.jh_path))
+	break;
+
+      /* The hash covers the record with a zero hash */
+      hash = header.jh_hash;
+      header.jh_hash = 0;
+      memcpy(contents + offset, &header, sizeof(journal_header_t));
+      if (helper_hash_data(0, contents + offset, sizeof(journal_header_t) +
+			   header.jh_path + ((header.jh_size == JOURNAL_REMOVED)
+					     ? 0 : header.jh_size)) != hash)
+	break;
+
+      offset += sizeof(journal_header_t);
+      path = safe_malloc(header.jh_path + 1);
+      memcpy(path, contents + offset, header.jh_path);
+      path[header.jh_path] = '\0';
+      offset += header.jh_path;
+      if (path[0] != '/')
+	{
+	  char *full;
+
+	  full = helper_build_composite("SS", "/", journal_root, path);
+	  free(path);
+	  path = full;
+	}
+
+      if (header.jh_size == JOURNAL_REMOVED)
+	journal_set(path, NULL, 0);
+      else
+	{
+	  /* An append to a file that is gone is not needed anymore */
+	  if (header.jh_offset)
+	    journal_grow(path, contents + offset, header.jh_size,
+			 header.jh_offset);
+	  else
+	    journal_set(path, contents + offset, header.jh_size);
+	  offset += header.jh_size;
+	}
+      free(path);
+    }
+
+  free(contents);
+  return 0;
+}
+
+/*
+ * Open the journal of a version tree, and bring the files up to date with
+ * what it holds from the last mount.
+ */
+int journal_open(const char *vroot)
+{
+  char *path;
+  int res;
+
+  pthread_mutex_lock(&journal_lock);
+  journal_root = safe_strdup(vroot);
+  journal_root_length = strlen(vroot);
+  path = helper_build_composite("SS", "/", vroot, JOURNAL_NAME);
+  journal_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+  free(path);
+  if (journal_fd == -1)
+    {
+      pthread_mutex_unlock(&journal_lock);
+      return -1;
+    }
+
+  res = journal_replay();
+  if (!res)
+    res = journal_checkpoint();
+  if (res == -1)
+    {
+      int error = errno;
+
+      journal_clear();
+      close(journal_fd);
+      journal_fd = -1;
+      errno = error;
+    }
+  pthread_mutex_unlock(&journal_lock);
+  return res;
+}
+
+/*
+ * Write everything that is still pending, and stop journaling. If that
+ * fails, the next mount replays the journal.
+ */
+void journal_close(void)
+{
+  pthread_mutex_lock(&journal_lock);
+  if (journal_fd != -1)
+    {
+      journal_checkpoint();
+      close(journal_fd);
+      journal_fd = -1;
+      journal_clear();
+    }
+  free(journal_root);
+  journal_root = NULL;
+  pthread_mutex_unlock(&journal_lock);
+}
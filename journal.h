@@ -0,0 +1,58 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#ifndef JOURNAL_H
+# define JOURNAL_H
+
+# include <stdint.h>
+# include <sys/types.h>
+
+# define JOURNAL_NAME		"journal"	/* In the version tree	*/
+# define JOURNAL_MAGIC		0x4C4E524AU	/* "JRNL"		*/
+# define JOURNAL_REMOVED	0xFFFFFFFFU	/* Size of a removal	*/
+# define JOURNAL_BUCKETS	1024		/* Pending files table	*/
+# define JOURNAL_FILES		4096		/* Files before a checkpoint */
+# define JOURNAL_BYTES		(8 << 20)	/* Bytes before a checkpoint */
+
+typedef struct journal_header_t	journal_header_t;
+typedef struct journal_entry_t	journal_entry_t;
+
+/*
+ * A record of the journal, followed by the path and the contents. These
+ * replace what the file holds past its first jh_offset bytes : all of it,
+ * unless the record only appends to the file.
+ */
+struct				journal_header_t
+{
+  uint32_t			jh_magic;	/* JOURNAL_MAGIC	*/
+  uint32_t			jh_path;	/* Bytes of the path	*/
+  uint32_t			jh_size;	/* Bytes of the file	*/
+  uint32_t			jh_offset;	/* Bytes kept before it	*/
+  uint64_t			jh_hash;	/* Of the whole record	*/
+};
+
+/* The contents a file has in the journal, and not on the disk yet */
+struct				journal_entry_t
+{
+  char				*je_path;	/* Real file name	*/
+  char				*je_data;	/* Contents, or NULL	*/
+  size_t			je_size;	/* Bytes		*/
+  int				je_exists;	/* Some file is there ?	*/
+  journal_entry_t		*je_next;	/* Next in the bucket	*/
+};
+
+int		journal_open(const char *vroot);
+void		journal_close(void);
+int		journal_write(const char *path, const char *data, size_t size);
+int		journal_extend(const char *path, const char *data,
+			       size_t size);
+int		journal_remove(const char *path);
+int		journal_read(const char *path, char **data, size_t *size);
+char		**journal_list(const char *dir, const char *prefix);
+
+#endif /* !JOURNAL_H */
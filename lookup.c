@@ -6,33 +6,199 @@
  * See the file COPYING.
 */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include "helper.h"
 #include "structs.h"
+#include "intern.h"
+#include "slab.h"
 #include "parse.h"
 #include "cache.h"
+#include "overlay.h"
 #include "rcs.h"
 
+char *rcs_version_path = "/home/widan/versions";
 
-/* Ignore delete flags */
-int rcs_ignore_deleted = 0;
+/*
+ * Note that the versions of a file changed : its index is rebuilt, and the
+ * versions that use the file of another one are counted. Its default version
+ * is looked for again, along with the serial of its file that
+ * rcs_entry_directory() reads without the lock. The caller holds the
+ * metadata's lock for writing, or is the only one to know about it yet.
+ */
+void rcs_versions_changed(metadata_t *metadata)
+{
+  version_t *version;
+  unsigned int count;
+
+  for (count = 0, version = metadata->md_versions; version;
+       version = version->v_next)
+    count++;
+  if (count != metadata->md_count)
+    {
+      free(metadata->md_index);
+      metadata->md_index = count ? safe_malloc(sizeof(version_t *) * count) :
+	NULL;
+      metadata->md_count = count;
+    }
+  metadata->md_borrowed = 0;
+  for (count = 0, version = metadata->md_versions; version;
+       version = version->v_next)
+    {
+      metadata->md_index[count++] = version;
+      if (version->v_file != version->v_vid)
+	metadata->md_borrowed++;
+    }
+  metadata->md_pinned = NULL;
+  version = rcs_find_version(metadata, LATEST, LATEST, RCS_SHOW_DELETED);
+  __atomic_store_n(&metadata->md_directory, version ? version->v_file : 0,
+		   __ATOMIC_RELEASE);
+}
+
+/*
+ * Get a version of a file from its index, or NULL if there is no such
+ * version. If svid is LATEST, it is the latest subversion of that version.
+ * The index is sorted like the list, newest first, so the search is for the
+ * first version that is not newer than the one asked for. The caller holds
+ * one of the metadata's locks.
+ */
+version_t *rcs_get_version(metadata_t *metadata, int vid, int svid)
+{
+  version_t *version;
+  unsigned int low, high, middle;
+
+  low = 0;
+  high = metadata->md_count;
+  while (low < high)
+    {
+      middle = low + (high - low) / 2;
+      version = metadata->md_index[middle];
+      if ((version->v_vid > (unsigned)vid) ||
+	  ((version->v_vid == (unsigned)vid) &&
+	   (version->v_svid > (unsigned)svid)))
+	low = middle + 1;
+      else
+	high = middle;
+    }
+  if (low == metadata->md_count)
+    return NULL;
+  version = metadata->md_index[low];
+  if ((version->v_vid != (unsigned)vid) ||
+      ((svid != LATEST) && (version->v_svid != (unsigned)svid)))
+    return NULL;
+  return version;
+}
+
+/*
+ * Get the first version, from the given one on in a list of versions, that
+ * uses the file of a version, or NULL. The versions that use a file are not
+ * older than the one it is named after, nor than the version itself.
+ */
+version_t *rcs_next_user(version_t *from, version_t *version)
+{
+  unsigned int oldest;
+
+  oldest = (version->v_file < version->v_vid) ? version->v_file :
+    version->v_vid;
+  for (; from && (from->v_vid >= oldest); from = from->v_next)
+    if (from->v_file == version->v_file)
+      return from;
+  return NULL;
+}
+
+/*
+ * Get the newest version of a file that uses the file of a version. Unless
+ * some versions use the file of another one, these are the version it is
+ * named after and its subversions, found from the index. The caller holds
+ * one of the metadata's locks.
+ */
+version_t *rcs_first_user(metadata_t *metadata, version_t *version)
+{
+  if (metadata->md_borrowed)
+    return rcs_next_user(metadata->md_versions, version);
+  return rcs_next_user(rcs_get_version(metadata, version->v_file, LATEST),
+		       version);
+}
+
+/*
+ * Compare two versions, packed with the serial of their file first, then
+ * their position.
+ */
+static int rcs_compare_users(const void *first, const void *second)
+{
+  uint64_t a, b;
+
+  a = *(const uint64_t *)first;
+  b = *(const uint64_t *)second;
+  return (a > b) - (a < b);
+}
+
+/*
+ * Find, for each version of a file by its position in the index, the
+ * position of the newest version that uses the same file : its own, unless
+ * a newer one does. A subversion made while an older version was pinned is
+ * a new version that uses the file of the pinned one, so the versions that
+ * share a file are not always next to each other. The caller holds one of
+ * the metadata's locks, and frees the array.
+ */
+unsigned int *rcs_newest_users(metadata_t *metadata)
+{
+  unsigned int *newest, i, first;
+  uint64_t *users;
+
+  users = safe_malloc(sizeof(uint64_t) * (metadata->md_count + 1));
+  newest = safe_malloc(sizeof(unsigned int) * (metadata->md_count + 1));
+  for (i = 0; i < metadata->md_count; i++)
+    users[i] = ((uint64_t)metadata->md_index[i]->v_file << 32) | i;
+  qsort(users, metadata->md_count, sizeof(uint64_t), rcs_compare_users);
+  for (first = 0, i = 0; i < metadata->md_count; i++)
+    {
+      if (!i || ((users[i] >> 32) != (users[i - 1] >> 32)))
+	first = (unsigned int)users[i];
+      newest[(unsigned int)users[i]] = first;
+    }
+  free(users);
+  return newest;
+}
+
+/*
+ * Look for a version and subversion of a file. A default version that is
+ * not there anymore gives the latest one.
+ */
+static version_t *rcs_search_version(metadata_t *metadata, int vid, int svid)
+{
+  version_t *version;
+
+  version = rcs_get_version(metadata, vid, svid);
 
+  /*
+   * If a default version makes no sense anymore, just use the real latest
+   * and ignore the default.
+   */
+  if (!version && (metadata->md_dfl_vid != LATEST))
+    return metadata->md_versions;
+  return version;
+}
 
 /*
  * Find a given version in a metadata set. If vid is LATEST, retrieves the
  * absolute latest version. If svid is LATEST and vid is not, retrieves the
  * latest subversion of that version, that is the latest revision of the
- * metadata.
+ * metadata. The latest version of a deleted file is only found with
+ * RCS_SHOW_DELETED. The caller has to hold the metadata's lock.
  */
-version_t *rcs_find_version(metadata_t *metadata, int vid, int svid)
+version_t *rcs_find_version(metadata_t *metadata, int vid, int svid,
+			    int deleted)
 {
   version_t *version;
 
-  version = metadata->md_versions;
-
   /* Latest version is first, else find version block */
   if (vid == LATEST)
     {
@@ -42,222 +208,460 @@ version_t *rcs_find_version(metadata_t *metadata, int vid, int svid)
        * version, as if it never existed (except the version number will be
        * higher than 1)
        */
-      if (metadata->md_deleted && !rcs_ignore_deleted)
+      if (metadata->md_deleted && (deleted != RCS_SHOW_DELETED))
 	return NULL;
 
+      /* Check if there is a pinned version */
+      if (metadata->md_dfl_vid == LATEST)
+	return metadata->md_versions;
+
       /*
-       * Check if there is a pinned version. If there is, we have a normal
-       * version search.
+       * It is only looked for once : whatever changes the versions or the
+       * default version forgets it, with the lock held for writing.
        */
-      if (metadata->md_dfl_vid == LATEST)
-	return version;
-      else
+      version = __atomic_load_n(&metadata->md_pinned, __ATOMIC_ACQUIRE);
+      if (!version)
 	{
-	  vid = metadata->md_dfl_vid;
-	  svid = metadata->md_dfl_svid;
+	  version = rcs_search_version(metadata, metadata->md_dfl_vid,
+				       metadata->md_dfl_svid);
+	  __atomic_store_n(&metadata->md_pinned, version, __ATOMIC_RELEASE);
 	}
+      return version;
     }
-  while (version && (version->v_vid > (unsigned)vid))
-    version = version->v_next;
+  return rcs_search_version(metadata, vid, svid);
+}
 
-  if (!version || (version->v_vid != (unsigned)vid))
-    {
-      /*
-       * If a default version makes no sense anymore, just use the real
-       * latest and ignore the default.
-       */
-      if (metadata->md_dfl_vid != LATEST)
-	return metadata->md_versions;
+/*
+ * Link a metadata block to its place in the tree, as the given entry of
+ * the parent directory.
+ */
+static void rcs_fixup_metadata_name(metadata_t *metadata, metadata_t *parent,
+				    const char *name)
+{
+  metadata->md_parent = parent;
+  metadata->md_name = intern_get(name);
+}
 
-      /* No such version */
-      return NULL;
-    }
+/*
+ * Get the metadata of the root directory. The root is special, since its
+ * metadata lives in the version directory itself.
+ */
+static metadata_t *rcs_translate_root(char *vroot)
+{
+  metadata_t *metadata;
+  version_t *last;
+  char metafile[PATH_MAX], dflfile[PATH_MAX];
 
-  /* Lookup subversion (ie metadata revision) */
-  if (svid == LATEST)
-    return version;
-  while (version && (version->v_vid == (unsigned)vid) &&
-	 (version->v_svid > (unsigned)svid))
-    version = version->v_next;
+  metadata = cache_get_child(NULL, "");
+  if (metadata)
+    return metadata;
 
-  if (!version || (version->v_vid != (unsigned)vid) ||
-      (version->v_svid != (unsigned)svid))
-    {
-      /*
-       * If the "default" version does not exist anymore, use the real
-       * default (it should never happen anyway)
-       */
-      if (metadata->md_dfl_vid != LATEST)
-	return metadata->md_versions;
+  metafile[0] = '\0';
+  dflfile[0] = '\0';
+  if (helper_append_path(metafile, "%s/metadata.", vroot) ||
+      helper_append_path(dflfile, "%s/dfl-meta.", vroot))
+    return NULL;
 
-      /* This subversion does not exist */
-      return NULL;
-    }
+  /* The root HAS to have metadata */
+  metadata = parse_metadata_file(metafile);
+  assert(metadata != NULL);
+  last = rcs_find_version(metadata, LATEST, LATEST, RCS_HIDE_DELETED);
+  assert(last != NULL);
 
-  return version;
+  /* Parse the default version file */
+  parse_default_file(dflfile, &metadata->md_dfl_vid,
+		     &metadata->md_dfl_svid);
+
+  /* Complete the metadata, its versions are all the version directory */
+  metadata->md_parent = NULL;
+  metadata->md_name = intern_get("");
+  return cache_add_metadata(metadata);
 }
 
 /*
- * Add the specified path to the versionned files in a metadata block.
+ * Build the real directory in which the files of an entry are, in a buffer
+ * of PATH_MAX bytes : the directory of the preferred version of its parent,
+ * which still holds them if the parent was removed since. It takes no lock,
+ * the serial of the file of each parent being kept by
+ * rcs_versions_changed(), so the caller may hold any lock of the entry.
+ * Returns non-zero on error.
  */
-static void rcs_fixup_metadata_paths(metadata_t *metadata, char *path)
+int rcs_entry_directory(metadata_t *metadata, char *buffer)
 {
-  version_t *version;
+  metadata_t *parent;
+  unsigned int serial;
 
-  for (version = metadata->md_versions; version; version = version->v_next)
+  /* The root and its entries are in the version directory itself */
+  parent = metadata->md_parent;
+  if (!parent || !parent->md_parent)
     {
-      char *new;
+      buffer[0] = '\0';
+      return helper_append_path(buffer, "%s", rcs_version_path);
+    }
 
-      new = helper_build_composite("SS", "/", path, version->v_rfile);
-      free(version->v_rfile);
-      version->v_rfile = new;
+  serial = __atomic_load_n(&parent->md_directory, __ATOMIC_ACQUIRE);
+  if (!serial)
+    {
+      errno = ENOENT;
+      return -1;
     }
+  if (rcs_entry_directory(parent, buffer) == -1)
+    return -1;
+  return helper_append_path(buffer, "/%08X.%s", serial, parent->md_name);
+}
+
+/*
+ * Build the real file of a version of a file in a buffer of PATH_MAX bytes.
+ * The versions of the root are the version directory itself. The caller
+ * holds the metadata's lock, or its update lock. Returns non-zero on error.
+ */
+int rcs_version_file(metadata_t *metadata, version_t *version, char *buffer)
+{
+  if (rcs_entry_directory(metadata, buffer) == -1)
+    return -1;
+  if (!metadata->md_parent)
+    return 0;
+  return helper_append_path(buffer, "/%08X.%s", version->v_file,
+			    metadata->md_name);
 }
 
 /*
- * Insert the given number of items from a path as a virtual file name
- * in the given metadata.
+ * Get a handle on the real directory of the files of an entry, and build
+ * the name of the file of one of its versions in it, in a buffer of
+ * NAME_MAX + 1 bytes, to reach it with the calls relative to a directory.
+ * The version of the root is the directory itself. The handle is given
+ * back with dircache_put(). Same locking as rcs_version_file(). Returns
+ * NULL on error.
  */
-static void rcs_fixup_metadata_vfile(metadata_t *metadata, char **elements,
-				     unsigned int count)
+dircache_t *rcs_version_at(metadata_t *metadata, version_t *version,
+			   char *name)
 {
-  unsigned int i;
+  char directory[PATH_MAX];
+  int length;
 
-  /* Make a copy of the proper portion of the path elements */
-  metadata->md_vpath = safe_malloc(sizeof(char *) * (count + 1));
-  for (i = 0; i < count; i++)
-    metadata->md_vpath[i] = safe_strdup(elements[i]);
-  metadata->md_vpath[i] = NULL;
+  if (rcs_entry_directory(metadata, directory) == -1)
+    return NULL;
+  if (!metadata->md_parent)
+    length = snprintf(name, NAME_MAX + 1, ".");
+  else
+    length = snprintf(name, NAME_MAX + 1, "%08X.%s", version->v_file,
+		      metadata->md_name);
+  if (length > NAME_MAX)
+    {
+      errno = ENAMETOOLONG;
+      return NULL;
+    }
+  return dircache_get(directory);
+}
 
-  /* Build the composite path */
-  metadata->md_vfile = helper_build_composite("-A", "/", metadata->md_vpath);
+/*
+ * Open the real file of a version, relative to the handle on its directory,
+ * with the flags of an open of the file. O_APPEND is left out : the writes
+ * give their offset, that pwrite() would ignore, and the kernel already
+ * makes an append write at the end of the file. The top layer of an overlay
+ * is not as long as the file anyway. Same locking as rcs_version_file().
+ * Returns -1 on error.
+ */
+int rcs_open_version(metadata_t *metadata, version_t *version, int flags)
+{
+  dircache_t *directory;
+  char name[NAME_MAX + 1];
+  int fd;
+
+  directory = rcs_version_at(metadata, version, name);
+  if (!directory)
+    return -1;
+  fd = openat(directory->dc_fd, name, flags & ~O_APPEND);
+  dircache_put(directory);
+  return fd;
 }
 
 /*
- * Translate a path in the virtual filesystem to the real path of the
- * versionned file, assuming a given version directory. This does the
- * translation level by level, at each time using the preferred version
- * of the file.
+ * Build the real directory in which the entries of a directory are stored,
+ * using its preferred version, in a buffer of PATH_MAX bytes. The caller
+ * holds the directory's lock. Returns non-zero on error, or if the
+ * directory was removed.
  */
-char *rcs_translate_path(const char *virtual, char *vroot)
+int rcs_directory(metadata_t *directory, char *buffer)
 {
-  char **elements, *path;
-  unsigned int i;
-  int base;
-  metadata_t *metadata;
   version_t *version;
 
-  /* The root directory is special */
-  if (!strcmp(virtual, "/"))
+  version = rcs_find_version(directory, LATEST, LATEST, RCS_HIDE_DELETED);
+  if (!version)
     {
-      version_t *last;
-      char *metafile, *dflfile;
-
-      metadata = cache_get_metadata(virtual);
-      if (metadata)
-	{
-	  version = rcs_find_version(metadata, LATEST, LATEST);
-	  return safe_strdup(version->v_rfile);
-	}
-
-      metafile = helper_build_composite("SS", "/", vroot, "metadata.");
-      dflfile = helper_build_composite("SS", "/", vroot, "dfl-meta.");
+      errno = ENOENT;
+      return -1;
+    }
+  return rcs_version_file(directory, version, buffer);
+}
 
-      /* The root HAS to have metadata */
-      metadata = parse_metadata_file(metafile);
-      assert(metadata != NULL);
-      last = rcs_find_version(metadata, LATEST, LATEST);
-      assert(last != NULL);
+/*
+ * Build an entry saying that a directory has no file with the given name, so
+ * that looking it up again does not need to go to the disk. Such a negative
+ * entry has no versions, and its default version fields hold the version of
+ * the directory it was checked against, since locking or recreating the
+ * directory changes what it contains.
+ */
+static metadata_t *rcs_new_negative(metadata_t *parent, const char *name,
+				    version_t *directory)
+{
+  metadata_t *metadata;
 
-      /* Parse the default version file */
-      parse_default_file(dflfile, &metadata->md_dfl_vid,
-			 &metadata->md_dfl_svid);
+  metadata = slab_alloc(&slab_metadata);
+  metadata->md_versions = NULL;
+  metadata->md_index = NULL;
+  metadata->md_count = 0;
+  metadata->md_borrowed = 0;
+  metadata->md_deleted = 1;
+  metadata->md_negative = 1;
+  metadata->md_writers = 0;
+  metadata->md_partial = 0;
+  metadata->md_appendable = 0;
+  metadata->md_dfl_vid = directory->v_vid;
+  metadata->md_dfl_svid = directory->v_svid;
+  metadata->md_pinned = NULL;
+  metadata->md_timestamp = 0;
+  rcs_fixup_metadata_name(metadata, parent, name);
+  return metadata;
+}
 
-      free(metafile);
-      free(dflfile);
+/*
+ * Get the metadata of an entry of a directory, from the cache, or from the
+ * disk if it is not cached yet (it is then added to the cache). It returns
+ * deleted entries too, it is up to the caller to check. The metadata is
+ * returned referenced.
+ */
+metadata_t *rcs_lookup(metadata_t *parent, const char *name)
+{
+  metadata_t *metadata;
+  version_t *directory;
+  char path[PATH_MAX];
 
-      /* Complete the metadata */
-      metadata->md_vpath = safe_malloc(sizeof(char *));
-      metadata->md_vpath[0] = NULL;
+  metadata = cache_get_child(parent, name);
+  if (metadata && !metadata->md_negative)
+    return metadata;
 
-      for (version = metadata->md_versions; version; version = version->v_next)
+  /* Retrieve our metadata in the directory's preferred version */
+  pthread_rwlock_rdlock(&parent->md_lock);
+  directory = rcs_find_version(parent, LATEST, LATEST, RCS_HIDE_DELETED);
+  if (metadata)
+    {
+      /* Known not to exist, unless the directory changed since */
+      if (!directory ||
+	  (((unsigned)metadata->md_dfl_vid == directory->v_vid) &&
+	   ((unsigned)metadata->md_dfl_svid == directory->v_svid)))
 	{
-	  free(version->v_rfile);
-	  version->v_rfile = safe_strdup(vroot);
+	  pthread_rwlock_unlock(&parent->md_lock);
+	  cache_release_metadata(metadata);
+	  return NULL;
 	}
-      metadata->md_vfile = safe_strdup("/");
-      cache_add_metadata(metadata);
-      return safe_strdup(last->v_rfile);
+      cache_drop_metadata(metadata);
+      cache_release_metadata(metadata);
+    }
+  if (!directory || (rcs_version_file(parent, directory, path) == -1))
+    {
+      pthread_rwlock_unlock(&parent->md_lock);
+      return NULL;
     }
 
-  /* Get path elements */
-  elements = helper_split_to_array(virtual, '/');
-
-  /* Try to get a starting point from the cache, the more advanced possible */
-  base = cache_find_maximal_match(elements, &metadata);
-  if (base > 0)
+  metadata = parse_metadata_for_file(path, name);
+  if (metadata)
     {
-      version = rcs_find_version(metadata, LATEST, LATEST);
-      if (!version)
-	{
-	  helper_free_array(elements);
-	  return NULL;
-	}
-      path = version->v_rfile;
+      /* Fixup this metadata */
+      rcs_fixup_metadata_name(metadata, parent, name);
     }
   else
+    metadata = rcs_new_negative(parent, name, directory);
+  pthread_rwlock_unlock(&parent->md_lock);
+
+  /* Add it to the cache, unless another thread was faster */
+  metadata = cache_add_metadata(metadata);
+  if (metadata->md_negative)
+    {
+      cache_release_metadata(metadata);
+      return NULL;
+    }
+  return metadata;
+}
+
+/*
+ * Read the versions of a file that its lookup left on the disk, for the
+ * callers that walk its whole history. They go after the oldest version
+ * known so far, since newer ones may have been added meanwhile. The caller
+ * holds the metadata's update lock, since the others walk the versions with
+ * it only, but not its lock. Returns non-zero on error.
+ */
+int rcs_load_history(metadata_t *metadata)
+{
+  metadata_t *history;
+  version_t *last, *version, *next;
+  char metapath[PATH_MAX];
+
+  if (!__atomic_load_n(&metadata->md_partial, __ATOMIC_ACQUIRE))
+    return 0;
+  pthread_rwlock_wrlock(&metadata->md_lock);
+  if (!metadata->md_partial)
     {
-      path = vroot;
-      base = 0;
+      pthread_rwlock_unlock(&metadata->md_lock);
+      return 0;
     }
 
-  /* Iterate from the root onwards */
-  for (i = base; elements[i]; i++)
+  /* Only the entries of a directory are read partially */
+  history = NULL;
+  if (!rcs_entry_directory(metadata, metapath) &&
+      !helper_append_path(metapath, "/metadata.%s", metadata->md_name))
+    history = parse_metadata_file(metapath);
+  if (!history)
     {
-      /* Retrieve our metadata and find the proper version */
-      metadata = parse_metadata_for_file(path, elements[i]);
-      if (!metadata)
+      pthread_rwlock_unlock(&metadata->md_lock);
+      errno = ENOENT;
+      return -1;
+    }
+
+  /* Link the versions older than the ones we have, and drop the others */
+  for (last = metadata->md_versions; last->v_next; last = last->v_next)
+    ;
+  for (version = history->md_versions; version; version = version->v_next)
+    if ((version->v_vid == last->v_vid) && (version->v_svid == last->v_svid))
+      {
+	last->v_next = version->v_next;
+	version->v_next = NULL;
+	break;
+      }
+  for (version = history->md_versions; version; version = next)
+    {
+      next = version->v_next;
+      slab_free(version);
+    }
+  slab_free(history);
+
+  /* A default version that was not read yet may be there now */
+  rcs_versions_changed(metadata);
+
+  __atomic_store_n(&metadata->md_partial, 0, __ATOMIC_RELEASE);
+  cache_update_metadata(metadata);
+  pthread_rwlock_unlock(&metadata->md_lock);
+  return 0;
+}
+
+/*
+ * Check if a file is visible, with the given visibility of deleted files.
+ */
+static int rcs_exists(metadata_t *metadata, int deleted)
+{
+  version_t *version;
+
+  pthread_rwlock_rdlock(&metadata->md_lock);
+  version = rcs_find_version(metadata, LATEST, LATEST, deleted);
+  pthread_rwlock_unlock(&metadata->md_lock);
+  return version != NULL;
+}
+
+/*
+ * Translate a path in the virtual filesystem to the metadata of the
+ * versionned file, assuming a given version directory. This walks the tree
+ * component by component from the root, at each level using the preferred
+ * version of the directory, and reading from the disk only the levels that
+ * are not cached yet. The metadata is returned referenced.
+ */
+static metadata_t *rcs_translate_worker(const char *virtual, char *vroot,
+					int deleted)
+{
+  metadata_t *metadata, *child;
+  char name[NAME_MAX + 1];
+  const char *element;
+  size_t length;
+
+  metadata = rcs_translate_root(vroot);
+  if (!metadata)
+    return NULL;
+
+  /* The components are looked up in place, one at a time */
+  for (element = helper_next_component(virtual, '/', &length); element;
+       element = helper_next_component(element + length, '/', &length))
+    {
+      if (length > NAME_MAX)
 	{
-	  helper_free_array(elements);
+	  cache_release_metadata(metadata);
+	  errno = ENAMETOOLONG;
 	  return NULL;
 	}
-      version = rcs_find_version(metadata, LATEST, LATEST);
-      if (!version)
+      memcpy(name, element, length);
+      name[length] = '\0';
+
+      child = rcs_lookup(metadata, name);
+      cache_release_metadata(metadata);
+      if (!child)
+	return NULL;
+      metadata = child;
+
+      /* Deleted files and directories are not there (unless asked for) */
+      if (!rcs_exists(metadata, deleted))
 	{
-	  helper_free_array(elements);
-	  rcs_free_metadata(metadata);
+	  cache_release_metadata(metadata);
 	  return NULL;
 	}
+    }
 
-      /* Fixup this metadata, and add it to the cache */
-      rcs_fixup_metadata_paths(metadata, path);
-      rcs_fixup_metadata_vfile(metadata, elements, i + 1);
-      cache_add_metadata(metadata);
+  return metadata;
+}
 
-      /* Get the new path from there */
-      path = version->v_rfile;
+/*
+ * Translate a path in the virtual filesystem to the real path of the
+ * versionned file, assuming a given version directory, in a buffer of
+ * PATH_MAX bytes. Returns non-zero if there is no such file.
+ */
+int rcs_translate_path(const char *virtual, char *vroot, char *buffer)
+{
+  metadata_t *metadata;
+  version_t *version;
+  int res;
+
+  metadata = rcs_translate_worker(virtual, vroot, RCS_HIDE_DELETED);
+  if (!metadata)
+    return -1;
+  pthread_rwlock_rdlock(&metadata->md_lock);
+  version = rcs_find_version(metadata, LATEST, LATEST, RCS_HIDE_DELETED);
+  if (!version)
+    {
+      errno = ENOENT;
+      res = -1;
     }
-
-  /* If we got there, we found it, so return it */
-  helper_free_array(elements);
-  return safe_strdup(path);
+  else
+    res = rcs_version_file(metadata, version, buffer);
+  pthread_rwlock_unlock(&metadata->md_lock);
+  cache_release_metadata(metadata);
+  return res;
 }
 
 /*
- * Get the metadata structure associated with a virtual file.
+ * Get the metadata structure associated with a virtual file. The result
+ * is referenced, and has to be given back with cache_release_metadata().
  */
-metadata_t *rcs_translate_to_metadata(const char *vfile, char *vroot)
+metadata_t *rcs_translate_to_metadata(const char *vfile, char *vroot,
+				      int deleted)
 {
-  char *path;
+  return rcs_translate_worker(vfile, vroot, deleted);
+}
 
-  path = rcs_translate_path(vfile, vroot);
-  if (!path)
-    return NULL;
-  free(path);
+/*
+ * Free a metadata block and its versions, once nobody uses it anymore.
+ */
+void rcs_free_metadata(metadata_t *metadata)
+{
+  version_t *version, *next;
 
-  /*
-   * Lookup the metadata that got put in the cache. It can't have been removed
-   * yet, since cache cleaning is only done on insertions.
-   */
-  return cache_get_metadata(vfile);
+  version = metadata->md_versions;
+  while (version)
+    {
+      next = version->v_next;
+      overlay_put(version->v_overlay);
+      slab_free(version);
+      version = next;
+    }
+  free(metadata->md_index);
+  pthread_rwlock_destroy(&metadata->md_lock);
+  pthread_mutex_destroy(&metadata->md_update);
+  intern_put(metadata->md_name);
+  slab_free(metadata);
 }
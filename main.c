@@ -13,32 +13,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 
 #include "helper.h"
 #include "structs.h"
 #include "cache.h"
 #include "create.h"
-
-char *rcs_version_path = "/home/widan/versions";
-
-void rcs_free_metadata(metadata_t *metadata)
-{
-  version_t *version, *next;
-
-  version = metadata->md_versions;
-  while (version)
-    {
-      next = version->v_next;
-      free(version->v_rfile);
-      free(version);
-      version = next;
-    }
-  if (metadata->md_vpath)
-    helper_free_array(metadata->md_vpath);
-  free(metadata->md_vfile);
-  free(metadata);
-}
+#include "rcs.h"
+#include "dircache.h"
+#include "delta.h"
+#include "chunk.h"
+#include "compress.h"
+#include "retain.h"
+#include "journal.h"
+#include "catalog.h"
 
 #if 0
 void set_config()
@@ -61,10 +49,21 @@ int main(int argc, char *argv[])
 #endif
 
 
-extern struct fuse_operations callback_oper;
+extern struct fuse_lowlevel_ops callback_oper;
 
 int main(int argc, char **argv)
 {
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  struct fuse_cmdline_opts opts;
+  struct fuse_session *session;
+  retain_policy_t policy;
+  unsigned int cache_items, delta_depth;
+  size_t cache_bytes;
+  time_t compress_age;
+  metadata_t *root;
+  char *value;
+  int compress_level, res;
+
   rcs_version_path = getenv("RCS_VERSION_PATH");
   if (!rcs_version_path)
     {
@@ -73,11 +72,124 @@ int main(int argc, char **argv)
       exit(1);
     }
 
+  if (fuse_parse_cmdline(&args, &opts) != 0)
+    exit(1);
+  if (opts.show_help)
+    {
+      printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+      fuse_cmdline_help();
+      fuse_lowlevel_help();
+      exit(0);
+    }
+  else if (opts.show_version)
+    {
+      fuse_lowlevel_version();
+      exit(0);
+    }
+  else if (!opts.mountpoint)
+    {
+      fprintf(stderr, "usage: %s [options] <mountpoint>\n", argv[0]);
+      exit(1);
+    }
+
   /* Restrict permissions on create files */
   umask(0077);
 
-  cache_initialize();
-  fuse_main(argc, argv, &callback_oper);
+  /* Cache limits, zero (or not set) meaning the default */
+  cache_items = 0;
+  cache_bytes = 0;
+  if ((value = getenv("RCS_CACHE_SIZE")))
+    cache_items = strtoul(value, NULL, 0);
+  if ((value = getenv("RCS_CACHE_BYTES")))
+    cache_bytes = strtoul(value, NULL, 0);
+
+  cache_initialize(cache_items, cache_bytes);
+
+  /* Real directories kept open for the versions, zero meaning the default */
+  value = getenv("RCS_DIR_FDS");
+  dircache_setup(value ? strtoul(value, NULL, 0) : 0);
+
+  /* Longest chain of deltas for the old versions, zero keeping them whole */
+  delta_depth = DELTA_DEPTH;
+  if ((value = getenv("RCS_DELTA_DEPTH")))
+    delta_depth = strtoul(value, NULL, 0);
+
+  /* Old versions of large files may be cut in shared chunks */
+  value = getenv("RCS_CHUNKS");
+  chunk_setup(value && strcmp(value, "0"));
+
+  /* Old versions may be compressed once they have been left alone a while */
+  compress_level = COMPRESS_LEVEL;
+  compress_age = COMPRESS_AGE;
+  if ((value = getenv("RCS_COMPRESS_LEVEL")))
+    compress_level = strtol(value, NULL, 0);
+  if ((value = getenv("RCS_COMPRESS_AGE")))
+    compress_age = strtol(value, NULL, 0);
+  compress_setup(compress_level, compress_age);
+
+  /* How much history is kept, unless a file or directory says otherwise */
+  memset(&policy, 0, sizeof(retain_policy_t));
+  if ((value = getenv("RCS_KEEP_VERSIONS")))
+    policy.rp_versions = strtoul(value, NULL, 0);
+  if ((value = getenv("RCS_KEEP_BYTES")))
+    policy.rp_bytes = strtoull(value, NULL, 0);
+  if ((value = getenv("RCS_KEEP_AGE")))
+    policy.rp_age = strtol(value, NULL, 0);
+  retain_setup(&policy);
+
+  /* One catalog per directory instead of files per entry, once asked for */
+  value = getenv("RCS_CATALOG");
+  if (catalog_setup(rcs_version_path, value && strcmp(value, "0")) == -1)
+    {
+      fprintf(stderr, "Can't create the catalog in %s.\n", rcs_version_path);
+      exit(1);
+    }
+
+  /* Metadata updates go through the journal, replayed after a crash */
+  if (journal_open(rcs_version_path) == -1)
+    {
+      fprintf(stderr, "Can't open the journal in %s.\n", rcs_version_path);
+      exit(1);
+    }
+
+  /* The root is always known by the kernel, so it stays referenced */
+  root = rcs_translate_to_metadata("/", rcs_version_path, RCS_HIDE_DELETED);
+  if (!root)
+    {
+      fprintf(stderr, "No root metadata in %s.\n", rcs_version_path);
+      exit(1);
+    }
+
+  res = 1;
+  session = fuse_session_new(&args, &callback_oper, sizeof(callback_oper),
+			     root);
+  if (session)
+    {
+      if (fuse_set_signal_handlers(session) == 0)
+	{
+	  if (fuse_session_mount(session, opts.mountpoint) == 0)
+	    {
+	      fuse_daemonize(opts.foreground);
+	      delta_start(delta_depth);
+	      retain_start(root);
+	      if (opts.singlethread)
+		res = fuse_session_loop(session);
+	      else
+		res = fuse_session_loop_mt(session, opts.clone_fd);
+	      retain_stop();
+	      delta_stop();
+	      fuse_session_unmount(session);
+	    }
+	  fuse_remove_signal_handlers(session);
+	}
+      fuse_session_destroy(session);
+    }
+
+  free(opts.mountpoint);
+  fuse_opt_free_args(&args);
+  cache_release_metadata(root);
   cache_finalize();
-  exit(0);
+  dircache_finalize();
+  journal_close();
+  exit(res ? 1 : 0);
 }
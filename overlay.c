@@ -0,0 +1,1288 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "helper.h"
+#include "structs.h"
+#include "rcs.h"
+#include "create.h"
+#include "overlay.h"
+#include "store.h"
+#include "chunk.h"
+#include "compress.h"
+
+/*
+ * A new version of a large file does not need a copy of the whole file : an
+ * overlay version is a sparse file of the same size, that only holds the
+ * blocks written since the version was created. Which blocks those are is
+ * recorded in a map file next to it, named extents.<version file>, that also
+ * tells which version the other blocks come from. That base version may be
+ * an overlay itself, so the layers are stacked until a version holding all
+ * its data, but never more than OVERLAY_DEPTH overlays high.
+ *
+ * Only the newest version of a file is written to, so only the top layer of
+ * a chain changes, and its map lock is the only one to take. The maps are
+ * loaded the first time a version is used, and the overlay_lock guards that
+ * and the reference counts.
+ *
+ * An old version may also be kept as a list of chunks of the object store
+ * (see chunk.c) : its file is then as sparse as an overlay holding nothing,
+ * its map file lists where each chunk ends, and the chunks are links in a
+ * directory named chunks.<version file>. It is the bottom layer of the
+ * chains it is in, and is never written to.
+ */
+
+static pthread_mutex_t overlay_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Free an overlay when nothing uses it anymore. The caller holds the
+ * overlay_lock.
+ */
+static void overlay_unref(overlay_t *overlay)
+{
+  if (!overlay || --overlay->o_refcount)
+    return;
+  close(overlay->o_mapfd);
+  if (overlay->o_framefd != -1)
+    close(overlay->o_framefd);
+  pthread_mutex_destroy(&overlay->o_lock);
+  if (overlay->o_discard)
+    chunk_remove(overlay->o_chunkdir);
+  free(overlay->o_chunkdir);
+  free(overlay->o_ends);
+  free(overlay->o_map);
+  free(overlay);
+}
+
+/*
+ * Allocate an overlay for a map file, without any block.
+ */
+static overlay_t *overlay_new(int mapfd, unsigned int base, off_t base_size)
+{
+  overlay_t *overlay;
+
+  overlay = safe_malloc(sizeof(overlay_t));
+  overlay->o_refcount = 1;
+  pthread_mutex_init(&overlay->o_lock, NULL);
+  overlay->o_mapfd = mapfd;
+  overlay->o_base = base;
+  overlay->o_base_size = base_size;
+  overlay->o_map = NULL;
+  overlay->o_bytes = 0;
+  overlay->o_chunkdir = NULL;
+  overlay->o_framefd = -1;
+  overlay->o_ends = NULL;
+  overlay->o_chunks = 0;
+  overlay->o_discard = 0;
+  return overlay;
+}
+
+/*
+ * Write the header of a map file. The caller holds the map lock, or is the
+ * only one to know about the overlay.
+ */
+static int overlay_write_header(overlay_t *overlay)
+{
+  overlay_header_t header;
+
+  memset(&header, 0, sizeof(overlay_header_t));
+  memcpy(header.oh_magic, OVERLAY_MAGIC, sizeof(header.oh_magic));
+  header.oh_base = overlay->o_base;
+  header.oh_base_size = overlay->o_base_size;
+  if (pwrite(overlay->o_mapfd, &header, sizeof(overlay_header_t), 0) !=
+      sizeof(overlay_header_t))
+    {
+      if (errno == 0)
+	errno = ENOSPC;
+      return -1;
+    }
+  return 0;
+}
+
+/*
+ * Load the list of a version holding its own data as chunks or compressed
+ * frames, given its map file. The caller is the only one to know about the
+ * overlay. A list is never empty, since only files of some size are split,
+ * so an empty one means the map is damaged.
+ */
+static int overlay_load_list(const char *rfile, overlay_t *overlay,
+			     off_t map_size, int frames)
+{
+  char *framefile;
+  size_t bytes;
+
+  bytes = sizeof(uint64_t) * overlay->o_chunks;
+  if (!overlay->o_chunks ||
+      (map_size != (off_t)(sizeof(overlay_header_t) + bytes)))
+    return -1;
+  overlay->o_ends = safe_malloc(bytes);
+  if (pread(overlay->o_mapfd, overlay->o_ends, bytes,
+	    sizeof(overlay_header_t)) != (ssize_t)bytes)
+    return -1;
+  if (!frames)
+    {
+      overlay->o_chunkdir = helper_get_sibling_name(rfile, "chunks");
+      return 0;
+    }
+  framefile = helper_get_sibling_name(rfile, "frames");
+  overlay->o_framefd = open(framefile, O_RDONLY);
+  free(framefile);
+  return (overlay->o_framefd == -1) ? -1 : 0;
+}
+
+/*
+ * Load the map file of a version. Sets *overlay to NULL if the version has
+ * all its data, and returns -1 if the map can't be read.
+ */
+static int overlay_load(const char *rfile, overlay_t **overlay)
+{
+  overlay_header_t header;
+  struct stat st_map;
+  char *mapfile;
+  int fd, chunked, frames;
+
+  mapfile = helper_get_sibling_name(rfile, "extents");
+  fd = open(mapfile, O_RDWR);
+  free(mapfile);
+  *overlay = NULL;
+  if (fd == -1)
+    return (errno == ENOENT) ? 0 : -1;
+
+  chunked = 0;
+  frames = 0;
+  if ((fstat(fd, &st_map) == -1) ||
+      (pread(fd, &header, sizeof(overlay_header_t), 0) !=
+       sizeof(overlay_header_t)) ||
+      (memcmp(header.oh_magic, OVERLAY_MAGIC, sizeof(header.oh_magic)) &&
+       !(chunked = !memcmp(header.oh_magic, OVERLAY_CHUNKED,
+			   sizeof(header.oh_magic))) &&
+       !(frames = !memcmp(header.oh_magic, OVERLAY_FRAMES,
+			  sizeof(header.oh_magic)))))
+    {
+      close(fd);
+      errno = EIO;
+      return -1;
+    }
+
+  if (chunked || frames)
+    {
+      *overlay = overlay_new(fd, 0, header.oh_base_size);
+      (*overlay)->o_chunks = header.oh_base;
+      if (overlay_load_list(rfile, *overlay, st_map.st_size, frames) == -1)
+	{
+	  overlay_unref(*overlay);
+	  *overlay = NULL;
+	  errno = EIO;
+	  return -1;
+	}
+      return 0;
+    }
+
+  *overlay = overlay_new(fd, header.oh_base, header.oh_base_size);
+  if (st_map.st_size > (off_t)sizeof(overlay_header_t))
+    {
+      (*overlay)->o_bytes = st_map.st_size - sizeof(overlay_header_t);
+      (*overlay)->o_map = safe_malloc((*overlay)->o_bytes);
+      if (pread(fd, (*overlay)->o_map, (*overlay)->o_bytes,
+		sizeof(overlay_header_t)) != (ssize_t)(*overlay)->o_bytes)
+	{
+	  overlay_unref(*overlay);
+	  *overlay = NULL;
+	  errno = EIO;
+	  return -1;
+	}
+    }
+  return 0;
+}
+
+/*
+ * Get a reference on the overlay of a version, or NULL if the version has
+ * all its data. The caller holds one of the metadata's locks.
+ */
+int overlay_get(metadata_t *metadata, version_t *version, overlay_t **overlay)
+{
+  version_t *sibling;
+  char rfile[PATH_MAX];
+
+  pthread_mutex_lock(&overlay_lock);
+  if (!version->v_probed)
+    {
+      /* Its name is built without holding the lock of all the overlays */
+      pthread_mutex_unlock(&overlay_lock);
+      if (rcs_version_file(metadata, version, rfile) == -1)
+	return -1;
+      pthread_mutex_lock(&overlay_lock);
+    }
+  if (!version->v_probed)
+    {
+      /* The versions that use the same file share its map */
+      for (sibling = rcs_first_user(metadata, version); sibling;
+	   sibling = rcs_next_user(sibling->v_next, version))
+	if ((sibling != version) && sibling->v_probed)
+	  break;
+      if (sibling)
+	{
+	  version->v_overlay = sibling->v_overlay;
+	  if (version->v_overlay)
+	    version->v_overlay->o_refcount++;
+	}
+      else if (overlay_load(rfile, &version->v_overlay) == -1)
+	{
+	  pthread_mutex_unlock(&overlay_lock);
+	  return -1;
+	}
+      version->v_probed = 1;
+    }
+  *overlay = version->v_overlay;
+  if (*overlay)
+    (*overlay)->o_refcount++;
+  pthread_mutex_unlock(&overlay_lock);
+  return 0;
+}
+
+/*
+ * Give back a reference on an overlay.
+ */
+void overlay_put(overlay_t *overlay)
+{
+  pthread_mutex_lock(&overlay_lock);
+  overlay_unref(overlay);
+  pthread_mutex_unlock(&overlay_lock);
+}
+
+/*
+ * Check if an overlay is the chunk list of a chunked version, or the frame
+ * list of a compressed version, rather than the blocks of an overlay
+ * version : such a layer holds all the data of its version.
+ */
+int overlay_whole(overlay_t *overlay)
+{
+  return overlay && (overlay->o_chunkdir || (overlay->o_framefd != -1));
+}
+
+/*
+ * Create the map file of a new overlay version of a file, whose blocks all
+ * come from the given base version, up to base_size. The version file
+ * itself is created by the caller.
+ */
+int overlay_create(metadata_t *metadata, version_t *version,
+		   unsigned int base, off_t base_size)
+{
+  overlay_t *overlay;
+  char rfile[PATH_MAX], *mapfile;
+  int fd;
+
+  if (rcs_version_file(metadata, version, rfile) == -1)
+    return -1;
+  mapfile = helper_get_sibling_name(rfile, "extents");
+  fd = open(mapfile, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd == -1)
+    {
+      free(mapfile);
+      return -1;
+    }
+  overlay = overlay_new(fd, base, base_size);
+  if (overlay_write_header(overlay) == -1)
+    {
+      int error = errno;
+      unlink(mapfile);
+      free(mapfile);
+      overlay_put(overlay);
+      errno = error;
+      return -1;
+    }
+  free(mapfile);
+
+  version->v_overlay = overlay;
+  version->v_probed = 1;
+  return 0;
+}
+
+/*
+ * Remove the map file of a version, and its frame file if it is compressed.
+ * The chains using them keep their descriptors.
+ */
+static void overlay_unlink(const char *rfile)
+{
+  char *mapfile;
+
+  mapfile = helper_get_sibling_name(rfile, "extents");
+  unlink(mapfile);
+  free(mapfile);
+  mapfile = helper_get_sibling_name(rfile, "frames");
+  unlink(mapfile);
+  free(mapfile);
+}
+
+/*
+ * Forget the map of a version that does not need it anymore, because it
+ * was flattened or is being purged, along with the versions that use the
+ * same file. The chunks of a chunked version go away once the chains still
+ * reading them are closed. The caller holds the metadata's update lock.
+ */
+void overlay_remove(metadata_t *metadata, version_t *version)
+{
+  version_t *sibling;
+  char rfile[PATH_MAX];
+
+  if (!rcs_version_file(metadata, version, rfile))
+    overlay_unlink(rfile);
+
+  pthread_mutex_lock(&overlay_lock);
+  if (version->v_overlay && version->v_overlay->o_chunkdir)
+    version->v_overlay->o_discard = 1;
+  for (sibling = rcs_first_user(metadata, version); sibling;
+       sibling = rcs_next_user(sibling->v_next, version))
+    if (sibling != version)
+      {
+	overlay_unref(sibling->v_overlay);
+	sibling->v_overlay = NULL;
+	sibling->v_probed = 1;
+      }
+  overlay_unref(version->v_overlay);
+  version->v_overlay = NULL;
+  version->v_probed = 1;
+  pthread_mutex_unlock(&overlay_lock);
+}
+
+/*
+ * Remove the files of a version of a file that is being purged, along with
+ * the versions following it that use them : the caller checked that no
+ * version it keeps does. Its chunks, if it is a chunked version, go away
+ * once the chains still reading them are closed : its overlay is loaded to
+ * keep track of them, unless one of these versions already has it.
+ */
+void overlay_discard(metadata_t *metadata, version_t *version)
+{
+  version_t *sibling;
+  overlay_t *overlay;
+  char rfile[PATH_MAX];
+
+  if (rcs_version_file(metadata, version, rfile) == -1)
+    return;
+  pthread_mutex_lock(&overlay_lock);
+  for (sibling = rcs_next_user(version, version); sibling;
+       sibling = rcs_next_user(sibling->v_next, version))
+    if (sibling->v_probed)
+      break;
+  if (sibling)
+    overlay = sibling->v_overlay;
+  else if (overlay_load(rfile, &overlay) == 0)
+    {
+      version->v_overlay = overlay;
+      version->v_probed = 1;
+    }
+  else
+    overlay = NULL;
+  if (overlay && overlay->o_chunkdir)
+    overlay->o_discard = 1;
+  pthread_mutex_unlock(&overlay_lock);
+
+  store_unlink(rfile);
+  overlay_unlink(rfile);
+}
+
+/*
+ * Find the version an overlay is based on. It fails with EAGAIN if it may
+ * be one of the versions rcs_load_history() has not read yet.
+ */
+static version_t *overlay_find_base(metadata_t *metadata, overlay_t *overlay)
+{
+  version_t *version;
+
+  version = rcs_get_version(metadata, overlay->o_base, LATEST);
+  if (version)
+    return version;
+  errno = __atomic_load_n(&metadata->md_partial, __ATOMIC_ACQUIRE) ?
+    EAGAIN : EIO;
+  return NULL;
+}
+
+/*
+ * Count the overlays stacked from a version down to a version with all its
+ * data, stopping past OVERLAY_DEPTH. The caller holds one of the metadata's
+ * locks.
+ */
+int overlay_depth(metadata_t *metadata, version_t *version)
+{
+  overlay_t *overlay;
+  int depth;
+
+  for (depth = 0; depth <= OVERLAY_DEPTH; depth++)
+    {
+      if (overlay_get(metadata, version, &overlay) == -1)
+	return -1;
+      if (!overlay)
+	break;
+
+      /* A chunked or compressed version has nothing below it */
+      if (overlay_whole(overlay))
+	{
+	  overlay_put(overlay);
+	  return depth + 1;
+	}
+      version = overlay_find_base(metadata, overlay);
+      overlay_put(overlay);
+      if (!version)
+	return -1;
+    }
+  return depth;
+}
+
+/*
+ * Give back the layers of a chain.
+ */
+void overlay_close_chain(chain_t *chain)
+{
+  unsigned int i;
+
+  if (!chain)
+    return;
+  for (i = 0; i < chain->c_count; i++)
+    {
+      close(chain->c_fds[i]);
+      overlay_put(chain->c_overlays[i]);
+    }
+  free(chain->c_frame);
+  free(chain);
+}
+
+/*
+ * Open the layers a version is read from, given a descriptor of its file.
+ * Sets *chain to NULL if the version has all its data. The chain gets its
+ * own descriptors. The caller holds one of the metadata's locks.
+ */
+int overlay_open_chain(metadata_t *metadata, version_t *version, int fd,
+		       chain_t **chain)
+{
+  overlay_t *overlay;
+  char rfile[PATH_MAX];
+  int error;
+
+  *chain = NULL;
+  if (overlay_get(metadata, version, &overlay) == -1)
+    return -1;
+  if (!overlay)
+    return 0;
+
+  *chain = safe_malloc(sizeof(chain_t));
+  (*chain)->c_count = 0;
+  (*chain)->c_frame = NULL;
+  (*chain)->c_frame_layer = NULL;
+  while (1)
+    {
+      if (!(*chain)->c_count)
+	fd = dup(fd);
+      else if (rcs_version_file(metadata, version, rfile) == -1)
+	fd = -1;
+      else
+	fd = open(rfile, O_RDONLY);
+      if (fd == -1)
+	{
+	  overlay_put(overlay);
+	  break;
+	}
+      (*chain)->c_fds[(*chain)->c_count] = fd;
+      (*chain)->c_overlays[(*chain)->c_count++] = overlay;
+      if (!overlay || overlay_whole(overlay))
+	return 0;
+
+      /* Stacks deeper than the limit can only come from a damaged store */
+      version = overlay_find_base(metadata, overlay);
+      if (!version)
+	break;
+      if ((*chain)->c_count > OVERLAY_DEPTH)
+	{
+	  errno = EIO;
+	  break;
+	}
+      if (overlay_get(metadata, version, &overlay) == -1)
+	break;
+    }
+
+  error = errno;
+  overlay_close_chain(*chain);
+  *chain = NULL;
+  errno = error;
+  return -1;
+}
+
+/*
+ * Check if a block is held by an overlay.
+ */
+static int overlay_test(overlay_t *overlay, off_t block)
+{
+  if ((size_t)(block / 8) >= overlay->o_bytes)
+    return 0;
+  return (overlay->o_map[block / 8] >> (block % 8)) & 1;
+}
+
+/*
+ * Find the chunk of a chunked version that holds the data at the given
+ * offset, and open it. What is past the last chunk reads as zeroes from the
+ * version file.
+ */
+static int overlay_locate_chunk(overlay_t *overlay, off_t offset, off_t end,
+				extent_t *extent)
+{
+  unsigned int low, high, middle;
+  char name[16], *chunk;
+  off_t start;
+
+  low = 0;
+  high = overlay->o_chunks;
+  while (low < high)
+    {
+      middle = low + (high - low) / 2;
+      if ((off_t)overlay->o_ends[middle] <= offset)
+	low = middle + 1;
+      else
+	high = middle;
+    }
+  if (low == overlay->o_chunks)
+    {
+      extent->e_zero = 1;
+      extent->e_length = end - offset;
+      return 0;
+    }
+
+  start = low ? (off_t)overlay->o_ends[low - 1] : 0;
+  if (end > (off_t)overlay->o_ends[low])
+    end = overlay->o_ends[low];
+  sprintf(name, "%08X", low);
+  chunk = helper_build_composite("SS", "/", overlay->o_chunkdir, name);
+  extent->e_fd = open(chunk, O_RDONLY);
+  free(chunk);
+  if (extent->e_fd == -1)
+    return -1;
+  extent->e_owned = 1;
+  extent->e_position = offset - start;
+  extent->e_length = end - offset;
+  return 0;
+}
+
+/*
+ * Find the frame of a compressed version that holds the data at the given
+ * offset, and give the extent its own copy of the data, up to the end of the
+ * frame. The chain keeps the last frame it decompressed, since reads tend to
+ * follow each other. What is past the last frame reads as zeroes from the
+ * version file.
+ */
+static int overlay_locate_frame(chain_t *chain, overlay_t *overlay,
+				off_t offset, off_t end, extent_t *extent)
+{
+  unsigned int frame;
+  ssize_t size;
+  off_t start;
+
+  frame = offset / COMPRESS_FRAME;
+  if (frame >= overlay->o_chunks)
+    {
+      extent->e_zero = 1;
+      extent->e_length = end - offset;
+      return 0;
+    }
+
+  if ((chain->c_frame_layer != overlay) || (chain->c_frame_index != frame))
+    {
+      if (!chain->c_frame)
+	chain->c_frame = safe_malloc(COMPRESS_FRAME);
+      chain->c_frame_layer = NULL;
+      size = compress_load_frame(overlay->o_framefd,
+				 frame ? overlay->o_ends[frame - 1] : 0,
+				 overlay->o_ends[frame], chain->c_frame);
+      if (size == -1)
+	return -1;
+      chain->c_frame_layer = overlay;
+      chain->c_frame_index = frame;
+      chain->c_frame_size = size;
+    }
+
+  start = (off_t)frame * COMPRESS_FRAME;
+  if (end > start + (off_t)chain->c_frame_size)
+    end = start + chain->c_frame_size;
+  if (end <= offset)
+    {
+      errno = EIO;
+      return -1;
+    }
+  extent->e_length = end - offset;
+  extent->e_data = safe_malloc(extent->e_length);
+  memcpy(extent->e_data, chain->c_frame + (offset - start),
+	 extent->e_length);
+  return 0;
+}
+
+/*
+ * Find where the data of a file starts at the given offset, and how far it
+ * goes on in the same layer, up to end. Data that was never written reads as
+ * zeroes from the holes of the layer. The extent gets its own descriptor if
+ * it is in a chunk, or its own copy of the data if it is in a compressed
+ * frame. The caller holds the top map's lock.
+ */
+static int overlay_locate(chain_t *chain, off_t offset, off_t end,
+			  extent_t *extent)
+{
+  overlay_t *overlay;
+  off_t block, next;
+  unsigned int i;
+  int present;
+
+  extent->e_offset = offset;
+  extent->e_position = offset;
+  extent->e_zero = 0;
+  extent->e_owned = 0;
+  extent->e_data = NULL;
+  for (i = 0; i < chain->c_count; i++)
+    {
+      overlay = chain->c_overlays[i];
+      extent->e_fd = chain->c_fds[i];
+      if (!overlay)
+	break;
+      if (overlay->o_chunkdir)
+	return overlay_locate_chunk(overlay, offset, end, extent);
+      if (overlay->o_framefd != -1)
+	return overlay_locate_frame(chain, overlay, offset, end, extent);
+
+      /* Stop at the end of the blocks this layer holds, or does not hold */
+      block = offset / OVERLAY_BLOCK;
+      present = overlay_test(overlay, block);
+      for (next = block + 1; next * OVERLAY_BLOCK < end; next++)
+	if (overlay_test(overlay, next) != present)
+	  {
+	    end = next * OVERLAY_BLOCK;
+	    break;
+	  }
+      if (present)
+	break;
+
+      /* The base was shorter, or was truncated in this layer */
+      if (offset >= overlay->o_base_size)
+	{
+	  extent->e_zero = 1;
+	  break;
+	}
+      if (end > overlay->o_base_size)
+	end = overlay->o_base_size;
+    }
+  extent->e_length = end - offset;
+  return 0;
+}
+
+/*
+ * Find the extents of the layers the given range of a file has to be read
+ * from, stopping at the end of the file. Returns their count, or -1. The
+ * array has to be given back with overlay_free_extents().
+ */
+int overlay_map_range(chain_t *chain, off_t offset, size_t size,
+		      extent_t **extents)
+{
+  struct stat st_data;
+  unsigned int count, allocated;
+  off_t end;
+
+  pthread_mutex_lock(&chain->c_overlays[0]->o_lock);
+  if (fstat(chain->c_fds[0], &st_data) == -1)
+    {
+      pthread_mutex_unlock(&chain->c_overlays[0]->o_lock);
+      return -1;
+    }
+  end = offset + size;
+  if (end > st_data.st_size)
+    end = st_data.st_size;
+
+  allocated = 4;
+  *extents = safe_malloc(sizeof(extent_t) * allocated);
+  for (count = 0; offset < end; count++)
+    {
+      if (count == allocated)
+	{
+	  allocated *= 2;
+	  *extents = safe_realloc(*extents, sizeof(extent_t) * allocated);
+	}
+      if (overlay_locate(chain, offset, end, *extents + count) == -1)
+	{
+	  int error = errno;
+	  pthread_mutex_unlock(&chain->c_overlays[0]->o_lock);
+	  overlay_free_extents(*extents, count);
+	  errno = error;
+	  return -1;
+	}
+      offset += (*extents)[count].e_length;
+    }
+  pthread_mutex_unlock(&chain->c_overlays[0]->o_lock);
+  return count;
+}
+
+/*
+ * Give back the extents found by overlay_map_range().
+ */
+void overlay_free_extents(extent_t *extents, int count)
+{
+  int i;
+
+  for (i = 0; i < count; i++)
+    {
+      if (extents[i].e_owned)
+	close(extents[i].e_fd);
+      free(extents[i].e_data);
+    }
+  free(extents);
+}
+
+/*
+ * Read a whole range of a file, that the file may be too short for.
+ */
+static int overlay_read_buffer(int fd, char *buffer, size_t size,
+			       off_t offset)
+{
+  ssize_t res;
+
+  while (size)
+    {
+      res = pread(fd, buffer, size, offset);
+      if (res == -1 && errno == EINTR)
+	continue;
+      if (res == -1)
+	return -1;
+      if (res == 0)
+	{
+	  memset(buffer, 0, size);
+	  break;
+	}
+      buffer += res;
+      size -= res;
+      offset += res;
+    }
+  return 0;
+}
+
+/*
+ * Write a whole buffer at the given offset of a file.
+ */
+static int overlay_write_buffer(int fd, const char *buffer, size_t size,
+				off_t offset)
+{
+  ssize_t res;
+
+  while (size)
+    {
+      res = pwrite(fd, buffer, size, offset);
+      if (res == -1 && errno == EINTR)
+	continue;
+      if (res == -1)
+	return -1;
+      buffer += res;
+      size -= res;
+      offset += res;
+    }
+  return 0;
+}
+
+/*
+ * Read what a range of a file reads as, through the layers that hold it. The
+ * caller holds the top map's lock.
+ */
+static int overlay_read_layers(chain_t *chain, char *buffer, off_t start,
+			       off_t end)
+{
+  extent_t extent;
+  off_t offset;
+  int res;
+
+  for (offset = start; offset < end; offset += extent.e_length)
+    {
+      if (overlay_locate(chain, offset, end, &extent) == -1)
+	return -1;
+      res = 0;
+      if (extent.e_zero)
+	memset(buffer + (offset - start), 0, extent.e_length);
+      else if (extent.e_data)
+	memcpy(buffer + (offset - start), extent.e_data, extent.e_length);
+      else
+	res = overlay_read_buffer(extent.e_fd, buffer + (offset - start),
+				  extent.e_length, extent.e_position);
+      if (extent.e_owned)
+	close(extent.e_fd);
+      free(extent.e_data);
+      if (res == -1)
+	return -1;
+    }
+  return 0;
+}
+
+/*
+ * Copy what a block of the top layer reads as, before it gets partially
+ * written. Nothing past the end of the file needs to be copied. The caller
+ * holds the top map's lock.
+ */
+static int overlay_copy_block(chain_t *chain, off_t block, off_t size)
+{
+  char buffer[OVERLAY_BLOCK];
+  off_t start, end;
+
+  start = block * OVERLAY_BLOCK;
+  end = start + OVERLAY_BLOCK;
+  if (end > size)
+    end = size;
+  if (start >= end)
+    return 0;
+
+  if (overlay_read_layers(chain, buffer, start, end) == -1)
+    return -1;
+  return overlay_write_buffer(chain->c_fds[0], buffer, end - start, start);
+}
+
+/*
+ * Read a whole range of a version, through its chain if it has one, else
+ * from its descriptor. What is past the end of the file reads as zeroes.
+ */
+int overlay_read(chain_t *chain, int fd, char *buffer, size_t size,
+		 off_t offset)
+{
+  struct stat st_data;
+  off_t end;
+  int res;
+
+  if (!chain)
+    return overlay_read_buffer(fd, buffer, size, offset);
+
+  pthread_mutex_lock(&chain->c_overlays[0]->o_lock);
+  res = fstat(chain->c_fds[0], &st_data);
+  end = offset + size;
+  if (!res && end > st_data.st_size)
+    end = st_data.st_size;
+  if (!res && offset < end)
+    res = overlay_read_layers(chain, buffer, offset, end);
+  pthread_mutex_unlock(&chain->c_overlays[0]->o_lock);
+  if (!res && end < (off_t)(offset + size))
+    {
+      if (end < offset)
+	end = offset;
+      memset(buffer + (end - offset), 0, offset + size - end);
+    }
+  return res;
+}
+
+/*
+ * Make room in the map of an overlay for the given number of bytes. The
+ * caller holds the map lock.
+ */
+static void overlay_grow(overlay_t *overlay, size_t needed)
+{
+  size_t size;
+
+  if (needed <= overlay->o_bytes)
+    return;
+  size = overlay->o_bytes * 2;
+  if (size < needed)
+    size = needed;
+  overlay->o_map = safe_realloc(overlay->o_map, size);
+  memset(overlay->o_map + overlay->o_bytes, 0, size - overlay->o_bytes);
+  overlay->o_bytes = size;
+}
+
+/*
+ * Mark the given blocks as held by an overlay, and commit that to its map
+ * file. The caller holds the map lock.
+ */
+static int overlay_mark(overlay_t *overlay, off_t first, off_t last)
+{
+  size_t size;
+  off_t block;
+
+  overlay_grow(overlay, last / 8 + 1);
+  for (block = first; block <= last; block++)
+    overlay->o_map[block / 8] |= 1 << (block % 8);
+
+  size = last / 8 - first / 8 + 1;
+  return overlay_write_buffer(overlay->o_mapfd,
+			      (char *)overlay->o_map + first / 8, size,
+			      sizeof(overlay_header_t) + first / 8);
+}
+
+/*
+ * Write to the top layer of a chain. The first time a block is written,
+ * what it held before is copied in if it is only partially written, and it
+ * is marked as held by the overlay. If the write fails, the blocks it went
+ * to are not marked, so that they still read as before.
+ */
+ssize_t overlay_write(chain_t *chain, const char *buffer, size_t size,
+		      off_t offset)
+{
+  struct stat st_data;
+  overlay_t *overlay;
+  off_t first, last, block;
+  int res;
+
+  if (!size)
+    return 0;
+  overlay = chain->c_overlays[0];
+  first = offset / OVERLAY_BLOCK;
+  last = (offset + size - 1) / OVERLAY_BLOCK;
+
+  pthread_mutex_lock(&overlay->o_lock);
+  for (block = first; block <= last; block++)
+    if (!overlay_test(overlay, block))
+      break;
+  if (block > last)
+    {
+      /* The overlay already has all these blocks */
+      pthread_mutex_unlock(&overlay->o_lock);
+      return pwrite(chain->c_fds[0], buffer, size, offset);
+    }
+
+  res = fstat(chain->c_fds[0], &st_data);
+  if (!res && (offset % OVERLAY_BLOCK) && !overlay_test(overlay, first))
+    res = overlay_copy_block(chain, first, st_data.st_size);
+  if (!res && ((offset + size) % OVERLAY_BLOCK) &&
+      !overlay_test(overlay, last) &&
+      ((last != first) || !(offset % OVERLAY_BLOCK)))
+    res = overlay_copy_block(chain, last, st_data.st_size);
+  if (!res)
+    res = overlay_write_buffer(chain->c_fds[0], buffer, size, offset);
+  if (!res)
+    res = overlay_mark(overlay, first, last);
+  pthread_mutex_unlock(&overlay->o_lock);
+  return res ? -1 : (ssize_t)size;
+}
+
+/*
+ * Change the size of the top layer of a chain. When it shrinks, the bytes
+ * past the new size must not come back from the base if it grows again.
+ */
+int overlay_truncate(overlay_t *overlay, int fd, off_t size)
+{
+  off_t old_size;
+  int res;
+
+  pthread_mutex_lock(&overlay->o_lock);
+  old_size = overlay->o_base_size;
+  if (size < old_size)
+    {
+      overlay->o_base_size = size;
+      if (overlay_write_header(overlay) == -1)
+	{
+	  overlay->o_base_size = old_size;
+	  pthread_mutex_unlock(&overlay->o_lock);
+	  return -1;
+	}
+    }
+  res = ftruncate(fd, size);
+  pthread_mutex_unlock(&overlay->o_lock);
+  return res;
+}
+
+/*
+ * Flush the top layer of a chain and its map to the disk.
+ */
+int overlay_sync(chain_t *chain, int datasync)
+{
+  int (*flush)(int);
+
+  flush = datasync ? fdatasync : fsync;
+  if (flush(chain->c_fds[0]) == -1)
+    return -1;
+  return fdatasync(chain->c_overlays[0]->o_mapfd);
+}
+
+/*
+ * Turn an overlay version into a version with all its data, in place, so
+ * that the versions below it can go away. The blocks it does not hold are
+ * copied in from the layers below, and the map is removed once they are on
+ * the disk. The chains still using the map keep reading the other blocks
+ * from their own descriptors of the layers below, which stay valid even once
+ * the files are gone, or from the chunks, which stay until the last of these
+ * chains is closed. So the bitmap is not touched : other chains may read it
+ * without its lock, when the version is one of their lower layers. The
+ * caller holds the metadata's update lock.
+ */
+int overlay_flatten_version(metadata_t *metadata, version_t *version)
+{
+  struct stat st_data;
+  overlay_t *overlay;
+  extent_t extent;
+  chain_t *chain;
+  off_t offset;
+  char rfile[PATH_MAX];
+  int fd, res;
+
+  if ((rcs_version_file(metadata, version, rfile) == -1) ||
+      ((fd = open(rfile, O_RDWR)) == -1))
+    return -1;
+  res = overlay_open_chain(metadata, version, fd, &chain);
+  close(fd);
+  if (res == -1 || !chain)
+    return res;
+
+  overlay = chain->c_overlays[0];
+  pthread_mutex_lock(&overlay->o_lock);
+  res = fstat(chain->c_fds[0], &st_data);
+  for (offset = 0; !res && offset < st_data.st_size;
+       offset += extent.e_length)
+    {
+      if (overlay_locate(chain, offset, st_data.st_size, &extent) == -1)
+	{
+	  res = -1;
+	  break;
+	}
+      if (extent.e_data)
+	res = overlay_write_buffer(chain->c_fds[0], extent.e_data,
+				   extent.e_length, offset);
+      else if (!extent.e_zero && (extent.e_fd != chain->c_fds[0]) &&
+	       (create_copy_range(extent.e_fd, extent.e_position,
+				  chain->c_fds[0], offset,
+				  offset + extent.e_length) == -1))
+	res = -1;
+      if (extent.e_owned)
+	close(extent.e_fd);
+      free(extent.e_data);
+    }
+  if (!res)
+    res = fdatasync(chain->c_fds[0]);
+  pthread_mutex_unlock(&overlay->o_lock);
+  overlay_close_chain(chain);
+
+  if (!res)
+    overlay_remove(metadata, version);
+  return res;
+}
+
+/*
+ * Put the new files of a version in place of the old ones, once they are on
+ * the disk : its chunks or frames, if it has some, then its map, then its
+ * data file, which gets the times of the old one. Nobody may open the
+ * version between the renames, so that it reads the same at any time, even
+ * after a crash. The versions sharing its file get the new overlay. The
+ * caller holds the metadata's update lock.
+ */
+static int overlay_commit(metadata_t *metadata, version_t *version,
+			  overlay_t *overlay, const char *newmap,
+			  const char *newlist, const char *list,
+			  const char *data)
+{
+  struct timespec times[2];
+  struct stat st_data;
+  version_t *sibling;
+  char rfile[PATH_MAX], *mapfile;
+  int res, error;
+
+  if ((rcs_version_file(metadata, version, rfile) == -1) ||
+      (lstat(rfile, &st_data) == -1))
+    return -1;
+  times[0] = st_data.st_atim;
+  times[1] = st_data.st_mtim;
+  if (utimensat(AT_FDCWD, data, times, 0) == -1)
+    return -1;
+
+  mapfile = helper_get_sibling_name(rfile, "extents");
+  pthread_rwlock_wrlock(&metadata->md_lock);
+  res = newlist ? rename(newlist, list) : 0;
+  if (!res && (rename(newmap, mapfile) == -1))
+    {
+      error = errno;
+      if (newlist)
+	rename(list, newlist);
+      errno = error;
+      res = -1;
+    }
+  if (!res && (rename(data, rfile) == -1))
+    {
+      error = errno;
+      unlink(mapfile);
+      if (newlist)
+	rename(list, newlist);
+      errno = error;
+      res = -1;
+    }
+  if (!res)
+    {
+      pthread_mutex_lock(&overlay_lock);
+      for (sibling = rcs_first_user(metadata, version); sibling;
+	   sibling = rcs_next_user(sibling->v_next, version))
+	{
+	  overlay_unref(sibling->v_overlay);
+	  sibling->v_overlay = overlay;
+	  sibling->v_probed = 1;
+	  overlay->o_refcount++;
+	}
+      pthread_mutex_unlock(&overlay_lock);
+    }
+  pthread_rwlock_unlock(&metadata->md_lock);
+  free(mapfile);
+  return res;
+}
+
+/*
+ * Replace a version with all its data by an overlay of the given base, whose
+ * data file was written by the caller with the blocks it differs by. The
+ * caller holds the metadata's update lock.
+ */
+int overlay_install(metadata_t *metadata, version_t *version, const char *data,
+		    unsigned int base, off_t base_size,
+		    const unsigned char *map, size_t bytes)
+{
+  overlay_t *overlay;
+  char rfile[PATH_MAX], *newfile;
+  int fd, res, error;
+
+  if (rcs_version_file(metadata, version, rfile) == -1)
+    return -1;
+  newfile = helper_get_sibling_name(rfile, "newmap");
+  fd = open(newfile, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd == -1)
+    {
+      free(newfile);
+      return -1;
+    }
+  overlay = overlay_new(fd, base, base_size);
+  overlay->o_map = safe_malloc(bytes);
+  memcpy(overlay->o_map, map, bytes);
+  overlay->o_bytes = bytes;
+  res = overlay_write_header(overlay);
+  if (!res)
+    res = overlay_write_buffer(fd, (char *)map, bytes,
+			       sizeof(overlay_header_t));
+  if (!res)
+    res = fdatasync(fd);
+  if (!res)
+    res = overlay_commit(metadata, version, overlay, newfile, NULL, NULL,
+			 data);
+
+  error = errno;
+  if (res)
+    unlink(newfile);
+  free(newfile);
+  overlay_put(overlay);
+  errno = error;
+  return res ? -1 : 0;
+}
+
+/*
+ * Write the map of a version holding its own data as a list of chunks or
+ * frames, and put it in place with the list, whose temporary and final
+ * names are given. The overlay has its kind of list already.
+ */
+static int overlay_install_list(metadata_t *metadata, version_t *version,
+				overlay_t *overlay, const char *magic,
+				const uint64_t *ends, unsigned int count,
+				const char *data, const char *newlist,
+				const char *list)
+{
+  overlay_header_t header;
+  char rfile[PATH_MAX], *newfile;
+  int res, error;
+
+  if (rcs_version_file(metadata, version, rfile) == -1)
+    {
+      error = errno;
+      overlay_put(overlay);
+      errno = error;
+      return -1;
+    }
+  newfile = helper_get_sibling_name(rfile, "newmap");
+  overlay->o_mapfd = open(newfile, O_RDWR | O_CREAT | O_TRUNC,
+			  S_IRUSR | S_IWUSR);
+  if (overlay->o_mapfd == -1)
+    {
+      error = errno;
+      free(newfile);
+      overlay_put(overlay);
+      errno = error;
+      return -1;
+    }
+  overlay->o_chunks = count;
+  overlay->o_ends = safe_malloc(sizeof(uint64_t) * count);
+  memcpy(overlay->o_ends, ends, sizeof(uint64_t) * count);
+
+  memset(&header, 0, sizeof(overlay_header_t));
+  memcpy(header.oh_magic, magic, sizeof(header.oh_magic));
+  header.oh_base = count;
+  header.oh_base_size = overlay->o_base_size;
+  res = overlay_write_buffer(overlay->o_mapfd, (char *)&header,
+			     sizeof(overlay_header_t), 0);
+  if (!res)
+    res = overlay_write_buffer(overlay->o_mapfd, (char *)ends,
+			       sizeof(uint64_t) * count,
+			       sizeof(overlay_header_t));
+  if (!res)
+    res = fdatasync(overlay->o_mapfd);
+  if (!res)
+    res = overlay_commit(metadata, version, overlay, newfile, newlist, list,
+			 data);
+
+  error = errno;
+  if (res)
+    unlink(newfile);
+  free(newfile);
+  overlay_put(overlay);
+  errno = error;
+  return res ? -1 : 0;
+}
+
+/*
+ * Replace a version with all its data by a chunked version, whose chunks
+ * were linked in the given directory by the caller, and whose data file is
+ * a sparse file of the same size. The caller holds the metadata's update
+ * lock.
+ */
+int overlay_install_chunks(metadata_t *metadata, version_t *version,
+			   const char *data, const char *chunkdir,
+			   const uint64_t *ends, unsigned int count)
+{
+  overlay_t *overlay;
+  char rfile[PATH_MAX];
+
+  if (rcs_version_file(metadata, version, rfile) == -1)
+    return -1;
+  overlay = overlay_new(-1, 0, count ? ends[count - 1] : 0);
+  overlay->o_chunkdir = helper_get_sibling_name(rfile, "chunks");
+  return overlay_install_list(metadata, version, overlay, OVERLAY_CHUNKED,
+			      ends, count, data, chunkdir,
+			      overlay->o_chunkdir);
+}
+
+/*
+ * Replace a version with all its data by a compressed version of the given
+ * size, whose frames were written to the given file by the caller, and whose
+ * data file is a sparse file of the same size. The caller holds the
+ * metadata's update lock.
+ */
+int overlay_install_frames(metadata_t *metadata, version_t *version,
+			   const char *data, const char *frames, int fd,
+			   off_t size, const uint64_t *ends, unsigned int count)
+{
+  overlay_t *overlay;
+  char rfile[PATH_MAX], *framefile;
+  int res;
+
+  if (rcs_version_file(metadata, version, rfile) == -1)
+    return -1;
+  overlay = overlay_new(-1, 0, size);
+  if ((overlay->o_framefd = dup(fd)) == -1)
+    {
+      int error = errno;
+      overlay_put(overlay);
+      errno = error;
+      return -1;
+    }
+  framefile = helper_get_sibling_name(rfile, "frames");
+  res = overlay_install_list(metadata, version, overlay, OVERLAY_FRAMES,
+			     ends, count, data, frames, framefile);
+  free(framefile);
+  return res;
+}
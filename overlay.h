@@ -0,0 +1,75 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#ifndef OVERLAY_H
+# define OVERLAY_H
+
+# include <stdint.h>
+# include "structs.h"
+
+# define OVERLAY_BLOCK		4096		/* Bytes per map bit	*/
+# define OVERLAY_MIN_SIZE	(1 << 20)	/* Smaller files copied	*/
+# define OVERLAY_MAGIC		"CPFSMAP1"	/* Map file format	*/
+# define OVERLAY_CHUNKED	"CPFSCHK1"	/* Chunk list format	*/
+# define OVERLAY_FRAMES		"CPFSZIP1"	/* Frame list format	*/
+
+typedef struct overlay_header_t	overlay_header_t;
+
+/*
+ * Start of a map file, followed by the bitmap, in host byte order. The map
+ * of a chunked or compressed version has the number of chunks or frames as
+ * base, and is followed by the offset each one ends at instead : in the
+ * version for the chunks, and in the frame file for the frames.
+ */
+struct				overlay_header_t
+{
+  char				oh_magic[8];	/* OVERLAY_MAGIC	*/
+  uint32_t			oh_base;	/* Base version ID	*/
+  uint32_t			oh_reserved;	/* Zero			*/
+  uint64_t			oh_base_size;	/* Bytes from the base	*/
+};
+
+int		overlay_get(metadata_t *metadata, version_t *version,
+			    overlay_t **overlay);
+void		overlay_put(overlay_t *overlay);
+int		overlay_whole(overlay_t *overlay);
+int		overlay_create(metadata_t *metadata, version_t *version,
+			       unsigned int base, off_t base_size);
+void		overlay_remove(metadata_t *metadata, version_t *version);
+void		overlay_discard(metadata_t *metadata, version_t *version);
+int		overlay_depth(metadata_t *metadata, version_t *version);
+int		overlay_open_chain(metadata_t *metadata, version_t *version,
+				   int fd, chain_t **chain);
+void		overlay_close_chain(chain_t *chain);
+int		overlay_map_range(chain_t *chain, off_t offset, size_t size,
+				  extent_t **extents);
+void		overlay_free_extents(extent_t *extents, int count);
+int		overlay_read(chain_t *chain, int fd, char *buffer, size_t size,
+			     off_t offset);
+ssize_t		overlay_write(chain_t *chain, const char *buffer, size_t size,
+			      off_t offset);
+int		overlay_truncate(overlay_t *overlay, int fd, off_t size);
+int		overlay_sync(chain_t *chain, int datasync);
+int		overlay_flatten_version(metadata_t *metadata,
+					version_t *version);
+int		overlay_install(metadata_t *metadata, version_t *version,
+				const char *data, unsigned int base,
+				off_t base_size, const unsigned char *map,
+				size_t bytes);
+int		overlay_install_chunks(metadata_t *metadata,
+				       version_t *version, const char *data,
+				       const char *chunkdir,
+				       const uint64_t *ends,
+				       unsigned int count);
+int		overlay_install_frames(metadata_t *metadata,
+				       version_t *version, const char *data,
+				       const char *frames, int fd, off_t size,
+				       const uint64_t *ends,
+				       unsigned int count);
+
+#endif /* !OVERLAY_H */
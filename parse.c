@@ -7,14 +7,62 @@
 */
 
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <limits.h>
 #include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 
 #include "helper.h"
 #include "structs.h"
+#include "slab.h"
+#include "journal.h"
+#include "catalog.h"
+#include "parse.h"
 
+/* How parse_map() found the contents of a file */
+#define PARSE_COPY		0		/* To free		*/
+#define PARSE_MAPPED		1		/* To unmap		*/
+#define PARSE_CATALOG		2		/* In the catalog	*/
+
+/* Smallest entry of a metadata file : an empty name, and the length */
+#define PARSE_ENTRY_MIN		(sizeof(metafile_entry_t) + 2 * sizeof(uint32_t))
+
+/*
+ * Make a version from what the metadata file says about it. Only the serial
+ * its file is named after is kept from the name of the file : one that
+ * does not start with it is taken as named after the version itself.
+ */
+static version_t *parse_new_version(unsigned int vid, unsigned int svid,
+				    unsigned int mode, unsigned int uid,
+				    unsigned int gid, const char *name)
+{
+  version_t *v_info;
+  unsigned int serial;
+  int length;
+
+  v_info = slab_alloc(&slab_versions);
+  v_info->v_vid = vid;
+  v_info->v_svid = svid;
+  length = 0;
+  if ((sscanf(name, "%8X.%n", &serial, &length) == 1) && (length == 9))
+    v_info->v_file = serial;
+  else
+    v_info->v_file = vid;
+  v_info->v_mode = (mode_t)mode;
+  v_info->v_uid = (uid_t)uid;
+  v_info->v_gid = (gid_t)gid;
+  v_info->v_overlay = NULL;
+  v_info->v_probed = 0;
+  v_info->v_next = NULL;
+  return v_info;
+}
 
 /*
  * Parse a line of the metadata file into a version data structure.
@@ -44,52 +92,27 @@ static version_t *parse_version_line(FILE *fh)
     }
   else
     {
-      v_info = safe_malloc(sizeof(version_t));
-      v_info->v_vid = l_vid;
-      v_info->v_svid = l_svid;
-      v_info->v_mode = (mode_t)l_mode;
-      v_info->v_uid = (uid_t)l_uid;
-      v_info->v_gid = (gid_t)l_gid;
-
-      /*
-       * Don't try to append a path just now, since we may need those
-       * metadata for the purpose of path translation. This will be done
-       * later.
-       */
-      v_info->v_rfile = safe_strdup(buffer + name_pos);
-
+      v_info = parse_new_version(l_vid, l_svid, l_mode, l_uid, l_gid,
+				 buffer + name_pos);
       free(buffer);
       return v_info;
     }
 }
 
 /*
- * Parse a complete metadata file into the equivalent memory structure,
- * but do not try to resolve paths to the actual versionned files.
- * The returned metadata lists all versions, but cannot be used as is : it
- * is still necessary to resolve all paths, put in the name of the virtual
- * file, put in the default version number...
+ * Parse a metadata file in the text format of the older releases, where
+ * each line is a version, oldest first. It is converted to the binary
+ * format the next time it is written.
  */
-metadata_t *parse_metadata_file(char *metafile)
+static void parse_text(metadata_t *md_info, char *data, size_t size)
 {
   FILE *fh;
-  metadata_t *md_info;
   version_t *v_info;
   int deleted;
 
-  fh = fopen(metafile, "r");
+  fh = fmemopen(data, size, "r");
   if (!fh)
-    {
-      /* No metadata, maybe we do not know the file yet */
-      return NULL;
-    }
-
-  md_info = safe_malloc(sizeof(metadata_t));
-
-  /* We do not know the virtual path here, it is up to the caller to set it */
-  md_info->md_vfile = NULL;
-  md_info->md_vpath = NULL;
-  md_info->md_versions = NULL;
+    return;
 
   /* Parse it line per line and link the data */
   deleted = 0;
@@ -106,8 +129,7 @@ metadata_t *parse_metadata_file(char *metafile)
 	  if (!v_info->v_vid)
 	    {
 	      deleted = 1;
-	      free(v_info->v_rfile);
-	      free(v_info);
+	      slab_free(v_info);
 	    }
 	  else
 	    {
@@ -128,6 +150,231 @@ metadata_t *parse_metadata_file(char *metafile)
 
   /* Tag the file as deleted or not */
   md_info->md_deleted = deleted;
+  fclose(fh);
+}
+
+/*
+ * Check the entry of a metadata file that ends at the given offset, and
+ * return where it starts, or 0 if it is damaged.
+ */
+static size_t parse_entry_start(const char *data, size_t end,
+				metafile_entry_t *entry)
+{
+  uint32_t length;
+
+  if (end < sizeof(metafile_header_t) + PARSE_ENTRY_MIN)
+    return 0;
+  memcpy(&length, data + end - sizeof(uint32_t), sizeof(uint32_t));
+  if ((length < PARSE_ENTRY_MIN) || (length % sizeof(uint32_t)) ||
+      (length > end - sizeof(metafile_header_t)))
+    return 0;
+  memcpy(entry, data + end - length, sizeof(metafile_entry_t));
+  if ((entry->me_length != length) || data[end - sizeof(uint32_t) - 1])
+    return 0;
+  return end - length;
+}
+
+/*
+ * Find where the valid entries of a metadata file end, reading it from its
+ * start. Only needed when its last entry is damaged.
+ */
+static size_t parse_entries_end(const char *data, size_t size)
+{
+  metafile_entry_t entry;
+  size_t end;
+
+  end = sizeof(metafile_header_t);
+  while (end + PARSE_ENTRY_MIN <= size)
+    {
+      memcpy(&entry, data + end, sizeof(metafile_entry_t));
+      if ((entry.me_length < PARSE_ENTRY_MIN) ||
+	  (entry.me_length > size - end) ||
+	  (parse_entry_start(data, end + entry.me_length, &entry) != end))
+	break;
+      end += entry.me_length;
+    }
+  return end;
+}
+
+/*
+ * Parse a metadata file made of appended entries, from its end, so that the
+ * newest versions come first. If partial is set, the walk stops at the
+ * given preferred version, or where it would be, or at the latest version
+ * if it is LATEST : lookups only need these, and the older ones are left on
+ * the disk until the whole history is needed. Only a deletion that comes
+ * last counts.
+ */
+static void parse_appended(metadata_t *md_info, const char *data,
+			   size_t size, int partial, int vid, int svid)
+{
+  metafile_entry_t entry;
+  version_t **last, *v_info;
+  size_t end, start;
+  int newest;
+
+  /*
+   * A damaged end is left behind by the next change, which rewrites the
+   * file : the whole history is needed for that.
+   */
+  end = size;
+  md_info->md_appendable = 1;
+  if ((end > sizeof(metafile_header_t)) &&
+      !parse_entry_start(data, end, &entry))
+    {
+      end = parse_entries_end(data, size);
+      md_info->md_appendable = 0;
+      partial = 0;
+    }
+
+  last = &md_info->md_versions;
+  newest = 1;
+  while ((start = parse_entry_start(data, end, &entry)))
+    {
+      end = start;
+      if (!entry.me_vid)
+	{
+	  md_info->md_deleted |= newest;
+	  newest = 0;
+	  continue;
+	}
+      newest = 0;
+      v_info = parse_new_version(entry.me_vid, entry.me_svid, entry.me_mode,
+				 entry.me_uid, entry.me_gid,
+				 data + start + sizeof(metafile_entry_t));
+      *last = v_info;
+      last = &v_info->v_next;
+      if (partial &&
+	  ((vid == LATEST) || (v_info->v_vid < (unsigned)vid) ||
+	   ((v_info->v_vid == (unsigned)vid) &&
+	    ((svid == LATEST) || (v_info->v_svid <= (unsigned)svid)))))
+	{
+	  md_info->md_partial = (end > sizeof(metafile_header_t));
+	  break;
+	}
+    }
+}
+
+/*
+ * Get the contents of a metadata or default version file : a copy of what
+ * the journal holds for it, or what the catalog of its directory holds, or
+ * the file itself, mapped. Returns NULL if there is none. The way it was
+ * found is returned, to release it with parse_unmap().
+ */
+static char *parse_map(char *path, catalog_t *catalog, size_t *size,
+		       int *mapped)
+{
+  struct stat st_file;
+  const char *found, *name;
+  char *data;
+  int fd;
+
+  *mapped = PARSE_COPY;
+  if (journal_read(path, &data, size))
+    return data;
+
+  name = rindex(path, '/');
+  name = name ? name + 1 : path;
+  if (catalog)
+    switch (catalog_find(catalog, name, &found, size))
+      {
+      case 1:
+	*mapped = PARSE_CATALOG;
+	return (char *)found;
+      case 0:
+	return NULL;
+      }
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    {
+      /* The directory may just have been converted to a catalog */
+      if (catalog && (errno == ENOENT) && !catalog_reload(catalog) &&
+	  (catalog_find(catalog, name, &found, size) == 1))
+	{
+	  *mapped = PARSE_CATALOG;
+	  return (char *)found;
+	}
+      return NULL;
+    }
+  if (fstat(fd, &st_file) == -1)
+    {
+      close(fd);
+      return NULL;
+    }
+  *size = st_file.st_size;
+  if (!*size)
+    {
+      close(fd);
+      return safe_malloc(1);
+    }
+  data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return NULL;
+  *mapped = PARSE_MAPPED;
+  return data;
+}
+
+/*
+ * Release what parse_map() returned.
+ */
+static void parse_unmap(char *data, size_t size, int mapped)
+{
+  if (mapped == PARSE_MAPPED)
+    munmap(data, size);
+  else if (mapped == PARSE_COPY)
+    free(data);
+}
+
+/*
+ * Parse a metadata file, given the catalog of its directory if catalogs are
+ * used. If partial is set, the versions older than the given preferred one
+ * may be left out.
+ */
+static metadata_t *parse_metadata(char *metafile, catalog_t *catalog,
+				  int partial, int vid, int svid)
+{
+  metafile_header_t header;
+  metadata_t *md_info;
+  size_t size;
+  char *data;
+  int mapped;
+
+  data = parse_map(metafile, catalog, &size, &mapped);
+  if (!data)
+    {
+      /* No metadata, maybe we do not know the file yet */
+      return NULL;
+    }
+
+  md_info = slab_alloc(&slab_metadata);
+
+  /* We do not know the name here, it is up to the caller to set it */
+  md_info->md_name = NULL;
+  md_info->md_parent = NULL;
+  md_info->md_versions = NULL;
+  md_info->md_index = NULL;
+  md_info->md_count = 0;
+  md_info->md_borrowed = 0;
+  md_info->md_negative = 0;
+  md_info->md_writers = 0;
+  md_info->md_deleted = 0;
+  md_info->md_partial = 0;
+  md_info->md_appendable = 0;
+
+  /*
+   * The text format is converted the next time the file is written. The
+   * header is copied, as the data of a catalog entry may not be aligned.
+   */
+  if ((size >= sizeof(metafile_header_t)) &&
+      !memcmp(data, METADATA_MAGIC, sizeof(METADATA_MAGIC) - 1))
+    {
+      memcpy(&header, data, sizeof(metafile_header_t));
+      if (header.mh_format == METADATA_FORMAT)
+	parse_appended(md_info, data, size, partial, vid, svid);
+    }
+  else if (size)
+    parse_text(md_info, data, size);
 
   /* Never touched */
   md_info->md_timestamp = 0;
@@ -135,25 +382,50 @@ metadata_t *parse_metadata_file(char *metafile)
   /* Default version is latest (it will be replaced later if needed) */
   md_info->md_dfl_vid = LATEST;
   md_info->md_dfl_svid = LATEST;
+  md_info->md_pinned = NULL;
 
   /* Initialize the "control" data */
   md_info->md_next = NULL;
   md_info->md_previous = NULL;
 
-  fclose(fh);
+  parse_unmap(data, size, mapped);
   return md_info;
 }
 
 /*
- * Parse a default version file and extract the preferred version.
+ * Parse a complete metadata file into the equivalent memory structure.
+ * The returned metadata lists all versions, but cannot be used as is : it
+ * is still necessary to put in the name of the virtual file, put in the
+ * default version number...
  */
-void parse_default_file(char *dflfile, int *vid, int *svid)
+metadata_t *parse_metadata_file(char *metafile)
 {
-  char *line;
-  FILE *fh;
+  metadata_t *metadata;
+  catalog_t *catalog;
+  char *dir;
 
-  fh = fopen(dflfile, "r");
-  if (!fh)
+  dir = helper_extract_dirname(metafile);
+  catalog = catalog_open(dir);
+  free(dir);
+  metadata = parse_metadata(metafile, catalog, 0, LATEST, LATEST);
+  catalog_close(catalog);
+  return metadata;
+}
+
+/*
+ * Parse a default version file, given the catalog of its directory if
+ * catalogs are used.
+ */
+static void parse_default(char *dflfile, catalog_t *catalog, int *vid,
+			  int *svid)
+{
+  char line[32];
+  size_t size, length;
+  char *data;
+  int mapped;
+
+  data = parse_map(dflfile, catalog, &size, &mapped);
+  if (!data)
     {
       /* No default, assume user wants real latest */
       *vid = LATEST;
@@ -161,50 +433,67 @@ void parse_default_file(char *dflfile, int *vid, int *svid)
       return;
     }
 
-  line = helper_read_line(fh);
+  length = (size < sizeof(line)) ? size : sizeof(line) - 1;
+  memcpy(line, data, length);
+  line[length] = '\0';
+  parse_unmap(data, size, mapped);
   if (sscanf(line, "%i.%i", vid, svid) != 2)
     {
       /* The file is probably corrupt, just assume real latest version */
       *vid = LATEST;
       *svid = LATEST;
     }
+}
 
-  free(line);
-  fclose(fh);
+/*
+ * Parse a default version file and extract the preferred version.
+ */
+void parse_default_file(char *dflfile, int *vid, int *svid)
+{
+  catalog_t *catalog;
+  char *dir;
+
+  dir = helper_extract_dirname(dflfile);
+  catalog = catalog_open(dir);
+  free(dir);
+  parse_default(dflfile, catalog, vid, svid);
+  catalog_close(catalog);
 }
 
 /*
- * Retrieve metadata in a given root for a given file. It does not resolve
- * paths yet, but gets the preferred versions.
+ * Retrieve metadata in a given root for a given file, and get the
+ * preferred versions. Only the versions down to
+ * the preferred one are read : see rcs_load_history() for the others.
  */
-metadata_t *parse_metadata_for_file(char *root, char *filename)
+metadata_t *parse_metadata_for_file(char *root, const char *filename)
 {
-  char *metafile, *dflfile, *metapath, *dflpath;
+  char metapath[PATH_MAX], dflpath[PATH_MAX];
   metadata_t *metadata;
+  catalog_t *catalog;
+  int vid, svid;
+
+  metapath[0] = '\0';
+  dflpath[0] = '\0';
+  if (helper_append_path(dflpath, "%s/dfl-meta.%s", root, filename) ||
+      helper_append_path(metapath, "%s/metadata.%s", root, filename))
+    return NULL;
+
+  /* Both files are in the same catalog, if there is one */
+  catalog = catalog_open(root);
 
-  /* Build the path for the metadata file */
-  metafile = helper_get_file_name(filename, "metadata");
-  metapath = helper_build_composite("SS", "/", root, metafile);
-  free(metafile);
+  /* The default version says where the walk of the versions stops */
+  parse_default(dflpath, catalog, &vid, &svid);
 
   /* Read the partial metadata */
-  metadata = parse_metadata_file(metapath);
+  metadata = parse_metadata(metapath, catalog, 1, vid, svid);
+  catalog_close(catalog);
   if (!metadata)
     {
       /* No metadata, we don't know about this file yet */
-      free(metapath);
       return NULL;
     }
-
-  /* Build the path for the default version file */
-  dflfile = helper_get_file_name(filename, "dfl-meta");
-  dflpath = helper_build_composite("SS", "/", root, dflfile);
-  free(dflfile);
-
-  /* Parse the default version file */
-  parse_default_file(dflpath, &metadata->md_dfl_vid, &metadata->md_dfl_svid);
-
-  free(metapath);
-  free(dflpath);
+  metadata->md_dfl_vid = vid;
+  metadata->md_dfl_svid = svid;
+  metadata->md_pinned = NULL;
   return metadata;
 }
@@ -9,11 +9,44 @@
 #ifndef PARSE_H
 # define PARSE_H
 
+# include <stdint.h>
 # include "structs.h"
 
+# define METADATA_MAGIC		"CPFSMETA"	/* Metadata file format	*/
+# define METADATA_FORMAT	1		/* Its revision		*/
+
+typedef struct metafile_header_t	metafile_header_t;
+typedef struct metafile_entry_t		metafile_entry_t;
+
+/*
+ * Start of a binary metadata file, in host byte order. It is followed by
+ * the entries of the versions, oldest first.
+ */
+struct				metafile_header_t
+{
+  char				mh_magic[8];	/* METADATA_MAGIC	*/
+  uint32_t			mh_format;	/* METADATA_FORMAT	*/
+};
+
+/*
+ * A version, or a deletion if its ID is zero, appended to a metadata file.
+ * It is followed by the name, a null byte and zeroes up to a multiple of
+ * four bytes, and by its length again, for the file to be read from its
+ * end.
+ */
+struct				metafile_entry_t
+{
+  uint32_t			me_vid;		/* Version ID		*/
+  uint32_t			me_svid;	/* Subversion ID	*/
+  uint32_t			me_mode;	/* File permissions	*/
+  uint32_t			me_uid;		/* Owner		*/
+  uint32_t			me_gid;		/* Group		*/
+  uint32_t			me_length;	/* Bytes of the entry	*/
+};
+
 metadata_t	*parse_metadata_file(char *metafile);
 void		parse_default_file(char *dflfile, int *vid, int *svid);
 
-metadata_t	*parse_metadata_for_file(char *root, char *filename);
+metadata_t	*parse_metadata_for_file(char *root, const char *filename);
 
 #endif /* !PARSE_H */
@@ -10,13 +10,34 @@
 # define RCS_H
 
 # include "structs.h"
+# include "dircache.h"
+
+# define RCS_HIDE_DELETED	0	/* Deleted files are not found	*/
+# define RCS_SHOW_DELETED	1	/* Deleted files are found too	*/
 
 extern char	*rcs_version_path;
-extern int	rcs_ignore_deleted;
 
-version_t	*rcs_find_version(metadata_t *metadata, int vid, int svid);
-char		*rcs_translate_path(const char *virtual, char *vroot);
-metadata_t	*rcs_translate_to_metadata(const char *vfile, char *vroot);
+void		rcs_versions_changed(metadata_t *metadata);
+version_t	*rcs_get_version(metadata_t *metadata, int vid, int svid);
+version_t	*rcs_next_user(version_t *from, version_t *version);
+version_t	*rcs_first_user(metadata_t *metadata, version_t *version);
+unsigned int	*rcs_newest_users(metadata_t *metadata);
+version_t	*rcs_find_version(metadata_t *metadata, int vid, int svid,
+				  int deleted);
+int		rcs_entry_directory(metadata_t *metadata, char *buffer);
+int		rcs_version_file(metadata_t *metadata, version_t *version,
+				 char *buffer);
+dircache_t	*rcs_version_at(metadata_t *metadata, version_t *version,
+				char *name);
+int		rcs_open_version(metadata_t *metadata, version_t *version,
+				 int flags);
+int		rcs_directory(metadata_t *directory, char *buffer);
+metadata_t	*rcs_lookup(metadata_t *parent, const char *name);
+int		rcs_load_history(metadata_t *metadata);
+int		rcs_translate_path(const char *virtual, char *vroot,
+				   char *buffer);
+metadata_t	*rcs_translate_to_metadata(const char *vfile, char *vroot,
+					   int deleted);
 
 void		rcs_free_metadata(metadata_t *metadata);
 
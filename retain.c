@@ -0,0 +1,529 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "helper.h"
+#include "structs.h"
+#include "slab.h"
+#include "rcs.h"
+#include "cache.h"
+#include "create.h"
+#include "write.h"
+#include "overlay.h"
+#include "delta.h"
+#include "catalog.h"
+#include "retain.h"
+
+/*
+ * Old versions go away once a file has more of them than its policy allows,
+ * once they use more disk space than it allows, or once they stopped being
+ * the current version for longer than it allows. The newest version, and
+ * the versions newer than the one a file is locked to, are always kept.
+ *
+ * A file's policy is given by the retention.<name> file next to its
+ * metadata, or else by the nearest directory above it that has one, or else
+ * by the mount's. The policies are applied when a file gets new versions,
+ * by the delta thread, and to the whole tree from time to time by a thread
+ * of its own, that pauses every RETAIN_BATCH files so that it stays in the
+ * background. The versions that expired are cut from the file's metadata,
+ * which is written once, and their files are unlinked in batches, without
+ * holding any lock.
+ */
+
+static pthread_mutex_t retain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t retain_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_t retain_thread;
+static retain_policy_t retain_default;
+static int retain_running = 0;
+static int retain_stopping = 0;
+
+/* Only used by the thread */
+static version_t *retain_batch[RETAIN_BATCH];
+static metadata_t *retain_batch_files[RETAIN_BATCH]; /* Whose they were */
+static unsigned int retain_batched = 0;
+static unsigned long retain_count = 0;
+
+
+/*
+ * Set the policy of the files that have none, and of no directory above
+ * them.
+ */
+void retain_setup(const retain_policy_t *policy)
+{
+  retain_default = *policy;
+}
+
+/*
+ * Read the policy set on a file or a directory. Returns 1 if it has one, 0
+ * if it does not, or -1.
+ */
+int retain_read_policy(metadata_t *metadata, retain_policy_t *policy)
+{
+  unsigned long long bytes;
+  unsigned int versions;
+  char retfile[PATH_MAX];
+  long age;
+  FILE *fh;
+  int res;
+
+  if (create_meta_name(metadata, "retention", retfile))
+    return -1;
+  fh = fopen(retfile, "r");
+  if (!fh)
+    return (errno == ENOENT) ? 0 : -1;
+  res = fscanf(fh, "%u:%llu:%ld", &versions, &bytes, &age);
+  fclose(fh);
+  if (res != 3)
+    {
+      errno = EIO;
+      return -1;
+    }
+  policy->rp_versions = versions;
+  policy->rp_bytes = bytes;
+  policy->rp_age = age;
+  return 1;
+}
+
+/*
+ * Set the policy of a file, or of the files below a directory, or remove it
+ * if policy is NULL. Returns non-zero on error.
+ */
+int retain_write_policy(metadata_t *metadata, const retain_policy_t *policy)
+{
+  char retfile[PATH_MAX];
+  FILE *fh;
+  int res;
+
+  if (create_meta_name(metadata, "retention", retfile))
+    return -1;
+  if (!policy)
+    return unlink(retfile);
+  fh = fopen(retfile, "w");
+  if (!fh)
+    return -1;
+  res = (fprintf(fh, "%u:%llu:%ld\n", policy->rp_versions, policy->rp_bytes,
+		 (long)policy->rp_age) < 0) ? -1 : 0;
+  if (fclose(fh) && !res)
+    res = -1;
+  return res;
+}
+
+/*
+ * Find the policy of a file : its own, or the one of the nearest directory
+ * above it that has one, or the mount's.
+ */
+static int retain_find_policy(metadata_t *metadata, retain_policy_t *policy)
+{
+  int res;
+
+  for (; metadata; metadata = metadata->md_parent)
+    if ((res = retain_read_policy(metadata, policy)))
+      return res;
+  *policy = retain_default;
+  return 0;
+}
+
+/*
+ * Make sure the given number of newest versions do not need the others,
+ * before the others are removed : the overlays based on one of them are
+ * given all their data. Chunked and compressed versions have no base. The
+ * caller holds the metadata's update lock.
+ */
+int retain_flatten(metadata_t *metadata, int kept)
+{
+  version_t *version, *oldest;
+  overlay_t *overlay;
+  int i, needed;
+
+  /* A base is kept if it is not older than the oldest version kept */
+  if (kept > (int)metadata->md_count)
+    kept = metadata->md_count;
+  if (kept <= 0)
+    return 0;
+  oldest = metadata->md_index[kept - 1];
+  version = metadata->md_versions;
+  for (i = 0; version && i < kept; i++, version = version->v_next)
+    {
+      if (overlay_get(metadata, version, &overlay) == -1)
+	return -1;
+      if (!overlay || overlay_whole(overlay))
+	{
+	  overlay_put(overlay);
+	  continue;
+	}
+      needed = overlay->o_base < oldest->v_vid;
+      overlay_put(overlay);
+      if (needed && (overlay_flatten_version(metadata, version) == -1))
+	return -1;
+    }
+  return 0;
+}
+
+/*
+ * Get the disk space used by a version, with its map and frames, and when
+ * its data was last written to.
+ */
+static void retain_measure(const char *rfile, unsigned long long *bytes,
+			   time_t *mtime)
+{
+  static char *siblings[] = { "extents", "frames", NULL };
+  struct stat st_data;
+  char *name;
+  int i;
+
+  *bytes = 0;
+  *mtime = time(NULL);
+  if (lstat(rfile, &st_data) == -1)
+    return;
+  *bytes = st_data.st_blocks * 512ULL;
+  *mtime = st_data.st_mtime;
+  for (i = 0; siblings[i]; i++)
+    {
+      name = helper_get_sibling_name(rfile, siblings[i]);
+      if (!lstat(name, &st_data))
+	*bytes += st_data.st_blocks * 512ULL;
+      free(name);
+    }
+}
+
+/*
+ * Cut the versions of a file its policy does not keep from its metadata.
+ * Since the data of a version is last written before the next one is
+ * created, a version stopped being current before the next one was last
+ * written to. The versions that were cut are added to *expired, for the
+ * caller to unlink them, except the ones whose file a kept version still
+ * uses, which are freed here. Returns 1 if some were cut, 0 if there were
+ * none, or -1. The caller holds the metadata's update lock.
+ */
+static int retain_apply(metadata_t *metadata, const retain_policy_t *policy,
+			version_t **expired)
+{
+  version_t *version, *last, **link;
+  unsigned long long bytes, used;
+  unsigned int groups, i, *newest;
+  time_t now, current, mtime;
+  char rfile[PATH_MAX], metafile[PATH_MAX];
+  int kept, locked;
+
+  if ((!policy->rp_versions && !policy->rp_bytes && !policy->rp_age) ||
+      metadata->md_writers)
+    return 0;
+
+  now = time(NULL);
+  current = now;
+  bytes = 0;
+  groups = 0;
+  kept = 0;
+  last = NULL;
+  locked = (metadata->md_dfl_vid != LATEST);
+  for (version = metadata->md_versions; version; version = last->v_next)
+    {
+      if (rcs_version_file(metadata, version, rfile) == -1)
+	rfile[0] = '\0';
+      retain_measure(rfile, &used, &mtime);
+      if (last && !locked &&
+	  ((policy->rp_versions && (groups >= policy->rp_versions)) ||
+	   (policy->rp_bytes && (bytes + used > policy->rp_bytes)) ||
+	   (policy->rp_age && (now - current > policy->rp_age))))
+	break;
+      if (version->v_vid == (unsigned)metadata->md_dfl_vid)
+	locked = 0;
+      groups++;
+      bytes += used;
+      current = mtime;
+
+      /* Subversions share the file of their version */
+      for (last = version, kept++;
+	   last->v_next && (last->v_next->v_vid == version->v_vid);
+	   last = last->v_next)
+	kept++;
+    }
+  if (!version)
+    return 0;
+
+  if (retain_flatten(metadata, kept) == -1)
+    return -1;
+  if (create_meta_name(metadata, "metadata", metafile))
+    return -1;
+  newest = rcs_newest_users(metadata);
+  pthread_rwlock_wrlock(&metadata->md_lock);
+  last->v_next = NULL;
+  rcs_versions_changed(metadata);
+  pthread_rwlock_unlock(&metadata->md_lock);
+  if (write_metadata_file(metafile, metadata) == -1)
+    {
+      int error = errno;
+      pthread_rwlock_wrlock(&metadata->md_lock);
+      last->v_next = version;
+      rcs_versions_changed(metadata);
+      pthread_rwlock_unlock(&metadata->md_lock);
+      free(newest);
+      errno = error;
+      return -1;
+    }
+  cache_update_metadata(metadata);
+
+  /* The files a kept version still uses stay */
+  for (link = &version, i = kept; *link; i++)
+    if (newest[i] < (unsigned int)kept)
+      {
+	last = *link;
+	*link = last->v_next;
+	overlay_put(last->v_overlay);
+	slab_free(last);
+      }
+    else
+      link = &(*link)->v_next;
+  free(newest);
+  if (!version)
+    return 1;
+
+  for (last = version; last->v_next; last = last->v_next)
+    ;
+  last->v_next = *expired;
+  *expired = version;
+  return 1;
+}
+
+/*
+ * Unlink the files of versions that were cut from the metadata of a file,
+ * and free them.
+ */
+static void retain_discard(metadata_t *metadata, version_t *versions)
+{
+  version_t *next;
+
+  while (versions)
+    {
+      next = versions->v_next;
+      overlay_discard(metadata, versions);
+      overlay_put(versions->v_overlay);
+      slab_free(versions);
+      versions = next;
+    }
+}
+
+/*
+ * Apply its policy to a file now. Returns 1 if some versions went away, 0
+ * if none did or the file was dropped from the cache meanwhile, or -1.
+ */
+int retain_file(metadata_t *metadata)
+{
+  retain_policy_t policy;
+  version_t *expired;
+  int res;
+
+  if (retain_find_policy(metadata, &policy) == -1)
+    return -1;
+  expired = NULL;
+  pthread_mutex_lock(&metadata->md_update);
+  if (!cache_has_metadata(metadata))
+    res = 0;
+  else if (!(res = rcs_load_history(metadata)))
+    res = retain_apply(metadata, &policy, &expired);
+  pthread_mutex_unlock(&metadata->md_update);
+  retain_discard(metadata, expired);
+  return res;
+}
+
+/*
+ * Unlink the versions that expired since the last batch, and give back the
+ * files they were from.
+ */
+static void retain_flush(void)
+{
+  unsigned int i;
+
+  for (i = 0; i < retain_batched; i++)
+    {
+      retain_discard(retain_batch_files[i], retain_batch[i]);
+      cache_release_metadata(retain_batch_files[i]);
+    }
+  retain_batched = 0;
+}
+
+/*
+ * Count a file that was looked at, and pause after each batch of them, once
+ * their expired versions are unlinked. Returns -1 if the thread has to stop.
+ */
+static int retain_pace(void)
+{
+  struct timespec deadline;
+  int res;
+
+  if (++retain_count % RETAIN_BATCH)
+    return __atomic_load_n(&retain_stopping, __ATOMIC_ACQUIRE) ? -1 : 0;
+  retain_flush();
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += RETAIN_PAUSE * 1000000L;
+  deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+  deadline.tv_nsec %= 1000000000L;
+  pthread_mutex_lock(&retain_lock);
+  if (!retain_stopping)
+    pthread_cond_timedwait(&retain_wakeup, &retain_lock, &deadline);
+  res = retain_stopping ? -1 : 0;
+  pthread_mutex_unlock(&retain_lock);
+  return res;
+}
+
+/*
+ * Look up an entry of a directory for the scan. Entries that were not cached
+ * go back to the cold end of the cache once the scan is done with them, so
+ * that it does not evict the files in use.
+ */
+static metadata_t *retain_lookup(metadata_t *directory, const char *name,
+				 int *loaded)
+{
+  metadata_t *metadata;
+
+  *loaded = 0;
+  metadata = cache_get_child(directory, name);
+  if (metadata && !metadata->md_negative)
+    return metadata;
+  if (metadata)
+    cache_release_metadata(metadata);
+  *loaded = 1;
+  return rcs_lookup(directory, name);
+}
+
+/*
+ * Apply the policies to the files of a directory and of the directories
+ * below it, given the policy it passes on. Returns -1 once the thread has
+ * to stop.
+ */
+static int retain_scan(metadata_t *directory, const retain_policy_t *inherited)
+{
+  retain_policy_t policy;
+  struct stat st_data;
+  metadata_t *metadata;
+  version_t *expired;
+  unsigned int i;
+  char **names;
+  char path[PATH_MAX];
+  int res, loaded, subdirectory;
+
+  pthread_rwlock_rdlock(&directory->md_lock);
+  names = rcs_directory(directory, path) ? NULL :
+    catalog_list(path, "metadata.");
+  pthread_rwlock_unlock(&directory->md_lock);
+  if (!names)
+    return 0;
+
+  res = 0;
+  for (i = 0; !res && names[i]; i++)
+    {
+      metadata = retain_lookup(directory, names[i], &loaded);
+      if (!metadata)
+	continue;
+      if (retain_read_policy(metadata, &policy) != 1)
+	policy = *inherited;
+
+      pthread_rwlock_rdlock(&metadata->md_lock);
+      subdirectory = metadata->md_versions &&
+	!rcs_version_file(metadata, metadata->md_versions, path) &&
+	!lstat(path, &st_data) && S_ISDIR(st_data.st_mode);
+      pthread_rwlock_unlock(&metadata->md_lock);
+
+      if (subdirectory)
+	res = retain_scan(metadata, &policy);
+      else
+	{
+	  expired = NULL;
+	  pthread_mutex_lock(&metadata->md_update);
+	  if (!rcs_load_history(metadata))
+	    retain_apply(metadata, &policy, &expired);
+	  pthread_mutex_unlock(&metadata->md_update);
+	  if (expired)
+	    {
+	      /* Their files are found through the file, kept until then */
+	      cache_hold_metadata(metadata);
+	      retain_batch_files[retain_batched] = metadata;
+	      retain_batch[retain_batched++] = expired;
+
+	      /* The objects they shared get swept */
+	      delta_schedule(metadata);
+	    }
+	}
+      if (loaded)
+	cache_demote_metadata(metadata);
+      cache_release_metadata(metadata);
+      if (!res)
+	res = retain_pace();
+    }
+  helper_free_array(names);
+  return res;
+}
+
+/*
+ * Background thread : apply the policies to the whole tree every
+ * RETAIN_INTERVAL seconds.
+ */
+static void *retain_worker(void *root)
+{
+  struct timespec deadline;
+  retain_policy_t policy;
+
+  pthread_mutex_lock(&retain_lock);
+  while (!retain_stopping)
+    {
+      pthread_mutex_unlock(&retain_lock);
+      if (retain_read_policy(root, &policy) != 1)
+	policy = retain_default;
+      retain_scan(root, &policy);
+      retain_flush();
+      pthread_mutex_lock(&retain_lock);
+
+      deadline.tv_sec = time(NULL) + RETAIN_INTERVAL;
+      deadline.tv_nsec = 0;
+      if (!retain_stopping)
+	pthread_cond_timedwait(&retain_wakeup, &retain_lock, &deadline);
+    }
+  pthread_mutex_unlock(&retain_lock);
+  return NULL;
+}
+
+/*
+ * Start the background thread, scanning the tree below the given root.
+ */
+void retain_start(metadata_t *root)
+{
+  pthread_mutex_lock(&retain_lock);
+  retain_stopping = 0;
+  retain_running = !pthread_create(&retain_thread, NULL, retain_worker,
+				   root);
+  pthread_mutex_unlock(&retain_lock);
+}
+
+/*
+ * Stop the background thread, unlinking the versions it has cut already.
+ */
+void retain_stop(void)
+{
+  pthread_mutex_lock(&retain_lock);
+  if (!retain_running)
+    {
+      pthread_mutex_unlock(&retain_lock);
+      return;
+    }
+  retain_running = 0;
+  __atomic_store_n(&retain_stopping, 1, __ATOMIC_RELEASE);
+  pthread_cond_signal(&retain_wakeup);
+  pthread_mutex_unlock(&retain_lock);
+  pthread_join(retain_thread, NULL);
+}
@@ -0,0 +1,39 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#ifndef RETAIN_H
+# define RETAIN_H
+
+# include <time.h>
+# include "structs.h"
+
+# define RETAIN_BATCH		64		/* Files between pauses	*/
+# define RETAIN_PAUSE		100		/* Milliseconds		*/
+# define RETAIN_INTERVAL	3600		/* Seconds between scans */
+
+typedef struct retain_policy_t	retain_policy_t;
+
+/* How much history of a file is kept, zero meaning no limit */
+struct				retain_policy_t
+{
+  unsigned int			rp_versions;	/* Versions kept	*/
+  unsigned long long		rp_bytes;	/* Disk space they use	*/
+  time_t			rp_age;		/* Seconds since current */
+};
+
+void		retain_setup(const retain_policy_t *policy);
+void		retain_start(metadata_t *root);
+void		retain_stop(void);
+int		retain_file(metadata_t *metadata);
+int		retain_flatten(metadata_t *metadata, int kept);
+int		retain_read_policy(metadata_t *metadata,
+				   retain_policy_t *policy);
+int		retain_write_policy(metadata_t *metadata,
+				    const retain_policy_t *policy);
+
+#endif /* !RETAIN_H */
@@ -0,0 +1,176 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "structs.h"
+#include "slab.h"
+
+/*
+ * The versions and the metadata of the files are allocated from slabs
+ * rather than one at a time with malloc() : they are small, of a single
+ * size each, and come and go all the time with the cache. The objects of a
+ * slab are all of the same kind, so a freed one always leaves room for the
+ * next one of its kind, and a slab whose objects are all free goes back to
+ * the system, but for one spare slab per pool, kept against churn.
+ */
+
+slab_pool_t slab_versions = SLAB_POOL(sizeof(version_t));
+slab_pool_t slab_metadata = SLAB_POOL(sizeof(metadata_t));
+
+/*
+ * Offset of the first object of a slab, after its header.
+ */
+#define SLAB_FIRST	((sizeof(slab_t) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1))
+
+/*
+ * Get a new slab for a pool, with all its objects free. The caller holds
+ * the pool's lock.
+ */
+static slab_t *slab_create(slab_pool_t *pool)
+{
+  slab_t *slab;
+  char *object, *end;
+  void **last;
+
+  if (posix_memalign((void **)&slab, SLAB_BYTES, SLAB_BYTES))
+    {
+      fprintf(stderr, "Out of memory in posix_memalign() [%s]\n", __func__);
+      abort();
+    }
+  slab->s_pool = pool;
+  slab->s_next = NULL;
+  slab->s_previous = NULL;
+  slab->s_used = 0;
+
+  /* Chain the free objects in the order of their addresses */
+  last = &slab->s_free;
+  end = (char *)slab + SLAB_BYTES - pool->sp_size;
+  for (object = (char *)slab + SLAB_FIRST; object <= end;
+       object += pool->sp_size)
+    {
+      *last = object;
+      last = (void **)object;
+    }
+  *last = NULL;
+
+  pool->sp_slabs++;
+  pool->sp_created++;
+  return slab;
+}
+
+/*
+ * Put a slab at the head of the partial slabs of its pool. The caller holds
+ * the pool's lock.
+ */
+static void slab_link(slab_pool_t *pool, slab_t *slab)
+{
+  slab->s_previous = NULL;
+  slab->s_next = pool->sp_partial;
+  if (pool->sp_partial)
+    pool->sp_partial->s_previous = slab;
+  pool->sp_partial = slab;
+}
+
+/*
+ * Take a slab out of the partial slabs of its pool. The caller holds the
+ * pool's lock.
+ */
+static void slab_unlink(slab_pool_t *pool, slab_t *slab)
+{
+  if (slab->s_previous)
+    slab->s_previous->s_next = slab->s_next;
+  else
+    pool->sp_partial = slab->s_next;
+  if (slab->s_next)
+    slab->s_next->s_previous = slab->s_previous;
+}
+
+/*
+ * Get an object from a pool. It is not initialized.
+ */
+void *slab_alloc(slab_pool_t *pool)
+{
+  slab_t *slab;
+  void *object;
+
+  pthread_mutex_lock(&pool->sp_lock);
+  slab = pool->sp_partial;
+  if (!slab)
+    {
+      slab = pool->sp_spare;
+      pool->sp_spare = NULL;
+      if (!slab)
+	slab = slab_create(pool);
+      slab_link(pool, slab);
+    }
+
+  object = slab->s_free;
+  slab->s_free = *(void **)object;
+  slab->s_used++;
+  pool->sp_used++;
+
+  /* A full slab is only found again through its objects */
+  if (!slab->s_free)
+    slab_unlink(pool, slab);
+  pthread_mutex_unlock(&pool->sp_lock);
+  return object;
+}
+
+/*
+ * Give back an object from slab_alloc().
+ */
+void slab_free(void *object)
+{
+  slab_pool_t *pool;
+  slab_t *slab, *released;
+
+  if (!object)
+    return;
+  slab = (slab_t *)((uintptr_t)object & ~(uintptr_t)(SLAB_BYTES - 1));
+  pool = slab->s_pool;
+
+  pthread_mutex_lock(&pool->sp_lock);
+  if (!slab->s_free)
+    slab_link(pool, slab);
+  *(void **)object = slab->s_free;
+  slab->s_free = object;
+  slab->s_used--;
+  pool->sp_used--;
+
+  /* An empty slab becomes the spare one, which goes back to the system */
+  released = NULL;
+  if (!slab->s_used)
+    {
+      slab_unlink(pool, slab);
+      released = pool->sp_spare;
+      pool->sp_spare = slab;
+      if (released)
+	pool->sp_slabs--;
+    }
+  pthread_mutex_unlock(&pool->sp_lock);
+  free(released);
+}
+
+/*
+ * Get the counters of a pool. The free objects are the room left in the
+ * slabs it holds, that only objects of its kind can use.
+ */
+void slab_get_stats(slab_pool_t *pool, slab_stats_t *stats)
+{
+  pthread_mutex_lock(&pool->sp_lock);
+  stats->ss_used = pool->sp_used;
+  stats->ss_slabs = pool->sp_slabs;
+  stats->ss_created = pool->sp_created;
+  pthread_mutex_unlock(&pool->sp_lock);
+  stats->ss_free = stats->ss_slabs *
+    ((SLAB_BYTES - SLAB_FIRST) / pool->sp_size) - stats->ss_used;
+}
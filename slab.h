@@ -0,0 +1,68 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#ifndef SLAB_H
+# define SLAB_H
+
+# include <stddef.h>
+# include <pthread.h>
+
+# define SLAB_BYTES		(64 << 10)	/* Size and alignment	*/
+# define SLAB_ALIGN		sizeof(void *)	/* Of the objects	*/
+
+typedef struct slab_t		slab_t;
+typedef struct slab_pool_t	slab_pool_t;
+typedef struct slab_stats_t	slab_stats_t;
+
+/*
+ * The header of a slab : a block of SLAB_BYTES, aligned on its size, cut in
+ * objects of the same size. The slab of an object is found by masking its
+ * address.
+ */
+struct				slab_t
+{
+  slab_pool_t			*s_pool;	/* Pool it belongs to	*/
+  slab_t			*s_next;	/* Next partial slab	*/
+  slab_t			*s_previous;	/* Previous partial slab */
+  void				*s_free;	/* Free objects		*/
+  unsigned int			s_used;		/* Objects handed out	*/
+};
+
+/* Objects of one size, taken from slabs that are full, partial or spare */
+struct				slab_pool_t
+{
+  pthread_mutex_t		sp_lock;
+  size_t			sp_size;	/* Bytes of an object	*/
+  slab_t			*sp_partial;	/* With free objects	*/
+  slab_t			*sp_spare;	/* Empty one kept, or NULL */
+  unsigned long			sp_used;	/* Objects handed out	*/
+  unsigned long			sp_slabs;	/* Slabs held		*/
+  unsigned long			sp_created;	/* Slabs ever allocated	*/
+};
+
+struct				slab_stats_t
+{
+  unsigned long			ss_used;	/* Objects handed out	*/
+  unsigned long			ss_free;	/* Free in the slabs	*/
+  unsigned long			ss_slabs;	/* Slabs held		*/
+  unsigned long			ss_created;	/* Slabs ever allocated	*/
+};
+
+# define SLAB_POOL(size)						\
+  { PTHREAD_MUTEX_INITIALIZER,						\
+    ((size) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1), NULL, NULL, 0, 0, 0 }
+
+/* The pools of the records of the metadata */
+extern slab_pool_t	slab_versions;
+extern slab_pool_t	slab_metadata;
+
+void		*slab_alloc(slab_pool_t *pool);
+void		slab_free(void *object);
+void		slab_get_stats(slab_pool_t *pool, slab_stats_t *stats);
+
+#endif /* !SLAB_H */
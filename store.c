@@ -0,0 +1,477 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include "helper.h"
+#include "structs.h"
+#include "rcs.h"
+#include "create.h"
+#include "store.h"
+
+/*
+ * Versions that hold the same data, in any file, share it through the
+ * object store : a directory of the version tree where each object is named
+ * after the hash of its contents, and is a hard link to the version files
+ * that hold these contents. The link count of an object is its reference
+ * count, so a version file keeps its name and is read like any other, and
+ * purging a version simply unlinks it. Objects only linked from the store
+ * are removed by store_sweep().
+ *
+ * Only versions that will not be written to anymore are stored, since all
+ * the files sharing an object would change with them, and only those
+ * without user attributes, since they would share these too. The chunks of
+ * the chunked versions (see chunk.c) are objects as well. The objects are
+ * added by the background thread only (see delta.c), so nothing else links
+ * to them while they are swept.
+ */
+
+static int store_orphans = 0;
+
+
+/*
+ * Get the name of the object directory, or of an object in it. Several
+ * objects with different contents may have the same hash : they get the
+ * following indexes.
+ */
+static char *store_object_name(uint64_t hash, int index)
+{
+  char name[32];
+
+  if (index < 0)
+    return helper_build_composite("SS", "/", rcs_version_path, STORE_DIR);
+  if (index)
+    sprintf(name, "%016llX.%d", (unsigned long long)hash, index);
+  else
+    sprintf(name, "%016llX", (unsigned long long)hash);
+  return helper_build_composite("SSS", "/", rcs_version_path, STORE_DIR,
+				name);
+}
+
+/*
+ * Create the object directory if it does not exist yet.
+ */
+static int store_make_directory(void)
+{
+  char *directory;
+  int res;
+
+  directory = store_object_name(0, -1);
+  res = mkdir(directory, S_IRWXU);
+  free(directory);
+  return (res == -1 && errno != EEXIST) ? -1 : 0;
+}
+
+/*
+ * Read as much of a buffer as the file has at the given offset. Returns the
+ * number of bytes read, or -1.
+ */
+static ssize_t store_read(int fd, char *buffer, size_t size, off_t offset)
+{
+  ssize_t res, done;
+
+  for (done = 0; (size_t)done < size; done += res)
+    {
+      res = pread(fd, buffer + done, size - done, offset + done);
+      if (res == -1 && errno == EINTR)
+	res = 0;
+      else if (res == -1)
+	return -1;
+      else if (res == 0)
+	break;
+    }
+  return done;
+}
+
+/*
+ * Hash the contents of a file.
+ */
+static int store_hash(int fd, uint64_t *hash)
+{
+  char *buffer;
+  off_t offset;
+  ssize_t res;
+
+  buffer = safe_malloc(STORE_CHUNK);
+  *hash = HASH_FNV_OFFSET;
+  offset = 0;
+  while ((res = store_read(fd, buffer, STORE_CHUNK, offset)) > 0)
+    {
+      *hash = helper_hash_data(*hash, buffer, res);
+      offset += res;
+    }
+  free(buffer);
+  *hash = helper_hash_mix(*hash ^ offset);
+  return (res == -1) ? -1 : 0;
+}
+
+/*
+ * Check if an object holds the same data as a file of the given size.
+ * Returns 1 if it does, 0 if it does not, or -1.
+ */
+static int store_compare(int fd, const char *object, off_t size)
+{
+  struct stat st_object;
+  char *ours, *theirs;
+  ssize_t res, other;
+  off_t offset;
+  int objfd, same;
+
+  if ((objfd = open(object, O_RDONLY)) == -1)
+    return -1;
+  if (fstat(objfd, &st_object) == -1)
+    {
+      close(objfd);
+      return -1;
+    }
+  if (st_object.st_size != size)
+    {
+      close(objfd);
+      return 0;
+    }
+
+  ours = safe_malloc(STORE_CHUNK);
+  theirs = safe_malloc(STORE_CHUNK);
+  same = 1;
+  for (offset = 0; same == 1 && offset < size; offset += res)
+    {
+      res = store_read(fd, ours, STORE_CHUNK, offset);
+      other = store_read(objfd, theirs, STORE_CHUNK, offset);
+      if ((res == -1) || (other == -1))
+	same = -1;
+      else if ((res != other) || (res == 0) || memcmp(ours, theirs, res))
+	same = 0;
+    }
+  free(ours);
+  free(theirs);
+  close(objfd);
+  return same;
+}
+
+/*
+ * Check if an object holds the given data. Returns 1 if it does, 0 if it
+ * does not, or -1, with ENOENT if there is no such object.
+ */
+static int store_match(const char *object, const char *data, size_t size)
+{
+  struct stat st_object;
+  char *theirs;
+  int objfd, same;
+
+  if ((objfd = open(object, O_RDONLY)) == -1)
+    return -1;
+  if (fstat(objfd, &st_object) == -1)
+    {
+      close(objfd);
+      return -1;
+    }
+  if (st_object.st_size != (off_t)size)
+    {
+      close(objfd);
+      return 0;
+    }
+
+  theirs = safe_malloc(size + 1);
+  if (store_read(objfd, theirs, size, 0) != (ssize_t)size)
+    same = -1;
+  else
+    same = !memcmp(data, theirs, size);
+  free(theirs);
+  close(objfd);
+  return same;
+}
+
+/*
+ * Write a new file with the given data, on the disk before it is used.
+ */
+static int store_write(const char *path, const char *data, size_t size)
+{
+  ssize_t res;
+  size_t done;
+  int fd;
+
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR)) == -1)
+    return -1;
+  for (done = 0; done < size; done += res)
+    {
+      res = pwrite(fd, data + done, size - done, done);
+      if (res == -1 && errno == EINTR)
+	res = 0;
+      else if (res == -1)
+	break;
+    }
+  if ((done < size) || (fdatasync(fd) == -1))
+    {
+      int error = errno;
+      close(fd);
+      unlink(path);
+      errno = error;
+      return -1;
+    }
+  return close(fd);
+}
+
+/*
+ * Make a version file a link to an object with the same contents. The
+ * switch is atomic, so readers see either file.
+ */
+static int store_link(const char *object, const char *rfile)
+{
+  char *temp;
+  int res;
+
+  temp = helper_get_sibling_name(rfile, "dedup");
+  unlink(temp);
+  res = link(object, temp);
+  if (!res && (rename(temp, rfile) == -1))
+    {
+      int error = errno;
+      unlink(temp);
+      errno = error;
+      res = -1;
+    }
+  free(temp);
+  return res;
+}
+
+/*
+ * Put a version that holds all its data in the object store : it becomes a
+ * link to the object holding the same contents, or the object itself if
+ * there is none yet. Versions already in the store, and files that are not
+ * regular files, or that have user attributes, are left alone. The caller
+ * holds the metadata's update lock, and makes sure the version will not be
+ * written to anymore.
+ */
+int store_add_version(metadata_t *metadata, version_t *version)
+{
+  struct stat st_data;
+  uint64_t hash;
+  char rfile[PATH_MAX], *object;
+  int fd, res, same, i;
+
+  if ((rcs_version_file(metadata, version, rfile) == -1) ||
+      ((fd = open(rfile, O_RDONLY)) == -1))
+    return -1;
+  if ((fstat(fd, &st_data) == -1) ||
+      (S_ISREG(st_data.st_mode) && (st_data.st_nlink == 1) &&
+       (store_hash(fd, &hash) == -1)))
+    {
+      int error = errno;
+      close(fd);
+      errno = error;
+      return -1;
+    }
+  if (!S_ISREG(st_data.st_mode) || (st_data.st_nlink != 1) ||
+      store_has_attributes(rfile))
+    {
+      close(fd);
+      return 0;
+    }
+
+  if (store_make_directory() == -1)
+    {
+      int error = errno;
+      close(fd);
+      errno = error;
+      return -1;
+    }
+
+  res = 0;
+  for (i = 0; i < STORE_PROBES; i++)
+    {
+      object = store_object_name(hash, i);
+      if (link(rfile, object) == 0)
+	same = 2;
+      else if (errno != EEXIST)
+	same = -1;
+      else
+	same = store_compare(fd, object, st_data.st_size);
+      if (same == 1)
+	res = store_link(object, rfile);
+      free(object);
+      if (same == -1)
+	res = -1;
+      if (same)
+	break;
+    }
+  close(fd);
+  return res;
+}
+
+/*
+ * Link a chunk of a version, with the given data, to the given path, from
+ * the object holding the same data, or from a new object if there is none
+ * yet. Returns 1 if an object was shared, 0 if a new one was written, or
+ * -1.
+ */
+int store_add_chunk(const char *data, size_t size, const char *path)
+{
+  uint64_t hash;
+  char *object;
+  int res, same, i;
+
+  if (store_make_directory() == -1)
+    return -1;
+
+  /* The same hash as the one of a version file holding that data */
+  hash = helper_hash_mix(helper_hash_data(HASH_FNV_OFFSET, data, size) ^
+			 size);
+  for (i = 0; i < STORE_PROBES; i++)
+    {
+      object = store_object_name(hash, i);
+      same = store_match(object, data, size);
+      res = 0;
+      if (same == 1)
+	res = (link(object, path) == -1) ? -1 : 1;
+      else if (same == -1 && errno == ENOENT)
+	{
+	  /* The first chunk with that data becomes the object */
+	  same = 2;
+	  res = store_write(path, data, size);
+	  if (!res && (link(path, object) == -1))
+	    res = -1;
+	}
+      else if (same == -1)
+	res = -1;
+      free(object);
+      if (same)
+	return res;
+    }
+
+  /* Too many objects with that hash, this one is not shared */
+  return store_write(path, data, size);
+}
+
+/*
+ * Check if a version file has user attributes, that the versions sharing
+ * its data would get too.
+ */
+int store_has_attributes(const char *rfile)
+{
+  char *names, *name;
+  ssize_t size;
+  int found;
+
+  size = llistxattr(rfile, NULL, 0);
+  if (size <= 0)
+    return 0;
+  names = safe_malloc(size);
+  size = llistxattr(rfile, names, size);
+  found = 0;
+  for (name = names; (size > 0) && (name < names + size);
+       name += strlen(name) + 1)
+    if (!strncmp(name, "user.", 5))
+      found = 1;
+  free(names);
+  return found;
+}
+
+/*
+ * Note that a version file sharing its data may have gone away, so that the
+ * next sweep looks for the objects nothing uses anymore.
+ */
+void store_release(void)
+{
+  __atomic_store_n(&store_orphans, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Remove a version file, which may have been the last user of an object.
+ */
+int store_unlink(const char *rfile)
+{
+  struct stat st_data;
+
+  if (lstat(rfile, &st_data) == -1)
+    return -1;
+  if (unlink(rfile) == -1)
+    return -1;
+  if (st_data.st_nlink > 1)
+    store_release();
+  return 0;
+}
+
+/*
+ * Give a version file its own copy of its data before its inode changes,
+ * if it shares it with an object. The caller holds the metadata's update
+ * lock.
+ */
+int store_detach(const char *rfile)
+{
+  struct timespec times[2];
+  struct stat st_data;
+  char *temp;
+  int res;
+
+  if (lstat(rfile, &st_data) == -1)
+    return -1;
+  if (!S_ISREG(st_data.st_mode) || (st_data.st_nlink == 1))
+    return 0;
+
+  temp = helper_get_sibling_name(rfile, "detach");
+  unlink(temp);
+  times[0] = st_data.st_atim;
+  times[1] = st_data.st_mtim;
+  res = (create_copy_file(rfile, temp, -1) == 0) ? 0 : -1;
+  if (!res)
+    res = utimensat(AT_FDCWD, temp, times, 0);
+  if (!res && (rename(temp, rfile) == -1))
+    {
+      int error = errno;
+      unlink(temp);
+      errno = error;
+      res = -1;
+    }
+  free(temp);
+  if (!res)
+    store_release();
+  return res;
+}
+
+/*
+ * Remove the objects that no version uses anymore, if some version files
+ * that were sharing their data went away since the last sweep.
+ */
+void store_sweep(void)
+{
+  struct dirent *entry;
+  struct stat st_data;
+  char *directory, *object;
+  DIR *dir;
+
+  if (!__atomic_exchange_n(&store_orphans, 0, __ATOMIC_ACQ_REL))
+    return;
+
+  directory = store_object_name(0, -1);
+  dir = opendir(directory);
+  if (dir)
+    {
+      while ((entry = readdir(dir)))
+	{
+	  if (entry->d_name[0] == '.')
+	    continue;
+	  object = helper_build_composite("SS", "/", directory,
+					  entry->d_name);
+	  if (!lstat(object, &st_data) && (st_data.st_nlink == 1))
+	    unlink(object);
+	  free(object);
+	}
+      closedir(dir);
+    }
+  free(directory);
+}
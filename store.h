@@ -0,0 +1,28 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#ifndef STORE_H
+# define STORE_H
+
+# include <sys/types.h>
+# include "structs.h"
+
+# define STORE_DIR		"objects"	/* Under the versions	*/
+# define STORE_CHUNK		(256 << 10)	/* Bytes read at once	*/
+# define STORE_PROBES		8		/* Objects per hash	*/
+
+int		store_add_version(metadata_t *metadata, version_t *version);
+int		store_add_chunk(const char *data, size_t size,
+				const char *path);
+int		store_has_attributes(const char *rfile);
+void		store_release(void);
+int		store_unlink(const char *rfile);
+int		store_detach(const char *rfile);
+void		store_sweep(void);
+
+#endif /* !STORE_H */
@@ -11,41 +11,140 @@
 
 # include <sys/types.h>
 # include <sys/time.h>
+# include <stdint.h>
+# include <pthread.h>
 
 # define LATEST			-1
+# define OVERLAY_DEPTH		8		/* Overlays over a copy	*/
 
 /* Data types */
 
 typedef struct version_t	version_t;
 typedef struct metadata_t	metadata_t;
 typedef struct bucket_t		bucket_t;
+typedef struct table_t		table_t;
+typedef struct handle_t		handle_t;
+typedef struct listing_t	listing_t;
+typedef struct overlay_t	overlay_t;
+typedef struct chain_t		chain_t;
+typedef struct extent_t		extent_t;
 
+/*
+ * A version of a file. Its real file is named after v_file in the preferred
+ * version of the parent directory, and is found with rcs_version_file().
+ * Subversions share the file of the version they were made from.
+ */
 struct				version_t
 {
   unsigned int			v_vid;		/* Version ID		*/
   unsigned int			v_svid;		/* Subversion ID	*/
+  unsigned int			v_file;		/* Serial of its file	*/
 
   mode_t			v_mode;		/* File permissions	*/
   uid_t				v_uid;		/* Owner		*/
   gid_t				v_gid;		/* Group		*/
 
-  char				*v_rfile;	/* Real file name	*/
+  overlay_t			*v_overlay;	/* Blocks it holds	*/
+  int				v_probed;	/* Overlay looked for ?	*/
 
   version_t			*v_next;	/* Next version		*/
 };
 
 struct				metadata_t
 {
-  char				*md_vfile;	/* Virtual file name	*/
-  char				**md_vpath;	/* Virtual path		*/
+  const char			*md_name;	/* Last path component	*/
+  metadata_t			*md_parent;	/* Parent directory	*/
+  uint64_t			md_hash;	/* Hash of the path	*/
   version_t			*md_versions;	/* List of versions	*/
+  version_t			**md_index;	/* The same, by position */
+  unsigned int			md_count;	/* Versions in the index */
+  unsigned int			md_borrowed;	/* Using older files	*/
   int				md_deleted;	/* File deleted ?	*/
+  int				md_negative;	/* Known not to exist	*/
   int				md_dfl_vid;	/* Default version	*/
   int				md_dfl_svid;	/* Default subversion	*/
+  version_t			*md_pinned;	/* Default found, or NULL */
+  unsigned int			md_directory;	/* Its file, or 0	*/
   time_t			md_timestamp;	/* Mod. begin		*/
+  unsigned int			md_writers;	/* Open for writing	*/
+  int				md_partial;	/* Older versions unread */
+  int				md_appendable;	/* File takes entries ?	*/
+
+  pthread_rwlock_t		md_lock;	/* Guards the above	*/
+  pthread_mutex_t		md_update;	/* Serializes changes	*/
+
+  unsigned int			md_refcount;	/* Users and children	*/
+  int				md_cached;	/* Linked in cache ?	*/
+  int				md_demoted;	/* Evict first once unused */
+  size_t			md_size;	/* Accounted bytes	*/
 
   metadata_t			*md_next;	/* Next file in bucket	*/
   metadata_t			*md_previous;	/* Previous "		*/
+  metadata_t			*md_lru_next;	/* Less recently used	*/
+  metadata_t			*md_lru_previous; /* More recently used	*/
+};
+
+struct				handle_t
+{
+  int				h_fd;		/* Real file descriptor	*/
+  int				h_flags;	/* Flags to write with	*/
+  int				h_write;	/* Open for writing ?	*/
+  int				h_dirty;	/* Has its own version ? */
+  chain_t			*h_chain;	/* Layers of an overlay	*/
+  chain_t			*h_retired;	/* Chain before writing	*/
+  metadata_t			*h_metadata;	/* Metadata of the file	*/
+};
+
+/*
+ * An overlay version only holds the blocks written since it was created, the
+ * others come from its base version, up to the size the base had (or the
+ * size the overlay was truncated to since). Its block map is shared by all
+ * the users of the version. A chunked version is a layer without a base,
+ * whose data is a list of chunks of the object store instead, and so is a
+ * compressed version, whose data is a list of compressed frames.
+ */
+struct				overlay_t
+{
+  unsigned int			o_refcount;	/* Versions and chains	*/
+  pthread_mutex_t		o_lock;		/* Guards the map	*/
+  int				o_mapfd;	/* Map file		*/
+  unsigned int			o_base;		/* Base version ID	*/
+  off_t				o_base_size;	/* Bytes from the base	*/
+  unsigned char			*o_map;		/* Blocks held here	*/
+  size_t			o_bytes;	/* Size of the map	*/
+  char				*o_chunkdir;	/* Chunks, or NULL	*/
+  int				o_framefd;	/* Frames, or -1	*/
+  uint64_t			*o_ends;	/* Where each one ends	*/
+  unsigned int			o_chunks;	/* Number of them	*/
+  int				o_discard;	/* Remove them at last?	*/
+};
+
+struct				chain_t
+{
+  unsigned int			c_count;	/* Layers in the chain	*/
+  int				c_fds[OVERLAY_DEPTH + 1]; /* Newest first */
+  overlay_t			*c_overlays[OVERLAY_DEPTH + 1]; /* Or NULL */
+  char				*c_frame;	/* Last frame read	*/
+  overlay_t			*c_frame_layer;	/* Layer it comes from	*/
+  unsigned int			c_frame_index;	/* Its index there	*/
+  size_t			c_frame_size;	/* Bytes it holds	*/
+};
+
+struct				extent_t
+{
+  int				e_fd;		/* Layer holding it	*/
+  off_t				e_offset;	/* Offset in the file	*/
+  off_t				e_position;	/* Offset in the layer	*/
+  size_t			e_length;	/* Bytes		*/
+  int				e_zero;		/* Never written ?	*/
+  int				e_owned;	/* Descriptor to close?	*/
+  char				*e_data;	/* Or the data itself	*/
+};
+
+struct				listing_t
+{
+  char				**l_names;	/* Visible entries	*/
+  unsigned int			l_count;	/* Number of entries	*/
 };
 
 struct				bucket_t
@@ -54,4 +153,11 @@ struct				bucket_t
   metadata_t			*b_contents;	/* Metadata chain	*/
 };
 
+struct				table_t
+{
+  bucket_t			*t_buckets;	/* Bucket array		*/
+  unsigned int			t_size;		/* Bucket count (2^n)	*/
+  unsigned int			t_count;	/* Item count		*/
+};
+
 #endif /* !STRUCTS_H */
@@ -0,0 +1,79 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "structs.h"
+#include "cache.h"
+#include "test.h"
+
+#define BENCH_LOOKUPS	1000000		/* Lookups per size	*/
+
+/*
+ * Look up random entries of a directory in the cache, as it grows from a
+ * thousand entries up to the number given (a million by default), to check
+ * that the cost of a lookup does not depend on the size of the cache. All
+ * the entries stay cached, and are all found again after the hash table
+ * grew.
+ */
+int main(int argc, char **argv)
+{
+  metadata_t *root, *metadata;
+  cache_stats_t stats;
+  unsigned int count, size, max, i, index;
+  unsigned long long random;
+  char name[32], limit[32];
+  double start;
+
+  max = (argc > 1) ? strtoul(argv[1], NULL, 0) : 1000000;
+  snprintf(limit, sizeof(limit), "%u", max + 1);
+  setenv("RCS_CACHE_SIZE", limit, 1);
+  setenv("RCS_CACHE_BYTES", "0x7fffffffffff", 1);
+  root = test_setup();
+
+  random = 88172645463325252ULL;
+  for (count = 0, size = 1000; size <= max; size *= 10)
+    {
+      for (; count < size; count++)
+	{
+	  snprintf(name, sizeof(name), "entry%u", count);
+	  cache_release_metadata(test_new_metadata(root, name));
+	}
+
+      start = test_now();
+      for (i = 0; i < BENCH_LOOKUPS; i++)
+	{
+	  random ^= random << 13;
+	  random ^= random >> 7;
+	  random ^= random << 17;
+	  index = random % size;
+	  snprintf(name, sizeof(name), "entry%u", index);
+	  metadata = cache_get_child(root, name);
+	  TEST_ASSERT(metadata);
+	  cache_release_metadata(metadata);
+	}
+      printf("%9u entries: %4.0f ns per lookup\n", size,
+	     (test_now() - start) * 1e9 / BENCH_LOOKUPS);
+
+      /* Nothing was evicted, and the table was grown without losing any */
+      cache_get_stats(&stats);
+      TEST_ASSERT(stats.cs_items == size + 1);
+      TEST_ASSERT(!stats.cs_evictions);
+      for (index = 0; index < size; index++)
+	{
+	  snprintf(name, sizeof(name), "entry%u", index);
+	  metadata = cache_get_child(root, name);
+	  TEST_ASSERT(metadata);
+	  cache_release_metadata(metadata);
+	}
+    }
+
+  test_teardown(root);
+  return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+
+#include "helper.h"
+#include "structs.h"
+#include "cache.h"
+#include "create.h"
+#include "chunk.h"
+#include "store.h"
+#include "rcs.h"
+#include "test.h"
+
+#define BENCH_SIZE	(64 << 20)	/* Bytes of the first version	*/
+#define BENCH_VERSIONS	8		/* Versions made		*/
+#define BENCH_INSERT	100		/* Bytes inserted per version	*/
+
+static unsigned long long bench_bytes;
+
+/*
+ * Add up the space used by the files below a directory.
+ */
+static int bench_count(const char *path, const struct stat *st_data,
+		       int type, struct FTW *ftw)
+{
+  (void)path;
+  (void)ftw;
+  if (type == FTW_F)
+    bench_bytes += st_data->st_blocks * 512ULL;
+  return 0;
+}
+
+/*
+ * Get the space used by the files below a directory.
+ */
+static unsigned long long bench_space(const char *path)
+{
+  bench_bytes = 0;
+  TEST_ASSERT(!nftw(path, bench_count, 16, FTW_PHYS));
+  return bench_bytes;
+}
+
+/*
+ * Make versions of a large file, each with a few bytes inserted somewhere,
+ * and keep each old version twice : as a full copy, the way versions were
+ * kept before, and as chunks. Compare the time both take, and the space
+ * they use once all the versions are in.
+ */
+int main(void)
+{
+  metadata_t *root, *metadata;
+  version_t *version;
+  chunk_stats_t stats;
+  unsigned long long random, logical;
+  char rfile[PATH_MAX], copy[PATH_MAX + 16], *copies, *objects, *data;
+  double copied, chunked, start;
+  size_t size, offset;
+  int i, fd;
+
+  root = test_setup();
+  chunk_setup(1);
+  copies = helper_build_composite("SS", "/", rcs_version_path, "copies");
+  objects = helper_build_composite("SS", "/", rcs_version_path, STORE_DIR);
+  TEST_ASSERT(!mkdir(copies, S_IRWXU));
+
+  data = safe_malloc(BENCH_SIZE + BENCH_VERSIONS * BENCH_INSERT);
+  random = 88172645463325252ULL;
+  for (size = 0; size < BENCH_SIZE; size++)
+    {
+      random ^= random << 13;
+      random ^= random >> 7;
+      random ^= random << 17;
+      data[size] = random;
+    }
+  metadata = test_create_file(root, "file", data, size);
+
+  copied = 0;
+  chunked = 0;
+  logical = 0;
+  for (i = 0; i < BENCH_VERSIONS; i++)
+    {
+      /* The next version has a few more bytes somewhere */
+      random ^= random << 13;
+      random ^= random >> 7;
+      random ^= random << 17;
+      offset = random % size;
+      memmove(data + offset + BENCH_INSERT, data + offset, size - offset);
+      memset(data + offset, 'a' + i, BENCH_INSERT);
+
+      pthread_mutex_lock(&metadata->md_update);
+      version = metadata->md_versions;
+      TEST_ASSERT(!rcs_version_file(metadata, version, rfile));
+      metadata->md_timestamp = 0;
+      TEST_ASSERT(!create_new_version_truncated(metadata, 0));
+
+      /* Keep the old one as a copy, then as chunks */
+      snprintf(copy, sizeof(copy), "%s/%i", copies, i);
+      start = test_now();
+      TEST_ASSERT(!create_copy_file(rfile, copy, -1));
+      copied += test_now() - start;
+      start = test_now();
+      TEST_ASSERT(chunk_add_version(metadata, version) == 1);
+      chunked += test_now() - start;
+      logical += size;
+
+      size += BENCH_INSERT;
+      TEST_ASSERT(!rcs_version_file(metadata, metadata->md_versions, rfile));
+      fd = open(rfile, O_WRONLY);
+      TEST_ASSERT(fd != -1);
+      TEST_ASSERT(write(fd, data, size) == (ssize_t)size);
+      close(fd);
+      pthread_mutex_unlock(&metadata->md_update);
+    }
+
+  chunk_get_stats(&stats);
+  TEST_ASSERT(stats.ck_bytes == logical);
+  printf("%i versions, %llu MB of data\n", BENCH_VERSIONS, logical >> 20);
+  printf("full copies: %6.0f MB/s, %6llu MB used\n", logical / copied / 1e6,
+	 bench_space(copies) >> 20);
+  printf("chunks:      %6.0f MB/s, %6llu MB used, %lu of %lu chunks shared\n",
+	 logical / chunked / 1e6, bench_space(objects) >> 20, stats.ck_shared,
+	 stats.ck_chunks);
+
+  free(data);
+  free(objects);
+  free(copies);
+  cache_release_metadata(metadata);
+  test_teardown(root);
+  return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "helper.h"
+#include "structs.h"
+#include "cache.h"
+#include "create.h"
+#include "rcs.h"
+#include "dircache.h"
+#include "test.h"
+
+#define BENCH_SIZE	(64 << 20)	/* Bytes of the file read	*/
+#define BENCH_CHUNK	(128 << 10)	/* Largest read			*/
+#define BENCH_PASSES	4		/* Times the file is read	*/
+
+/*
+ * Read a file sequentially the way the callbacks did before they kept a
+ * descriptor in their handle : translating its path, then opening and
+ * closing it again for each chunk. What is read is checked against the
+ * data written if asked to.
+ */
+static double bench_by_path(const char *data, char *buffer, int chunk,
+			    int passes)
+{
+  char rfile[PATH_MAX];
+  double start;
+  off_t offset;
+  int pass, fd;
+
+  start = test_now();
+  for (pass = 0; pass < passes; pass++)
+    for (offset = 0; offset < BENCH_SIZE; offset += chunk)
+      {
+	TEST_ASSERT(!rcs_translate_path("/a/b/c/file", rcs_version_path,
+					rfile));
+	fd = open(rfile, O_RDONLY);
+	TEST_ASSERT(fd != -1);
+	TEST_ASSERT(pread(fd, buffer, chunk, offset) == chunk);
+	close(fd);
+	TEST_ASSERT(!data || !memcmp(buffer, data + offset, chunk));
+      }
+  return test_now() - start;
+}
+
+/*
+ * Read a file sequentially the way the callbacks do : with the descriptor
+ * opened once, relative to the handle of its real directory.
+ */
+static double bench_by_handle(metadata_t *metadata, const char *data,
+			      char *buffer, int chunk, int passes)
+{
+  dircache_t *directory;
+  version_t *version;
+  char name[NAME_MAX + 1];
+  double start;
+  off_t offset;
+  int pass, fd;
+
+  start = test_now();
+  pthread_rwlock_rdlock(&metadata->md_lock);
+  version = rcs_find_version(metadata, LATEST, LATEST, RCS_HIDE_DELETED);
+  TEST_ASSERT(version);
+  directory = rcs_version_at(metadata, version, name);
+  TEST_ASSERT(directory);
+  fd = openat(directory->dc_fd, name, O_RDONLY);
+  TEST_ASSERT(fd != -1);
+  dircache_put(directory);
+  pthread_rwlock_unlock(&metadata->md_lock);
+  for (pass = 0; pass < passes; pass++)
+    for (offset = 0; offset < BENCH_SIZE; offset += chunk)
+      {
+	TEST_ASSERT(pread(fd, buffer, chunk, offset) == chunk);
+	TEST_ASSERT(!data || !memcmp(buffer, data + offset, chunk));
+      }
+  close(fd);
+  return test_now() - start;
+}
+
+/*
+ * Compare the throughput of sequential reads of a file below a few
+ * directories, by path and through a kept descriptor, once the file is in
+ * the page cache. Both have to read the data that was written.
+ */
+int main(void)
+{
+  metadata_t *root, *directory, *metadata;
+  static const char *path_names[] = { "a", "b", "c", NULL };
+  char *data, *buffer;
+  double path, handle;
+  size_t i;
+  int chunk;
+
+  root = test_setup();
+  cache_hold_metadata(root);
+  for (i = 0, directory = root; path_names[i]; i++)
+    {
+      TEST_ASSERT(!create_new_directory(directory, path_names[i], 0755,
+					getuid(), getgid()));
+      metadata = rcs_lookup(directory, path_names[i]);
+      TEST_ASSERT(metadata);
+      cache_release_metadata(directory);
+      directory = metadata;
+    }
+  data = safe_malloc(BENCH_SIZE);
+  buffer = safe_malloc(BENCH_CHUNK);
+  for (i = 0; i < BENCH_SIZE; i++)
+    data[i] = i * 7 + i / 4093;
+  metadata = test_create_file(directory, "file", data, BENCH_SIZE);
+  cache_release_metadata(directory);
+
+  /* Check both ways, which warms the page cache, then time them */
+  bench_by_path(data, buffer, BENCH_CHUNK, 1);
+  bench_by_handle(metadata, data, buffer, BENCH_CHUNK, 1);
+  for (chunk = 4096; chunk <= BENCH_CHUNK; chunk *= 2)
+    {
+      path = bench_by_path(NULL, buffer, chunk, BENCH_PASSES);
+      handle = bench_by_handle(metadata, NULL, buffer, chunk, BENCH_PASSES);
+      printf("%6i bytes per read: %6.0f MB/s by path, %6.0f MB/s by handle\n",
+	     chunk, BENCH_PASSES * (double)BENCH_SIZE / path / 1e6,
+	     BENCH_PASSES * (double)BENCH_SIZE / handle / 1e6);
+    }
+
+  free(buffer);
+  free(data);
+  cache_release_metadata(metadata);
+  test_teardown(root);
+  return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "structs.h"
+#include "intern.h"
+#include "slab.h"
+#include "cache.h"
+#include "test.h"
+
+/*
+ * Get the bytes held by the slabs of the metadata and of the versions, and
+ * by the interned names.
+ */
+static void bench_held(size_t *slabs, size_t *names)
+{
+  slab_stats_t metadata, versions;
+  unsigned int count;
+
+  slab_get_stats(&slab_metadata, &metadata);
+  slab_get_stats(&slab_versions, &versions);
+  *slabs = (metadata.ss_slabs + versions.ss_slabs) * (size_t)SLAB_BYTES;
+  intern_get_stats(&count, names);
+}
+
+/*
+ * Fill the cache with entries of a directory, each with one version, from
+ * a thousand up to the number given (a million by default), and report
+ * the memory an entry takes : its records, from the slabs they are cut
+ * from, its name, and its index of versions, along with what the cache
+ * accounts for it.
+ */
+int main(int argc, char **argv)
+{
+  metadata_t *root;
+  cache_stats_t first, stats;
+  unsigned int count, size, max;
+  size_t slabs, names, slabs_first, names_first, index;
+  char name[32], limit[32];
+
+  max = (argc > 1) ? strtoul(argv[1], NULL, 0) : 1000000;
+  snprintf(limit, sizeof(limit), "%u", max + 1);
+  setenv("RCS_CACHE_SIZE", limit, 1);
+  setenv("RCS_CACHE_BYTES", "0x7fffffffffff", 1);
+  root = test_setup();
+  cache_get_stats(&first);
+  bench_held(&slabs_first, &names_first);
+
+  for (count = 0, size = 1000; size <= max; size *= 10)
+    {
+      for (; count < size; count++)
+	{
+	  snprintf(name, sizeof(name), "entry%u", count);
+	  cache_release_metadata(test_new_metadata(root, name));
+	}
+
+      cache_get_stats(&stats);
+      TEST_ASSERT(stats.cs_items == first.cs_items + size);
+      TEST_ASSERT(!stats.cs_evictions);
+      bench_held(&slabs, &names);
+      index = sizeof(version_t *);
+      printf("%9u entries: %4.0f bytes per entry (records %3.0f, name %2.0f,"
+	     " index %zu), %4.0f accounted\n", size,
+	     (double)(slabs - slabs_first + names - names_first) / size +
+	     index, (double)(slabs - slabs_first) / size,
+	     (double)(names - names_first) / size, index,
+	     (double)(stats.cs_bytes - first.cs_bytes) / size);
+    }
+
+  test_teardown(root);
+  return 0;
+}
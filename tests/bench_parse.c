@@ -0,0 +1,132 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "structs.h"
+#include "slab.h"
+#include "cache.h"
+#include "create.h"
+#include "journal.h"
+#include "parse.h"
+#include "write.h"
+#include "rcs.h"
+#include "test.h"
+
+#define BENCH_VERSIONS	5000		/* Versions of the file	*/
+#define BENCH_ROUNDS	200		/* Parses timed		*/
+
+/*
+ * Give a file versions up to the given one, newest first, every tenth one
+ * with a subversion.
+ */
+static void bench_add_versions(metadata_t *metadata, unsigned int count)
+{
+  version_t *version;
+  unsigned int vid, svid;
+
+  pthread_rwlock_wrlock(&metadata->md_lock);
+  for (vid = metadata->md_versions->v_vid + 1; vid <= count; vid++)
+    for (svid = 0; svid <= !(vid % 10); svid++)
+      {
+	version = slab_alloc(&slab_versions);
+	*version = *metadata->md_versions;
+	version->v_vid = vid;
+	version->v_svid = svid;
+	version->v_file = vid;
+	version->v_mode = 0600 | (vid & 077);
+	version->v_next = metadata->md_versions;
+	metadata->md_versions = version;
+      }
+  rcs_versions_changed(metadata);
+  pthread_rwlock_unlock(&metadata->md_lock);
+}
+
+/*
+ * Write the versions of a file in the text format of the older releases,
+ * oldest first, one line each.
+ */
+static void bench_write_text(const char *metafile, metadata_t *metadata)
+{
+  version_t *version;
+  unsigned int i;
+  FILE *fh;
+
+  fh = fopen(metafile, "w");
+  TEST_ASSERT(fh);
+  for (i = metadata->md_count; i > 0; i--)
+    {
+      version = metadata->md_index[i - 1];
+      fprintf(fh, "%u:%u:%o:%u:%u:%08X.%s\n", version->v_vid,
+	      version->v_svid, version->v_mode, version->v_uid,
+	      version->v_gid, version->v_file, metadata->md_name);
+    }
+  TEST_ASSERT(!fclose(fh));
+}
+
+/*
+ * Parse a metadata file over and over, checking that all the versions are
+ * read each time, and return the microseconds a parse takes.
+ */
+static double bench_parse(char *metafile, metadata_t *metadata)
+{
+  metadata_t *parsed;
+  version_t *version;
+  unsigned int count;
+  double start;
+  int i;
+
+  start = test_now();
+  for (i = 0; i < BENCH_ROUNDS; i++)
+    {
+      parsed = parse_metadata_file(metafile);
+      TEST_ASSERT(parsed);
+      for (count = 0, version = parsed->md_versions; version;
+	   version = version->v_next)
+	count++;
+      TEST_ASSERT(count == metadata->md_count);
+      TEST_ASSERT(parsed->md_versions->v_vid == BENCH_VERSIONS);
+      rcs_free_metadata(parsed);
+    }
+  return (test_now() - start) * 1e6 / BENCH_ROUNDS;
+}
+
+/*
+ * Time the parse of a long history, from a metadata file in the binary
+ * format, then from the same versions in the text format.
+ */
+int main(void)
+{
+  metadata_t *root, *metadata;
+  char metafile[PATH_MAX];
+
+  /*
+   * Without the journal or the catalogs, the files are read from the disk,
+   * where the text one is written here.
+   */
+  setenv("RCS_CATALOG", "0", 1);
+  root = test_setup();
+  journal_close();
+  metadata = test_new_metadata(root, "history");
+  bench_add_versions(metadata, BENCH_VERSIONS);
+  TEST_ASSERT(!create_meta_name(metadata, "metadata", metafile));
+
+  TEST_ASSERT(!write_metadata_file(metafile, metadata));
+  printf("%u versions, binary: %7.0f us per parse\n", metadata->md_count,
+	 bench_parse(metafile, metadata));
+  bench_write_text(metafile, metadata);
+  printf("%u versions, text:   %7.0f us per parse\n", metadata->md_count,
+	 bench_parse(metafile, metadata));
+
+  cache_release_metadata(metadata);
+  test_teardown(root);
+  return 0;
+}
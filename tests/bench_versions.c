@@ -0,0 +1,101 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "structs.h"
+#include "slab.h"
+#include "cache.h"
+#include "rcs.h"
+#include "test.h"
+
+#define BENCH_LOOKUPS	1000000		/* Lookups per size	*/
+
+/*
+ * Give a file versions up to the given one, each with two subversions, the
+ * way new versions are linked : newest first.
+ */
+static void bench_add_versions(metadata_t *metadata, unsigned int count)
+{
+  version_t *version;
+  unsigned int vid, svid;
+
+  pthread_rwlock_wrlock(&metadata->md_lock);
+  for (vid = metadata->md_versions->v_vid + 1; vid <= count; vid++)
+    for (svid = 0; svid < 2; svid++)
+      {
+	version = slab_alloc(&slab_versions);
+	*version = *metadata->md_versions;
+	version->v_vid = vid;
+	version->v_svid = svid;
+	version->v_file = vid;
+	version->v_next = metadata->md_versions;
+	metadata->md_versions = version;
+      }
+  rcs_versions_changed(metadata);
+  pthread_rwlock_unlock(&metadata->md_lock);
+}
+
+/*
+ * Look up random versions of a file, as its history grows from ten to a
+ * hundred thousand versions (or the number given), to check that the cost
+ * of a lookup does not depend on the size of the history. Every version is
+ * found, the latest subversion when none is given, and no other.
+ */
+int main(int argc, char **argv)
+{
+  metadata_t *root, *metadata;
+  version_t *version;
+  unsigned int count, max, vid, i;
+  unsigned long long random;
+  double start;
+
+  max = (argc > 1) ? strtoul(argv[1], NULL, 0) : 100000;
+  root = test_setup();
+  metadata = test_new_metadata(root, "history");
+
+  random = 88172645463325252ULL;
+  for (count = 10; count <= max; count *= 10)
+    {
+      bench_add_versions(metadata, count);
+      TEST_ASSERT(metadata->md_count == count * 2 - 1);
+
+      pthread_rwlock_rdlock(&metadata->md_lock);
+      for (vid = 1; vid <= count; vid++)
+	{
+	  version = rcs_get_version(metadata, vid, LATEST);
+	  TEST_ASSERT(version && (version->v_vid == vid));
+	  TEST_ASSERT(version->v_svid == ((vid == 1) ? 0 : 1));
+	  version = rcs_get_version(metadata, vid, 0);
+	  TEST_ASSERT(version && (version->v_vid == vid) && !version->v_svid);
+	  TEST_ASSERT(!rcs_get_version(metadata, vid, 2));
+	}
+      TEST_ASSERT(!rcs_get_version(metadata, 0, LATEST));
+      TEST_ASSERT(!rcs_get_version(metadata, count + 1, LATEST));
+
+      start = test_now();
+      for (i = 0; i < BENCH_LOOKUPS; i++)
+	{
+	  random ^= random << 13;
+	  random ^= random >> 7;
+	  random ^= random << 17;
+	  vid = random % count + 1;
+	  version = rcs_get_version(metadata, vid, 0);
+	  TEST_ASSERT(version && (version->v_vid == vid));
+	}
+      pthread_rwlock_unlock(&metadata->md_lock);
+      printf("%9u versions: %4.0f ns per lookup\n", count * 2 - 1,
+	     (test_now() - start) * 1e9 / BENCH_LOOKUPS);
+    }
+
+  cache_release_metadata(metadata);
+  test_teardown(root);
+  return 0;
+}
@@ -0,0 +1,113 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "structs.h"
+#include "cache.h"
+#include "create.h"
+#include "rcs.h"
+#include "test.h"
+
+#define CHECK_ROUNDS	1000		/* Translations counted	*/
+
+/*
+ * The allocations are counted by replacing the allocator's entry points
+ * with ones that count the calls, then go to the C library's. The
+ * sanitizers replace them already : the calls are not counted with them.
+ */
+#if !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+# define CHECK_COUNTED	1
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *pointer, size_t size);
+
+static unsigned long check_allocations;
+
+void *malloc(size_t size)
+{
+  __atomic_add_fetch(&check_allocations, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+  __atomic_add_fetch(&check_allocations, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size)
+{
+  __atomic_add_fetch(&check_allocations, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(pointer, size);
+}
+#else
+# define CHECK_COUNTED	0
+
+static unsigned long check_allocations;
+#endif
+
+/*
+ * Translate a virtual path, and the name of the metadata file of the entry
+ * it leads to, once all its components are in the cache, as each FUSE
+ * callback that works on a path did : none of it may allocate memory.
+ */
+int main(void)
+{
+  metadata_t *root, *directory, *metadata;
+  static const char *path_names[] = { "a", "b", "c", NULL };
+  char rfile[PATH_MAX], metafile[PATH_MAX];
+  unsigned long before;
+  size_t length;
+  int i;
+
+  root = test_setup();
+  cache_hold_metadata(root);
+  for (i = 0, directory = root; path_names[i]; i++)
+    {
+      TEST_ASSERT(!create_new_directory(directory, path_names[i], 0755,
+					getuid(), getgid()));
+      metadata = rcs_lookup(directory, path_names[i]);
+      TEST_ASSERT(metadata);
+      cache_release_metadata(directory);
+      directory = metadata;
+    }
+
+  /* Warm the cache, with redundant separators */
+  TEST_ASSERT(!rcs_translate_path("//a/b//c", rcs_version_path, rfile));
+  length = strlen(rcs_version_path);
+  TEST_ASSERT(!strncmp(rfile, rcs_version_path, length));
+  TEST_ASSERT(!strcmp(rfile + length,
+		      "/00000001.a/00000001.b/00000001.c"));
+
+  before = __atomic_load_n(&check_allocations, __ATOMIC_RELAXED);
+  for (i = 0; i < CHECK_ROUNDS; i++)
+    {
+      TEST_ASSERT(!rcs_translate_path("//a/b//c", rcs_version_path, rfile));
+      metadata = rcs_translate_to_metadata("/a/b/c", rcs_version_path,
+					   RCS_HIDE_DELETED);
+      TEST_ASSERT(metadata == directory);
+      TEST_ASSERT(!create_meta_name(metadata, "metadata", metafile));
+      cache_release_metadata(metadata);
+    }
+  TEST_ASSERT(!CHECK_COUNTED ||
+	      (__atomic_load_n(&check_allocations, __ATOMIC_RELAXED) ==
+	       before));
+  TEST_ASSERT(!strcmp(metafile + length,
+		      "/00000001.a/00000001.b/metadata.c"));
+
+  cache_release_metadata(directory);
+  test_teardown(root);
+  return 0;
+}
@@ -0,0 +1,155 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "structs.h"
+#include "cache.h"
+#include "create.h"
+#include "rcs.h"
+#include "test.h"
+
+#define CHECK_ITEMS	32		/* Items the cache holds	*/
+#define CHECK_HELD	8		/* Entries kept referenced	*/
+
+/*
+ * Check that a failed lookup leaves a negative entry in the cache, which
+ * answers the next lookups of the name, and that creating the file
+ * replaces it.
+ */
+static void check_negative(metadata_t *root)
+{
+  cache_stats_t first, stats;
+  metadata_t *metadata;
+
+  /* The first lookup goes to the disk, and caches the answer */
+  cache_get_stats(&first);
+  TEST_ASSERT(!rcs_lookup(root, "file"));
+  cache_get_stats(&stats);
+  TEST_ASSERT(stats.cs_misses == first.cs_misses + 1);
+  TEST_ASSERT(stats.cs_items == first.cs_items + 1);
+  metadata = cache_get_child(root, "file");
+  TEST_ASSERT(metadata && metadata->md_negative);
+  cache_release_metadata(metadata);
+
+  /* The next one is answered by the cache */
+  cache_get_stats(&first);
+  TEST_ASSERT(!rcs_lookup(root, "file"));
+  cache_get_stats(&stats);
+  TEST_ASSERT(stats.cs_misses == first.cs_misses);
+  TEST_ASSERT(stats.cs_negative_hits == first.cs_negative_hits + 1);
+
+  /* Creating the file replaces the entry */
+  TEST_ASSERT(!create_new_file(root, "file", S_IFREG | 0644, getuid(),
+			       getgid(), 0));
+  cache_get_stats(&first);
+  TEST_ASSERT(first.cs_items == stats.cs_items);
+  metadata = rcs_lookup(root, "file");
+  TEST_ASSERT(metadata && !metadata->md_negative && !metadata->md_deleted);
+  TEST_ASSERT(metadata->md_versions && (metadata->md_versions->v_vid == 1));
+  cache_get_stats(&stats);
+  TEST_ASSERT(stats.cs_hits == first.cs_hits + 1);
+  TEST_ASSERT(stats.cs_negative_hits == first.cs_negative_hits);
+  cache_release_metadata(metadata);
+}
+
+/*
+ * Tell if an entry of a directory is cached. Looking it up does not make it
+ * more recent : it is demoted afterwards.
+ */
+static int check_cached(metadata_t *parent, const char *name)
+{
+  metadata_t *metadata;
+  int res;
+
+  metadata = cache_get_child(parent, name);
+  res = (metadata != NULL);
+  if (metadata)
+    {
+      cache_demote_metadata(metadata);
+      cache_release_metadata(metadata);
+    }
+  return res;
+}
+
+/*
+ * Check that a full cache evicts the least recently released entries, never
+ * the ones in use, and the demoted ones first.
+ */
+static void check_eviction(metadata_t *root)
+{
+  metadata_t *held[CHECK_HELD], *metadata;
+  cache_stats_t stats;
+  char name[32];
+  unsigned int i;
+
+  for (i = 0; i < CHECK_HELD; i++)
+    {
+      snprintf(name, sizeof(name), "held%u", i);
+      held[i] = test_new_metadata(root, name);
+    }
+  for (i = 0; i < 4 * CHECK_ITEMS; i++)
+    {
+      snprintf(name, sizeof(name), "entry%u", i);
+      cache_release_metadata(test_new_metadata(root, name));
+    }
+
+  /* The oldest entries went, the ones in use stayed */
+  cache_get_stats(&stats);
+  TEST_ASSERT(stats.cs_items == CHECK_ITEMS);
+  TEST_ASSERT(stats.cs_evictions >= 3 * CHECK_ITEMS);
+  for (i = 0; i < CHECK_HELD; i++)
+    TEST_ASSERT(cache_has_metadata(held[i]));
+  TEST_ASSERT(cache_has_metadata(root));
+  metadata = cache_get_child(root, "entry0");
+  TEST_ASSERT(!metadata);
+  metadata = cache_get_child(root, "entry126");
+  TEST_ASSERT(metadata);
+
+  /* Demoted while in use, it goes first once released */
+  cache_demote_metadata(metadata);
+  cache_release_metadata(metadata);
+  cache_release_metadata(test_new_metadata(root, "last"));
+  TEST_ASSERT(!check_cached(root, "entry126"));
+  TEST_ASSERT(check_cached(root, "entry127"));
+  TEST_ASSERT(check_cached(root, "last"));
+
+  /* Released, they can go too */
+  for (i = 0; i < CHECK_HELD; i++)
+    cache_release_metadata(held[i]);
+  for (i = 0; i < CHECK_ITEMS; i++)
+    {
+      snprintf(name, sizeof(name), "other%u", i);
+      cache_release_metadata(test_new_metadata(root, name));
+    }
+  for (i = 0; i < CHECK_HELD; i++)
+    {
+      snprintf(name, sizeof(name), "held%u", i);
+      TEST_ASSERT(!check_cached(root, name));
+    }
+}
+
+/*
+ * Check the entries the cache keeps, and the ones it evicts.
+ */
+int main(void)
+{
+  metadata_t *root;
+  char limit[32];
+
+  snprintf(limit, sizeof(limit), "%u", CHECK_ITEMS);
+  setenv("RCS_CACHE_SIZE", limit, 1);
+  root = test_setup();
+  check_negative(root);
+  check_eviction(root);
+  test_teardown(root);
+  return 0;
+}
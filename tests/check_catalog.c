@@ -0,0 +1,153 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "helper.h"
+#include "structs.h"
+#include "cache.h"
+#include "create.h"
+#include "journal.h"
+#include "catalog.h"
+#include "write.h"
+#include "rcs.h"
+#include "test.h"
+
+#define CHECK_PREFIX	"metadata."	/* Of the metadata files	*/
+
+/*
+ * Write everything the journal holds to the catalogs, which then replace
+ * the files of their directories, the way a checkpoint does at mount.
+ */
+static void check_checkpoint(void)
+{
+  journal_close();
+  TEST_ASSERT(!journal_open(rcs_version_path));
+}
+
+/*
+ * Forget an entry, so that the next lookup reads it from the catalog.
+ */
+static void check_forget(metadata_t *metadata)
+{
+  cache_drop_metadata(metadata);
+  cache_release_metadata(metadata);
+}
+
+/*
+ * Count the entries of a directory that are not deleted, the way rmdir
+ * and the listings find them : from the names in the catalog, and the
+ * metadata of each.
+ */
+static unsigned int check_visible(metadata_t *directory)
+{
+  metadata_t *metadata;
+  unsigned int i, count;
+  char rpath[PATH_MAX];
+  char **names;
+
+  pthread_rwlock_rdlock(&directory->md_lock);
+  TEST_ASSERT(!rcs_directory(directory, rpath));
+  names = catalog_list(rpath, CHECK_PREFIX);
+  pthread_rwlock_unlock(&directory->md_lock);
+  TEST_ASSERT(names);
+  for (count = 0, i = 0; names[i]; i++)
+    {
+      metadata = rcs_lookup(directory, names[i]);
+      TEST_ASSERT(metadata);
+      if (!metadata->md_deleted)
+	count++;
+      cache_release_metadata(metadata);
+    }
+  helper_free_array(names);
+  return count;
+}
+
+/*
+ * Mark a file deleted, the way unlink does.
+ */
+static void check_delete(metadata_t *metadata)
+{
+  char metafile[PATH_MAX];
+
+  TEST_ASSERT(!create_meta_name(metadata, "metadata", metafile));
+  pthread_mutex_lock(&metadata->md_update);
+  pthread_rwlock_wrlock(&metadata->md_lock);
+  metadata->md_deleted = 1;
+  pthread_rwlock_unlock(&metadata->md_lock);
+  TEST_ASSERT(!write_metadata_append(metafile, metadata));
+  pthread_mutex_unlock(&metadata->md_update);
+}
+
+/*
+ * With catalogs, the metadata files of a directory are merged in its
+ * catalog at a checkpoint, and removed. Lookups find the entries there,
+ * and the names there tell whether a directory is empty, once its files
+ * are deleted.
+ */
+int main(void)
+{
+  metadata_t *root, *directory, *file, *other;
+  struct stat st_data;
+  char rpath[PATH_MAX], *path;
+
+  setenv("RCS_CATALOG", "1", 1);
+  root = test_setup();
+  TEST_ASSERT(catalog_enabled());
+  TEST_ASSERT(!create_new_directory(root, "directory", 0755, getuid(),
+				    getgid()));
+  directory = rcs_lookup(root, "directory");
+  TEST_ASSERT(directory);
+  file = test_create_file(directory, "file", "1", 1);
+  other = test_create_file(directory, "other", "2", 1);
+  check_checkpoint();
+
+  /* The catalog holds the metadata, the files are gone */
+  TEST_ASSERT(!rcs_directory(directory, rpath));
+  path = helper_build_composite("SS", "/", rpath, CATALOG_NAME);
+  TEST_ASSERT(!lstat(path, &st_data));
+  free(path);
+  path = helper_build_composite("SS", "/", rpath, CHECK_PREFIX "file");
+  TEST_ASSERT((lstat(path, &st_data) == -1) && (errno == ENOENT));
+  free(path);
+
+  /* Lookups read it */
+  check_forget(file);
+  check_forget(other);
+  file = rcs_lookup(directory, "file");
+  TEST_ASSERT(file && !file->md_deleted);
+  TEST_ASSERT(file->md_versions && (file->md_versions->v_vid == 1));
+  TEST_ASSERT(!rcs_lookup(directory, "missing"));
+  TEST_ASSERT(check_visible(directory) == 2);
+
+  /* A directory whose files are all deleted is empty */
+  check_delete(file);
+  TEST_ASSERT(check_visible(directory) == 1);
+  other = rcs_lookup(directory, "other");
+  TEST_ASSERT(other);
+  check_delete(other);
+  TEST_ASSERT(!check_visible(directory));
+  check_checkpoint();
+  check_forget(file);
+  check_forget(other);
+  TEST_ASSERT(!check_visible(directory));
+  file = rcs_lookup(directory, "file");
+  TEST_ASSERT(file && file->md_deleted);
+  check_forget(file);
+
+  cache_release_metadata(directory);
+  test_teardown(root);
+  return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "helper.h"
+#include "structs.h"
+#include "cache.h"
+#include "create.h"
+#include "overlay.h"
+#include "chunk.h"
+#include "rcs.h"
+#include "test.h"
+
+#define CHECK_SIZE	((4 << 20) + 1234)	/* Bytes of the first version */
+#define CHECK_EDIT	((2 << 20) + 77)	/* Where bytes are inserted */
+#define CHECK_INSERT	100			/* Bytes inserted	*/
+
+/*
+ * Give a file a new version holding the given data, and chunk the version
+ * it replaces, which holds all its data and is not written to anymore.
+ */
+static void check_new_version(metadata_t *metadata, const char *data,
+			      size_t size)
+{
+  version_t *version;
+  char rfile[PATH_MAX];
+  int fd;
+
+  pthread_mutex_lock(&metadata->md_update);
+  version = metadata->md_versions;
+  metadata->md_timestamp = 0;
+  TEST_ASSERT(!create_new_version_truncated(metadata, 0));
+  TEST_ASSERT(!rcs_version_file(metadata, metadata->md_versions, rfile));
+  fd = open(rfile, O_WRONLY);
+  TEST_ASSERT(fd != -1);
+  TEST_ASSERT(write(fd, data, size) == (ssize_t)size);
+  close(fd);
+  TEST_ASSERT(chunk_add_version(metadata, version) == 1);
+  pthread_mutex_unlock(&metadata->md_update);
+}
+
+/*
+ * Read a version of a file through its chain, the way the callbacks do, and
+ * compare it with the data it was written with.
+ */
+static void check_read(metadata_t *metadata, int vid, const char *data,
+		       size_t size)
+{
+  version_t *version;
+  chain_t *chain;
+  char *buffer;
+  int fd;
+
+  buffer = safe_malloc(size);
+  pthread_rwlock_rdlock(&metadata->md_lock);
+  version = rcs_find_version(metadata, vid, LATEST, RCS_HIDE_DELETED);
+  TEST_ASSERT(version);
+  fd = rcs_open_version(metadata, version, O_RDONLY);
+  TEST_ASSERT(fd != -1);
+  TEST_ASSERT(!overlay_open_chain(metadata, version, fd, &chain));
+  pthread_rwlock_unlock(&metadata->md_lock);
+  TEST_ASSERT(chain);
+  TEST_ASSERT(!overlay_read(chain, fd, buffer, size, 0));
+  TEST_ASSERT(!memcmp(buffer, data, size));
+  overlay_close_chain(chain);
+  close(fd);
+  free(buffer);
+}
+
+/*
+ * Chunk two versions of a large file, the second with a few bytes inserted
+ * in its middle, and another file holding the same data as the first : the
+ * cuts after the insertion are found at the same data, so only the chunks
+ * around it are stored again, and the other file stores nothing. Every
+ * version has to read as it was written.
+ */
+int main(void)
+{
+  metadata_t *root, *metadata, *copy;
+  chunk_stats_t first, second, third;
+  unsigned long long random;
+  char *data, *edited;
+  size_t i;
+
+  root = test_setup();
+  chunk_setup(1);
+  data = safe_malloc(CHECK_SIZE);
+  edited = safe_malloc(CHECK_SIZE + CHECK_INSERT);
+  random = 88172645463325252ULL;
+  for (i = 0; i < CHECK_SIZE; i++)
+    {
+      random ^= random << 13;
+      random ^= random >> 7;
+      random ^= random << 17;
+      data[i] = random;
+    }
+  memcpy(edited, data, CHECK_EDIT);
+  memset(edited + CHECK_EDIT, 'x', CHECK_INSERT);
+  memcpy(edited + CHECK_EDIT + CHECK_INSERT, data + CHECK_EDIT,
+	 CHECK_SIZE - CHECK_EDIT);
+
+  /* Random data : the first version shares nothing */
+  metadata = test_create_file(root, "file", data, CHECK_SIZE);
+  check_new_version(metadata, edited, CHECK_SIZE + CHECK_INSERT);
+  chunk_get_stats(&first);
+  TEST_ASSERT(first.ck_versions == 1);
+  TEST_ASSERT(first.ck_bytes == CHECK_SIZE);
+  TEST_ASSERT(!first.ck_shared && (first.ck_stored == CHECK_SIZE));
+  TEST_ASSERT(first.ck_chunks >= CHECK_SIZE / CHUNK_MAX);
+
+  /* Only the chunks around the insertion are new */
+  check_new_version(metadata, data, CHECK_SIZE);
+  chunk_get_stats(&second);
+  TEST_ASSERT(second.ck_bytes - first.ck_bytes == CHECK_SIZE + CHECK_INSERT);
+  TEST_ASSERT(second.ck_chunks - first.ck_chunks <=
+	      second.ck_shared - first.ck_shared + 2);
+  TEST_ASSERT(second.ck_stored - first.ck_stored <= 2 * CHUNK_MAX);
+
+  /* The same data in another file is all shared */
+  copy = test_create_file(root, "copy", data, CHECK_SIZE);
+  check_new_version(copy, "", 0);
+  chunk_get_stats(&third);
+  TEST_ASSERT(third.ck_chunks - second.ck_chunks ==
+	      third.ck_shared - second.ck_shared);
+  TEST_ASSERT(third.ck_stored == second.ck_stored);
+
+  check_read(metadata, 1, data, CHECK_SIZE);
+  check_read(metadata, 2, edited, CHECK_SIZE + CHECK_INSERT);
+  check_read(copy, 1, data, CHECK_SIZE);
+
+  free(edited);
+  free(data);
+  cache_release_metadata(copy);
+  cache_release_metadata(metadata);
+  test_teardown(root);
+  return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "structs.h"
+#include "cache.h"
+#include "create.h"
+#include "parse.h"
+#include "rcs.h"
+#include "test.h"
+
+#define CHECK_VERSIONS	20		/* Versions made before the lookup */
+
+/*
+ * Make a new version of a file, regardless of the time since the last one.
+ */
+static void check_new_version(metadata_t *metadata)
+{
+  pthread_mutex_lock(&metadata->md_update);
+  metadata->md_timestamp = 0;
+  TEST_ASSERT(!create_new_version_locked(metadata));
+  pthread_mutex_unlock(&metadata->md_update);
+}
+
+/*
+ * A lookup only reads the newest version of a file. When the next change,
+ * here a new subversion which does not need the older versions, cannot be
+ * appended to its metadata file, as with a file in the text format, the
+ * file is rewritten : the versions the lookup left on the disk have to be
+ * read first, and all of them written back.
+ */
+int main(void)
+{
+  metadata_t *root, *metadata, *parsed;
+  version_t *version, *expected;
+  char metafile[PATH_MAX];
+  unsigned int vid, count;
+
+  root = test_setup();
+  metadata = test_create_file(root, "file", "0", 1);
+  for (vid = 0; vid < CHECK_VERSIONS; vid++)
+    check_new_version(metadata);
+
+  /* Look it up again, which leaves the older versions on the disk */
+  cache_drop_metadata(metadata);
+  cache_release_metadata(metadata);
+  metadata = rcs_lookup(root, "file");
+  TEST_ASSERT(metadata && metadata->md_partial);
+  TEST_ASSERT(metadata->md_versions && !metadata->md_versions->v_next);
+
+  /* As if its file were in the text format */
+  metadata->md_appendable = 0;
+  pthread_mutex_lock(&metadata->md_update);
+  metadata->md_timestamp = 0;
+  TEST_ASSERT(!create_new_subversion_locked(metadata, 0600, getuid(),
+					    getgid()));
+  pthread_mutex_unlock(&metadata->md_update);
+  TEST_ASSERT(!metadata->md_partial && metadata->md_appendable);
+  TEST_ASSERT(metadata->md_count == CHECK_VERSIONS + 2);
+
+  TEST_ASSERT(!create_meta_name(metadata, "metadata", metafile));
+  parsed = parse_metadata_file(metafile);
+  TEST_ASSERT(parsed);
+  for (count = 0, version = parsed->md_versions,
+	 expected = metadata->md_versions;
+       version; count++, version = version->v_next,
+	 expected = expected->v_next)
+    {
+      TEST_ASSERT(expected);
+      TEST_ASSERT(version->v_vid == expected->v_vid);
+      TEST_ASSERT(version->v_svid == expected->v_svid);
+    }
+  TEST_ASSERT(count == CHECK_VERSIONS + 2);
+  rcs_free_metadata(parsed);
+
+  cache_release_metadata(metadata);
+  test_teardown(root);
+  return 0;
+}
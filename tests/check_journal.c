@@ -0,0 +1,141 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "helper.h"
+#include "structs.h"
+#include "cache.h"
+#include "create.h"
+#include "ea.h"
+#include "journal.h"
+#include "parse.h"
+#include "rcs.h"
+#include "test.h"
+
+#define CHECK_VERSIONS	4		/* Versions once replayed	*/
+
+#define CHECK_GROW	0		/* The child adds versions	*/
+#define CHECK_PIN	1		/* The child pins version 2	*/
+
+/*
+ * Change a file in a child that stops without closing the journal, as the
+ * daemon would if it crashed : the changes are only in the journal. The
+ * journal is closed here first, so that it only holds the child's records.
+ */
+static void check_crash(metadata_t *metadata, int change)
+{
+  unsigned int vid;
+  pid_t pid;
+  int status;
+
+  journal_close();
+  pid = fork();
+  TEST_ASSERT(pid != -1);
+  if (!pid)
+    {
+      TEST_ASSERT(!journal_open(rcs_version_path));
+      if (change == CHECK_GROW)
+	for (vid = 2; vid <= CHECK_VERSIONS; vid++)
+	  {
+	    pthread_mutex_lock(&metadata->md_update);
+	    metadata->md_timestamp = 0;
+	    TEST_ASSERT(!create_new_version_locked(metadata));
+	    pthread_mutex_unlock(&metadata->md_update);
+	  }
+      else
+	TEST_ASSERT(!ea_setxattr(metadata, "rcs.locked_version", "2.-1", 4,
+				 0, getuid()));
+      _exit(0);
+    }
+  TEST_ASSERT(waitpid(pid, &status, 0) == pid);
+  TEST_ASSERT(WIFEXITED(status) && !WEXITSTATUS(status));
+}
+
+/*
+ * Mount again after a crash, once the end of the journal is cut by the
+ * given number of bytes, and look the file up anew. The journal is empty
+ * once it is replayed.
+ */
+static metadata_t *check_mount(metadata_t *root, metadata_t *metadata,
+			       off_t torn)
+{
+  struct stat st_journal;
+  char *path;
+
+  path = helper_build_composite("SS", "/", rcs_version_path, JOURNAL_NAME);
+  TEST_ASSERT(!stat(path, &st_journal));
+  TEST_ASSERT(st_journal.st_size > torn);
+  TEST_ASSERT(!truncate(path, st_journal.st_size - torn));
+  TEST_ASSERT(!journal_open(rcs_version_path));
+  TEST_ASSERT(!stat(path, &st_journal) && !st_journal.st_size);
+  free(path);
+
+  cache_drop_metadata(metadata);
+  cache_release_metadata(metadata);
+  metadata = rcs_lookup(root, "file");
+  TEST_ASSERT(metadata);
+  pthread_mutex_lock(&metadata->md_update);
+  TEST_ASSERT(!rcs_load_history(metadata));
+  pthread_mutex_unlock(&metadata->md_update);
+  return metadata;
+}
+
+/*
+ * Check that the files are brought up to date at mount with what the
+ * journal held after a crash : all the records that were completely
+ * written, and none of a record torn at its end.
+ */
+int main(void)
+{
+  metadata_t *root, *metadata, *parsed;
+  char metafile[PATH_MAX];
+  unsigned int count;
+  version_t *version;
+
+  root = test_setup();
+  metadata = test_create_file(root, "file", "1", 1);
+  TEST_ASSERT(!create_meta_name(metadata, "metadata", metafile));
+
+  /* New versions, all replayed */
+  check_crash(metadata, CHECK_GROW);
+  metadata = check_mount(root, metadata, 0);
+  TEST_ASSERT(metadata->md_count == CHECK_VERSIONS);
+  TEST_ASSERT(metadata->md_versions->v_vid == CHECK_VERSIONS);
+  TEST_ASSERT(metadata->md_dfl_vid == LATEST);
+  parsed = parse_metadata_file(metafile);
+  TEST_ASSERT(parsed);
+  for (count = 0, version = parsed->md_versions; version;
+       version = version->v_next)
+    TEST_ASSERT(version->v_vid == CHECK_VERSIONS - count++);
+  TEST_ASSERT(count == CHECK_VERSIONS);
+  rcs_free_metadata(parsed);
+
+  /* A torn record is left out, and the versions before it stay */
+  check_crash(metadata, CHECK_PIN);
+  metadata = check_mount(root, metadata, 1);
+  TEST_ASSERT(metadata->md_count == CHECK_VERSIONS);
+  TEST_ASSERT(metadata->md_dfl_vid == LATEST);
+
+  /* The same record, whole, is replayed */
+  check_crash(metadata, CHECK_PIN);
+  metadata = check_mount(root, metadata, 0);
+  TEST_ASSERT(metadata->md_count == CHECK_VERSIONS);
+  TEST_ASSERT(metadata->md_dfl_vid == 2);
+
+  cache_release_metadata(metadata);
+  test_teardown(root);
+  return 0;
+}
@@ -0,0 +1,94 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "helper.h"
+#include "structs.h"
+#include "cache.h"
+#include "create.h"
+#include "overlay.h"
+#include "rcs.h"
+#include "test.h"
+
+#define CHECK_SIZE	((2 << 20) + 123)	/* Not a whole block	*/
+
+/*
+ * Open the current version of a file through its chain, with the given
+ * flags, the way the callbacks do.
+ */
+static int check_open(metadata_t *metadata, int flags, chain_t **chain)
+{
+  version_t *version;
+  int fd;
+
+  pthread_rwlock_rdlock(&metadata->md_lock);
+  version = rcs_find_version(metadata, LATEST, LATEST, RCS_HIDE_DELETED);
+  TEST_ASSERT(version);
+  fd = rcs_open_version(metadata, version, flags);
+  TEST_ASSERT(fd != -1);
+  TEST_ASSERT(!overlay_open_chain(metadata, version, fd, chain));
+  pthread_rwlock_unlock(&metadata->md_lock);
+  return fd;
+}
+
+/*
+ * Append to a large file opened with O_APPEND, which gets an overlay
+ * version that only holds the blocks written : each append has to land at
+ * the end of the file, past the blocks of the base, and everything before
+ * has to read as it was.
+ */
+int main(void)
+{
+  metadata_t *root, *metadata;
+  chain_t *chain;
+  char *data, *buffer;
+  size_t i;
+  int fd;
+
+  root = test_setup();
+  data = safe_malloc(CHECK_SIZE + 20);
+  buffer = safe_malloc(CHECK_SIZE + 20);
+  for (i = 0; i < CHECK_SIZE; i++)
+    data[i] = i * 7 + i / 4093;
+  memcpy(data + CHECK_SIZE, "0123456789abcdefghij", 20);
+  metadata = test_create_file(root, "file", data, CHECK_SIZE);
+
+  /* The new version is an overlay of the first one */
+  pthread_mutex_lock(&metadata->md_update);
+  metadata->md_timestamp = 0;
+  TEST_ASSERT(!create_new_version_locked(metadata));
+  pthread_mutex_unlock(&metadata->md_update);
+
+  fd = check_open(metadata, O_WRONLY | O_APPEND, &chain);
+  TEST_ASSERT(chain);
+  TEST_ASSERT(overlay_write(chain, data + CHECK_SIZE, 10, CHECK_SIZE) == 10);
+  TEST_ASSERT(overlay_write(chain, data + CHECK_SIZE + 10, 10,
+			    CHECK_SIZE + 10) == 10);
+  overlay_close_chain(chain);
+  close(fd);
+
+  /* Read it back through a new chain */
+  fd = check_open(metadata, O_RDONLY, &chain);
+  TEST_ASSERT(chain);
+  TEST_ASSERT(!overlay_read(chain, fd, buffer, CHECK_SIZE + 20, 0));
+  TEST_ASSERT(!memcmp(buffer, data, CHECK_SIZE + 20));
+  overlay_close_chain(chain);
+  close(fd);
+
+  free(buffer);
+  free(data);
+  cache_release_metadata(metadata);
+  test_teardown(root);
+  return 0;
+}
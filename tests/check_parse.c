@@ -0,0 +1,179 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "helper.h"
+#include "structs.h"
+#include "slab.h"
+#include "cache.h"
+#include "create.h"
+#include "journal.h"
+#include "parse.h"
+#include "write.h"
+#include "rcs.h"
+#include "test.h"
+
+#define CHECK_VERSIONS	5001		/* Versions of the file		*/
+#define CHECK_PINNED	100		/* Version it is locked to	*/
+
+/*
+ * Give a file new versions up to the given one, newest first, every tenth
+ * one with a subversion, and attributes that differ from one to the next.
+ */
+static void check_add_versions(metadata_t *metadata, unsigned int count)
+{
+  version_t *version;
+  unsigned int vid, svid;
+
+  pthread_rwlock_wrlock(&metadata->md_lock);
+  for (vid = metadata->md_versions->v_vid + 1; vid <= count; vid++)
+    for (svid = 0; svid <= !(vid % 10); svid++)
+      {
+	version = slab_alloc(&slab_versions);
+	version->v_vid = vid;
+	version->v_svid = svid;
+	version->v_file = vid;
+	version->v_mode = 0600 | (vid & 077);
+	version->v_uid = vid * 3;
+	version->v_gid = vid * 7;
+	version->v_overlay = NULL;
+	version->v_probed = 1;
+	version->v_next = metadata->md_versions;
+	metadata->md_versions = version;
+      }
+  rcs_versions_changed(metadata);
+  pthread_rwlock_unlock(&metadata->md_lock);
+}
+
+/*
+ * Check that the versions read from a file are the first ones of a list,
+ * in the same order, and return how many there are.
+ */
+static unsigned int check_versions(metadata_t *parsed, metadata_t *metadata)
+{
+  version_t *version, *expected;
+  unsigned int count;
+
+  count = 0;
+  for (version = parsed->md_versions, expected = metadata->md_versions;
+       version; version = version->v_next, expected = expected->v_next)
+    {
+      TEST_ASSERT(expected);
+      TEST_ASSERT(version->v_vid == expected->v_vid);
+      TEST_ASSERT(version->v_svid == expected->v_svid);
+      TEST_ASSERT(version->v_file == expected->v_file);
+      TEST_ASSERT(version->v_mode == expected->v_mode);
+      TEST_ASSERT(version->v_uid == expected->v_uid);
+      TEST_ASSERT(version->v_gid == expected->v_gid);
+      count++;
+    }
+  return count;
+}
+
+/*
+ * Write a metadata file, then append to it, and read it back, mapped, in
+ * whole or down to a locked version. A damaged end is skipped, and a file
+ * in the text format of the older releases is still read.
+ */
+int main(void)
+{
+  metadata_t *root, *metadata, *parsed;
+  char metafile[PATH_MAX], dflfile[PATH_MAX];
+  unsigned int count;
+  version_t *version;
+  FILE *fh;
+
+  /*
+   * Without the journal or the catalogs, the files are read from the disk,
+   * where they are written and damaged here.
+   */
+  setenv("RCS_CATALOG", "0", 1);
+  root = test_setup();
+  journal_close();
+  metadata = test_new_metadata(root, "file");
+  check_add_versions(metadata, CHECK_VERSIONS - 1);
+  TEST_ASSERT(!create_meta_name(metadata, "metadata", metafile));
+  TEST_ASSERT(!create_meta_name(metadata, "dfl-meta", dflfile));
+  TEST_ASSERT(!write_metadata_file(metafile, metadata));
+  check_add_versions(metadata, CHECK_VERSIONS);
+  TEST_ASSERT(!write_metadata_append(metafile, metadata));
+
+  parsed = parse_metadata_file(metafile);
+  TEST_ASSERT(parsed);
+  TEST_ASSERT(check_versions(parsed, metadata) == metadata->md_count);
+  TEST_ASSERT(!parsed->md_deleted && !parsed->md_partial);
+  TEST_ASSERT(parsed->md_appendable);
+  rcs_free_metadata(parsed);
+
+  /* A lookup only reads down to the locked version */
+  fh = fopen(dflfile, "w");
+  TEST_ASSERT(fh);
+  fprintf(fh, "%u.-1\n", CHECK_PINNED);
+  fclose(fh);
+  parsed = parse_metadata_for_file(rcs_version_path, "file");
+  TEST_ASSERT(parsed);
+  count = check_versions(parsed, metadata);
+  for (version = parsed->md_versions; version->v_next;
+       version = version->v_next)
+    ;
+  TEST_ASSERT((version->v_vid == CHECK_PINNED) && (version->v_svid == 1));
+  TEST_ASSERT(count == metadata->md_count - CHECK_PINNED - CHECK_PINNED / 10
+	      + 1);
+  TEST_ASSERT(parsed->md_partial && (parsed->md_dfl_vid == CHECK_PINNED));
+  rcs_free_metadata(parsed);
+  TEST_ASSERT(!unlink(dflfile));
+
+  /* Only a deletion that comes last counts */
+  metadata->md_deleted = 1;
+  TEST_ASSERT(!write_metadata_append(metafile, metadata));
+  parsed = parse_metadata_file(metafile);
+  TEST_ASSERT(parsed && parsed->md_deleted);
+  TEST_ASSERT(check_versions(parsed, metadata) == metadata->md_count);
+  rcs_free_metadata(parsed);
+
+  /* A torn end is left out, and the next change rewrites the file */
+  fh = fopen(metafile, "a");
+  TEST_ASSERT(fh);
+  fputs("torn", fh);
+  fclose(fh);
+  parsed = parse_metadata_for_file(rcs_version_path, "file");
+  TEST_ASSERT(parsed && parsed->md_deleted);
+  TEST_ASSERT(!parsed->md_appendable && !parsed->md_partial);
+  TEST_ASSERT(check_versions(parsed, metadata) == metadata->md_count);
+  rcs_free_metadata(parsed);
+
+  /* The text format, whose names may not start with the serial */
+  fh = fopen(metafile, "w");
+  TEST_ASSERT(fh);
+  fprintf(fh, "1:0:644:%u:%u:file\n", getuid(), getgid());
+  fprintf(fh, "2:0:600:3:4:00000007.file\n0:0:0:0:0:\n");
+  fprintf(fh, "3:1:640:5:6:00000009.file\n");
+  fclose(fh);
+  parsed = parse_metadata_file(metafile);
+  TEST_ASSERT(parsed && !parsed->md_deleted && !parsed->md_appendable);
+  version = parsed->md_versions;
+  TEST_ASSERT(version && (version->v_vid == 3) && (version->v_svid == 1));
+  TEST_ASSERT((version->v_file == 9) && (version->v_mode == 0640));
+  version = version->v_next;
+  TEST_ASSERT(version && (version->v_vid == 2) && (version->v_file == 7));
+  TEST_ASSERT((version->v_uid == 3) && (version->v_gid == 4));
+  version = version->v_next;
+  TEST_ASSERT(version && (version->v_vid == 1) && (version->v_file == 1));
+  TEST_ASSERT(!version->v_next);
+  rcs_free_metadata(parsed);
+
+  cache_release_metadata(metadata);
+  test_teardown(root);
+  return 0;
+}
@@ -0,0 +1,142 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "structs.h"
+#include "cache.h"
+#include "create.h"
+#include "ea.h"
+#include "rcs.h"
+#include "test.h"
+
+/*
+ * Check that a path is the one of the version tree, followed by the given
+ * components.
+ */
+static void check_path(const char *path, const char *components)
+{
+  size_t length;
+
+  length = strlen(rcs_version_path);
+  TEST_ASSERT(!strncmp(path, rcs_version_path, length));
+  TEST_ASSERT(!strcmp(path + length, components));
+}
+
+/*
+ * Check that a version of a file has the given IDs, and that its real file
+ * is the given one, below the directory of the entry, and is there.
+ */
+static void check_version(metadata_t *metadata, version_t *version,
+			  unsigned int vid, unsigned int svid,
+			  const char *components)
+{
+  struct stat st_data;
+  char rfile[PATH_MAX];
+
+  TEST_ASSERT(version);
+  TEST_ASSERT((version->v_vid == vid) && (version->v_svid == svid));
+  TEST_ASSERT(!rcs_version_file(metadata, version, rfile));
+  check_path(rfile, components);
+  TEST_ASSERT(!lstat(rfile, &st_data));
+}
+
+/*
+ * Make a new version or subversion of a file, regardless of the time since
+ * the last one.
+ */
+static void check_new_version(metadata_t *metadata, int subversion)
+{
+  pthread_mutex_lock(&metadata->md_update);
+  metadata->md_timestamp = 0;
+  if (subversion)
+    TEST_ASSERT(!create_new_subversion_locked(metadata, 0600, getuid(),
+					      getgid()));
+  else
+    TEST_ASSERT(!create_new_version_locked(metadata));
+  pthread_mutex_unlock(&metadata->md_update);
+}
+
+/*
+ * The real file of a version is named after its serial, in the directory
+ * named after the serial of the current version of each parent. Versions
+ * get their own serial, but subversions share the file of their version,
+ * even a subversion that becomes a new version because an older version
+ * was pinned. The serials are read back the same from the metadata file.
+ */
+int main(void)
+{
+  metadata_t *root, *directory, *metadata;
+  version_t *version;
+  char rfile[PATH_MAX];
+
+  root = test_setup();
+  TEST_ASSERT(!create_new_directory(root, "directory", 0755, getuid(),
+				    getgid()));
+  directory = rcs_lookup(root, "directory");
+  TEST_ASSERT(directory);
+  metadata = test_create_file(directory, "file", "1", 1);
+  check_version(metadata, metadata->md_versions, 1, 0,
+		"/00000001.directory/00000001.file");
+
+  /* A new version gets its own file */
+  check_new_version(metadata, 0);
+  check_version(metadata, metadata->md_versions, 2, 0,
+		"/00000001.directory/00000002.file");
+
+  /* A subversion of a pinned version is a new version, with its file */
+  TEST_ASSERT(!ea_setxattr(metadata, "rcs.locked_version", "1.-1", 4, 0,
+			   getuid()));
+  check_new_version(metadata, 1);
+  TEST_ASSERT(metadata->md_dfl_vid == LATEST);
+  check_version(metadata, metadata->md_versions, 3, 0,
+		"/00000001.directory/00000001.file");
+
+  /* A subversion of the directory keeps its entries where they are */
+  check_new_version(directory, 1);
+  check_version(directory, directory->md_versions, 1, 1,
+		"/00000001.directory");
+  TEST_ASSERT(!rcs_entry_directory(metadata, rfile));
+  check_path(rfile, "/00000001.directory");
+  TEST_ASSERT(!rcs_translate_path("/directory/file", rcs_version_path,
+				  rfile));
+  check_path(rfile, "/00000001.directory/00000001.file");
+
+  /* A new lookup finds the same files */
+  cache_drop_metadata(metadata);
+  cache_release_metadata(metadata);
+  cache_drop_metadata(directory);
+  cache_release_metadata(directory);
+  directory = rcs_lookup(root, "directory");
+  TEST_ASSERT(directory);
+  metadata = rcs_lookup(directory, "file");
+  TEST_ASSERT(metadata);
+  pthread_mutex_lock(&metadata->md_update);
+  TEST_ASSERT(!rcs_load_history(metadata));
+  pthread_mutex_unlock(&metadata->md_update);
+  version = metadata->md_versions;
+  check_version(metadata, version, 3, 0, "/00000001.directory/00000001.file");
+  version = version->v_next;
+  check_version(metadata, version, 2, 0, "/00000001.directory/00000002.file");
+  version = version->v_next;
+  check_version(metadata, version, 1, 0, "/00000001.directory/00000001.file");
+  TEST_ASSERT(!version->v_next);
+  check_version(directory, directory->md_versions, 1, 1,
+		"/00000001.directory");
+
+  cache_release_metadata(metadata);
+  cache_release_metadata(directory);
+  test_teardown(root);
+  return 0;
+}
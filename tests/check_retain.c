@@ -0,0 +1,144 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "structs.h"
+#include "cache.h"
+#include "create.h"
+#include "ea.h"
+#include "rcs.h"
+#include "retain.h"
+#include "test.h"
+
+#define CHECK_VERSIONS	6		/* Versions of the first file	*/
+#define CHECK_KEPT	2		/* Versions its policy keeps	*/
+
+/*
+ * Make a new version or subversion of a file, regardless of the time since
+ * the last one.
+ */
+static void check_new_version(metadata_t *metadata, int subversion)
+{
+  pthread_mutex_lock(&metadata->md_update);
+  metadata->md_timestamp = 0;
+  if (subversion)
+    TEST_ASSERT(!create_new_subversion_locked(metadata, 0600, getuid(),
+					      getgid()));
+  else
+    TEST_ASSERT(!create_new_version_locked(metadata));
+  pthread_mutex_unlock(&metadata->md_update);
+}
+
+/*
+ * Check if the real file of a version of a file is there, given the serial
+ * it is named after.
+ */
+static int check_exists(metadata_t *metadata, unsigned int serial)
+{
+  version_t version;
+  struct stat st_data;
+  char rfile[PATH_MAX];
+
+  memset(&version, 0, sizeof(version_t));
+  version.v_file = serial;
+  TEST_ASSERT(!rcs_version_file(metadata, &version, rfile));
+  return !lstat(rfile, &st_data);
+}
+
+/*
+ * Check that the versions a policy keeps are the newest ones, that their
+ * files are still there and the others are gone. A version that uses the
+ * file of an older one, made while the older one was pinned, keeps it even
+ * once the older one expires, or is purged.
+ */
+int main(void)
+{
+  metadata_t *root, *metadata;
+  retain_policy_t policy, found;
+  version_t *version;
+  unsigned int vid;
+  char data[16];
+  int fd;
+
+  root = test_setup();
+  memset(&policy, 0, sizeof(retain_policy_t));
+  retain_setup(&policy);
+
+  /* Without a policy, all the versions are kept */
+  metadata = test_create_file(root, "file", "1", 1);
+  for (vid = 2; vid <= CHECK_VERSIONS; vid++)
+    check_new_version(metadata, 0);
+  TEST_ASSERT(retain_file(metadata) == 0);
+  TEST_ASSERT(metadata->md_count == CHECK_VERSIONS);
+
+  /* A policy of its own keeps the newest versions */
+  policy.rp_versions = CHECK_KEPT;
+  TEST_ASSERT(!retain_write_policy(metadata, &policy));
+  TEST_ASSERT(retain_read_policy(metadata, &found) == 1);
+  TEST_ASSERT(found.rp_versions == CHECK_KEPT);
+  TEST_ASSERT(!found.rp_bytes && !found.rp_age);
+  TEST_ASSERT(retain_file(metadata) == 1);
+  TEST_ASSERT(metadata->md_count == CHECK_KEPT);
+  for (vid = 1; vid <= CHECK_VERSIONS; vid++)
+    TEST_ASSERT(check_exists(metadata, vid) ==
+		(vid > CHECK_VERSIONS - CHECK_KEPT));
+  for (vid = CHECK_VERSIONS, version = metadata->md_versions; version;
+       vid--, version = version->v_next)
+    TEST_ASSERT(version->v_vid == vid);
+  TEST_ASSERT(retain_file(metadata) == 0);
+  TEST_ASSERT(!retain_write_policy(metadata, NULL));
+  TEST_ASSERT(retain_read_policy(metadata, &found) == 0);
+  cache_release_metadata(metadata);
+
+  /* The policy of the mount, for a file that borrows an expired file */
+  policy.rp_versions = 1;
+  retain_setup(&policy);
+  metadata = test_create_file(root, "pinned", "1", 1);
+  check_new_version(metadata, 0);
+  TEST_ASSERT(!ea_setxattr(metadata, "rcs.locked_version", "1.-1", 4, 0,
+			   getuid()));
+  check_new_version(metadata, 1);
+  version = metadata->md_versions;
+  TEST_ASSERT((version->v_vid == 3) && (version->v_file == 1));
+  TEST_ASSERT(retain_file(metadata) == 1);
+  TEST_ASSERT(metadata->md_count == 1);
+  TEST_ASSERT(metadata->md_versions == version);
+  TEST_ASSERT(check_exists(metadata, 1) && !check_exists(metadata, 2));
+
+  /* Its contents are still there */
+  fd = rcs_open_version(metadata, version, O_RDONLY);
+  TEST_ASSERT(fd != -1);
+  TEST_ASSERT(read(fd, data, sizeof(data)) == 1);
+  TEST_ASSERT(data[0] == '1');
+  close(fd);
+  cache_release_metadata(metadata);
+
+  /* Purging the older versions keeps it too */
+  policy.rp_versions = 0;
+  retain_setup(&policy);
+  metadata = test_create_file(root, "purged", "1", 1);
+  check_new_version(metadata, 0);
+  TEST_ASSERT(!ea_setxattr(metadata, "rcs.locked_version", "1.-1", 4, 0,
+			   getuid()));
+  check_new_version(metadata, 1);
+  TEST_ASSERT(!ea_setxattr(metadata, "rcs.purge", "2", 1, 0, getuid()));
+  TEST_ASSERT(metadata->md_count == 1);
+  TEST_ASSERT(check_exists(metadata, 1) && !check_exists(metadata, 2));
+
+  cache_release_metadata(metadata);
+  test_teardown(root);
+  return 0;
+}
@@ -0,0 +1,215 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "structs.h"
+#include "cache.h"
+#include "create.h"
+#include "ea.h"
+#include "rcs.h"
+#include "test.h"
+
+#define THREADS_FILES		4	/* Files written to		*/
+#define THREADS_READERS		4	/* Threads reading them		*/
+#define THREADS_ROUNDS		200	/* Versions made per file	*/
+
+/*
+ * Several threads change the versions of the files of a directory, and of
+ * the directory itself, while others look them up and read them, the way
+ * the FUSE callbacks do. Each file is written, pinned to a version and
+ * purged, and the directory gets new subversions and is pinned, which
+ * moves nothing since subversions share their file. Any deadlock between
+ * the locks of a file and of its directory stops the test with the alarm,
+ * and every version that was found has to be readable.
+ */
+
+static metadata_t *threads_directory;
+static metadata_t *threads_files[THREADS_FILES];
+static int threads_done;
+
+/*
+ * Make new versions of a file, and write its number in each one. The
+ * versions are made regardless of the time since the last one.
+ */
+static void *threads_writer(void *argument)
+{
+  metadata_t *metadata;
+  version_t *version;
+  char rfile[PATH_MAX], data[32];
+  int i, fd, length;
+
+  metadata = argument;
+  for (i = 0; i < THREADS_ROUNDS; i++)
+    {
+      pthread_mutex_lock(&metadata->md_update);
+      metadata->md_timestamp = 0;
+      TEST_ASSERT(!create_new_version_locked(metadata));
+      version = rcs_find_version(metadata, LATEST, LATEST, RCS_HIDE_DELETED);
+      TEST_ASSERT(version);
+      TEST_ASSERT(!rcs_version_file(metadata, version, rfile));
+      fd = open(rfile, O_WRONLY | O_TRUNC);
+      TEST_ASSERT(fd != -1);
+      length = snprintf(data, sizeof(data), "%u", version->v_vid);
+      TEST_ASSERT(write(fd, data, length) == length);
+      close(fd);
+      pthread_mutex_unlock(&metadata->md_update);
+    }
+  return NULL;
+}
+
+/*
+ * Pin the files to one of their versions and back, and purge their old
+ * versions, while they are written.
+ */
+static void *threads_purger(void *argument)
+{
+  unsigned int count;
+  char value[32];
+  int i, j, res;
+
+  (void)argument;
+  for (i = 0; !__atomic_load_n(&threads_done, __ATOMIC_ACQUIRE); i++)
+    for (j = 0; j < THREADS_FILES; j++)
+      {
+	snprintf(value, sizeof(value), "%u.-1", i);
+	res = ea_setxattr(threads_files[j], "rcs.locked_version", value,
+			  strlen(value), 0, getuid());
+	TEST_ASSERT(!res || (res == -EINVAL));
+	TEST_ASSERT(!ea_setxattr(threads_files[j], "rcs.locked_version",
+				 "-1.-1", 5, 0, getuid()));
+
+	/* Keep the ten newest versions, never purging the whole file */
+	pthread_rwlock_rdlock(&threads_files[j]->md_lock);
+	count = threads_files[j]->md_count;
+	pthread_rwlock_unlock(&threads_files[j]->md_lock);
+	if (count <= 20)
+	  continue;
+	snprintf(value, sizeof(value), "%u", count - 10);
+	TEST_ASSERT(!ea_setxattr(threads_files[j], "rcs.purge", value,
+				 strlen(value), 0, getuid()));
+      }
+  return NULL;
+}
+
+/*
+ * Give the directory new subversions, and pin it to its first version, so
+ * that the files are looked for in it while its versions change.
+ */
+static void *threads_directory_changer(void *argument)
+{
+  metadata_t *metadata;
+
+  (void)argument;
+  metadata = threads_directory;
+  while (!__atomic_load_n(&threads_done, __ATOMIC_ACQUIRE))
+    {
+      pthread_mutex_lock(&metadata->md_update);
+      metadata->md_timestamp = 0;
+      TEST_ASSERT(!create_new_subversion_locked(metadata, 0755, getuid(),
+						getgid()));
+      pthread_mutex_unlock(&metadata->md_update);
+      TEST_ASSERT(!ea_setxattr(metadata, "rcs.locked_version", "1.-1", 4, 0,
+			       getuid()));
+      TEST_ASSERT(!ea_setxattr(metadata, "rcs.locked_version", "-1.-1", 5, 0,
+			       getuid()));
+    }
+  return NULL;
+}
+
+/*
+ * Look the files up and read their current version, which has to be
+ * there, and dump their versions.
+ */
+static void *threads_reader(void *argument)
+{
+  metadata_t *metadata;
+  version_t *version;
+  char rfile[PATH_MAX], name[16], dump[65536];
+  int i, fd;
+
+  (void)argument;
+  for (i = 0; !__atomic_load_n(&threads_done, __ATOMIC_ACQUIRE); i++)
+    {
+      snprintf(name, sizeof(name), "file%u", i % THREADS_FILES);
+      metadata = rcs_lookup(threads_directory, name);
+      TEST_ASSERT(metadata);
+      pthread_rwlock_rdlock(&metadata->md_lock);
+      version = rcs_find_version(metadata, LATEST, LATEST, RCS_HIDE_DELETED);
+      TEST_ASSERT(version);
+      TEST_ASSERT(!rcs_version_file(metadata, version, rfile));
+      fd = open(rfile, O_RDONLY);
+      TEST_ASSERT(fd != -1);
+      close(fd);
+      pthread_rwlock_unlock(&metadata->md_lock);
+      TEST_ASSERT(ea_getxattr(metadata, "rcs.metadata_dump", dump,
+			      sizeof(dump)) > 0);
+      cache_release_metadata(metadata);
+    }
+  return NULL;
+}
+
+int main(void)
+{
+  pthread_t writers[THREADS_FILES], readers[THREADS_READERS];
+  pthread_t purger, changer;
+  metadata_t *root;
+  version_t *version;
+  char name[16];
+  unsigned int i, count;
+
+  alarm(120);
+  root = test_setup();
+  TEST_ASSERT(!create_new_directory(root, "directory", 0755, getuid(),
+				    getgid()));
+  threads_directory = rcs_lookup(root, "directory");
+  TEST_ASSERT(threads_directory);
+  for (i = 0; i < THREADS_FILES; i++)
+    {
+      snprintf(name, sizeof(name), "file%u", i);
+      threads_files[i] = test_create_file(threads_directory, name, "0", 1);
+    }
+
+  for (i = 0; i < THREADS_FILES; i++)
+    TEST_ASSERT(!pthread_create(&writers[i], NULL, threads_writer,
+				threads_files[i]));
+  for (i = 0; i < THREADS_READERS; i++)
+    TEST_ASSERT(!pthread_create(&readers[i], NULL, threads_reader, NULL));
+  TEST_ASSERT(!pthread_create(&purger, NULL, threads_purger, NULL));
+  TEST_ASSERT(!pthread_create(&changer, NULL, threads_directory_changer,
+			      NULL));
+  for (i = 0; i < THREADS_FILES; i++)
+    pthread_join(writers[i], NULL);
+  __atomic_store_n(&threads_done, 1, __ATOMIC_RELEASE);
+  for (i = 0; i < THREADS_READERS; i++)
+    pthread_join(readers[i], NULL);
+  pthread_join(purger, NULL);
+  pthread_join(changer, NULL);
+
+  /* Every file has its last version, and its index matches its list */
+  for (i = 0; i < THREADS_FILES; i++)
+    {
+      TEST_ASSERT(threads_files[i]->md_versions->v_vid == THREADS_ROUNDS + 1);
+      for (count = 0, version = threads_files[i]->md_versions; version;
+	   version = version->v_next)
+	TEST_ASSERT(threads_files[i]->md_index[count++] == version);
+      TEST_ASSERT(count == threads_files[i]->md_count);
+      cache_release_metadata(threads_files[i]);
+    }
+  cache_release_metadata(threads_directory);
+  test_teardown(root);
+  return 0;
+}
@@ -0,0 +1,177 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+
+#include "helper.h"
+#include "structs.h"
+#include "intern.h"
+#include "slab.h"
+#include "cache.h"
+#include "create.h"
+#include "rcs.h"
+#include "dircache.h"
+#include "journal.h"
+#include "catalog.h"
+#include "test.h"
+
+static char test_root[PATH_MAX];
+
+/*
+ * Report a failed check and stop.
+ */
+void test_fail(const char *file, int line, const char *condition)
+{
+  fprintf(stderr, "%s:%i: check failed: %s\n", file, line, condition);
+  exit(1);
+}
+
+/*
+ * Make a version directory with an empty root, and start the modules on it
+ * the way the daemon does, with the same environment variables for the
+ * cache limits and the catalogs. Returns the root, referenced.
+ */
+metadata_t *test_setup(void)
+{
+  metadata_t *root;
+  const char *tmp, *value;
+  unsigned int cache_items;
+  size_t cache_bytes;
+  char metafile[PATH_MAX + 16];
+  FILE *fh;
+
+  tmp = getenv("TMPDIR");
+  snprintf(test_root, sizeof(test_root), "%s/copyfs-test.XXXXXX",
+	   tmp ? tmp : "/tmp");
+  TEST_ASSERT(mkdtemp(test_root));
+  snprintf(metafile, sizeof(metafile), "%s/metadata.", test_root);
+  fh = fopen(metafile, "w");
+  TEST_ASSERT(fh);
+  fprintf(fh, "1:0:755:%u:%u:root\n", getuid(), getgid());
+  fclose(fh);
+
+  rcs_version_path = test_root;
+  cache_items = 0;
+  cache_bytes = 0;
+  if ((value = getenv("RCS_CACHE_SIZE")))
+    cache_items = strtoul(value, NULL, 0);
+  if ((value = getenv("RCS_CACHE_BYTES")))
+    cache_bytes = strtoul(value, NULL, 0);
+  cache_initialize(cache_items, cache_bytes);
+  value = getenv("RCS_CATALOG");
+  TEST_ASSERT(!catalog_setup(test_root, value && strcmp(value, "0")));
+  TEST_ASSERT(!journal_open(test_root));
+  root = rcs_translate_to_metadata("/", test_root, RCS_HIDE_DELETED);
+  TEST_ASSERT(root);
+  return root;
+}
+
+/*
+ * Remove the files of a version directory tree.
+ */
+static int test_remove(const char *path, const struct stat *st_data,
+		       int type, struct FTW *ftw)
+{
+  (void)st_data;
+  (void)type;
+  (void)ftw;
+  return remove(path);
+}
+
+/*
+ * Stop the modules, and remove the version directory.
+ */
+void test_teardown(metadata_t *root)
+{
+  cache_release_metadata(root);
+  cache_finalize();
+  dircache_finalize();
+  journal_close();
+  TEST_ASSERT(!nftw(test_root, test_remove, 16, FTW_DEPTH | FTW_PHYS));
+}
+
+/*
+ * Add an entry with a single version to the cache, without any file on the
+ * disk, for the tests that only look at the memory structures. Returns it,
+ * referenced.
+ */
+metadata_t *test_new_metadata(metadata_t *parent, const char *name)
+{
+  metadata_t *metadata;
+  version_t *version;
+
+  metadata = slab_alloc(&slab_metadata);
+  metadata->md_parent = parent;
+  metadata->md_name = intern_get(name);
+  metadata->md_deleted = 0;
+  metadata->md_negative = 0;
+  metadata->md_writers = 0;
+  metadata->md_partial = 0;
+  metadata->md_appendable = 1;
+  metadata->md_timestamp = 0;
+  metadata->md_dfl_vid = LATEST;
+  metadata->md_dfl_svid = LATEST;
+  metadata->md_pinned = NULL;
+  metadata->md_index = NULL;
+  metadata->md_count = 0;
+  metadata->md_borrowed = 0;
+  version = slab_alloc(&slab_versions);
+  version->v_vid = 1;
+  version->v_svid = 0;
+  version->v_file = 1;
+  version->v_mode = 0644;
+  version->v_uid = getuid();
+  version->v_gid = getgid();
+  version->v_overlay = NULL;
+  version->v_probed = 1;
+  version->v_next = NULL;
+  metadata->md_versions = version;
+  return cache_add_metadata(metadata);
+}
+
+/*
+ * Create a regular file in a directory, with the given contents. Returns
+ * it, referenced.
+ */
+metadata_t *test_create_file(metadata_t *parent, const char *name,
+			     const char *data, size_t size)
+{
+  metadata_t *metadata;
+  char rfile[PATH_MAX];
+  int fd;
+
+  TEST_ASSERT(!create_new_file(parent, name, S_IFREG | 0644, getuid(),
+			       getgid(), 0));
+  metadata = rcs_lookup(parent, name);
+  TEST_ASSERT(metadata);
+  TEST_ASSERT(!rcs_version_file(metadata, metadata->md_versions, rfile));
+  fd = open(rfile, O_WRONLY);
+  TEST_ASSERT(fd != -1);
+  TEST_ASSERT(write(fd, data, size) == (ssize_t)size);
+  close(fd);
+  return metadata;
+}
+
+/*
+ * Get a monotonic time in seconds, for the benchmarks.
+ */
+double test_now(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
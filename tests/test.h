@@ -0,0 +1,37 @@
+/*
+ * copyfs - copy on write filesystem  http://n0x.org/copyfs/
+ * Copyright (C) 2004 Nicolas Vigier <boklm@mars-attacks.org>
+ *                    Thomas Joubert <widan@net-42.eu.org>
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+*/
+
+#ifndef TEST_H
+# define TEST_H
+
+# include <stddef.h>
+# include "structs.h"
+
+/*
+ * The tests drive the modules of the daemon directly, below the FUSE
+ * callbacks, on a version directory of their own. Each one is a program
+ * that exits with a non-zero status on the first failed check.
+ */
+
+# define TEST_ASSERT(condition)						\
+  do									\
+    {									\
+      if (!(condition))							\
+	test_fail(__FILE__, __LINE__, #condition);			\
+    }									\
+  while (0)
+
+void		test_fail(const char *file, int line, const char *condition);
+metadata_t	*test_setup(void);
+void		test_teardown(metadata_t *root);
+metadata_t	*test_new_metadata(metadata_t *parent, const char *name);
+metadata_t	*test_create_file(metadata_t *parent, const char *name,
+				  const char *data, size_t size);
+double		test_now(void);
+
+#endif /* !TEST_H */
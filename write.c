@@ -7,73 +7,145 @@
 */
 
 #include <stdio.h>
-#include <strings.h>
-#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 
 #include "helper.h"
 #include "structs.h"
+#include "journal.h"
+#include "parse.h"
+#include "rcs.h"
 #include "write.h"
 
 
 /*
- * Worker function for version writing.
+ * Bytes of the entry of a version of a metadata set in its file, or of a
+ * deletion if version is NULL. The name of the real file of the version is
+ * its serial and the name of the entry.
  */
-static int write_metadata_file_worker(FILE *fh, version_t *version)
+static size_t write_entry_size(metadata_t *metadata, version_t *version)
 {
-  char *name;
-
-  /* Write them in order */
-  if (version->v_next)
-    if (write_metadata_file_worker(fh, version->v_next) != 0)
-      return -1;
-
-  /* Strip the path */
-  name = rindex(version->v_rfile, '/');
-  if (!name)
-    name = version->v_rfile;
-  else
-    name++;
-
-  /* Write this version's information */
-  if (fprintf(fh, "%i:%i:%04o:%i:%i:%s\n", version->v_vid, version->v_svid,
-	      version->v_mode, version->v_uid, version->v_gid, name) < 0)
-    return -1;
-  return 0;
+  size_t length;
+
+  length = version ? 9 + strlen(metadata->md_name) : 0;
+  return sizeof(metafile_entry_t) +
+    ((length + sizeof(uint32_t)) & ~(sizeof(uint32_t) - 1)) +
+    sizeof(uint32_t);
+}
+
+/*
+ * Fill in the entry of a version of a metadata set in its file, or of a
+ * deletion if version is NULL. Returns its size.
+ */
+static size_t write_entry(char *data, metadata_t *metadata,
+			  version_t *version)
+{
+  metafile_entry_t entry;
+  uint32_t length;
+
+  length = write_entry_size(metadata, version);
+  memset(data, 0, length);
+  memset(&entry, 0, sizeof(metafile_entry_t));
+  if (version)
+    {
+      entry.me_vid = version->v_vid;
+      entry.me_svid = version->v_svid;
+      entry.me_mode = version->v_mode;
+      entry.me_uid = version->v_uid;
+      entry.me_gid = version->v_gid;
+      sprintf(data + sizeof(metafile_entry_t), "%08X.%s", version->v_file,
+	      metadata->md_name);
+    }
+  entry.me_length = length;
+  memcpy(data, &entry, sizeof(metafile_entry_t));
+  memcpy(data + length - sizeof(uint32_t), &length, sizeof(uint32_t));
+  return length;
 }
 
 /*
  * Write a metadata file on disk from the in-memory structures. We rewrite
- * the whole file to avoid leaving "deletion lines" at all the points the
+ * the whole file to avoid leaving "deletion entries" at all the points the
  * file was deleted and re-created. Plus it cleans up partially corrupt files
- * automatically. Returns non-zero on error.
+ * automatically. The whole history has to be loaded. The file goes through
+ * the journal. Returns non-zero on error.
  */
 int write_metadata_file(char *metafile, metadata_t *metadata)
 {
-  FILE *fh;
+  metafile_header_t *header;
+  version_t *version;
+  size_t size, end;
+  char *data;
+  int res;
+
+  /* Size the file */
+  size = sizeof(metafile_header_t);
+  for (version = metadata->md_versions; version; version = version->v_next)
+    size += write_entry_size(metadata, version);
+  if (metadata->md_deleted)
+    size += write_entry_size(metadata, NULL);
 
-  /* Open metadata file */
-  fh = fopen(metafile, "w");
-  if (!fh)
-    return -1;
+  data = safe_malloc(size);
+  header = (metafile_header_t *)data;
+  memset(header, 0, sizeof(metafile_header_t));
+  memcpy(header->mh_magic, METADATA_MAGIC, sizeof(header->mh_magic));
+  header->mh_format = METADATA_FORMAT;
 
-  /* Write normal versions */
-  if (write_metadata_file_worker(fh, metadata->md_versions) != 0)
+  /* The list is newest first, and the file oldest first */
+  end = size;
+  if (metadata->md_deleted)
     {
-      fclose(fh);
-      return -1;
+      end -= write_entry_size(metadata, NULL);
+      write_entry(data + end, metadata, NULL);
+    }
+  for (version = metadata->md_versions; version; version = version->v_next)
+    {
+      end -= write_entry_size(metadata, version);
+      write_entry(data + end, metadata, version);
     }
 
-  /* If the file is marked deleted, put a killer version */
-  if (metadata->md_deleted)
-    if (fprintf(fh, "0:0:0000:0:0:\n") < 0)
-      {
-	fclose(fh);
-	return -1;
-      }
-
-  fclose(fh);
-  return 0;
+  res = journal_write(metafile, data, size);
+  free(data);
+  return res;
+}
+
+/*
+ * Write the last change of a metadata set to its file : its newest version,
+ * or its deletion if it is deleted. It is appended to the file, unless the
+ * file is in the text format, or is not in the current version of its
+ * directory, which had been removed : the file is then rewritten, with the
+ * versions its lookup left on the disk read first, so that none is lost.
+ * Only a file that is not there has none. The caller holds the metadata's
+ * update lock, but not its lock. Returns non-zero on error.
+ */
+int write_metadata_append(char *metafile, metadata_t *metadata)
+{
+  version_t *version;
+  char *data;
+  size_t size;
+  int res;
+
+  res = -1;
+  errno = ENOENT;
+  if (metadata->md_appendable)
+    {
+      version = metadata->md_deleted ? NULL : metadata->md_versions;
+      data = safe_malloc(write_entry_size(metadata, version));
+      size = write_entry(data, metadata, version);
+      res = journal_extend(metafile, data, size);
+      free(data);
+    }
+  if (res && (errno == ENOENT))
+    {
+      res = rcs_load_history(metadata);
+      if (res && (errno == ENOENT))
+	res = 0;
+      if (!res)
+	res = write_metadata_file(metafile, metadata);
+      if (!res)
+	metadata->md_appendable = 1;
+    }
+  return res;
 }
 
 /*
@@ -82,31 +154,14 @@ int write_metadata_file(char *metafile, metadata_t *metadata)
  */
 int write_default_file(char *dflfile, int vid, int svid)
 {
-  FILE *fh;
+  char buffer[32];
+  int length;
 
   /* If we want to return it to default, remove the file */
   if (vid == LATEST)
-    {
-      int result;
-
-      result = unlink(dflfile);
-      if (!result || (errno == ENOENT))
-	return 0;
-      else
-	return result;
-    }
-
-  fh = fopen(dflfile, "w");
-  if (!fh)
-    return -1;
+    return journal_remove(dflfile);
 
   /* Write new value */
-  if ((fprintf(fh, "%i.%i\n", vid, svid) < 0))
-    {
-      fclose(fh);
-      return -1;
-    }
-
-  fclose(fh);
-  return 0;
+  length = snprintf(buffer, sizeof(buffer), "%i.%i\n", vid, svid);
+  return journal_write(dflfile, buffer, length);
 }
@@ -10,6 +10,7 @@
 # define WRITE_H
 
 int write_metadata_file(char *metafile, metadata_t *metadata);
+int write_metadata_append(char *metafile, metadata_t *metadata);
 int write_default_file(char *dflfile, int vid, int svid);
 
 #endif /* !WRITE_H */